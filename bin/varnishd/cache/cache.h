@@ -129,6 +129,8 @@ struct sess;
 struct sesspool;
 struct vbc;
 struct vef_priv;
+struct vgzc;
+struct vesc;
 struct vrt_backend;
 struct vsb;
 struct waitinglist;
@@ -248,9 +250,25 @@ struct dstat {
 #undef L0
 #undef L1
 
+/* Latency histograms, see cache_hist.c ------------------------------*/
+
+enum hist_e {
+#define HIST(n, d)	HIST_##n,
+#include "tbl/histograms.h"
+#undef HIST
+	HIST__MAX
+};
+
+struct whist {
+	unsigned		n;
+	unsigned		lo, hi;		/* Buckets touched */
+	uint64_t		sum;		/* Microseconds */
+	uint32_t		bucket[VSC_HIST_NBUCKET];
+};
+
 /* Fetch processors --------------------------------------------------*/
 
-void VFP_update_length(const struct busyobj *, ssize_t);
+void VFP_update_length(struct busyobj *, ssize_t);
 
 typedef void vfp_begin_f(struct busyobj *, size_t );
 typedef int vfp_bytes_f(struct busyobj *, struct http_conn *, ssize_t);
@@ -313,6 +331,7 @@ struct pool_task {
 	VTAILQ_ENTRY(pool_task)		list;
 	pool_func_t			*func;
 	void				*priv;
+	double				t_queued;
 };
 
 enum pool_how {
@@ -333,12 +352,15 @@ struct worker {
 	struct busyobj		*nbo;
 	void			*nhashpriv;
 	struct dstat		stats;
+	struct whist		hist[HIST__MAX];
 
 	struct pool_task	task;
 
 	double			lastused;
 
 	struct wrw		*wrw;
+	struct vsb		*wrw_copy;	/* Copy of what is written */
+	const int		*wrw_copy_fd;	/* ...to this fd */
 
 	pthread_cond_t		cond;
 
@@ -406,6 +428,9 @@ struct objcore {
 	uintptr_t		priv2;
 	struct objhead		*objhead;
 	struct busyobj		*busyobj;
+	struct vgzc		*gunzip;	/* Gunzip cache */
+	struct vesc		*esi_cache;	/* Assembled ESI body */
+	struct objcore		*body_oc;	/* Owner of shared body */
 	double			timer_when;
 	unsigned		flags;
 #define OC_F_BUSY		(1<<1)
@@ -477,7 +502,8 @@ oc_getlru(const struct objcore *oc)
  * and while it is being fetched from the backend.
  *
  * One of these aspects will be how much has been fetched, which
- * streaming delivery will make use of.
+ * streaming delivery will make use of.  Changes to fetch_obj->len and
+ * state are made under mtx and broadcast on cond, see VBO_extend().
  */
 
 enum busyobj_state_e {
@@ -491,6 +517,7 @@ struct busyobj {
 	unsigned		magic;
 #define BUSYOBJ_MAGIC		0x23b95567
 	struct lock		mtx;
+	pthread_cond_t		cond;
 	char			*end;
 
 	/*
@@ -513,15 +540,18 @@ struct busyobj {
 	struct http		*bereq;
 	struct http		*beresp;
 	struct object		*fetch_obj;
+	struct object		*stale_obj;	/* Being revalidated */
 	struct exp		exp;
 	struct http_conn	htc;
 
 	enum body_status	body_status;
 	struct pool_task	fetch_task;
+	double			t_fetch;	/* Started fetch */
 
 	struct vef_priv		*vef_priv;
 
 	unsigned		should_close;
+	const struct director	*retry_dir;	/* FetchHdr() second try */
 	char			*h_content_length;
 
 	unsigned		do_esi;
@@ -574,6 +604,10 @@ struct object {
 
 	struct storagehead	store;
 
+	/* Gunzip'ed copy of a gzip'ed body, complete if gunzip_len > 0 */
+	struct storagehead	gunzip_store;
+	ssize_t			gunzip_len;
+
 	struct storage		*esidata;
 
 	double			last_use;
@@ -589,8 +623,10 @@ struct req {
 	int			restarts;
 	int			esi_level;
 	int			disable_esi;
+	struct vesc		*vesc;		/* ESI body being assembled */
 	uint8_t			hash_ignore_busy;
 	uint8_t			hash_always_miss;
+	uint8_t			bgfetch;
 
 	struct sess		*sp;
 	struct worker		*wrk;
@@ -656,6 +692,7 @@ struct req {
 #define RES_ESI			(1<<4)
 #define RES_ESI_CHILD		(1<<5)
 #define RES_GUNZIP		(1<<6)
+#define RES_PLAIN		(1<<7)	/* Stored gunzip'ed copy */
 
 	/* Transaction VSL buffer */
 	struct vsl_log		vsl[1];
@@ -706,6 +743,7 @@ struct sess {
 	/* Timestamps, all on TIM_real() timescale */
 	double			t_open;		/* fd accepted */
 	double			t_idle;		/* fd accepted or resp sent */
+	double			t_gap;		/* avg. idle before next req */
 
 #if defined(HAVE_EPOLL_CTL)
 	struct epoll_event ev;
@@ -763,6 +801,18 @@ void VBO_Init(void);
 struct busyobj *VBO_GetBusyObj(struct worker *, struct req *);
 void VBO_DerefBusyObj(struct worker *wrk, struct busyobj **busyobj);
 void VBO_Free(struct busyobj **vbo);
+void VBO_extend(struct busyobj *, ssize_t);
+ssize_t VBO_waitlen(struct busyobj *, ssize_t l);
+void VBO_waitstate(struct busyobj *bo, enum busyobj_state_e want);
+void VBO_setstate(struct busyobj *bo, enum busyobj_state_e next);
+void VBO_waitfetch(struct busyobj *bo);
+
+/* cache_hist.c */
+void HIST_Init(void);
+unsigned HIST_Bucket(double d);
+uint64_t HIST_Limit(unsigned u);
+void HIST_Add(struct worker *, enum hist_e, double d);
+void HIST_Sum(struct worker *);
 
 /* cache_http1_fsm.c [HTTP1] */
 void HTTP1_Session(struct worker *, struct req *);
@@ -788,6 +838,7 @@ void EXP_Set_keep(struct exp *e, double v);
 
 double EXP_Ttl(const struct req *, const struct object*);
 double EXP_Grace(const struct req *, const struct object*);
+double EXP_Keep(const struct req *, const struct object*);
 void EXP_Insert(struct object *o);
 void EXP_Inject(struct objcore *oc, struct lru *lru, double when);
 void EXP_Init(void);
@@ -827,6 +878,10 @@ enum vgzret_e VGZ_Gzip(struct vgz *, const void **, size_t *len, enum vgz_flag);
 enum vgzret_e VGZ_Gunzip(struct vgz *, const void **, size_t *len);
 enum vgzret_e VGZ_Destroy(struct vgz **);
 void VGZ_UpdateObj(const struct vgz*, struct object *);
+void VGZ_StoreGunzip(struct busyobj *);
+int VGZ_CacheDeliver(struct req *);
+void VGZ_CacheFree(struct objcore *);
+void VGZ_Init(void);
 
 int VGZ_WrwInit(struct vgz *vg);
 enum vgzret_e VGZ_WrwGunzip(struct req *, struct vgz *, const void *ibuf,
@@ -871,6 +926,7 @@ enum sess_close http_DoConnection(const struct http *);
 void http_CopyHome(const struct http *hp);
 void http_Unset(struct http *hp, const char *hdr);
 void http_CollectHdr(struct http *hp, const char *hdr);
+void http_Merge(const struct http *fm, struct http *to);
 
 /* cache_httpconn.c */
 enum htc_status_e {
@@ -937,12 +993,14 @@ void PAN_Init(void);
 
 /* cache_pipe.c */
 void PipeRequest(struct req *req);
+void Pipe_Init(void);
 
 /* cache_pool.c */
 void Pool_Init(void);
 void Pool_Accept(void);
 void Pool_Work_Thread(void *priv, struct worker *w);
 int Pool_Task(struct pool *pp, struct pool_task *task, enum pool_how how);
+int Pool_Dry(const struct pool *pp);
 
 #define WRW_IsReleased(w)	((w)->wrw == NULL)
 int WRW_Error(const struct worker *w);
@@ -964,10 +1022,22 @@ int SES_ScheduleReq(struct req *);
 struct req *SES_GetReq(struct worker *, struct sess *);
 void SES_Handle(struct sess *sp, double now);
 void SES_ReleaseReq(struct req *);
+struct req *SES_NewBgReq(struct worker *, const struct sess *);
+int SES_ScheduleBgReq(struct req *);
+void SES_DeleteBgReq(struct req *);
 pool_func_t SES_pool_accept_task;
 
 /* cache_shmlog.c */
 extern struct VSC_C_main *VSC_C_main;
+unsigned VSC_NShard(void);
+unsigned VSC_ShardNo(void);
+struct VSC_C_main *VSC_Shard(void);
+#ifdef HAVE_SYNC_ADD
+#define VSC_Add(p, n)	((void)__sync_fetch_and_add((p), (uint64_t)(n)))
+#else
+void VSC_Add(uint64_t *p, uint64_t n);
+#endif
+#define VSC_ADD(fld, n)	VSC_Add(&VSC_Shard()->fld, (n))
 void VSM_Init(void);
 void *VSM_Alloc(unsigned size, const char *class, const char *type,
     const char *ident);
@@ -979,6 +1049,7 @@ void VSL(enum VSL_tag_e tag, uint32_t vxid, const char *fmt, ...)
 void VSLb(struct vsl_log *, enum VSL_tag_e tag, const char *fmt, ...)
     __printflike(3, 4);
 void VSLbt(struct vsl_log *, enum VSL_tag_e tag, txt t);
+void VSLbb(struct vsl_log *, enum VSL_tag_e tag, ...);
 
 void VSL_Flush(struct vsl_log *, int overflow);
 
@@ -999,6 +1070,7 @@ void VRY_Finish(struct req *req, struct busyobj *bo);
 void VCL_Init(void);
 void VCL_Refresh(struct VCL_conf **vcc);
 void VCL_Rel(struct VCL_conf **vcc);
+void VCL_Ref(struct VCL_conf *vc);
 void VCL_Poll(void);
 const char *VCL_Return_Name(unsigned method);
 
@@ -1013,6 +1085,9 @@ char *VRT_StringList(char *d, unsigned dl, const char *p, va_list ap);
 
 void ESI_Deliver(struct req *);
 void ESI_DeliverChild(struct req *);
+void ESI_CacheAdd(struct req *);
+void ESI_CacheFree(struct objcore *);
+void ESI_Init(void);
 
 /* cache_vrt_vmod.c */
 void VMOD_Init(void);
@@ -1024,8 +1099,6 @@ const char *WAIT_GetName(void);
 
 /* cache_wrk.c */
 
-void WRK_Init(void);
-int WRK_TrySumStat(struct worker *w);
 void WRK_SumStat(struct worker *w);
 void *WRK_thread(void *priv);
 typedef void *bgthread_t(struct worker *, void *priv);
@@ -1059,6 +1132,7 @@ void STV_free(struct storage *st);
 void STV_open(void);
 void STV_close(void);
 void STV_Freestore(struct object *o);
+int STV_ShareBody(struct object *o, const struct object *src);
 void STV_BanInfo(enum baninfo event, const uint8_t *ban, unsigned len);
 
 /* storage_synth.c */
@@ -32,6 +32,7 @@
 
 #include "config.h"
 
+#include <math.h>
 #include <poll.h>
 #include <stdlib.h>
 #include <stddef.h>
@@ -42,6 +43,7 @@
 #include "cache_backend.h"
 #include "vrt.h"
 #include "vtcp.h"
+#include "vtim.h"
 
 static struct mempool	*vbcpool;
 
@@ -98,49 +100,169 @@ VBE_ReleaseConn(struct vbc *vc)
 	} while (0)
 
 /*--------------------------------------------------------------------
- * Attempt to connect to a given addrinfo entry.
- *
- * Must be called with locked backend, but will release the backend
- * lock during the slow/sleeping stuff, so that other worker threads
- * can have a go, while we ponder.
- *
+ * Start a non-blocking connect to a given addrinfo entry.
+ * Returns the socket, and sets *done if it connected right away.
  */
 
 static int
-vbe_TryConnect(const struct req *req, int pf, const struct sockaddr_storage *sa,
-    socklen_t salen, const struct vdi_simple *vs)
+vbe_StartConnect(int pf, const struct sockaddr_storage *sa, socklen_t salen,
+    int *done)
 {
-	int s, i, tmo;
-	double tmod;
-
-	CHECK_OBJ_NOTNULL(req, REQ_MAGIC);
-	CHECK_OBJ_NOTNULL(vs, VDI_SIMPLE_MAGIC);
+	int s, i;
 
+	*done = 0;
 	s = socket(pf, SOCK_STREAM, 0);
 	if (s < 0)
 		return (s);
 
-	FIND_TMO(connect_timeout, tmod, req, vs->vrt);
+	(void)VTCP_nonblocking(s);
+	i = connect(s, (const void *)sa, salen);
+	if (i == 0)
+		*done = 1;
+	else if (errno != EINPROGRESS) {
+		AZ(close(s));
+		return (-1);
+	}
+	return (s);
+}
 
-	tmo = (int)(tmod * 1000.0);
+/*--------------------------------------------------------------------
+ * Open a new connection to the backend.  On failure vc->fd is negative.
+ *
+ * The addresses are tried in the order prefer_ipv6 dictates, but we
+ * do not wait for one to time out before trying the next: once the
+ * current attempt has had connect_race_delay to itself, the next one
+ * is started in parallel, and whichever connects first wins.  An
+ * attempt which fails outright lets the next one start immediately.
+ *
+ * Private interface to cache_backend_cfg.c, which uses it to pre-warm
+ * idle connections.
+ */
 
-	i = VTCP_connect(s, sa, salen, tmo);
+#define VBE_NADDR	2
 
-	if (i != 0) {
-		AZ(close(s));
-		return (-1);
+void
+VBE_Connect(struct backend *bp, struct vbc *vc, double tmod)
+{
+	struct sockaddr_storage *sa[VBE_NADDR];
+	socklen_t sl[VBE_NADDR];
+	int pf[VBE_NADDR], s[VBE_NADDR];
+	struct pollfd pfd[VBE_NADDR];
+	int idx[VBE_NADDR];
+	int i, j, k, n, nxt, np, win, done, tmo;
+	socklen_t l;
+	double now, t_end, t_next;
+
+	CHECK_OBJ_NOTNULL(bp, BACKEND_MAGIC);
+	CHECK_OBJ_NOTNULL(vc, VBC_MAGIC);
+	assert(bp->ipv6 != NULL || bp->ipv4 != NULL);
+
+	n = 0;
+	if (cache_param->prefer_ipv6 && bp->ipv6 != NULL) {
+		pf[n] = PF_INET6;
+		sa[n] = bp->ipv6;
+		sl[n++] = bp->ipv6len;
+	}
+	if (bp->ipv4 != NULL) {
+		pf[n] = PF_INET;
+		sa[n] = bp->ipv4;
+		sl[n++] = bp->ipv4len;
+	}
+	if (!cache_param->prefer_ipv6 && bp->ipv6 != NULL) {
+		pf[n] = PF_INET6;
+		sa[n] = bp->ipv6;
+		sl[n++] = bp->ipv6len;
+	}
+	for (i = 0; i < n; i++)
+		s[i] = -1;
+
+	now = VTIM_real();
+	t_end = tmod > 0. ? now + tmod : 0.;
+	t_next = now;
+	nxt = 0;
+	win = -1;
+	while (win < 0) {
+		now = VTIM_real();
+		if (t_end > 0. && now >= t_end)
+			break;
+		if (nxt < n && now >= t_next) {
+			s[nxt] = vbe_StartConnect(pf[nxt], sa[nxt], sl[nxt],
+			    &done);
+			if (done)
+				win = nxt;
+			t_next = now;
+			if (s[nxt] >= 0)
+				t_next += cache_param->connect_race_delay;
+			nxt++;
+			continue;
+		}
+		np = 0;
+		for (i = 0; i < nxt; i++) {
+			if (s[i] < 0)
+				continue;
+			pfd[np].fd = s[i];
+			pfd[np].events = POLLWRNORM;
+			pfd[np].revents = 0;
+			idx[np++] = i;
+		}
+		if (np == 0 && nxt == n)
+			break;
+		if (np == 0) {
+			t_next = now;
+			continue;
+		}
+		tmo = -1;
+		if (t_end > 0.)
+			tmo = (int)ceil((t_end - now) * 1e3);
+		if (nxt < n && (tmo < 0 || t_next - now < t_end - now))
+			tmo = (int)ceil((t_next - now) * 1e3);
+		if (poll(pfd, np, tmo) <= 0)
+			continue;
+		for (j = 0; j < np && win < 0; j++) {
+			if (pfd[j].revents == 0)
+				continue;
+			i = idx[j];
+			l = sizeof k;
+			AZ(getsockopt(s[i], SOL_SOCKET, SO_ERROR, &k, &l));
+			if (k == 0) {
+				win = i;
+				break;
+			}
+			AZ(close(s[i]));
+			s[i] = -1;
+			t_next = now;
+		}
 	}
 
-	return (s);
+	for (i = 0; i < nxt; i++)
+		if (i != win && s[i] >= 0)
+			AZ(close(s[i]));
+
+	if (win < 0) {
+		vc->fd = -1;
+		vc->addr = NULL;
+		vc->addrlen = 0;
+		return;
+	}
+	if (win > 0)
+		VSC_C_main->backend_race++;
+	(void)VTCP_blocking(s[win]);
+	vc->fd = s[win];
+	vc->addr = sa[win];
+	vc->addrlen = sl[win];
+	vc->t_open = VTIM_real();
 }
 
-/*--------------------------------------------------------------------*/
+/*--------------------------------------------------------------------
+ * The backend lock is only held around the accounting, so that other
+ * worker threads can have a go, while we ponder.
+ */
 
 static void
 bes_conn_try(struct req *req, struct vbc *vc, const struct vdi_simple *vs)
 {
-	int s;
 	struct backend *bp = vs->backend;
+	double tmod;
 	char abuf1[VTCP_ADDRBUFSIZE];
 	char pbuf1[VTCP_PORTBUFSIZE];
 
@@ -151,68 +273,30 @@ bes_conn_try(struct req *req, struct vbc *vc, const struct vdi_simple *vs)
 	bp->n_conn++;		/* It mostly works */
 	Lck_Unlock(&bp->mtx);
 
-	s = -1;
-	assert(bp->ipv6 != NULL || bp->ipv4 != NULL);
-
-	/* release lock during stuff that can take a long time */
-
-	if (cache_param->prefer_ipv6 && bp->ipv6 != NULL) {
-		s = vbe_TryConnect(req, PF_INET6, bp->ipv6, bp->ipv6len, vs);
-		vc->addr = bp->ipv6;
-		vc->addrlen = bp->ipv6len;
-	}
-	if (s == -1 && bp->ipv4 != NULL) {
-		s = vbe_TryConnect(req, PF_INET, bp->ipv4, bp->ipv4len, vs);
-		vc->addr = bp->ipv4;
-		vc->addrlen = bp->ipv4len;
-	}
-	if (s == -1 && !cache_param->prefer_ipv6 && bp->ipv6 != NULL) {
-		s = vbe_TryConnect(req, PF_INET6, bp->ipv6, bp->ipv6len, vs);
-		vc->addr = bp->ipv6;
-		vc->addrlen = bp->ipv6len;
-	}
+	FIND_TMO(connect_timeout, tmod, req, vs->vrt);
+	VBE_Connect(bp, vc, tmod);
 
-	vc->fd = s;
-	if (s < 0) {
+	if (vc->fd < 0) {
 		Lck_Lock(&bp->mtx);
 		bp->n_conn--;
 		bp->refcount--;		/* Only keep ref on success */
 		Lck_Unlock(&bp->mtx);
-		vc->addr = NULL;
-		vc->addrlen = 0;
 	} else {
-		VTCP_myname(s, abuf1, sizeof abuf1, pbuf1, sizeof pbuf1);
+		VTCP_myname(vc->fd, abuf1, sizeof abuf1, pbuf1, sizeof pbuf1);
 		VSLb(req->vsl, SLT_BackendOpen, "%d %s %s %s ",
 		    vc->fd, vs->backend->display_name, abuf1, pbuf1);
 	}
 
 }
 
-/*--------------------------------------------------------------------
- * Check that there is still something at the far end of a given socket.
- * We poll the fd with instant timeout, if there are any events we can't
- * use it (backends are not allowed to pipeline).
- */
-
-static int
-vbe_CheckFd(int fd)
-{
-	struct pollfd pfd;
-
-	pfd.fd = fd;
-	pfd.events = POLLIN;
-	pfd.revents = 0;
-	return(poll(&pfd, 1, 0) == 0);
-}
-
 /*--------------------------------------------------------------------
  * Manage a pool of vbc structures.
  * XXX: as an experiment, make this caching controled by a parameter
  * XXX: so we can see if it has any effect.
  */
 
-static struct vbc *
-vbe_NewConn(void)
+struct vbc *
+VBE_NewConn(void)
 {
 	struct vbc *vc;
 
@@ -307,6 +391,21 @@ vbe_Healthy(const struct vdi_simple *vs, const struct req *req)
 	return (retval);
 }
 
+/*--------------------------------------------------------------------
+ * Check that a recycled connection has not been closed by the backend.
+ */
+
+static int
+vbe_CheckFd(int fd)
+{
+	struct pollfd pfd;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	return(poll(&pfd, 1, 0) == 0);
+}
+
 /*--------------------------------------------------------------------
  * Get a connection to a particular backend.
  */
@@ -316,13 +415,27 @@ vbe_GetVbe(struct req *req, struct vdi_simple *vs)
 {
 	struct vbc *vc;
 	struct backend *bp;
+	int i, retry, body;
 
 	CHECK_OBJ_NOTNULL(req, REQ_MAGIC);
 	CHECK_OBJ_NOTNULL(vs, VDI_SIMPLE_MAGIC);
 	bp = vs->backend;
 	CHECK_OBJ_NOTNULL(bp, BACKEND_MAGIC);
-
-	/* first look for vbc's we can recycle */
+	retry = req->busyobj != NULL && req->busyobj->retry_dir != NULL;
+	body = !req->reqbodydone &&
+	    http_GetHdr(req->http, H_Content_Length, NULL);
+
+	/*
+	 * First look for a vbc we can recycle.  Idle connections are
+	 * checked for EOF and stray input in the background by the
+	 * backend-idle thread, so we do not poll(2) them here.  Should
+	 * the backend have closed one since, FetchHdr() will retry with
+	 * the same backend, and on that second try we poll those the idle
+	 * thread has not seen since they were recycled, so that we do not
+	 * pick another equally stale one.  A request body is read from
+	 * the client as it is sent and cannot be sent again, so there is
+	 * no retry for requests with one: those always poll.
+	 */
 	while (1) {
 		Lck_Lock(&bp->mtx);
 		vc = VTAILQ_FIRST(&bp->connlist);
@@ -332,13 +445,17 @@ vbe_GetVbe(struct req *req, struct vdi_simple *vs)
 			assert(vc->fd >= 0);
 			AN(vc->addr);
 			VTAILQ_REMOVE(&bp->connlist, vc, list);
+			bp->vsc->idle = --bp->n_idle;
 		}
+		else if (cache_param->backend_preconnect)
+			bp->preconnect = 1;
+		i = (vc != NULL && (body || (retry && !vc->checked)));
 		Lck_Unlock(&bp->mtx);
 		if (vc == NULL)
 			break;
-		if (vbe_CheckFd(vc->fd)) {
-			/* XXX locking of stats */
-			VSC_C_main->backend_reuse += 1;
+		if (!i || vbe_CheckFd(vc->fd)) {
+			VSC_ADD(backend_reuse, 1);
+			bp->vsc->reuse++;
 			VSLb(req->vsl, SLT_Backend, "%d %s %s",
 			    vc->fd, req->director->vcl_name,
 			    bp->display_name);
@@ -346,7 +463,8 @@ vbe_GetVbe(struct req *req, struct vdi_simple *vs)
 			vc->recycled = 1;
 			return (vc);
 		}
-		VSC_C_main->backend_toolate++;
+		VSC_ADD(backend_toolate, 1);
+		bp->vsc->toolate++;
 		VSLb(req->vsl, SLT_BackendClose, "%d %s toolate",
 		    vc->fd, bp->display_name);
 
@@ -371,7 +489,7 @@ vbe_GetVbe(struct req *req, struct vdi_simple *vs)
 		return (NULL);
 	}
 
-	vc = vbe_NewConn();
+	vc = VBE_NewConn();
 	assert(vc->fd == -1);
 	AZ(vc->backend);
 	bes_conn_try(req, vc, vs);
@@ -381,7 +499,7 @@ vbe_GetVbe(struct req *req, struct vdi_simple *vs)
 		return (NULL);
 	}
 	vc->backend = bp;
-	VSC_C_main->backend_conn++;
+	VSC_ADD(backend_conn, 1);
 	VSLb(req->vsl, SLT_Backend, "%d %s %s",
 	    vc->fd, req->director->vcl_name, bp->display_name);
 	vc->vdis = vs;
@@ -408,6 +526,20 @@ vdi_get_backend_if_simple(const struct director *d)
 	return (vs->backend);
 }
 
+/*--------------------------------------------------------------------
+ * The simple director a connection came from, so that FetchHdr() can
+ * retry on the same backend rather than ask the director again.
+ */
+
+const struct director *
+VBE_Director(const struct vbc *vc)
+{
+
+	CHECK_OBJ_NOTNULL(vc, VBC_MAGIC);
+	CHECK_OBJ_NOTNULL(vc->vdis, VDI_SIMPLE_MAGIC);
+	return (&vc->vdis->dir);
+}
+
 /*--------------------------------------------------------------------
  *
  */
@@ -133,8 +133,18 @@ struct backend {
 	socklen_t		ipv6len;
 
 	unsigned		n_conn;
+	unsigned		n_idle;
+	unsigned		preconnect;
 	VTAILQ_HEAD(, vbc)	connlist;
 
+	/*
+	 * Time to first byte histogram, see HIST_Bucket().  ttfb only
+	 * grows, with atomic adds, the rest is the idle thread's.
+	 */
+	uint64_t		ttfb[VSC_HIST_NBUCKET];
+	uint64_t		ttfb_last[VSC_HIST_NBUCKET];
+	uint64_t		ttfb_recent[VSC_HIST_NBUCKET];
+
 	struct vbp_target	*probe;
 	unsigned		healthy;
 	enum admin_health	admin_health;
@@ -159,6 +169,10 @@ struct vbc {
 	socklen_t		addrlen;
 
 	uint8_t			recycled;
+	uint8_t			checked;	/* Polled since it went idle */
+
+	double			t_open;
+	double			t_idle;
 
 	/* Timeouts */
 	double			first_byte_timeout;
@@ -166,13 +180,17 @@ struct vbc {
 };
 
 /* cache_backend.c */
+struct vbc *VBE_NewConn(void);
+void VBE_Connect(struct backend *bp, struct vbc *vc, double tmod);
 void VBE_ReleaseConn(struct vbc *vc);
 struct backend *vdi_get_backend_if_simple(const struct director *d);
+const struct director *VBE_Director(const struct vbc *vc);
 
 /* cache_backend_cfg.c */
 void VBE_DropRefConn(struct backend *);
 void VBE_DropRefVcl(struct backend *);
 void VBE_DropRefLocked(struct backend *b);
+void VBE_TTFB(struct backend *b, double ttfb);
 
 /* cache_backend_poll.c */
 void VBP_Insert(struct backend *b, struct vrt_backend_probe const *p,
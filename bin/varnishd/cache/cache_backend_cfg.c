@@ -33,6 +33,7 @@
 #include "config.h"
 
 #include <ctype.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -42,12 +43,22 @@
 #include "vcli.h"
 #include "vcli_priv.h"
 #include "vrt.h"
+#include "vtcp.h"
+#include "vtim.h"
 
 /*
- * The list of backends is not locked, it is only ever accessed from
- * the CLI thread, so there is no need.
+ * The list of backends is only ever changed from the CLI thread, which
+ * can therefore walk it without locking.  Changes are made holding
+ * vbe_mtx, so that the backend-idle thread can walk it too.
  */
 static VTAILQ_HEAD(, backend) backends = VTAILQ_HEAD_INITIALIZER(backends);
+static struct lock vbe_mtx;
+static pthread_t vbe_idle_thread;
+
+#define VBE_IDLE_TICK	0.2
+#define VBE_IDLE_POLL	64
+#define VBE_IDLE_PREWARM	64
+#define VBE_TTFB_DECAY	50
 
 /*--------------------------------------------------------------------
  */
@@ -57,7 +68,9 @@ VBE_Nuke(struct backend *b)
 {
 
 	ASSERT_CLI();
+	Lck_Lock(&vbe_mtx);
 	VTAILQ_REMOVE(&backends, b, list);
+	Lck_Unlock(&vbe_mtx);
 	free(b->ipv4);
 	free(b->ipv4_addr);
 	free(b->ipv6);
@@ -68,6 +81,30 @@ VBE_Nuke(struct backend *b)
 	VSC_C_main->n_backend--;
 }
 
+/*--------------------------------------------------------------------
+ * Close the idle connections of a backend nobody references any more,
+ * and get rid of it.
+ */
+
+static void
+vbe_Cleanup(struct backend *b)
+{
+	struct vbc *vbe, *vbe2;
+
+	ASSERT_CLI();
+	AZ(b->refcount);
+	VTAILQ_FOREACH_SAFE(vbe, &b->connlist, list, vbe2) {
+		VTAILQ_REMOVE(&b->connlist, vbe, list);
+		if (vbe->fd >= 0) {
+			AZ(close(vbe->fd));
+			vbe->fd = -1;
+		}
+		vbe->backend = NULL;
+		VBE_ReleaseConn(vbe);
+	}
+	VBE_Nuke(b);
+}
+
 /*--------------------------------------------------------------------
  */
 
@@ -84,10 +121,248 @@ VBE_Poll(void)
 			b->admin_health == ah_probe
 		);
 		if (b->refcount == 0 && b->probe == NULL)
-			VBE_Nuke(b);
+			vbe_Cleanup(b);
 	}
 }
 
+/*--------------------------------------------------------------------
+ * Look after the idle connections of a backend.
+ *
+ * Backends are not allowed to pipeline, so an idle connection which
+ * polls readable has either been closed by the far end or is out of
+ * sync, and cannot be reused.  Connections which have been idle longer
+ * than backend_idle_timeout or open longer than backend_max_age are
+ * retired as well.
+ *
+ * Idle connections hold no reference on the backend.  Once the
+ * refcount has dropped to zero the CLI thread owns the connlist.
+ */
+
+static void
+vbe_idle_check(struct backend *b, double now)
+{
+	struct vbc *vc, *vc2, *vcs[VBE_IDLE_POLL];
+	struct pollfd pfd[VBE_IDLE_POLL];
+	VTAILQ_HEAD(, vbc) dead = VTAILQ_HEAD_INITIALIZER(dead);
+	double idle, age;
+	int i, n;
+
+	CHECK_OBJ_NOTNULL(b, BACKEND_MAGIC);
+	idle = cache_param->backend_idle_timeout;
+	age = cache_param->backend_max_age;
+
+	Lck_Lock(&b->mtx);
+	if (b->refcount == 0) {
+		Lck_Unlock(&b->mtx);
+		return;
+	}
+	vc2 = VTAILQ_FIRST(&b->connlist);
+	while (vc2 != NULL) {
+		for (n = 0; vc2 != NULL && n < VBE_IDLE_POLL; n++) {
+			CHECK_OBJ_NOTNULL(vc2, VBC_MAGIC);
+			vcs[n] = vc2;
+			pfd[n].fd = vc2->fd;
+			pfd[n].events = POLLIN;
+			pfd[n].revents = 0;
+			vc2 = VTAILQ_NEXT(vc2, list);
+		}
+		(void)poll(pfd, n, 0);
+		for (i = 0; i < n; i++) {
+			vc = vcs[i];
+			if (pfd[i].revents) {
+				/* XXX locking of stats */
+				VSC_C_main->backend_toolate++;
+				b->vsc->toolate++;
+				VSL(SLT_BackendClose, 0, "%d %s toolate",
+				    vc->fd, b->display_name);
+			} else if ((idle > 0. && now - vc->t_idle > idle) ||
+			    (age > 0. && now - vc->t_open > age)) {
+				b->vsc->retire++;
+				VSL(SLT_BackendClose, 0, "%d %s retire",
+				    vc->fd, b->display_name);
+			} else {
+				vc->checked = 1;
+				continue;
+			}
+			VTAILQ_REMOVE(&b->connlist, vc, list);
+			b->vsc->idle = --b->n_idle;
+			assert(b->n_conn > 0);
+			b->n_conn--;
+			VTAILQ_INSERT_TAIL(&dead, vc, list);
+		}
+	}
+	Lck_Unlock(&b->mtx);
+
+	VTAILQ_FOREACH_SAFE(vc, &dead, list, vc2) {
+		VTAILQ_REMOVE(&dead, vc, list);
+		VTCP_close(&vc->fd);
+		vc->backend = NULL;
+		VBE_ReleaseConn(vc);
+	}
+}
+
+/*--------------------------------------------------------------------
+ * Open one connection ahead of demand, if a backend still in use by
+ * VCL has fewer than backend_min_idle idle connections, or a request
+ * recently had to connect because there were none (backend_preconnect).
+ * One per tick is plenty, and limits how long a dead backend can hold
+ * us up.
+ *
+ * vbe_idle_want() picks the backends under vbe_mtx, and holds a
+ * reference on them, so that the connects can be done without it.
+ * Should ours be the last reference when we are done, the backend is
+ * left for VBE_Poll() to clean up in the CLI thread.
+ */
+
+static int
+vbe_idle_want(struct backend *b)
+{
+
+	CHECK_OBJ_NOTNULL(b, BACKEND_MAGIC);
+
+	Lck_Lock(&b->mtx);
+	if (b->refcount == 0 || b->vsc->vcls == 0 ||
+	    b->admin_health == ah_sick ||
+	    (b->admin_health == ah_probe && !b->healthy) ||
+	    (!b->preconnect && b->n_idle >= cache_param->backend_min_idle)) {
+		b->preconnect = 0;
+		Lck_Unlock(&b->mtx);
+		return (0);
+	}
+	b->preconnect = 0;
+	b->refcount++;
+	b->n_conn++;
+	Lck_Unlock(&b->mtx);
+	return (1);
+}
+
+static void
+vbe_idle_prewarm(struct backend *b, double now)
+{
+	struct vbc *vc;
+	char abuf[VTCP_ADDRBUFSIZE];
+	char pbuf[VTCP_PORTBUFSIZE];
+
+	CHECK_OBJ_NOTNULL(b, BACKEND_MAGIC);
+
+	vc = VBE_NewConn();
+	VBE_Connect(b, vc, cache_param->connect_timeout);
+	if (vc->fd >= 0) {
+		VTCP_myname(vc->fd, abuf, sizeof abuf, pbuf, sizeof pbuf);
+		VSL(SLT_BackendOpen, 0, "%d %s %s %s ",
+		    vc->fd, b->display_name, abuf, pbuf);
+	}
+
+	Lck_Lock(&b->mtx);
+	assert(b->refcount > 0);
+	if (vc->fd >= 0 && b->refcount > 1) {
+		vc->backend = b;
+		vc->t_idle = now;
+		vc->checked = 1;
+		VTAILQ_INSERT_TAIL(&b->connlist, vc, list);
+		b->vsc->idle = ++b->n_idle;
+		b->vsc->prewarm++;
+		vc = NULL;
+	} else
+		b->n_conn--;
+	b->refcount--;
+	Lck_Unlock(&b->mtx);
+
+	if (vc == NULL) {
+		/* XXX locking of stats */
+		VSC_C_main->backend_conn++;
+		return;
+	}
+	if (vc->fd >= 0)
+		VTCP_close(&vc->fd);
+	VBE_ReleaseConn(vc);
+}
+
+/*--------------------------------------------------------------------
+ * Time to first byte histogram, bucketed like the cache_hist.c ones.
+ * Fetches only do an atomic add.  The idle thread keeps a copy of the
+ * counts which it halves every VBE_TTFB_DECAY ticks, so that the
+ * percentiles it publishes follow the recent past.
+ */
+
+void
+VBE_TTFB(struct backend *b, double ttfb)
+{
+
+	CHECK_OBJ_NOTNULL(b, BACKEND_MAGIC);
+	VSC_Add(&b->ttfb[HIST_Bucket(ttfb)], 1);
+}
+
+static void
+vbe_ttfb_update(struct backend *b, int decay)
+{
+	unsigned u;
+	uint64_t v, n, n50, n90, n99;
+
+	CHECK_OBJ_NOTNULL(b, BACKEND_MAGIC);
+	n = 0;
+	for (u = 0; u < VSC_HIST_NBUCKET; u++) {
+		v = b->ttfb[u];
+		if (decay)
+			b->ttfb_recent[u] /= 2;
+		b->ttfb_recent[u] += v - b->ttfb_last[u];
+		b->ttfb_last[u] = v;
+		n += b->ttfb_recent[u];
+	}
+	if (n == 0)
+		return;
+	n50 = (n + 1) / 2;
+	n90 = n - n / 10;
+	n99 = n - n / 100;
+	n = 0;
+	for (u = 0; u < VSC_HIST_NBUCKET; u++) {
+		v = b->ttfb_recent[u];
+		if (v == 0)
+			continue;
+		if (n < n50 && n + v >= n50)
+			b->vsc->ttfb_p50 = HIST_Limit(u);
+		if (n < n90 && n + v >= n90)
+			b->vsc->ttfb_p90 = HIST_Limit(u);
+		n += v;
+		if (n >= n99) {
+			b->vsc->ttfb_p99 = HIST_Limit(u);
+			break;
+		}
+	}
+}
+
+static void * __match_proto__(bgthread_t)
+vbe_idle(struct worker *wrk, void *priv)
+{
+	struct backend *b, *pw[VBE_IDLE_PREWARM];
+	double now;
+	unsigned tick = 0, u, npw;
+	int decay;
+
+	CHECK_OBJ_NOTNULL(wrk, WORKER_MAGIC);
+	AZ(priv);
+	while (1) {
+		VTIM_sleep(VBE_IDLE_TICK);
+		now = VTIM_real();
+		decay = (++tick % VBE_TTFB_DECAY) == 0;
+		npw = 0;
+		Lck_Lock(&vbe_mtx);
+		VTAILQ_FOREACH(b, &backends, list) {
+			vbe_idle_check(b, now);
+			if ((cache_param->backend_min_idle > 0 ||
+			    cache_param->backend_preconnect) &&
+			    npw < VBE_IDLE_PREWARM && vbe_idle_want(b))
+				pw[npw++] = b;
+			vbe_ttfb_update(b, decay);
+		}
+		Lck_Unlock(&vbe_mtx);
+		/* Connecting can take connect_timeout, not under vbe_mtx */
+		for (u = 0; u < npw; u++)
+			vbe_idle_prewarm(pw[u], now);
+	}
+	NEEDLESS_RETURN(NULL);
+}
+
 /*--------------------------------------------------------------------
  * Drop a reference to a backend.
  * The last reference must come from the watcher in the CLI thread,
@@ -98,7 +373,6 @@ void
 VBE_DropRefLocked(struct backend *b)
 {
 	int i;
-	struct vbc *vbe, *vbe2;
 
 	CHECK_OBJ_NOTNULL(b, BACKEND_MAGIC);
 	assert(b->refcount > 0);
@@ -108,17 +382,7 @@ VBE_DropRefLocked(struct backend *b)
 	if (i > 0)
 		return;
 
-	ASSERT_CLI();
-	VTAILQ_FOREACH_SAFE(vbe, &b->connlist, list, vbe2) {
-		VTAILQ_REMOVE(&b->connlist, vbe, list);
-		if (vbe->fd >= 0) {
-			AZ(close(vbe->fd));
-			vbe->fd = -1;
-		}
-		vbe->backend = NULL;
-		VBE_ReleaseConn(vbe);
-	}
-	VBE_Nuke(b);
+	vbe_Cleanup(b);
 }
 
 void
@@ -236,7 +500,9 @@ VBE_AddBackend(struct cli *cli, const struct vrt_backend *vb)
 	b->healthy = 1;
 	b->admin_health = ah_probe;
 
+	Lck_Lock(&vbe_mtx);
 	VTAILQ_INSERT_TAIL(&backends, b, list);
+	Lck_Unlock(&vbe_mtx);
 	VSC_C_main->n_backend++;
 	return (b);
 }
@@ -500,4 +766,6 @@ VBE_InitCfg(void)
 {
 
 	CLI_AddFuncs(backend_cmds);
+	Lck_New(&vbe_mtx, lck_vbe);
+	WRK_BgThread(&vbe_idle_thread, "backend-idle", vbe_idle, NULL);
 }
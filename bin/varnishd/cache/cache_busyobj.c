@@ -69,6 +69,7 @@ vbo_New(void)
 	bo->magic = BUSYOBJ_MAGIC;
 	bo->end = (char *)bo + sz;
 	Lck_New(&bo->mtx, lck_busyobj);
+	AZ(pthread_cond_init(&bo->cond, NULL));
 	return (bo);
 }
 
@@ -82,6 +83,7 @@ VBO_Free(struct busyobj **bop)
 	*bop = NULL;
 	CHECK_OBJ_NOTNULL(bo, BUSYOBJ_MAGIC);
 	AZ(bo->refcount);
+	AZ(pthread_cond_destroy(&bo->cond));
 	Lck_Delete(&bo->mtx);
 	MPL_Free(vbopool, bo);
 }
@@ -148,6 +150,7 @@ VBO_DerefBusyObj(struct worker *wrk, struct busyobj **pbo)
 	struct busyobj *bo;
 	struct objcore *oc;
 	unsigned r;
+	txt t;
 
 	CHECK_OBJ_ORNULL(wrk, WORKER_MAGIC);
 	AN(pbo);
@@ -168,14 +171,23 @@ VBO_DerefBusyObj(struct worker *wrk, struct busyobj **pbo)
 		Lck_Lock(&bo->mtx);
 		assert(bo->refcount > 0);
 		r = --bo->refcount;
+		if (r == 1)
+			AZ(pthread_cond_broadcast(&bo->cond));
 		Lck_Unlock(&bo->mtx);
 	}
 
 	if (r)
 		return;
 
+	t.b = t.e = TRUST_ME("");
+	VSLbt(bo->vsl, SLT_BereqEnd, t);
 	VSL_Flush(bo->vsl, 0);
 
+	if (bo->stale_obj != NULL) {
+		AN(wrk);
+		(void)HSH_Deref(&wrk->stats, NULL, &bo->stale_obj);
+	}
+
 	if (oc != NULL) {
 		AN(wrk);
 		(void)HSH_Deref(&wrk->stats, NULL, &bo->fetch_obj);
@@ -189,3 +201,88 @@ VBO_DerefBusyObj(struct worker *wrk, struct busyobj **pbo)
 	else
 		VBO_Free(&bo);
 }
+
+/*--------------------------------------------------------------------
+ * Streaming delivery follows the object as FetchBody() appends to it.
+ *
+ * The fetching side announces new body bytes with VBO_extend() and the
+ * end of the fetch with VBO_setstate(), the delivering side waits for
+ * either in VBO_waitlen(), or for the end alone in VBO_waitstate().
+ * Body bytes below the length returned by VBO_waitlen() are in the
+ * storage list and will not move.
+ */
+
+void
+VBO_extend(struct busyobj *bo, ssize_t l)
+{
+
+	CHECK_OBJ_NOTNULL(bo, BUSYOBJ_MAGIC);
+	CHECK_OBJ_NOTNULL(bo->fetch_obj, OBJECT_MAGIC);
+	if (l == 0)
+		return;
+	assert(l > 0);
+	Lck_Lock(&bo->mtx);
+	bo->fetch_obj->len += l;
+	AZ(pthread_cond_broadcast(&bo->cond));
+	Lck_Unlock(&bo->mtx);
+}
+
+ssize_t
+VBO_waitlen(struct busyobj *bo, ssize_t l)
+{
+	ssize_t rv;
+
+	CHECK_OBJ_NOTNULL(bo, BUSYOBJ_MAGIC);
+	CHECK_OBJ_NOTNULL(bo->fetch_obj, OBJECT_MAGIC);
+	Lck_Lock(&bo->mtx);
+	while (1) {
+		rv = bo->fetch_obj->len;
+		if (rv > l || bo->state >= BOS_FAILED)
+			break;
+		(void)Lck_CondWait(&bo->cond, &bo->mtx, NULL);
+	}
+	Lck_Unlock(&bo->mtx);
+	return (rv);
+}
+
+void
+VBO_waitstate(struct busyobj *bo, enum busyobj_state_e want)
+{
+
+	CHECK_OBJ_NOTNULL(bo, BUSYOBJ_MAGIC);
+	Lck_Lock(&bo->mtx);
+	while (bo->state < want)
+		(void)Lck_CondWait(&bo->cond, &bo->mtx, NULL);
+	Lck_Unlock(&bo->mtx);
+}
+
+void
+VBO_setstate(struct busyobj *bo, enum busyobj_state_e next)
+{
+
+	CHECK_OBJ_NOTNULL(bo, BUSYOBJ_MAGIC);
+	Lck_Lock(&bo->mtx);
+	bo->state = next;
+	AZ(pthread_cond_broadcast(&bo->cond));
+	Lck_Unlock(&bo->mtx);
+}
+
+/*--------------------------------------------------------------------
+ * A pass object has no refcount, and FetchBody() still uses it after
+ * the final state is set, so the request must let the fetch drop its
+ * reference on the busyobj before the object can be freed.
+ */
+
+void
+VBO_waitfetch(struct busyobj *bo)
+{
+
+	CHECK_OBJ_NOTNULL(bo, BUSYOBJ_MAGIC);
+	CHECK_OBJ_NOTNULL(bo->fetch_obj, OBJECT_MAGIC);
+	if (bo->fetch_obj->objcore->objhead != NULL)
+		return;
+	Lck_Lock(&bo->mtx);
+	while (bo->refcount > 1)
+		(void)Lck_CondWait(&bo->cond, &bo->mtx, NULL);
+	Lck_Unlock(&bo->mtx);
+}
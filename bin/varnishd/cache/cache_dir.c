@@ -36,6 +36,7 @@
 
 #include "cache_backend.h"
 #include "vtcp.h"
+#include "vtim.h"
 
 /* Close a connection ------------------------------------------------*/
 
@@ -54,14 +55,17 @@ VDI_CloseFd(struct vbc **vbp)
 
 	bp = vc->backend;
 
-	VSLb(vc->vsl, SLT_BackendClose, "%s", bp->display_name);
+	/* A pipe handed to the pipe thread has no log */
+	if (vc->vsl != NULL) {
+		VSLb(vc->vsl, SLT_BackendClose, "%s", bp->display_name);
 
-	/*
-	 * Checkpoint log to flush all info related to this connection
-	 * before the OS reuses the FD
-	 */
-	VSL_Flush(vc->vsl, 0);
-	vc->vsl = NULL;
+		/*
+		 * Checkpoint log to flush all info related to this
+		 * connection before the OS reuses the FD
+		 */
+		VSL_Flush(vc->vsl, 0);
+		vc->vsl = NULL;
+	}
 
 	VTCP_close(&vc->fd);
 	VBE_DropRefConn(bp);
@@ -86,6 +90,14 @@ VDI_RecycleFd(struct vbc **vbp)
 
 	bp = vc->backend;
 
+	/* Connections past backend_max_age are not worth keeping */
+	vc->t_idle = VTIM_real();
+	if (cache_param->backend_max_age > 0. &&
+	    vc->t_idle - vc->t_open > cache_param->backend_max_age) {
+		VDI_CloseFd(&vc);
+		return;
+	}
+
 	VSLb(vc->vsl, SLT_BackendReuse, "%s", bp->display_name);
 
 	/* XXX: revisit this hack */
@@ -93,7 +105,10 @@ VDI_RecycleFd(struct vbc **vbp)
 	vc->vsl = NULL;
 
 	Lck_Lock(&bp->mtx);
-	VSC_C_main->backend_recycle++;
+	VSC_ADD(backend_recycle, 1);
+	bp->vsc->recycle++;
+	bp->vsc->idle = ++bp->n_idle;
+	vc->checked = 0;
 	VTAILQ_INSERT_HEAD(&bp->connlist, vc, list);
 	VBE_DropRefLocked(bp);
 }
@@ -36,8 +36,16 @@
 #include "cache.h"
 
 #include "cache_esi.h"
+#include "hash/hash_slinger.h"
 #include "vend.h"
 #include "vgz.h"
+#include "vrt.h"
+#include "vrt_obj.h"
+#include "vsb.h"
+#include "vsha256.h"
+#include "vtim.h"
+
+static void vesc_check(struct req *req);
 
 /*--------------------------------------------------------------------*/
 
@@ -99,6 +107,7 @@ ved_include(struct req *preq, const char *src, const char *host)
 	req->gzip_resp = preq->gzip_resp;
 	req->crc = preq->crc;
 	req->l_crc = preq->l_crc;
+	req->vesc = preq->vesc;
 
 	THR_SetRequest(req);
 
@@ -127,6 +136,10 @@ ved_include(struct req *preq, const char *src, const char *host)
 	preq->crc = req->crc;
 	preq->l_crc = req->l_crc;
 
+	req->vesc = NULL;
+	if (preq->vesc != NULL)
+		vesc_check(preq);
+
 	req->wrk = NULL;
 
 	THR_SetRequest(preq);
@@ -218,6 +231,433 @@ ved_pretend_gzip(struct req *req, const uint8_t *p, ssize_t l)
 	(void)WRW_Flush(req->wrk);
 }
 
+/*---------------------------------------------------------------------
+ * Start a background request for an included object, so that it is
+ * being fetched on another worker thread by the time ved_include()
+ * gets to it.  The cache holds the result until then, and ved_include()
+ * will either hit it or wait for the busy object, so the output still
+ * comes out in document order.
+ *
+ * Returns non-zero if no worker thread was available.
+ */
+
+static int
+ved_prefetch(struct req *preq, const char *src, const char *host)
+{
+	struct worker *wrk;
+	struct req *req;
+
+	wrk = preq->wrk;
+	CHECK_OBJ_NOTNULL(wrk, WORKER_MAGIC);
+	AN(preq->vcl);
+
+	req = SES_NewBgReq(wrk, preq->sp);
+	VSLb(req->vsl, SLT_Link, "req %u", preq->vsl->wid & VSL_IDENTMASK);
+	VSLb(preq->vsl, SLT_Link, "bgreq %u", req->vsl->wid & VSL_IDENTMASK);
+	req->esi_level = preq->esi_level + 1;
+	req->t_req = W_TIM_real(wrk);
+	req->vcl = preq->vcl;
+	VCL_Ref(req->vcl);
+
+	/* Same massaging of the request as in ved_include() */
+	HTTP_Setup(req->http, req->ws, req->vsl, HTTP_Req);
+	HTTP_Copy(req->http, preq->http0);
+	req->http->conds = 0;
+	http_SetH(req->http, HTTP_HDR_URL, src);
+	if (host != NULL && *host != '\0')  {
+		http_Unset(req->http, H_Host);
+		http_SetHeader(req->http, host);
+	}
+	http_ForceGet(req->http);
+	http_Unset(req->http, H_If_Modified_Since);
+	http_Unset(req->http, H_Content_Length);
+	req->reqbodydone = 1;
+
+	/* The strings live in the parent, which may be gone before us */
+	http_CopyHome(req->http);
+	HTTP_Copy(req->http0, req->http);
+	req->ws_req = WS_Snapshot(req->ws);
+
+	req->req_step = R_STP_RECV;
+	if (!SES_ScheduleBgReq(req)) {
+		wrk->stats.esi_prefetch++;
+		return (0);
+	}
+	SES_DeleteBgReq(req);
+	return (1);
+}
+
+/*---------------------------------------------------------------------
+ * Only prefetch what is not in the cache already.  We do not want to
+ * run VCL for that, so we peek for the digest the default vcl_hash{}
+ * would make.  If the VCL hashes otherwise we will prefetch more or
+ * less than we should, neither of which is harmful.
+ */
+
+static int
+ved_cached(struct req *preq, const char *src, const char *host)
+{
+	struct SHA256Context sha256ctx;
+	unsigned char digest[DIGEST_LEN];
+	char *h, *ws_wm;
+
+	ws_wm = WS_Snapshot(preq->ws);
+	if (host != NULL && *host != '\0') {
+		h = strchr(host, ' ');
+		AN(h);
+		h++;
+	} else if (!http_GetHdr(preq->http0, H_Host, &h)) {
+		h = VRT_IP_string(preq, VRT_r_server_ip(preq));
+		if (h == NULL)
+			return (0);
+	}
+
+	SHA256_Init(&sha256ctx);
+	SHA256_Update(&sha256ctx, src, strlen(src));
+	SHA256_Update(&sha256ctx, "#", 1);
+	SHA256_Update(&sha256ctx, h, strlen(h));
+	SHA256_Update(&sha256ctx, "#", 1);
+	SHA256_Final(digest, &sha256ctx);
+	WS_Reset(preq->ws, ws_wm);
+	return (HSH_Peek(preq->wrk, digest, preq->t_req));
+}
+
+static void
+ved_prefetch_all(struct req *req, uint8_t *p, const uint8_t *e, int isgzip)
+{
+	const char *q;
+	unsigned n;
+
+	if (req->esi_level >= cache_param->max_esi_depth)
+		return;
+
+	for (n = 0; p < e && n < cache_param->esi_prefetch; ) {
+		switch (*p) {
+		case VEC_V1:
+		case VEC_V2:
+		case VEC_V8:
+			(void)ved_decode_len(&p);
+			if (isgzip) {
+				(void)ved_decode_len(&p);
+				p += 4;
+			}
+			break;
+		case VEC_S1:
+		case VEC_S2:
+		case VEC_S8:
+			(void)ved_decode_len(&p);
+			break;
+		case VEC_INCL:
+			p++;
+			q = strchr((const char*)p, '\0');
+			AN(q);
+			q++;
+			if (!ved_cached(req, q, (const char*)p)) {
+				if (ved_prefetch(req, q, (const char*)p))
+					return;
+				n++;
+			}
+			p = (void*)strchr(q, '\0');
+			AN(p);
+			p++;
+			break;
+		default:
+			WRONG("Bad VEC");
+		}
+	}
+}
+
+/*---------------------------------------------------------------------
+ * The ESI assembly cache keeps the body of an ESI object, as it was
+ * delivered with all its includes, with the objcore of the ESI object.
+ *
+ * For each of the included objects it remembers the digest, objcore and
+ * xid, but holds no reference, so they expire and get nuked as usual.
+ * The body is only used while they are all still the objects a lookup
+ * would find, have not expired, and no bans have been added since it
+ * was assembled.  An assembled body goes away with the objcore, or when
+ * it is found to be stale.  The total size is limited by param
+ * esi_cache.
+ */
+
+struct vesc_frag {
+	unsigned char		digest[DIGEST_LEN];
+	const struct objcore	*oc;
+	unsigned		xid;
+};
+
+struct vesc {
+	unsigned		magic;
+#define VESC_MAGIC		0x6d3e05a1
+	unsigned		refcnt;
+	int			gzip;
+	int			failed;
+	uint64_t		bans;
+	struct objcore		*oc;
+	struct vsb		*vsb;
+	unsigned		nfrag;
+	unsigned		lfrag;
+	struct vesc_frag	*frag;
+};
+
+static struct lock vesc_mtx;
+
+static void
+vesc_free(struct vesc **vpp)
+{
+	struct vesc *vp;
+
+	vp = *vpp;
+	*vpp = NULL;
+	CHECK_OBJ_NOTNULL(vp, VESC_MAGIC);
+	free(vp->frag);
+	VSB_delete(vp->vsb);
+	FREE_OBJ(vp);
+}
+
+/* Free a body which was in the cache */
+
+static void
+vesc_drop(struct vesc **vpp)
+{
+
+	CHECK_OBJ_NOTNULL(*vpp, VESC_MAGIC);
+	Lck_Lock(&vesc_mtx);
+	VSC_C_main->esi_cache_bytes -= VSB_len((*vpp)->vsb);
+	VSC_C_main->n_esi_cache--;
+	Lck_Unlock(&vesc_mtx);
+	vesc_free(vpp);
+}
+
+static void
+vesc_deref(struct objhead *oh, struct vesc **vpp)
+{
+	unsigned r;
+
+	CHECK_OBJ_NOTNULL(*vpp, VESC_MAGIC);
+	Lck_Lock(&oh->mtx);
+	assert((*vpp)->refcnt > 0);
+	r = --(*vpp)->refcnt;
+	Lck_Unlock(&oh->mtx);
+	if (r == 0)
+		vesc_drop(vpp);
+	else
+		*vpp = NULL;
+}
+
+/* Are the included objects still what a lookup would find ? */
+
+static int
+vesc_valid(struct req *req, const struct vesc *vp)
+{
+	const struct vesc_frag *vf;
+	unsigned u;
+
+	if (vp->bans != VSC_C_main->bans_added)
+		return (0);
+	for (u = 0; u < vp->nfrag; u++) {
+		vf = &vp->frag[u];
+		if (!HSH_Current(req->wrk, vf->digest, vf->oc, vf->xid,
+		    req->t_req))
+			return (0);
+	}
+	return (1);
+}
+
+/*
+ * Deliver req->obj from the ESI assembly cache if we can, otherwise
+ * start assembling it, if it is a cached object.
+ */
+
+static int
+vesc_deliver(struct req *req, int gzip)
+{
+	struct objcore *oc;
+	struct objhead *oh;
+	struct vesc *vp;
+
+	oc = req->obj->objcore;
+	CHECK_OBJ_ORNULL(oc, OBJCORE_MAGIC);
+	if (oc == NULL || oc->objhead == NULL)
+		return (0);
+	oh = oc->objhead;
+	CHECK_OBJ_NOTNULL(oh, OBJHEAD_MAGIC);
+
+	Lck_Lock(&oh->mtx);
+	vp = oc->esi_cache;
+	if (vp != NULL)
+		vp->refcnt++;
+	Lck_Unlock(&oh->mtx);
+
+	if (vp != NULL && vp->gzip == gzip && vesc_valid(req, vp)) {
+		req->wrk->stats.esi_cache_hit++;
+		(void)WRW_Write(req->wrk, VSB_data(vp->vsb), VSB_len(vp->vsb));
+		(void)WRW_Flush(req->wrk);
+		req->acct_req.bodybytes += VSB_len(vp->vsb);
+		vesc_deref(oh, &vp);
+		return (1);
+	}
+	if (vp != NULL) {
+		if (vp->gzip == gzip) {
+			/* Stale, let go of the included objects */
+			Lck_Lock(&oh->mtx);
+			if (oc->esi_cache == vp) {
+				oc->esi_cache = NULL;
+				vp->refcnt--;
+			}
+			Lck_Unlock(&oh->mtx);
+		}
+		vesc_deref(oh, &vp);
+	}
+
+	req->wrk->stats.esi_cache_miss++;
+	ALLOC_OBJ(vp, VESC_MAGIC);
+	AN(vp);
+	vp->gzip = gzip;
+	vp->bans = VSC_C_main->bans_added;
+	vp->oc = oc;
+	vp->vsb = VSB_new_auto();
+	AN(vp->vsb);
+	req->vesc = vp;
+	req->wrk->wrw_copy = vp->vsb;
+	req->wrk->wrw_copy_fd = &req->sp->fd;
+	return (0);
+}
+
+/* Give up assembling if it gets too big */
+
+static void
+vesc_check(struct req *req)
+{
+	struct vesc *vp;
+
+	vp = req->vesc;
+	CHECK_OBJ_NOTNULL(vp, VESC_MAGIC);
+	if (!vp->failed && VSB_len(vp->vsb) <= cache_param->esi_cache)
+		return;
+	vp->failed = 1;
+	req->wrk->wrw_copy = NULL;
+}
+
+/* Delivery is done, put the assembled body in the cache */
+
+static void
+vesc_insert(struct req *req)
+{
+	struct objcore *oc;
+	struct objhead *oh;
+	struct vesc *vp, *ovp;
+	ssize_t len;
+	int keep = 0;
+
+	vesc_check(req);
+	vp = req->vesc;
+	req->vesc = NULL;
+	req->wrk->wrw_copy = NULL;
+	CHECK_OBJ_NOTNULL(vp, VESC_MAGIC);
+	oc = vp->oc;
+	CHECK_OBJ_NOTNULL(oc, OBJCORE_MAGIC);
+	oh = oc->objhead;
+	CHECK_OBJ_NOTNULL(oh, OBJHEAD_MAGIC);
+
+	if (vp->failed || WRW_Error(req->wrk) || req->sp->fd < 0 ||
+	    VSB_finish(vp->vsb) || !vesc_valid(req, vp)) {
+		vesc_free(&vp);
+		return;
+	}
+
+	len = VSB_len(vp->vsb);
+	Lck_Lock(&vesc_mtx);
+	if (VSC_C_main->esi_cache_bytes + len <= cache_param->esi_cache) {
+		VSC_C_main->esi_cache_bytes += len;
+		VSC_C_main->n_esi_cache++;
+		keep = 1;
+	}
+	Lck_Unlock(&vesc_mtx);
+	if (!keep) {
+		vesc_free(&vp);
+		return;
+	}
+
+	vp->refcnt = 1;
+	Lck_Lock(&oh->mtx);
+	ovp = oc->esi_cache;
+	oc->esi_cache = vp;
+	if (ovp != NULL && --ovp->refcnt > 0)
+		ovp = NULL;
+	Lck_Unlock(&oh->mtx);
+	if (ovp != NULL)
+		vesc_drop(&ovp);
+}
+
+/*
+ * An included object has been delivered, remember it if it is one
+ * the assembled body can depend on.
+ */
+
+void
+ESI_CacheAdd(struct req *req)
+{
+	struct vesc *vp;
+	struct objcore *oc;
+	struct vesc_frag *fp;
+
+	CHECK_OBJ_NOTNULL(req, REQ_MAGIC);
+	assert(req->esi_level > 0);
+	vp = req->vesc;
+	CHECK_OBJ_NOTNULL(vp, VESC_MAGIC);
+	if (vp->failed)
+		return;
+	CHECK_OBJ_NOTNULL(req->obj, OBJECT_MAGIC);
+	oc = req->obj->objcore;
+	CHECK_OBJ_ORNULL(oc, OBJCORE_MAGIC);
+	if (oc == NULL || oc->objhead == NULL || oc == vp->oc ||
+	    (oc->flags & (OC_F_BUSY|OC_F_PASS)) ||
+	    req->obj->vary != NULL || req->busyobj != NULL) {
+		/* Not something we can find again without a lookup */
+		vp->failed = 1;
+		req->wrk->wrw_copy = NULL;
+		return;
+	}
+	if (vp->nfrag == vp->lfrag) {
+		vp->lfrag = vp->lfrag == 0 ? 8 : vp->lfrag * 2;
+		fp = realloc(vp->frag, vp->lfrag * sizeof *vp->frag);
+		if (fp == NULL) {
+			vp->failed = 1;
+			req->wrk->wrw_copy = NULL;
+			return;
+		}
+		vp->frag = fp;
+	}
+	fp = &vp->frag[vp->nfrag++];
+	memcpy(fp->digest, req->digest, sizeof fp->digest);
+	fp->oc = oc;
+	fp->xid = req->obj->vxid;
+}
+
+/* The objcore is going away */
+
+void
+ESI_CacheFree(struct objcore *oc)
+{
+	struct vesc *vp;
+
+	CHECK_OBJ_NOTNULL(oc, OBJCORE_MAGIC);
+	AZ(oc->refcnt);
+	vp = oc->esi_cache;
+	oc->esi_cache = NULL;
+	CHECK_OBJ_NOTNULL(vp, VESC_MAGIC);
+	assert(vp->refcnt == 1);
+	vesc_drop(&vp);
+}
+
+void
+ESI_Init(void)
+{
+
+	Lck_New(&vesc_mtx, lck_vesc);
+}
+
 /*---------------------------------------------------------------------
  */
 
@@ -257,6 +697,13 @@ ESI_Deliver(struct req *req)
 		isgzip = 0;
 	}
 
+	if (req->esi_level == 0 && cache_param->esi_cache > 0 &&
+	    vesc_deliver(req, isgzip && !(req->res_mode & RES_GUNZIP)))
+		return;
+
+	if (cache_param->esi_prefetch > 0)
+		ved_prefetch_all(req, p, e, isgzip);
+
 	if (req->esi_level == 0) {
 		/*
 		 * Only the top level document gets to decide this.
@@ -426,6 +873,8 @@ ESI_Deliver(struct req *req)
 		(void)WRW_Write(req->wrk, tailbuf, 13);
 	}
 	(void)WRW_Flush(req->wrk);
+	if (req->esi_level == 0 && req->vesc != NULL)
+		vesc_insert(req);
 }
 
 /*---------------------------------------------------------------------
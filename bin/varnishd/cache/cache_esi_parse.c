@@ -32,6 +32,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "cache.h"
 
@@ -551,7 +552,7 @@ void
 VEP_Parse(const struct busyobj *bo, const char *p, size_t l)
 {
 	struct vep_state *vep;
-	const char *e;
+	const char *e, *q;
 	struct vep_match *vm;
 	int i;
 
@@ -623,12 +624,12 @@ VEP_Parse(const struct busyobj *bo, const char *p, size_t l)
 				vep->state = VEP_NEXTTAG;
 			} else {
 				vep->tag_i = 0;
-				while (p < e) {
-					if (*p++ == '>') {
-						vep->state = VEP_NEXTTAG;
-						break;
-					}
-				}
+				q = memchr(p, '>', e - p);
+				if (q != NULL) {
+					p = q + 1;
+					vep->state = VEP_NEXTTAG;
+				} else
+					p = e;
 			}
 			if (p == e && !vep->remove)
 				vep_mark_verbatim(vep, p);
@@ -641,6 +642,11 @@ VEP_Parse(const struct busyobj *bo, const char *p, size_t l)
 			vep->endtag = 0;
 			vep->attr = NULL;
 			vep->dostuff = NULL;
+			if (vep->esicmt_p == NULL) {
+				/* Only '<' matters, let memchr(3) find it */
+				q = memchr(p, '<', e - p);
+				p = (q != NULL ? q : e);
+			}
 			while (p < e && *p != '<') {
 				if (vep->esicmt_p == NULL) {
 					p++;
@@ -945,6 +951,14 @@ VEP_Parse(const struct busyobj *bo, const char *p, size_t l)
 			 * Skip until we see magic string
 			 */
 			while (p < e) {
+				if (vep->until_p == vep->until) {
+					q = memchr(p, *vep->until, e - p);
+					if (q == NULL) {
+						p = e;
+						break;
+					}
+					p = q;
+				}
 				if (*p++ != *vep->until_p++) {
 					vep->until_p = vep->until;
 				} else if (*vep->until_p == '\0') {
@@ -108,7 +108,7 @@ EXP_ACCESS(keep, 0.,)
  * adjusted for defaults and by per-session limits.
  */
 
-static double
+double
 EXP_Keep(const struct req *req, const struct object *o)
 {
 	double r;
@@ -280,7 +280,7 @@ EXP_Touch(struct objcore *oc)
 	if (oc->timer_idx != BINHEAP_NOIDX) {
 		VTAILQ_REMOVE(&lru->lru_head, oc, lru_list);
 		VTAILQ_INSERT_TAIL(&lru->lru_head, oc, lru_list);
-		VSC_C_main->n_lru_moved++;
+		VSC_ADD(n_lru_moved, 1);
 	}
 	Lck_Unlock(&lru->mtx);
 	return (1);
@@ -32,6 +32,7 @@
 #include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "cache.h"
 
@@ -41,6 +42,7 @@
 #include "vcli_priv.h"
 #include "vct.h"
 #include "vtcp.h"
+#include "vtim.h"
 
 static unsigned fetchfrag;
 
@@ -64,7 +66,7 @@ FetchError2(struct busyobj *bo, const char *error, const char *more)
 		else
 			VSLb(bo->vsl, SLT_FetchError, "%s: %s", error, more);
 	}
-	bo->state = BOS_FAILED;
+	VBO_setstate(bo, BOS_FAILED);
 	return (-1);
 }
 
@@ -114,15 +116,10 @@ VFP_End(struct busyobj *bo)
 }
 
 void
-VFP_update_length(const struct busyobj *bo, ssize_t l)
+VFP_update_length(struct busyobj *bo, ssize_t l)
 {
 
-	CHECK_OBJ_NOTNULL(bo, BUSYOBJ_MAGIC);
-	CHECK_OBJ_NOTNULL(bo->fetch_obj, OBJECT_MAGIC);
-	if (l == 0)
-		return;
-	assert(l > 0);
-	bo->fetch_obj->len += l;
+	VBO_extend(bo, l);
 }
 
 /*--------------------------------------------------------------------
@@ -205,8 +202,9 @@ vfp_nop_end(struct busyobj *bo)
 		STV_free(st);
 		return (0);
 	}
+	/* Streaming readers may be looking at it, so it must not move */
 	if (st->len < st->space)
-		STV_trim(st, st->len, 1);
+		STV_trim(st, st->len, !bo->do_stream);
 	return (0);
 }
 
@@ -216,6 +214,49 @@ static struct vfp vfp_nop = {
 	.end	=	vfp_nop_end,
 };
 
+/*--------------------------------------------------------------------
+ * Reuse the body of the object being revalidated, the backend told us
+ * with a 304 that it is still good.  Normally the new object just
+ * references the storage of the old one, only persistent objects get
+ * a copy.
+ */
+
+static int
+fetch_cached(struct busyobj *bo)
+{
+	struct object *src;
+	struct storage *sst, *st;
+	ssize_t l, o;
+
+	CHECK_OBJ_NOTNULL(bo, BUSYOBJ_MAGIC);
+	src = bo->stale_obj;
+	CHECK_OBJ_NOTNULL(src, OBJECT_MAGIC);
+
+	if (STV_ShareBody(bo->fetch_obj, src) == 0)
+		VFP_update_length(bo, src->len);
+	else {
+		VTAILQ_FOREACH(sst, &src->store, list) {
+			for (o = 0; o < sst->len; o += l) {
+				st = FetchStorage(bo, src->len);
+				if (st == NULL)
+					return (-1);
+				l = st->space - st->len;
+				if (l > sst->len - o)
+					l = sst->len - o;
+				memcpy(st->ptr + st->len, sst->ptr + o, l);
+				st->len += l;
+				VFP_update_length(bo, l);
+			}
+		}
+	}
+	bo->stats->fetch_refresh_bytes += src->len;
+	bo->fetch_obj->gziped = src->gziped;
+	bo->fetch_obj->gzip_start = src->gzip_start;
+	bo->fetch_obj->gzip_last = src->gzip_last;
+	bo->fetch_obj->gzip_stop = src->gzip_stop;
+	return (0);
+}
+
 /*--------------------------------------------------------------------
  * Fetch Storage to put object into.
  *
@@ -440,6 +481,7 @@ FetchHdr(struct req *req, int need_host_hdr, int sendbody)
 	enum htc_status_e hs;
 	int retry = -1;
 	int i, first;
+	double t0, t;
 	struct http_conn *htc;
 
 	wrk = req->wrk;
@@ -457,7 +499,8 @@ FetchHdr(struct req *req, int need_host_hdr, int sendbody)
 
 	hp = bo->bereq;
 
-	bo->vbc = VDI_GetFd(NULL, req);
+	bo->t_fetch = VTIM_real();
+	bo->vbc = VDI_GetFd(bo->retry_dir, req);
 	if (bo->vbc == NULL) {
 		VSLb(req->vsl, SLT_FetchError, "no backend connection");
 		return (-1);
@@ -486,13 +529,15 @@ FetchHdr(struct req *req, int need_host_hdr, int sendbody)
 		VSLb(req->vsl, SLT_FetchError,
 		    "backend write error: %d (%s)",
 		    errno, strerror(errno));
+		if (retry == 1)
+			bo->retry_dir = VBE_Director(vc);
 		VDI_CloseFd(&bo->vbc);
 		/* XXX: other cleanup ? */
 		return (retry);
 	}
 
 	/* XXX is this the right place? */
-	VSC_C_main->backend_req++;
+	VSC_ADD(backend_req, 1);
 
 	/* Receive response */
 
@@ -502,6 +547,7 @@ FetchHdr(struct req *req, int need_host_hdr, int sendbody)
 
 	VTCP_set_read_timeout(vc->fd, vc->first_byte_timeout);
 
+	t0 = VTIM_real();
 	first = 1;
 	do {
 		hs = HTC_Rx(htc);
@@ -517,6 +563,8 @@ FetchHdr(struct req *req, int need_host_hdr, int sendbody)
 			VSLb(req->vsl, SLT_FetchError,
 			    "http %sread error: EOF",
 			    first ? "first " : "");
+			if (retry == 1)
+				bo->retry_dir = VBE_Director(vc);
 			VDI_CloseFd(&bo->vbc);
 			/* XXX: other cleanup ? */
 			return (retry);
@@ -524,6 +572,9 @@ FetchHdr(struct req *req, int need_host_hdr, int sendbody)
 		if (first) {
 			retry = -1;
 			first = 0;
+			t = VTIM_real() - t0;
+			VBE_TTFB(vc->backend, t);
+			HIST_Add(wrk, HIST_ttfb, t);
 			VTCP_set_read_timeout(vc->fd,
 			    vc->between_bytes_timeout);
 		}
@@ -583,7 +634,7 @@ FetchBody(struct worker *wrk, void *priv)
 	AZ(bo->vgz_rx);
 	AZ(VTAILQ_FIRST(&obj->store));
 
-	bo->state = BOS_FETCHING;
+	VBO_setstate(bo, BOS_FETCHING);
 
 	/* XXX: pick up estimate from objdr ? */
 	cl = 0;
@@ -618,6 +669,10 @@ FetchBody(struct worker *wrk, void *priv)
 		cls = 1;
 		VFP_End(bo);
 		break;
+	case BS_CACHED:
+		cls = fetch_cached(bo);
+		mklen = 1;
+		break;
 	case BS_ERROR:
 		cls = FetchError(bo, "error incompatible Transfer-Encoding");
 		mklen = 0;
@@ -656,7 +711,8 @@ FetchBody(struct worker *wrk, void *priv)
 		if (cls == 0 && bo->should_close)
 			cls = 1;
 
-		VSLb(bo->vsl, SLT_Length, "%zd", obj->len);
+		VSLbb(bo->vsl, SLT_Length, (uint64_t)obj->len);
+		HIST_Add(wrk, HIST_fetch, VTIM_real() - bo->t_fetch);
 
 		{
 		/* Sanity check fetch methods accounting */
@@ -684,12 +740,14 @@ FetchBody(struct worker *wrk, void *priv)
 		else
 			VDI_RecycleFd(&bo->vbc);
 
+		if (cache_param->gunzip_store && obj->gziped &&
+		    obj->esidata == NULL && obj->objcore->objhead != NULL)
+			VGZ_StoreGunzip(bo);
 
-		/* XXX: Atomic assignment, needs volatile/membar ? */
-		bo->state = BOS_FINISHED;
+		VBO_setstate(bo, BOS_FINISHED);
 	}
 	if (obj->objcore->objhead != NULL)
-		HSH_Complete(obj->objcore);
+		HSH_Complete(&wrk->stats, obj->objcore);
 	bo->stats = NULL;
 	VBO_DerefBusyObj(wrk, &bo);
 }
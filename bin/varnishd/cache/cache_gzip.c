@@ -43,6 +43,9 @@
 
 #include "cache.h"
 
+#include "hash/hash_slinger.h"
+#include "vend.h"
+
 #include "vgz.h"
 
 struct vgz {
@@ -88,7 +91,7 @@ VGZ_NewUngzip(struct vsl_log *vsl, const char *id)
 
 	vg = vgz_alloc_vgz(vsl, id);
 	vg->dir = VGZ_UN;
-	VSC_C_main->n_gunzip++;
+	VSC_ADD(n_gunzip, 1);
 
 	/*
 	 * Max memory usage according to zonf.h:
@@ -108,7 +111,7 @@ VGZ_NewGzip(struct vsl_log *vsl, const char *id)
 
 	vg = vgz_alloc_vgz(vsl, id);
 	vg->dir = VGZ_GZ;
-	VSC_C_main->n_gzip++;
+	VSC_ADD(n_gzip, 1);
 
 	/*
 	 * From zconf.h:
@@ -434,6 +437,287 @@ VGZ_Destroy(struct vgz **vgp)
 	return (vr);
 }
 
+/*--------------------------------------------------------------------
+ * The gzip trailer ends with the length of the input mod 2^32, which
+ * tells us how much storage the gunzip'ed copy needs.
+ */
+
+static ssize_t
+vgz_isize(const struct object *obj)
+{
+	const struct storage *st;
+	uint8_t b[4];
+	ssize_t i, l, o;
+	int n;
+
+	l = obj->len - 4;
+	o = 0;
+	n = 0;
+	VTAILQ_FOREACH(st, &obj->store, list) {
+		for (i = (l > o ? l - o : 0); i < st->len && n < 4; i++)
+			b[n++] = st->ptr[i];
+		o += st->len;
+	}
+	if (n != 4)
+		return (0);
+	return (vle32dec(b));
+}
+
+/*--------------------------------------------------------------------
+ * Store a gunzip'ed copy of the gzip'ed object we just fetched, so
+ * clients which do not accept gzip need not have it uncompressed on
+ * every delivery.  If we cannot, they will, so this is never an error.
+ */
+
+void
+VGZ_StoreGunzip(struct busyobj *bo)
+{
+	struct object *obj;
+	struct storagehead head;
+	struct storage *sst, *st, *stn;
+	struct vgz *vg;
+	ssize_t len, want;
+	size_t dl;
+	const void *dp;
+	enum vgzret_e vr;
+
+	CHECK_OBJ_NOTNULL(bo, BUSYOBJ_MAGIC);
+	obj = bo->fetch_obj;
+	CHECK_OBJ_NOTNULL(obj, OBJECT_MAGIC);
+	AN(obj->gziped);
+	AZ(obj->esidata);
+	AZ(obj->gunzip_len);
+	assert(VTAILQ_EMPTY(&obj->gunzip_store));
+
+	VTAILQ_INIT(&head);
+	vg = VGZ_NewUngzip(bo->vsl, "U F S");
+	st = NULL;
+	len = 0;
+	want = vgz_isize(obj);
+	vr = VGZ_OK;
+	VTAILQ_FOREACH(sst, &obj->store, list) {
+		CHECK_OBJ_NOTNULL(sst, STORAGE_MAGIC);
+		VGZ_Ibuf(vg, sst->ptr, sst->len);
+		do {
+			if (st == NULL || st->len == st->space) {
+				st = STV_alloc(bo, len < want ?
+				    want - len : cache_param->fetch_chunksize);
+				if (st == NULL)
+					break;
+				VTAILQ_INSERT_TAIL(&head, st, list);
+			}
+			VGZ_Obuf(vg, st->ptr + st->len, st->space - st->len);
+			vr = VGZ_Gunzip(vg, &dp, &dl);
+			st->len += dl;
+			len += dl;
+		} while (vr == VGZ_OK &&
+		    (!VGZ_IbufEmpty(vg) || VGZ_ObufFull(vg)));
+		if (st == NULL || vr == VGZ_ERROR || vr == VGZ_END)
+			break;
+	}
+	if (VGZ_Destroy(&vg) != VGZ_END || st == NULL) {
+		VTAILQ_FOREACH_SAFE(st, &head, list, stn) {
+			VTAILQ_REMOVE(&head, st, list);
+			STV_free(st);
+		}
+		return;
+	}
+	if (st->len == 0) {
+		VTAILQ_REMOVE(&head, st, list);
+		STV_free(st);
+	} else if (st->len < st->space)
+		STV_trim(st, st->len, 1);
+	VTAILQ_CONCAT(&obj->gunzip_store, &head, list);
+	obj->gunzip_len = len;
+	bo->stats->fetch_gunzip_store++;
+}
+
+/*--------------------------------------------------------------------
+ * The gunzip cache keeps the gunzip'ed body of a gzip'ed object with its
+ * objcore, once a client which does not accept gzip has had to have it
+ * gunzip'ed.  It is freed with the objcore, and the total size is
+ * limited by param gunzip_cache.
+ */
+
+struct vgzc {
+	unsigned		magic;
+#define VGZC_MAGIC		0x5e1d7c2b
+	ssize_t			len;
+	uint8_t			*ptr;
+};
+
+static struct lock vgzc_mtx;
+
+static void
+vgzc_free(struct vgzc **vcp)
+{
+	struct vgzc *vc;
+
+	vc = *vcp;
+	*vcp = NULL;
+	CHECK_OBJ_NOTNULL(vc, VGZC_MAGIC);
+	free(vc->ptr);
+	FREE_OBJ(vc);
+}
+
+/* Gunzip the object into memory, give up past maxlen */
+
+static struct vgzc *
+vgzc_gunzip(struct req *req, ssize_t maxlen)
+{
+	struct vgzc *vc;
+	struct storage *st;
+	struct vgz *vg;
+	enum vgzret_e vr;
+	ssize_t sz;
+	size_t dl;
+	const void *dp;
+	void *p;
+
+	ALLOC_OBJ(vc, VGZC_MAGIC);
+	AN(vc);
+	sz = req->obj->len * 4;
+	if (sz > maxlen)
+		sz = maxlen;
+	vc->ptr = malloc(sz);
+	if (vc->ptr == NULL) {
+		FREE_OBJ(vc);
+		return (NULL);
+	}
+
+	vg = VGZ_NewUngzip(req->vsl, "U D C");
+	vr = VGZ_OK;
+	VTAILQ_FOREACH(st, &req->obj->store, list) {
+		CHECK_OBJ_NOTNULL(st, STORAGE_MAGIC);
+		VGZ_Ibuf(vg, st->ptr, st->len);
+		do {
+			if (vc->len == sz) {
+				if (sz == maxlen)
+					break;
+				sz *= 2;
+				if (sz > maxlen)
+					sz = maxlen;
+				p = realloc(vc->ptr, sz);
+				if (p == NULL)
+					break;
+				vc->ptr = p;
+			}
+			VGZ_Obuf(vg, vc->ptr + vc->len, sz - vc->len);
+			vr = VGZ_Gunzip(vg, &dp, &dl);
+			vc->len += dl;
+		} while (vr == VGZ_OK &&
+		    (!VGZ_IbufEmpty(vg) || VGZ_ObufFull(vg)));
+		if (vr != VGZ_OK || vc->len == sz)
+			break;
+	}
+	if (VGZ_Destroy(&vg) != VGZ_END) {
+		vgzc_free(&vc);
+		return (NULL);
+	}
+	return (vc);
+}
+
+/*
+ * Deliver the gunzip'ed body of req->obj from the gunzip cache, putting
+ * it there if it is not.  Returns non-zero if the caller must gunzip it.
+ */
+
+int
+VGZ_CacheDeliver(struct req *req)
+{
+	struct objcore *oc;
+	struct objhead *oh;
+	struct vgzc *vc;
+	ssize_t room;
+	int keep;
+
+	CHECK_OBJ_NOTNULL(req, REQ_MAGIC);
+	CHECK_OBJ_NOTNULL(req->obj, OBJECT_MAGIC);
+	AN(req->obj->gziped);
+	oc = req->obj->objcore;
+	CHECK_OBJ_NOTNULL(oc, OBJCORE_MAGIC);
+	oh = oc->objhead;
+	if (cache_param->gunzip_cache == 0 || oh == NULL)
+		return (-1);
+	CHECK_OBJ_NOTNULL(oh, OBJHEAD_MAGIC);
+
+	Lck_Lock(&oh->mtx);
+	vc = oc->gunzip;
+	Lck_Unlock(&oh->mtx);
+
+	keep = 1;
+	if (vc != NULL) {
+		req->wrk->stats.gunzip_cache_hit++;
+	} else {
+		req->wrk->stats.gunzip_cache_miss++;
+		Lck_Lock(&vgzc_mtx);
+		room = cache_param->gunzip_cache -
+		    VSC_C_main->gunzip_cache_bytes;
+		Lck_Unlock(&vgzc_mtx);
+		if (room <= 0)
+			return (-1);
+		vc = vgzc_gunzip(req, room);
+		if (vc == NULL)
+			return (-1);
+
+		Lck_Lock(&vgzc_mtx);
+		if (VSC_C_main->gunzip_cache_bytes + vc->len <=
+		    cache_param->gunzip_cache) {
+			VSC_C_main->gunzip_cache_bytes += vc->len;
+			VSC_C_main->n_gunzip_cache++;
+		} else
+			keep = 0;
+		Lck_Unlock(&vgzc_mtx);
+
+		if (keep) {
+			Lck_Lock(&oh->mtx);
+			if (oc->gunzip == NULL)
+				oc->gunzip = vc;
+			else
+				keep = 0;	/* Somebody beat us to it */
+			Lck_Unlock(&oh->mtx);
+			if (!keep) {
+				Lck_Lock(&vgzc_mtx);
+				VSC_C_main->gunzip_cache_bytes -= vc->len;
+				VSC_C_main->n_gunzip_cache--;
+				Lck_Unlock(&vgzc_mtx);
+			}
+		}
+	}
+	CHECK_OBJ_NOTNULL(vc, VGZC_MAGIC);
+	req->acct_req.bodybytes += vc->len;
+	(void)WRW_Write(req->wrk, vc->ptr, vc->len);
+	if (!keep)
+		vgzc_free(&vc);
+	return (0);
+}
+
+/* The objcore is going away */
+
+void
+VGZ_CacheFree(struct objcore *oc)
+{
+	struct vgzc *vc;
+
+	CHECK_OBJ_NOTNULL(oc, OBJCORE_MAGIC);
+	AZ(oc->refcnt);
+	vc = oc->gunzip;
+	oc->gunzip = NULL;
+	CHECK_OBJ_NOTNULL(vc, VGZC_MAGIC);
+	Lck_Lock(&vgzc_mtx);
+	VSC_C_main->gunzip_cache_bytes -= vc->len;
+	VSC_C_main->n_gunzip_cache--;
+	Lck_Unlock(&vgzc_mtx);
+	vgzc_free(&vc);
+}
+
+void
+VGZ_Init(void)
+{
+
+	Lck_New(&vgzc_mtx, lck_vgzc);
+}
+
 /*--------------------------------------------------------------------
  * VFP_GUNZIP
  *
@@ -283,17 +283,152 @@ HSH_Insert(struct worker *wrk, const void *digest, struct objcore *oc)
 }
 
 /*---------------------------------------------------------------------
+ * Look at the objcores for a digest without referencing any of them.
+ * Whatever we learn is only true while we hold the objhead mutex.
+ */
+
+static struct objhead *
+hsh_peek(struct worker *wrk, const void *digest)
+{
+	struct objhead *oh;
+
+	CHECK_OBJ_NOTNULL(wrk, WORKER_MAGIC);
+	AN(digest);
+
+	hsh_prealloc(wrk);
+
+	AN(wrk->nobjhead);
+	oh = hash->lookup(wrk, digest, &wrk->nobjhead);
+	CHECK_OBJ_NOTNULL(oh, OBJHEAD_MAGIC);
+	Lck_AssertHeld(&oh->mtx);
+	assert(oh->refcnt > 0);
+	return (oh);
+}
+
+static void
+hsh_unpeek(struct worker *wrk, struct objhead *oh)
+{
+
+	Lck_Unlock(&oh->mtx);
+	if (!hash->deref(oh))
+		HSH_DeleteObjHead(&wrk->stats, oh);
+}
+
+/*
+ * Tell if a lookup for a digest would find something other than a miss:
+ * an unexpired object, a hit-for-pass or a fetch already in progress.
+ * This is only a hint, the object may well be gone by the time it is
+ * looked up.
+ */
+
+int
+HSH_Peek(struct worker *wrk, const void *digest, double now)
+{
+	struct objhead *oh;
+	struct objcore *oc;
+	struct object *o;
+	int retval = 0;
+
+	oh = hsh_peek(wrk, digest);
+	VTAILQ_FOREACH(oc, &oh->objcs, list) {
+		CHECK_OBJ_NOTNULL(oc, OBJCORE_MAGIC);
+		if (oc->flags & (OC_F_BUSY | OC_F_PASS) ||
+		    oc->busyobj != NULL) {
+			retval = 1;
+			break;
+		}
+		o = oc_getobj(&wrk->stats, oc);
+		CHECK_OBJ_NOTNULL(o, OBJECT_MAGIC);
+		if (o->exp.ttl > 0. && EXP_Ttl(NULL, o) >= now) {
+			retval = 1;
+			break;
+		}
+	}
+	hsh_unpeek(wrk, oh);
+	return (retval);
+}
+
+/*
+ * Tell if the object with this objcore and xid is still the first one
+ * a lookup for the digest finds, and has not expired.  The objcore
+ * pointer is only compared, so nobody needs to hold a reference on it,
+ * and the xid tells us if its memory has been reused for another one.
+ */
+
+int
+HSH_Current(struct worker *wrk, const void *digest,
+    const struct objcore *ocp, unsigned xid, double now)
+{
+	struct objhead *oh;
+	struct objcore *oc;
+	struct object *o;
+	int retval = 0;
+
+	oh = hsh_peek(wrk, digest);
+	VTAILQ_FOREACH(oc, &oh->objcs, list) {
+		CHECK_OBJ_NOTNULL(oc, OBJCORE_MAGIC);
+		if (!(oc->flags & OC_F_BUSY))
+			break;
+	}
+	if (oc != NULL && oc == ocp) {
+		o = oc_getobj(&wrk->stats, oc);
+		CHECK_OBJ_NOTNULL(o, OBJECT_MAGIC);
+		retval = (o->vxid == xid && EXP_Ttl(NULL, o) >= now);
+	}
+	hsh_unpeek(wrk, oh);
+	return (retval);
+}
+
+/*---------------------------------------------------------------------
+ * An object which has been unbusied but is still being fetched can be
+ * delivered to more clients by following the fetch, unless it is an
+ * ESI object or a hit-for-pass, or streaming was disabled for it.
+ */
+
+static int
+hsh_can_follow(const struct req *req, const struct objcore *oc)
+{
+	const struct busyobj *bo;
+
+	if (!cache_param->stream_followers || req->esi_level > 0)
+		return (0);
+	if (oc->flags & (OC_F_BUSY | OC_F_PASS))
+		return (0);
+	bo = oc->busyobj;
+	CHECK_OBJ_NOTNULL(bo, BUSYOBJ_MAGIC);
+	return (bo->do_stream && !bo->do_esi && bo->state < BOS_FAILED);
+}
+
+/*---------------------------------------------------------------------
+ * An object in grace can be delivered while a background fetch
+ * refreshes it, rather than making the request wait for the fetch.
+ */
+
+static int
+hsh_can_bgfetch(const struct req *req, const struct objcore *oc)
+{
+
+	if (!cache_param->bgfetch || req->hash_always_miss)
+		return (0);
+	return (!(oc->flags & OC_F_PASS) && oc->busyobj == NULL);
+}
+
+/*---------------------------------------------------------------------
+ * Look up an object.  If we return an object in grace which should be
+ * refreshed in the background, *bocp is a new busy objcore for that.
+ * If we return a busy objcore for a miss, *kocp is a referenced expired
+ * object, if we have one, which the fetch may revalidate.
  */
 
 struct objcore *
-HSH_Lookup(struct req *req)
+HSH_Lookup(struct req *req, struct objcore **bocp, struct objcore **kocp)
 {
 	struct worker *wrk;
 	struct objhead *oh;
 	struct objcore *oc;
-	struct objcore *grace_oc;
+	struct objcore *grace_oc, *keep_oc;
 	struct object *o;
-	double grace_ttl;
+	double grace_ttl, keep_ttl;
 	int busy_found;
 
 	CHECK_OBJ_NOTNULL(req, REQ_MAGIC);
@@ -302,6 +437,10 @@ HSH_Lookup(struct req *req)
 	CHECK_OBJ_NOTNULL(req->http, HTTP_MAGIC);
 	AN(req->director);
 	AN(hash);
+	AN(bocp);
+	*bocp = NULL;
+	AN(kocp);
+	*kocp = NULL;
 
 	hsh_prealloc(wrk);
 	if (DO_DEBUG(DBG_HASHEDGE))
@@ -328,6 +467,8 @@ HSH_Lookup(struct req *req)
 	busy_found = 0;
 	grace_oc = NULL;
 	grace_ttl = NAN;
+	keep_oc = NULL;
+	keep_ttl = NAN;
 	VTAILQ_FOREACH(oc, &oh->objcs, list) {
 		/* Must be at least our own ref + the objcore we examine */
 		assert(oh->refcnt > 1);
@@ -344,8 +485,10 @@ HSH_Lookup(struct req *req)
 			    !VRY_Match(req, oc->busyobj->vary))
 				continue;
 
-			busy_found = 1;
-			continue;
+			if (!hsh_can_follow(req, oc)) {
+				busy_found = 1;
+				continue;
+			}
 		}
 
 		o = oc_getobj(&wrk->stats, oc);
@@ -373,6 +516,18 @@ HSH_Lookup(struct req *req)
 				grace_ttl = o->exp.entered + o->exp.ttl;
 			}
 		}
+
+		/* Likewise for objects we can revalidate if we fetch */
+		if (!(oc->flags & (OC_F_BUSY | OC_F_PASS)) &&
+		    oc->busyobj == NULL &&
+		    (EXP_Keep(req, o) >= req->t_req ||
+		    EXP_Grace(req, o) >= req->t_req)) {
+			if (keep_oc == NULL ||
+			    keep_ttl < o->exp.entered + o->exp.ttl) {
+				keep_oc = oc;
+				keep_ttl = o->exp.entered + o->exp.ttl;
+			}
+		}
 	}
 
 	/*
@@ -384,13 +539,25 @@ HSH_Lookup(struct req *req)
 
 	AZ(req->objcore);
 	if (oc == NULL			/* We found no live object */
-	    && grace_oc != NULL		/* There is a grace candidate */
-	    && (busy_found		/* Somebody else is already busy */
-	    || !VDI_Healthy(req->director, req))) {
+	    && grace_oc != NULL) {	/* There is a grace candidate */
+		if (busy_found		/* Somebody else is already busy */
+		    || !VDI_Healthy(req->director, req)) {
 					/* Or it is impossible to fetch */
-		o = oc_getobj(&wrk->stats, grace_oc);
-		CHECK_OBJ_NOTNULL(o, OBJECT_MAGIC);
-		oc = grace_oc;
+			oc = grace_oc;
+		} else if (hsh_can_bgfetch(req, grace_oc)) {
+			/* Deliver it, and have it refreshed meanwhile */
+			oc = grace_oc;
+			*bocp = wrk->nobjcore;
+			wrk->nobjcore = NULL;
+			AN((*bocp)->flags & OC_F_BUSY);
+			(*bocp)->refcnt = 1;	/* Owned by busyobj */
+			(*bocp)->objhead = oh;
+			VTAILQ_INSERT_TAIL(&oh->objcs, *bocp, list);
+		}
+		if (oc != NULL) {
+			o = oc_getobj(&wrk->stats, oc);
+			CHECK_OBJ_NOTNULL(o, OBJECT_MAGIC);
+		}
 	}
 
 	if (oc != NULL && !req->hash_always_miss) {
@@ -398,8 +565,17 @@ HSH_Lookup(struct req *req)
 		assert(oh->refcnt > 1);
 		assert(oc->objhead == oh);
 		oc->refcnt++;
+		if (oc->busyobj != NULL) {
+			/* Still being fetched, follow the fetch */
+			AZ(req->busyobj);
+			oc->busyobj->refcount++;
+			req->busyobj = oc->busyobj;
+			wrk->stats.busy_follow++;
+		}
 		Lck_Unlock(&oh->mtx);
-		assert(hash->deref(oh));
+		/* A new busy objcore inherits our reference on the objhead */
+		if (*bocp == NULL)
+			assert(hash->deref(oh));
 		o = oc_getobj(&wrk->stats, oc);
 		CHECK_OBJ_NOTNULL(o, OBJECT_MAGIC);
 		if (!cache_param->obj_readonly && o->hits < INT_MAX)
@@ -409,6 +585,13 @@ HSH_Lookup(struct req *req)
 
 	if (busy_found) {
 		/* There are one or more busy objects, wait for them */
+		if (req->bgfetch) {
+			/* Nobody is waiting for a background request */
+			Lck_Unlock(&oh->mtx);
+			if (!hash->deref(oh))
+				HSH_DeleteObjHead(&wrk->stats, oh);
+			return (NULL);
+		}
 		if (req->esi_level == 0) {
 			CHECK_OBJ_NOTNULL(wrk->nwaitinglist,
 			    WAITINGLIST_MAGIC);
@@ -442,6 +625,11 @@ HSH_Lookup(struct req *req)
 	oc->refcnt = 1;		/* Owned by busyobj */
 	oc->objhead = oh;
 	VTAILQ_INSERT_TAIL(&oh->objcs, oc, list);
+	if (keep_oc != NULL) {
+		assert(keep_oc->objhead == oh);
+		keep_oc->refcnt++;
+		*kocp = keep_oc;
+	}
 	/* NB: do not deref objhead the new object inherits our reference */
 	Lck_Unlock(&oh->mtx);
 	return (oc);
@@ -563,11 +751,12 @@ HSH_Drop(struct worker *wrk, struct object **oo)
 }
 
 /*---------------------------------------------------------------------
- * Remove the busyobj from an objcore
+ * Remove the busyobj from an objcore when the fetch is done, and wake
+ * up anybody who waited for it.
  */
 
 void
-HSH_Complete(struct objcore *oc)
+HSH_Complete(struct dstat *ds, struct objcore *oc)
 {
 	struct objhead *oh;
 
@@ -577,11 +766,14 @@ HSH_Complete(struct objcore *oc)
 
 	Lck_Lock(&oh->mtx);
 	oc->busyobj = NULL;
+	if (oh->waitinglist != NULL)
+		hsh_rush(ds, oh);
 	Lck_Unlock(&oh->mtx);
 }
 
 /*---------------------------------------------------------------------
- * Unbusy an objcore when the object is completely fetched.
+ * Unbusy an objcore when the object headers are in place and the body
+ * is about to be fetched.
  */
 
 void
@@ -604,7 +796,11 @@ HSH_Unbusy(struct dstat *ds, struct objcore *oc)
 	VTAILQ_REMOVE(&oh->objcs, oc, list);
 	VTAILQ_INSERT_HEAD(&oh->objcs, oc, list);
 	oc->flags &= ~OC_F_BUSY;
-	if (oh->waitinglist != NULL)
+	/*
+	 * The waiting requests can follow the fetch from here on, unless
+	 * that is disabled, in which case HSH_Complete() wakes them.
+	 */
+	if (oh->waitinglist != NULL && cache_param->stream_followers)
 		hsh_rush(ds, oh);
 	Lck_Unlock(&oh->mtx);
 }
@@ -684,10 +880,17 @@ HSH_Deref(struct dstat *ds, struct objcore *oc, struct object **oo)
 		AZ(oc->ban);
 	}
 
+	if (oc->gunzip != NULL)
+		VGZ_CacheFree(oc);
+	if (oc->esi_cache != NULL)
+		ESI_CacheFree(oc);
+
 	if (oc->methods != NULL) {
 		oc_freeobj(oc);
 		ds->n_object--;
 	}
+	if (oc->body_oc != NULL)
+		(void)HSH_Deref(ds, oc->body_oc, NULL);
 	FREE_OBJ(oc);
 
 	ds->n_objectcore--;
@@ -0,0 +1,259 @@
+/*-
+ * Copyright (c) 2012 Varnish Software AS
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Latency histograms for the timings listed in tbl/histograms.h.
+ *
+ * Every worker thread keeps its own histograms, updating them takes
+ * no locks.  Whenever the worker sums its other statistics, they are
+ * added with atomic adds to the shard of the CPU it runs on, the same
+ * way VSC_Shard() spreads the main counters.  Once a second the
+ * cache-hist thread adds up the shards into the shared memory
+ * segments, which only it writes.
+ *
+ * Bucket 0-3 are 0-3 microseconds, above that there are four buckets
+ * per power of two, see vapi/vsc_int.h.  The shared memory buckets
+ * only ever grow, so readers can subtract two samples.  The
+ * percentiles published beside them are computed on the same tick
+ * from a copy of the counts which is halved every HIST_DECAY ticks,
+ * so they follow the recent past.
+ */
+
+#include "config.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+#include "cache.h"
+
+#include "vtim.h"
+
+#define HIST_TICK	1.0
+#define HIST_DECAY	10
+
+/* One CPU's share of a histogram */
+struct hist_shard {
+	uint64_t		count;
+	uint64_t		sum;
+	uint64_t		bucket[VSC_HIST_NBUCKET];
+};
+
+static struct VSC_C_hist	*hist_vsc[HIST__MAX];
+static uint64_t			*hist_bucket[HIST__MAX];
+
+/* VSC_NShard() rows of HIST__MAX histograms */
+static struct hist_shard	*hist_shard;
+static unsigned			hist_nshard;
+
+static uint64_t			hist_last[HIST__MAX][VSC_HIST_NBUCKET];
+static uint64_t			hist_recent[HIST__MAX][VSC_HIST_NBUCKET];
+
+/*--------------------------------------------------------------------*/
+
+unsigned
+HIST_Bucket(double d)
+{
+	uint64_t us;
+	unsigned i;
+
+	if (!(d > 0.))
+		return (0);
+	if (d > 1e12)
+		return (VSC_HIST_NBUCKET - 1);
+	us = (uint64_t)(d * 1e6);
+	if (us < 4)
+		return ((unsigned)us);
+	for (i = 0; us >= 8; i++)
+		us >>= 1;
+	i = 4 * i + (unsigned)us;
+	if (i >= VSC_HIST_NBUCKET)
+		i = VSC_HIST_NBUCKET - 1;
+	return (i);
+}
+
+uint64_t
+HIST_Limit(unsigned u)
+{
+
+	if (u < 4)
+		return (u + 1);
+	return ((uint64_t)(u % 4 + 5) << (u / 4 - 1));
+}
+
+/*--------------------------------------------------------------------
+ * Add a sample, in seconds.
+ */
+
+void
+HIST_Add(struct worker *wrk, enum hist_e h, double d)
+{
+	struct whist *wh;
+	unsigned u;
+
+	CHECK_OBJ_NOTNULL(wrk, WORKER_MAGIC);
+	assert(h < HIST__MAX);
+	if (isnan(d))
+		return;
+	u = HIST_Bucket(d);
+	wh = &wrk->hist[h];
+	if (wh->n == 0 || u < wh->lo)
+		wh->lo = u;
+	if (wh->n == 0 || u > wh->hi)
+		wh->hi = u;
+	wh->n++;
+	wh->bucket[u]++;
+	if (d > 0. && d < 1e6)
+		wh->sum += (uint64_t)(d * 1e6);
+}
+
+/*--------------------------------------------------------------------
+ * Move a workers samples to the shard of its CPU.
+ */
+
+void
+HIST_Sum(struct worker *wrk)
+{
+	struct whist *wh;
+	struct hist_shard *hs;
+	unsigned h, u;
+
+	CHECK_OBJ_NOTNULL(wrk, WORKER_MAGIC);
+	hs = NULL;
+	for (h = 0; h < HIST__MAX; h++) {
+		wh = &wrk->hist[h];
+		if (wh->n == 0)
+			continue;
+		if (hs == NULL)
+			hs = hist_shard + VSC_ShardNo() * HIST__MAX;
+		for (u = wh->lo; u <= wh->hi; u++) {
+			if (wh->bucket[u] == 0)
+				continue;
+			VSC_Add(&hs[h].bucket[u], wh->bucket[u]);
+			wh->bucket[u] = 0;
+		}
+		VSC_Add(&hs[h].count, wh->n);
+		VSC_Add(&hs[h].sum, wh->sum);
+		wh->n = 0;
+		wh->sum = 0;
+	}
+}
+
+/*--------------------------------------------------------------------*/
+
+static void
+hist_update(enum hist_e h, int decay)
+{
+	struct VSC_C_hist *vsc;
+	const struct hist_shard *hs;
+	uint64_t *r, c, n, n50, n90, n99, n999, count, sum;
+	unsigned u, s;
+
+	vsc = hist_vsc[h];
+	r = hist_recent[h];
+	n = 0;
+	count = sum = 0;
+	for (s = 0; s < hist_nshard; s++) {
+		hs = &hist_shard[s * HIST__MAX + h];
+		count += hs->count;
+		sum += hs->sum;
+	}
+	for (u = 0; u < VSC_HIST_NBUCKET; u++) {
+		/* Unlocked, the shard counters only grow */
+		c = 0;
+		for (s = 0; s < hist_nshard; s++)
+			c += hist_shard[s * HIST__MAX + h].bucket[u];
+		hist_bucket[h][u] = c;
+		r[u] += c - hist_last[h][u];
+		hist_last[h][u] = c;
+		n += r[u];
+	}
+	vsc->count = count;
+	vsc->sum = sum;
+	if (n == 0) {
+		vsc->p50 = vsc->p90 = vsc->p99 = vsc->p999 = 0;
+		return;
+	}
+	n50 = (n + 1) / 2;
+	n90 = n - n / 10;
+	n99 = n - n / 100;
+	n999 = n - n / 1000;
+	c = 0;
+	for (u = 0; u < VSC_HIST_NBUCKET; u++) {
+		if (r[u] == 0)
+			continue;
+		if (c < n50 && c + r[u] >= n50)
+			vsc->p50 = HIST_Limit(u);
+		if (c < n90 && c + r[u] >= n90)
+			vsc->p90 = HIST_Limit(u);
+		if (c < n99 && c + r[u] >= n99)
+			vsc->p99 = HIST_Limit(u);
+		c += r[u];
+		if (c >= n999) {
+			vsc->p999 = HIST_Limit(u);
+			break;
+		}
+	}
+	if (decay)
+		for (u = 0; u < VSC_HIST_NBUCKET; u++)
+			r[u] /= 2;
+}
+
+static void * __match_proto__(bgthread_t)
+hist_thread(struct worker *wrk, void *priv)
+{
+	unsigned h, tick = 0;
+	int decay;
+
+	CHECK_OBJ_NOTNULL(wrk, WORKER_MAGIC);
+	AZ(priv);
+	while (1) {
+		VTIM_sleep(HIST_TICK);
+		decay = (++tick % HIST_DECAY) == 0;
+		for (h = 0; h < HIST__MAX; h++)
+			hist_update(h, decay);
+	}
+	NEEDLESS_RETURN(NULL);
+}
+
+/*--------------------------------------------------------------------*/
+
+void
+HIST_Init(void)
+{
+	pthread_t thr;
+	unsigned l;
+
+	hist_nshard = VSC_NShard();
+	hist_shard = calloc(hist_nshard * HIST__MAX, sizeof *hist_shard);
+	AN(hist_shard);
+	l = sizeof(struct VSC_C_hist) + VSC_HIST_NBUCKET * sizeof(uint64_t);
+#define HIST(n, d)							\
+	hist_vsc[HIST_##n] = VSM_Alloc(l, VSC_CLASS, VSC_TYPE_HIST, #n);	\
+	AN(hist_vsc[HIST_##n]);						\
+	memset(hist_vsc[HIST_##n], 0, l);				\
+	hist_bucket[HIST_##n] = (void*)(hist_vsc[HIST_##n] + 1);
+#include "tbl/histograms.h"
+#undef HIST
+	WRK_BgThread(&thr, "cache-hist", hist_thread, NULL);
+}
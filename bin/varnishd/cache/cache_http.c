@@ -869,6 +869,43 @@ http_FilterResp(const struct http *fm, struct http *to, unsigned how)
 	http_filterfields(to, fm, how);
 }
 
+/*--------------------------------------------------------------------
+ * Turn a 304 response into the stored response it revalidated: the
+ * status line and any headers the 304 did not send come from the
+ * stored response [RFC2616 10.3.5 p63].  The 304 has no body, so it
+ * has nothing to say about the body we have.
+ */
+
+void
+http_Merge(const struct http *fm, struct http *to)
+{
+	unsigned u;
+	char *p;
+
+	CHECK_OBJ_NOTNULL(fm, HTTP_MAGIC);
+	CHECK_OBJ_NOTNULL(to, HTTP_MAGIC);
+	http_Unset(to, H_Content_Length);
+	http_Unset(to, H_Content_Encoding);
+	http_Unset(to, H_Transfer_Encoding);
+	to->status = fm->status;
+	http_linkh(to, fm, HTTP_HDR_RESPONSE);
+	for (u = HTTP_HDR_FIRST; u < fm->nhd; u++) {
+		if (fm->hd[u].b == NULL)
+			continue;
+		p = strchr(fm->hd[u].b, ':');
+		if (p == NULL || http_findhdr(to, p - fm->hd[u].b, fm->hd[u].b))
+			continue;
+		if (to->nhd < to->shd) {
+			to->hd[to->nhd] = fm->hd[u];
+			to->hdf[to->nhd] = 0;
+			to->nhd++;
+		} else  {
+			VSC_C_main->losthdr++;
+			VSLbt(to->vsl, SLT_LostHeader, fm->hd[u]);
+		}
+	}
+}
+
 /*--------------------------------------------------------------------
  * This function copies any header fields which reference foreign
  * storage into our own WS.
@@ -79,16 +79,49 @@
 #include "vtcp.h"
 #include "vtim.h"
 
+/*--------------------------------------------------------------------
+ * Decide how long to linger on a keep-alive session before we hand it
+ * to the waiter.
+ *
+ * If the pool has no idle threads, we should not sit on this one.
+ * Otherwise we look at how long this client usually takes to send
+ * the next request: if it is longer than timeout_linger, lingering is
+ * a waste of time, if it is shorter we linger for twice that.
+ */
+
+static double
+http1_linger(const struct sess *sp, const struct worker *wrk)
+{
+	double linger;
+
+	linger = cache_param->timeout_linger;
+	if (wrk->pool != NULL && Pool_Dry(wrk->pool))
+		return (0.0);
+	if (isnan(sp->t_gap))
+		return (linger);
+	if (sp->t_gap > linger)
+		return (0.0);
+	if (2 * sp->t_gap < linger)
+		linger = 2 * sp->t_gap;
+	if (linger < 1e-3)
+		linger = 1e-3;
+	return (linger);
+}
+
 /*--------------------------------------------------------------------
  * Collect a request from the client.
+ *
+ * If keepalive is set, we just finished the previous request on this
+ * session and the linger time is chosen by http1_linger().
  */
 
 static int
-http1_wait(struct sess *sp, struct worker *wrk, struct req *req)
+http1_wait(struct sess *sp, struct worker *wrk, struct req *req,
+    int keepalive)
 {
 	int j, tmo;
 	struct pollfd pfd[1];
-	double now, when;
+	double now, when, linger, gap;
 	enum sess_close why = SC_NULL;
 	enum htc_status_e hs;
 
@@ -104,7 +137,13 @@ http1_wait(struct sess *sp, struct worker *wrk, struct req *req)
 	assert(isnan(req->t_req));
 	assert(isnan(req->t_resp));
 
-	tmo = (int)(1e3 * cache_param->timeout_linger);
+	if (keepalive) {
+		linger = http1_linger(sp, wrk);
+		if (linger == 0.0)
+			wrk->stats.sess_linger_skip++;
+	} else
+		linger = cache_param->timeout_linger;
+	tmo = (int)(1e3 * linger);
 	while (1) {
 		pfd[0].fd = sp->fd;
 		pfd[0].events = POLLIN;
@@ -119,6 +158,16 @@ http1_wait(struct sess *sp, struct worker *wrk, struct req *req)
 		if (hs == HTC_COMPLETE) {
 			/* Got it, run with it */
 			req->t_req = now;
+			if (sp->acct_ses.req > 0) {
+				/* Track the clients inter-request gap */
+				gap = now - sp->t_idle;
+				if (isnan(sp->t_gap))
+					sp->t_gap = gap;
+				else
+					sp->t_gap += .25 * (gap - sp->t_gap);
+			}
+			if (keepalive && linger > 0.0)
+				wrk->stats.sess_linger_win++;
 			return (0);
 		} else if (hs == HTC_ERROR_EOF) {
 			why = SC_REM_CLOSE;
@@ -133,10 +182,12 @@ http1_wait(struct sess *sp, struct worker *wrk, struct req *req)
 				why = SC_RX_TIMEOUT;
 				break;
 			}
-			when = sp->t_idle + cache_param->timeout_linger;
+			when = sp->t_idle + linger;
 			tmo = (int)(1e3 * (when - now));
 			if (when < now || tmo == 0) {
 				req->t_req = NAN;
+				if (keepalive && linger > 0.0)
+					wrk->stats.sess_linger_loss++;
 				wrk->stats.sess_herd++;
 				SES_ReleaseReq(req);
 				WAIT_Enter(sp);
@@ -249,8 +300,11 @@ http1_dissect(struct worker *wrk, struct req *req)
 	 * Cache_req_fsm zeros the vxid once a requests is processed.
 	 * Allocate a new one only now that we know will need it.
 	 */
-	if (req->vsl->wid == 0)
+	if (req->vsl->wid == 0) {
 		req->vsl->wid = VXID_Get(&wrk->vxid_pool) | VSL_CLIENTMARKER;
+		VSLb(req->vsl, SLT_Link, "sess %u",
+		    req->sp->vxid & VSL_IDENTMASK);
+	}
 
 	/* Borrow VCL reference from worker thread */
 	VCL_Refresh(&wrk->vcl);
@@ -296,7 +350,7 @@ http1_dissect(struct worker *wrk, struct req *req)
 void
 HTTP1_Session(struct worker *wrk, struct req *req)
 {
-	int done = 0;
+	int done = 0, keepalive = 0;
 	struct sess *sp;
 	enum http1_cleanup_ret sdr;
 
@@ -349,6 +403,7 @@ HTTP1_Session(struct worker *wrk, struct req *req)
 				return;
 			case SESS_DONE_RET_WAIT:
 				sp->sess_step = S_STP_NEWREQ;
+				keepalive = 1;
 				break;
 			case SESS_DONE_RET_START:
 				sp->sess_step = S_STP_WORKING;
@@ -360,7 +415,8 @@ HTTP1_Session(struct worker *wrk, struct req *req)
 		}
 
 		if (sp->sess_step == S_STP_NEWREQ) {
-			done = http1_wait(sp, wrk, req);
+			done = http1_wait(sp, wrk, req, keepalive);
+			keepalive = 0;
 			if (done)
 				return;
 			sp->sess_step = S_STP_WORKING;
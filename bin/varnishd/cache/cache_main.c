@@ -194,16 +194,19 @@ child_main(void)
 	PAN_Init();
 	CLI_Init();
 	Fetch_Init();
+	VGZ_Init();
+	ESI_Init();
 
 	VCL_Init();
 
 	HTTP_Init();
 
 	VDI_Init();
+	Pipe_Init();
 	VBO_Init();
 	VBE_InitCfg();
 	VBP_Init();
-	WRK_Init();
+	HIST_Init();
 	Pool_Init();
 
 	EXP_Init();
@@ -31,8 +31,15 @@
 
 #include "config.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <poll.h>
 #include <stdio.h>
+#include <stdlib.h>
+
+#ifdef HAVE_EPOLL_CTL
+#include <sys/epoll.h>
+#endif
 
 #include "cache.h"
 
@@ -40,25 +47,402 @@
 #include "vtcp.h"
 #include "vtim.h"
 
+/*--------------------------------------------------------------------
+ * A pipe moves bytes in two directions, from one socket to the other.
+ *
+ * Where we have splice(2), the bytes go through a kernel pipe and never
+ * visit userland, otherwise they go through a buffer.  The sockets are
+ * non-blocking, and a direction which could not write everything it
+ * has pending polls for POLLOUT instead of reading more.
+ *
+ * The pipe is run either on the worker thread, or with param pipe_thread
+ * by a single thread which runs all the pipes handed to it, so that
+ * long lived pipes (websockets...) do not tie up worker threads.  The
+ * pipe thread needs epoll(7), elsewhere pipes stay on the worker thread.
+ */
+
+#define PIPE_CHUNK		65536
+
+struct vpipe_dir {
+	int			rfd;
+	int			wfd;
+	int			kp[2];		/* Kernel pipe for splice */
+	char			*buf;
+	ssize_t			off;
+	ssize_t			pending;
+	unsigned		done;
+	uint64_t		bytes;
+};
+
+struct vpipe {
+	unsigned		magic;
+#define VPIPE_MAGIC		0x1b7e4c92
+	struct vpipe_dir	dir[2];		/* [0]: to client */
+	int			fd;
+	struct vbc		*vc;
+	double			t_last;
+	VTAILQ_ENTRY(vpipe)	list;
+
+	/* Pipe thread only */
+	uint32_t		vxid;
+	unsigned		ev[2];		/* [0]: client fd */
+	int			dead;
+};
+
+static struct lock		pipe_mtx;
+
+static void
+vpipe_init(struct vpipe_dir *d, int rfd, int wfd)
+{
+
+	d->rfd = rfd;
+	d->wfd = wfd;
+	d->kp[0] = d->kp[1] = -1;
+#ifdef HAVE_SPLICE
+	if (pipe(d->kp)) {
+		/* Fall back to a buffer */
+		d->kp[0] = d->kp[1] = -1;
+	}
+#endif
+}
+
+static void
+vpipe_fini(struct vpipe_dir *d)
+{
+
+	if (d->kp[0] >= 0) {
+		AZ(close(d->kp[0]));
+		AZ(close(d->kp[1]));
+	}
+	free(d->buf);
+}
+
+static struct vpipe *
+vpipe_new(int fd, struct vbc *vc)
+{
+	struct vpipe *vp;
+
+	ALLOC_OBJ(vp, VPIPE_MAGIC);
+	AN(vp);
+	vp->fd = fd;
+	vp->vc = vc;
+	(void)VTCP_nonblocking(fd);
+	(void)VTCP_nonblocking(vc->fd);
+	vpipe_init(&vp->dir[0], vc->fd, fd);
+	vpipe_init(&vp->dir[1], fd, vc->fd);
+	Lck_Lock(&pipe_mtx);
+	VSC_C_main->n_pipe++;
+	Lck_Unlock(&pipe_mtx);
+	return (vp);
+}
+
+static void
+vpipe_free(struct vpipe **vpp)
+{
+	struct vpipe *vp;
+
+	vp = *vpp;
+	*vpp = NULL;
+	CHECK_OBJ_NOTNULL(vp, VPIPE_MAGIC);
+	vpipe_fini(&vp->dir[0]);
+	vpipe_fini(&vp->dir[1]);
+	Lck_Lock(&pipe_mtx);
+	VSC_C_main->n_pipe--;
+	VSC_C_main->s_pipe_out += vp->dir[0].bytes;
+	VSC_C_main->s_pipe_in += vp->dir[1].bytes;
+	Lck_Unlock(&pipe_mtx);
+	FREE_OBJ(vp);
+}
+
+/*--------------------------------------------------------------------
+ * Fill the pending data, or write it out.
+ */
+
+static ssize_t
+vpipe_read(struct vpipe_dir *d)
+{
+	ssize_t i;
+
+#ifdef HAVE_SPLICE
+	if (d->kp[0] >= 0) {
+		i = splice(d->rfd, NULL, d->kp[1], NULL, PIPE_CHUNK,
+		    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (i >= 0 || errno != EINVAL)
+			return (i);
+		/* Not something we can splice from, use a buffer */
+		AZ(close(d->kp[0]));
+		AZ(close(d->kp[1]));
+		d->kp[0] = d->kp[1] = -1;
+	}
+#endif
+	if (d->buf == NULL) {
+		d->buf = malloc(PIPE_CHUNK);
+		if (d->buf == NULL)
+			return (-1);
+	}
+	d->off = 0;
+	return (read(d->rfd, d->buf, PIPE_CHUNK));
+}
+
+static ssize_t
+vpipe_write(struct vpipe_dir *d)
+{
+	ssize_t i;
+
+#ifdef HAVE_SPLICE
+	if (d->kp[0] >= 0)
+		return (splice(d->kp[0], NULL, d->wfd, NULL, d->pending,
+		    SPLICE_F_MOVE | SPLICE_F_NONBLOCK));
+#endif
+	i = write(d->wfd, d->buf + d->off, d->pending);
+	if (i > 0)
+		d->off += i;
+	return (i);
+}
+
+/*
+ * Move what we can in one direction without blocking.  Returns
+ * non-zero if the pipe is finished.
+ */
+
 static int
-rdf(int fd0, int fd1)
+vpipe_move(struct vpipe *vp, unsigned u)
 {
-	int i, j;
-	char buf[BUFSIZ], *p;
-
-	i = read(fd0, buf, sizeof buf);
-	if (i <= 0)
-		return (1);
-	for (p = buf; i > 0; i -= j, p += j) {
-		j = write(fd1, p, i);
-		if (j <= 0)
+	struct vpipe_dir *d;
+	ssize_t i;
+
+	d = &vp->dir[u];
+	AZ(d->done);
+	if (d->pending == 0) {
+		i = vpipe_read(d);
+		if (i < 0 && errno == EAGAIN)
+			return (0);
+		if (i <= 0) {
+			/* EOF or error, close this direction */
+			if (vp->dir[!u].done || i < 0)
+				return (1);
+			(void)shutdown(d->rfd, SHUT_RD);
+			(void)shutdown(d->wfd, SHUT_WR);
+			d->done = 1;
+			return (0);
+		}
+		d->pending = i;
+	}
+	while (d->pending > 0) {
+		i = vpipe_write(d);
+		if (i < 0 && errno == EAGAIN)
+			return (0);
+		if (i <= 0)
 			return (1);
-		if (i != j)
-			(void)usleep(100000);		/* XXX hack */
+		d->pending -= i;
+		d->bytes += i;
+	}
+	return (0);
+}
+
+static void
+vpipe_poll(const struct vpipe *vp, struct pollfd *fds)
+{
+	const struct vpipe_dir *d;
+	unsigned u;
+
+	for (u = 0; u < 2; u++) {
+		d = &vp->dir[u];
+		fds[u].revents = 0;
+		if (d->done) {
+			fds[u].fd = -1;
+			fds[u].events = 0;
+		} else if (d->pending > 0) {
+			fds[u].fd = d->wfd;
+			fds[u].events = POLLOUT;
+		} else {
+			fds[u].fd = d->rfd;
+			fds[u].events = POLLIN;
+		}
 	}
+}
+
+static int
+vpipe_events(struct vpipe *vp, const struct pollfd *fds)
+{
+	unsigned u;
+
+	for (u = 0; u < 2; u++)
+		if (fds[u].revents && vpipe_move(vp, u))
+			return (1);
 	return (0);
 }
 
+#ifdef HAVE_EPOLL_CTL
+
+/*--------------------------------------------------------------------
+ * The pipe thread
+ *
+ * The sockets of all the pipes are in one epoll set, and a pipe is only
+ * looked at when one of its sockets has an event.  The pipes are kept in
+ * order of last activity, so the ones which timed out are at the head.
+ */
+
+#define PIPE_NEVENT		128
+
+static VTAILQ_HEAD(, vpipe)	pipe_new = VTAILQ_HEAD_INITIALIZER(pipe_new);
+static int			pipe_running;
+static int			pipe_wake[2];
+static pthread_t		pipe_thr;
+static int			pipe_epfd;
+
+static void
+vpipe_epoll(struct vpipe *vp, int op)
+{
+	struct epoll_event ev;
+	const struct vpipe_dir *d;
+	unsigned want[2], u;
+
+	/* dir[u] writes to the socket ev[u] is for, and reads the other */
+	want[0] = want[1] = 0;
+	for (u = 0; u < 2; u++) {
+		d = &vp->dir[u];
+		if (d->done)
+			continue;
+		if (d->pending > 0)
+			want[u] |= EPOLLOUT;
+		else
+			want[!u] |= EPOLLIN;
+	}
+	for (u = 0; u < 2; u++) {
+		if (op == EPOLL_CTL_MOD && want[u] == vp->ev[u])
+			continue;
+		memset(&ev, 0, sizeof ev);
+		ev.events = want[u];
+		ev.data.ptr = vp;
+		AZ(epoll_ctl(pipe_epfd, op, vp->dir[u].wfd, &ev));
+		vp->ev[u] = want[u];
+	}
+}
+
+static void
+vpipe_close(struct vpipe **vpp)
+{
+	struct vpipe *vp;
+
+	vp = *vpp;
+	CHECK_OBJ_NOTNULL(vp, VPIPE_MAGIC);
+	CHECK_OBJ_NOTNULL(vp->vc->backend, BACKEND_MAGIC);
+	VSL(SLT_BackendClose, vp->vxid, "%s", vp->vc->backend->display_name);
+	VTCP_close(&vp->fd);
+	VDI_CloseFd(&vp->vc);
+	vpipe_free(vpp);
+}
+
+static void *
+pipe_thread(struct worker *wrk, void *priv)
+{
+	VTAILQ_HEAD(, vpipe) pipes = VTAILQ_HEAD_INITIALIZER(pipes);
+	VTAILQ_HEAD(, vpipe) todo = VTAILQ_HEAD_INITIALIZER(todo);
+	struct epoll_event ev[PIPE_NEVENT];
+	struct vpipe *vp, *vp2;
+	char buf[64];
+	double now;
+	unsigned u;
+	int i, n;
+
+	CHECK_OBJ_NOTNULL(wrk, WORKER_MAGIC);
+	AZ(priv);
+
+	pipe_epfd = epoll_create(1);
+	assert(pipe_epfd >= 0);
+	memset(ev, 0, sizeof ev[0]);
+	ev[0].events = EPOLLIN;
+	ev[0].data.ptr = NULL;
+	AZ(epoll_ctl(pipe_epfd, EPOLL_CTL_ADD, pipe_wake[0], &ev[0]));
+
+	while (1) {
+		Lck_Lock(&pipe_mtx);
+		VTAILQ_CONCAT(&todo, &pipe_new, list);
+		Lck_Unlock(&pipe_mtx);
+		VTAILQ_FOREACH_SAFE(vp, &todo, list, vp2) {
+			VTAILQ_REMOVE(&todo, vp, list);
+			vpipe_epoll(vp, EPOLL_CTL_ADD);
+			VTAILQ_INSERT_TAIL(&pipes, vp, list);
+		}
+
+		n = epoll_wait(pipe_epfd, ev, PIPE_NEVENT, 1000);
+		now = VTIM_real();
+		for (i = 0; i < n; i++) {
+			vp = ev[i].data.ptr;
+			if (vp == NULL) {
+				(void)read(pipe_wake[0], buf, sizeof buf);
+				continue;
+			}
+			CHECK_OBJ_NOTNULL(vp, VPIPE_MAGIC);
+			if (vp->dead)
+				continue;
+			for (u = 0; u < 2 && !vp->dead; u++)
+				if (!vp->dir[u].done && vpipe_move(vp, u))
+					vp->dead = 1;
+			if (ev[i].events & (EPOLLERR | EPOLLHUP))
+				vp->dead = 1;
+			VTAILQ_REMOVE(&pipes, vp, list);
+			if (vp->dead) {
+				/* Other events in ev[] may still point to it */
+				VTAILQ_INSERT_TAIL(&todo, vp, list);
+				continue;
+			}
+			vp->t_last = now;
+			VTAILQ_INSERT_TAIL(&pipes, vp, list);
+			vpipe_epoll(vp, EPOLL_CTL_MOD);
+		}
+
+		while ((vp = VTAILQ_FIRST(&pipes)) != NULL &&
+		    now - vp->t_last >= cache_param->pipe_timeout) {
+			VTAILQ_REMOVE(&pipes, vp, list);
+			VTAILQ_INSERT_TAIL(&todo, vp, list);
+		}
+		VTAILQ_FOREACH_SAFE(vp, &todo, list, vp2) {
+			VTAILQ_REMOVE(&todo, vp, list);
+			vpipe_close(&vp);
+		}
+	}
+	NEEDLESS_RETURN(NULL);
+}
+
+/*--------------------------------------------------------------------
+ * Hand the two sockets to the pipe thread.  The session is closed as far
+ * as the rest of varnishd is concerned.
+ */
+
+static void
+pipe_handoff(struct req *req, struct vbc *vc)
+{
+	struct vpipe *vp;
+
+	vp = vpipe_new(req->sp->fd, vc);
+	vp->t_last = VTIM_real();
+	req->sp->fd = -1;
+	req->sp->reason = SC_TX_PIPE;
+
+	/* The busyobj and its log go away with the request */
+	vp->vxid = vc->vsl->wid;
+	VSL_Flush(vc->vsl, 0);
+	vc->vsl = NULL;
+
+	Lck_Lock(&pipe_mtx);
+	if (!pipe_running) {
+		AZ(pipe(pipe_wake));
+		(void)VTCP_nonblocking(pipe_wake[0]);
+		(void)VTCP_nonblocking(pipe_wake[1]);
+		WRK_BgThread(&pipe_thr, "pipe", pipe_thread, NULL);
+		pipe_running = 1;
+	}
+	VTAILQ_INSERT_TAIL(&pipe_new, vp, list);
+	Lck_Unlock(&pipe_mtx);
+	(void)write(pipe_wake[1], "", 1);
+}
+
+#endif
+
+/*--------------------------------------------------------------------*/
+
 void
 PipeRequest(struct req *req)
 {
@@ -66,6 +450,7 @@ PipeRequest(struct req *req)
 	struct worker *wrk;
 	struct pollfd fds[2];
 	struct busyobj *bo;
+	struct vpipe *vp;
 	int i;
 
 	CHECK_OBJ_NOTNULL(req, REQ_MAGIC);
@@ -99,40 +484,34 @@ PipeRequest(struct req *req)
 
 	req->t_resp = VTIM_real();
 
-	memset(fds, 0, sizeof fds);
-
 	// XXX: not yet (void)VTCP_linger(vc->fd, 0);
-	fds[0].fd = vc->fd;
-	fds[0].events = POLLIN | POLLERR;
-
 	// XXX: not yet (void)VTCP_linger(req->sp->fd, 0);
-	fds[1].fd = req->sp->fd;
-	fds[1].events = POLLIN | POLLERR;
 
-	while (fds[0].fd > -1 || fds[1].fd > -1) {
-		fds[0].revents = 0;
-		fds[1].revents = 0;
-		i = poll(fds, 2, cache_param->pipe_timeout * 1000);
-		if (i < 1)
-			break;
-		if (fds[0].revents && rdf(vc->fd, req->sp->fd)) {
-			if (fds[1].fd == -1)
-				break;
-			(void)shutdown(vc->fd, SHUT_RD);
-			(void)shutdown(req->sp->fd, SHUT_WR);
-			fds[0].events = 0;
-			fds[0].fd = -1;
-		}
-		if (fds[1].revents && rdf(req->sp->fd, vc->fd)) {
-			if (fds[0].fd == -1)
-				break;
-			(void)shutdown(req->sp->fd, SHUT_RD);
-			(void)shutdown(vc->fd, SHUT_WR);
-			fds[1].events = 0;
-			fds[1].fd = -1;
-		}
+#ifdef HAVE_EPOLL_CTL
+	if (cache_param->pipe_thread) {
+		pipe_handoff(req, vc);
+		bo->vbc = NULL;
+		return;
 	}
+#endif
+
+	vp = vpipe_new(req->sp->fd, vc);
+	do {
+		vpipe_poll(vp, fds);
+		i = poll(fds, 2, cache_param->pipe_timeout * 1000);
+	} while (i > 0 && !vpipe_events(vp, fds));
+	vpipe_free(&vp);
+
 	SES_Close(req->sp, SC_TX_PIPE);
 	VDI_CloseFd(&vc);
 	bo->vbc = NULL;
 }
+
+/*--------------------------------------------------------------------*/
+
+void
+Pipe_Init(void)
+{
+
+	Lck_New(&pipe_mtx, lck_pipe);
+}
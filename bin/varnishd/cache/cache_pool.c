@@ -148,7 +148,7 @@ pool_accept(struct worker *wrk, void *arg)
 		if (VCA_Accept(ps->lsock, wa) < 0) {
 			wrk->stats.sess_fail++;
 			/* We're going to pace in vca anyway... */
-			(void)WRK_TrySumStat(wrk);
+			WRK_SumStat(wrk);
 			continue;
 		}
 
@@ -221,6 +221,7 @@ Pool_Task(struct pool *pp, struct pool_task *task, enum pool_how how)
 			pp->ndropped++;
 			retval = -1;
 		} else {
+			task->t_queued = VTIM_real();
 			VTAILQ_INSERT_TAIL(&pp->front_queue, task, list);
 			pp->nqueued++;
 			pp->lqueue++;
@@ -236,6 +237,20 @@ Pool_Task(struct pool *pp, struct pool_task *task, enum pool_how how)
 	return (retval);
 }
 
+/*--------------------------------------------------------------------
+ * Tell if a pool has run out of idle threads.
+ *
+ * This is only a hint, so we do not bother with the lock.
+ */
+
+int
+Pool_Dry(const struct pool *pp)
+{
+
+	CHECK_OBJ_NOTNULL(pp, POOL_MAGIC);
+	return (pp->lqueue > 0 || VTAILQ_EMPTY(&pp->idle_queue));
+}
+
 /*--------------------------------------------------------------------
  * This is the work function for worker threads in the pool.
  */
@@ -244,12 +259,11 @@ void
 Pool_Work_Thread(void *priv, struct worker *wrk)
 {
 	struct pool *pp;
-	int stats_clean;
 	struct pool_task *tp;
+	double t_queued;
 
 	CAST_OBJ_NOTNULL(pp, priv, POOL_MAGIC);
 	wrk->pool = pp;
-	stats_clean = 1;
 	while (1) {
 		Lck_Lock(&pp->mtx);
 
@@ -257,10 +271,12 @@ Pool_Work_Thread(void *priv, struct worker *wrk)
 
 		WS_Reset(wrk->aws, NULL);
 
+		t_queued = NAN;
 		tp = VTAILQ_FIRST(&pp->front_queue);
 		if (tp != NULL) {
 			pp->lqueue--;
 			VTAILQ_REMOVE(&pp->front_queue, tp, list);
+			t_queued = tp->t_queued;
 		} else {
 			tp = VTAILQ_FIRST(&pp->back_queue);
 			if (tp != NULL)
@@ -275,8 +291,6 @@ Pool_Work_Thread(void *priv, struct worker *wrk)
 			wrk->task.priv = wrk;
 			AZ(wrk->task.func);
 			VTAILQ_INSERT_HEAD(&pp->idle_queue, &wrk->task, list);
-			if (!stats_clean)
-				WRK_SumStat(wrk);
 			(void)Lck_CondWait(&wrk->cond, &pp->mtx, NULL);
 			tp = &wrk->task;
 		}
@@ -286,8 +300,10 @@ Pool_Work_Thread(void *priv, struct worker *wrk)
 			break;
 
 		assert(wrk->pool == pp);
+		if (!isnan(t_queued))
+			HIST_Add(wrk, HIST_queue, VTIM_real() - t_queued);
 		tp->func(wrk, tp->priv);
-		stats_clean = WRK_TrySumStat(wrk);
+		WRK_SumStat(wrk);
 	}
 	wrk->pool = NULL;
 }
@@ -63,6 +63,7 @@ DOT acceptor -> recv [style=bold,color=green]
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "cache.h"
 
@@ -126,12 +127,14 @@ cnt_prepresp(struct worker *wrk, struct req *req)
 
 	if (cache_param->http_gzip_support && req->obj->gziped &&
 	    !RFC2616_Req_Gzip(req->http)) {
-		/*
-		 * We don't know what it uncompresses to
-		 * XXX: we could cache that
-		 */
-		req->res_mode &= ~RES_LEN;
-		req->res_mode |= RES_GUNZIP;
+		if (bo == NULL && req->obj->gunzip_len > 0) {
+			/* We have it uncompressed already */
+			req->res_mode |= RES_PLAIN;
+		} else {
+			/* We don't know what it uncompresses to */
+			req->res_mode &= ~RES_LEN;
+			req->res_mode |= RES_GUNZIP;
+		}
 	}
 
 	if (!(req->res_mode & (RES_LEN|RES_CHUNKED|RES_EOF))) {
@@ -167,6 +170,12 @@ cnt_prepresp(struct worker *wrk, struct req *req)
 			break;
 		if (bo != NULL) {
 			AN(bo->do_stream);
+			/*
+			 * Let the fetch finish first, so that its backend
+			 * connection is available to the restarted request.
+			 */
+			VBO_waitstate(bo, BOS_FAILED);
+			VBO_waitfetch(bo);
 			(void)HSH_Deref(&wrk->stats, NULL, &req->obj);
 			VBO_DerefBusyObj(wrk, &req->busyobj);
 		} else {
@@ -210,26 +219,32 @@ cnt_deliver(struct worker *wrk, struct req *req)
 	CHECK_OBJ_ORNULL(bo, BUSYOBJ_MAGIC);
 
 	if (bo != NULL) {
-		while (bo->state < BOS_FAILED)
-			(void)usleep(10000);
-		assert(bo->state >= BOS_FAILED);
-
+		/*
+		 * We stream the body as it is fetched, but hold off the
+		 * headers until the first bytes are in, so that a fetch
+		 * which fails early still gets a proper error.
+		 */
+		(void)VBO_waitlen(bo, 0);
 		if (bo->state == BOS_FAILED) {
+			VBO_waitfetch(bo);
 			HSH_Deref(&wrk->stats, NULL, &req->obj);
 			VBO_DerefBusyObj(wrk, &req->busyobj);
 			req->err_code = 503;
 			req->req_step = R_STP_ERROR;
 			return (0);
 		}
-		VBO_DerefBusyObj(wrk, &req->busyobj);
 	}
 
-	AZ(req->busyobj);
 	req->director = NULL;
 	req->restarts = 0;
 
 	RES_WriteObj(req);
 
+	if (bo != NULL) {
+		VBO_waitfetch(bo);
+		VBO_DerefBusyObj(wrk, &req->busyobj);
+	}
+
 	/* No point in saving the body if it is hit-for-pass */
 	if (req->obj->objcore->flags & OC_F_PASS)
 		STV_Freestore(req->obj);
@@ -394,6 +409,15 @@ cnt_fetch(struct worker *wrk, struct req *req)
 		 */
 		bo->body_status = RFC2616_Body(bo, &wrk->stats);
 
+		if (bo->stale_obj != NULL &&
+		    http_GetStatus(bo->beresp) == 304) {
+			/* Still good, we will reuse the body we have */
+			http_Merge(bo->stale_obj->http, bo->beresp);
+			bo->body_status = BS_CACHED;
+			wrk->stats.fetch_refresh++;
+		} else if (bo->stale_obj != NULL)
+			(void)HSH_Deref(&wrk->stats, NULL, &bo->stale_obj);
+
 		req->err_code = http_GetStatus(bo->beresp);
 
 		/*
@@ -509,6 +533,10 @@ cnt_fetchbody(struct worker *wrk, struct req *req)
 	 *
 	 */
 
+	/* A body we already have is stored again as it is */
+	if (bo->body_status == BS_CACHED)
+		bo->do_gzip = bo->do_gunzip = bo->do_esi = 0;
+
 	/* We do nothing unless the param is set */
 	if (!cache_param->http_gzip_support)
 		bo->do_gzip = bo->do_gunzip = 0;
@@ -676,9 +704,11 @@ cnt_fetchbody(struct worker *wrk, struct req *req)
 		HSH_Ref(req->obj->objcore);
 
 	if (bo->state == BOS_FINISHED) {
+		VBO_waitfetch(bo);
 		VBO_DerefBusyObj(wrk, &req->busyobj);
 	} else if (bo->state == BOS_FAILED) {
 		/* handle early failures */
+		VBO_waitfetch(bo);
 		HSH_Deref(&wrk->stats, NULL, &req->obj);
 		VBO_DerefBusyObj(wrk, &req->busyobj);
 		req->err_code = 503;
@@ -718,7 +748,7 @@ cnt_hit(struct worker *wrk, struct req *req)
 	CHECK_OBJ_NOTNULL(req->obj, OBJECT_MAGIC);
 	CHECK_OBJ_NOTNULL(req->vcl, VCL_CONF_MAGIC);
 	AZ(req->objcore);
-	AZ(req->busyobj);
+	CHECK_OBJ_ORNULL(req->busyobj, BUSYOBJ_MAGIC);
 
 	assert(!(req->obj->objcore->flags & OC_F_PASS));
 
@@ -734,6 +764,8 @@ cnt_hit(struct worker *wrk, struct req *req)
 
 	/* Drop our object, we won't need it */
 	(void)HSH_Deref(&wrk->stats, NULL, &req->obj);
+	if (req->busyobj != NULL)
+		VBO_DerefBusyObj(wrk, &req->busyobj);
 	req->objcore = NULL;
 
 	switch(req->handling) {
@@ -751,6 +783,112 @@ cnt_hit(struct worker *wrk, struct req *req)
 	}
 }
 
+/*--------------------------------------------------------------------
+ * Can a fetch ask the backend if this object is still good, and reuse
+ * its body if it is ?  ESI objects have more to them than the body.
+ */
+
+static int
+cnt_can_revalidate(const struct object *o)
+{
+
+	CHECK_OBJ_NOTNULL(o, OBJECT_MAGIC);
+	if (o->esidata != NULL)
+		return (0);
+	return (http_GetHdr(o->http, H_ETag, NULL) ||
+	    http_GetHdr(o->http, H_Last_Modified, NULL));
+}
+
+/*--------------------------------------------------------------------
+ * Start a background fetch to refresh the object in grace we are about
+ * to deliver.  It runs in a request of its own, which starts out as a
+ * miss on the busy objcore HSH_Lookup() gave us, goes through
+ * vcl_miss{} and vcl_fetch{} like any other, and ends when the object
+ * is in place.  If the stale object has validators, the fetch is
+ * conditional.
+ */
+
+static void
+cnt_bgfetch(struct worker *wrk, struct req *req, struct objcore *oc)
+{
+	struct req *bgreq;
+	struct busyobj *bo;
+	struct object *o;
+
+	CHECK_OBJ_NOTNULL(wrk, WORKER_MAGIC);
+	CHECK_OBJ_NOTNULL(req, REQ_MAGIC);
+	CHECK_OBJ_NOTNULL(oc, OBJCORE_MAGIC);
+	AN(oc->flags & OC_F_BUSY);
+	o = req->obj;
+	CHECK_OBJ_NOTNULL(o, OBJECT_MAGIC);
+
+	bgreq = SES_NewBgReq(wrk, req->sp);
+	VSLb(req->vsl, SLT_Link, "bgreq %u", bgreq->vsl->wid & VSL_IDENTMASK);
+	VSLb(bgreq->vsl, SLT_Link, "req %u", req->vsl->wid & VSL_IDENTMASK);
+
+	bgreq->t_req = W_TIM_real(wrk);
+	bgreq->vcl = req->vcl;
+	VCL_Ref(bgreq->vcl);
+	bgreq->director = req->director;
+	bgreq->disable_esi = req->disable_esi;
+	bgreq->wantbody = 1;
+	memcpy(bgreq->digest, req->digest, sizeof bgreq->digest);
+	HTTP_Setup(bgreq->http, bgreq->ws, bgreq->vsl, HTTP_Req);
+	HTTP_Copy(bgreq->http, req->http);
+	http_CopyHome(bgreq->http);
+	bgreq->ws_req = WS_Snapshot(bgreq->ws);
+
+	bo = VBO_GetBusyObj(wrk, bgreq);
+	/* One ref for req, one for FetchBody */
+	bo->refcount = 2;
+	oc->busyobj = bo;
+	bgreq->busyobj = bo;
+	bgreq->objcore = oc;
+
+	if (cnt_can_revalidate(o)) {
+		HSH_Ref(o->objcore);
+		bo->stale_obj = o;
+	}
+
+	bgreq->req_step = R_STP_MISS;
+	if (!SES_ScheduleBgReq(bgreq)) {
+		wrk->stats.fetch_bgfetch++;
+		return;
+	}
+
+	/* No thread for it, the next request in grace will try again */
+	AZ(HSH_Deref(&wrk->stats, oc, NULL));
+	bgreq->objcore = NULL;
+	VBO_DerefBusyObj(wrk, &bo);
+	VBO_DerefBusyObj(wrk, &bgreq->busyobj);
+	SES_DeleteBgReq(bgreq);
+}
+
+/*--------------------------------------------------------------------
+ * A background fetch has no client, so it is done where a client
+ * request would go on to deliver, or to anything else.  ESI prefetches
+ * (see cache_esi_deliver.c) also give up if the object is already busy.
+ */
+
+static int
+cnt_bgdone(struct worker *wrk, struct req *req)
+{
+
+	CHECK_OBJ_NOTNULL(wrk, WORKER_MAGIC);
+	CHECK_OBJ_NOTNULL(req, REQ_MAGIC);
+	AN(req->bgfetch);
+	AZ(req->objcore);
+
+	if (req->obj != NULL)
+		(void)HSH_Deref(&wrk->stats, NULL, &req->obj);
+	if (req->busyobj != NULL)
+		VBO_DerefBusyObj(wrk, &req->busyobj);
+	req->director = NULL;
+	req->t_resp = W_TIM_real(wrk);
+	req->sp->t_idle = req->t_resp;
+	return (1);
+}
+
 /*--------------------------------------------------------------------
  * LOOKUP
  * Hash things together and look object up in hash-table.
@@ -773,10 +911,11 @@ DOT lookup:yes -> pass [style=bold,color=red]
 static int
 cnt_lookup(struct worker *wrk, struct req *req)
 {
-	struct objcore *oc;
+	struct objcore *oc, *boc, *koc;
 	struct object *o;
 	struct objhead *oh;
 	struct busyobj *bo;
+	double t0;
 
 	CHECK_OBJ_NOTNULL(wrk, WORKER_MAGIC);
 	CHECK_OBJ_NOTNULL(req, REQ_MAGIC);
@@ -788,8 +927,15 @@ cnt_lookup(struct worker *wrk, struct req *req)
 	VRY_Prep(req);
 
 	AZ(req->objcore);
-	oc = HSH_Lookup(req);
+	t0 = VTIM_real();
+	oc = HSH_Lookup(req, &boc, &koc);
 	if (oc == NULL) {
+		if (req->bgfetch) {
+			/* Somebody else is already fetching it */
+			AZ(req->hash_objhead);
+			VRY_Finish(req, NULL);
+			return (cnt_bgdone(wrk, req));
+		}
 		/*
 		 * We lost the session to a busy object, disembark the
 		 * worker thread.   We return to STP_LOOKUP when the busy
@@ -799,6 +945,7 @@ cnt_lookup(struct worker *wrk, struct req *req)
 		return (2);
 	}
 	AZ(req->objcore);
+	HIST_Add(wrk, HIST_lookup, VTIM_real() - t0);
 
 	CHECK_OBJ_NOTNULL(oc, OBJCORE_MAGIC);
 	oh = oc->objhead;
@@ -816,13 +963,23 @@ cnt_lookup(struct worker *wrk, struct req *req)
 		oc->busyobj = bo;
 		wrk->stats.cache_miss++;
 
+		if (koc != NULL) {
+			/* An expired object, the fetch may revalidate it */
+			o = oc_getobj(&wrk->stats, koc);
+			CHECK_OBJ_NOTNULL(o, OBJECT_MAGIC);
+			if (cnt_can_revalidate(o))
+				bo->stale_obj = o;
+			else
+				(void)HSH_Deref(&wrk->stats, NULL, &o);
+		}
+
 		req->objcore = oc;
 		req->req_step = R_STP_MISS;
 		return (0);
 	}
 
-	/* We are not prepared to do streaming yet */
-	XXXAZ(req->busyobj);
+	/* If the object is still being fetched, we follow the fetch */
+	CHECK_OBJ_ORNULL(req->busyobj, BUSYOBJ_MAGIC);
 
 	o = oc_getobj(&wrk->stats, oc);
 	CHECK_OBJ_NOTNULL(o, OBJECT_MAGIC);
@@ -830,6 +987,9 @@ cnt_lookup(struct worker *wrk, struct req *req)
 
 	VRY_Finish(req, NULL);
 
+	if (boc != NULL)
+		cnt_bgfetch(wrk, req, boc);
+
 	if (oc->flags & OC_F_PASS) {
 		wrk->stats.cache_hitpass++;
 		VSLb(req->vsl, SLT_HitPass, "%u", req->obj->vxid);
@@ -863,6 +1023,7 @@ static int
 cnt_miss(struct worker *wrk, struct req *req)
 {
 	struct busyobj *bo;
+	char *p;
 
 	CHECK_OBJ_NOTNULL(wrk, WORKER_MAGIC);
 	CHECK_OBJ_NOTNULL(req, REQ_MAGIC);
@@ -884,6 +1045,16 @@ cnt_miss(struct worker *wrk, struct req *req)
 		http_Unset(bo->bereq, H_Accept_Encoding);
 		http_SetHeader(bo->bereq, "Accept-Encoding: gzip");
 	}
+	if (bo->stale_obj != NULL) {
+		/* Ask if what we have is still good */
+		CHECK_OBJ_NOTNULL(bo->stale_obj, OBJECT_MAGIC);
+		if (http_GetHdr(bo->stale_obj->http, H_ETag, &p))
+			http_PrintfHeader(bo->bereq, "If-None-Match: %s", p);
+		if (http_GetHdr(bo->stale_obj->http, H_Last_Modified, &p))
+			http_PrintfHeader(bo->bereq,
+			    "If-Modified-Since: %s", p);
+		wrk->stats.fetch_conditional++;
+	}
 
 	VCL_miss_method(req);
 
@@ -1142,7 +1313,7 @@ cnt_recv(const struct worker *wrk, struct req *req)
 		req->req_step = R_STP_LOOKUP;
 		return (0);
 	case VCL_RET_PIPE:
-		if (req->esi_level > 0) {
+		if (req->esi_level > 0 && !req->bgfetch) {
 			/* XXX: VSL something */
 			INCOMPL();
 			return (1);
@@ -1191,7 +1362,8 @@ CNT_Request(struct worker *wrk, struct req *req)
 	 */
 	assert(
 	    req->req_step == R_STP_LOOKUP ||
-	    req->req_step == R_STP_RECV);
+	    req->req_step == R_STP_RECV ||
+	    (req->bgfetch && req->req_step == R_STP_MISS));
 
 	AN(req->vsl->wid & VSL_CLIENTMARKER);
 
@@ -1214,6 +1386,15 @@ CNT_Request(struct worker *wrk, struct req *req)
 		WS_Assert(wrk->aws);
 		assert(wrk->aws->s == wrk->aws->f);
 
+		if (req->bgfetch && req->req_step != R_STP_RECV &&
+		    req->req_step != R_STP_LOOKUP &&
+		    req->req_step != R_STP_MISS &&
+		    req->req_step != R_STP_FETCH &&
+		    req->req_step != R_STP_FETCHBODY) {
+			done = cnt_bgdone(wrk, req);
+			break;
+		}
+
 		switch (req->req_step) {
 #define REQ_STEP(l,u,arg) \
 		    case R_STP_##u: \
@@ -1232,15 +1413,18 @@ CNT_Request(struct worker *wrk, struct req *req)
 	if (done == 1) {
 		/* XXX: Workaround for pipe */
 		if (req->sp->fd >= 0) {
-			VSLb(req->vsl, SLT_Length, "%ju",
-			    (uintmax_t)req->req_bodybytes);
+			/* Not charged yet, see below */
+			VSLbb(req->vsl, SLT_Length, (uint64_t)
+			    (req->req_bodybytes + req->acct_req.bodybytes));
 		}
-		VSLb(req->vsl, SLT_ReqEnd, "%.9f %.9f %.9f %.9f %.9f",
+		VSLbb(req->vsl, SLT_ReqEnd,
 		    req->t_req,
 		    req->sp->t_idle,
 		    req->sp->t_idle - req->t_resp,
 		    req->t_resp - req->t_req,
 		    req->sp->t_idle - req->t_resp);
+		/* sp->t_idle is not updated until http1_cleanup() */
+		HIST_Add(wrk, HIST_req, W_TIM_real(wrk) - req->t_req);
 
 		/* done == 2 was charged by cache_hash.c */
 		SES_Charge(wrk, req);
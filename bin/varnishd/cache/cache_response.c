@@ -123,6 +123,15 @@ RES_BuildHttp(struct req *req)
 	if (req->res_mode & RES_GUNZIP)
 		http_Unset(req->resp, H_Content_Encoding);
 
+	if (req->res_mode & RES_PLAIN) {
+		http_Unset(req->resp, H_Content_Encoding);
+		if (req->res_mode & RES_LEN) {
+			http_Unset(req->resp, H_Content_Length);
+			http_PrintfHeader(req->resp, "Content-Length: %jd",
+			    (intmax_t)req->obj->gunzip_len);
+		}
+	}
+
 	if (req->obj->objcore != NULL
 	    && !(req->obj->objcore->flags & OC_F_PASS)
 	    && req->obj->response == 200
@@ -155,19 +164,23 @@ RES_BuildHttp(struct req *req)
 /*--------------------------------------------------------------------
  * We have a gzip'ed object and need to ungzip it for a client which
  * does not understand gzip.
- * XXX: handle invalid gzip data better (how ?)
+ *
+ * Returns non-zero if the gzip data is invalid, the body sent so far
+ * is then truncated, and the client must not take it as complete.
  */
 
-static void
+static int
 res_WriteGunzipObj(struct req *req)
 {
 	struct storage *st;
 	unsigned u = 0;
 	struct vgz *vg;
-	int i;
 
 	CHECK_OBJ_NOTNULL(req, REQ_MAGIC);
 
+	if (!VGZ_CacheDeliver(req))
+		return (0);
+
 	vg = VGZ_NewUngzip(req->vsl, "U D -");
 	AZ(VGZ_WrwInit(vg));
 
@@ -176,13 +189,36 @@ res_WriteGunzipObj(struct req *req)
 		CHECK_OBJ_NOTNULL(st, STORAGE_MAGIC);
 		u += st->len;
 
-		i = VGZ_WrwGunzip(req, vg, st->ptr, st->len);
-		/* XXX: error check */
-		(void)i;
+		if (VGZ_WrwGunzip(req, vg, st->ptr, st->len) < VGZ_OK) {
+			(void)VGZ_Destroy(&vg);
+			return (-1);
+		}
 	}
 	VGZ_WrwFlush(req, vg);
 	(void)VGZ_Destroy(&vg);
 	assert(u == req->obj->len);
+	return (0);
+}
+
+/*--------------------------------------------------------------------
+ * Deliver the gunzip'ed copy we stored of a gzip'ed object.
+ */
+
+static void
+res_WritePlainObj(struct req *req)
+{
+	struct storage *st;
+	ssize_t u = 0;
+
+	CHECK_OBJ_NOTNULL(req, REQ_MAGIC);
+
+	VTAILQ_FOREACH(st, &req->obj->gunzip_store, list) {
+		CHECK_OBJ_NOTNULL(st, STORAGE_MAGIC);
+		u += st->len;
+		req->acct_req.bodybytes += st->len;
+		(void)WRW_Write(req->wrk, st->ptr, st->len);
+	}
+	assert(u == req->obj->gunzip_len);
 }
 
 /*--------------------------------------------------------------------*/
@@ -226,6 +262,62 @@ res_WriteDirObj(struct req *req, ssize_t low, ssize_t high)
 	assert(u == req->obj->len);
 }
 
+/*--------------------------------------------------------------------
+ * Deliver an object which is still being fetched, following the
+ * storage list as FetchBody() appends to it, and flushing whatever we
+ * have whenever we catch up with the fetch.
+ *
+ * Returns non-zero if the fetch failed, the gzip data is invalid, or
+ * the client went away.
+ */
+
+static int
+res_WriteStreamObj(struct req *req, struct busyobj *bo, struct vgz *vg)
+{
+	struct storage *st;
+	ssize_t pos, l, len;
+	size_t off;
+
+	CHECK_OBJ_NOTNULL(req, REQ_MAGIC);
+	CHECK_OBJ_NOTNULL(bo, BUSYOBJ_MAGIC);
+
+	st = NULL;
+	off = 0;
+	pos = 0;
+	while (1) {
+		l = VBO_waitlen(bo, pos);
+		if (l <= pos)
+			break;
+		while (pos < l) {
+			if (st == NULL)
+				st = VTAILQ_FIRST(&req->obj->store);
+			else if (off == st->len) {
+				st = VTAILQ_NEXT(st, list);
+				off = 0;
+			}
+			CHECK_OBJ_NOTNULL(st, STORAGE_MAGIC);
+			len = st->len - off;
+			if (len > l - pos)
+				len = l - pos;
+			if (vg != NULL) {
+				if (VGZ_WrwGunzip(req, vg,
+				    st->ptr + off, len) < VGZ_OK)
+					return (-1);
+			} else {
+				req->acct_req.bodybytes += len;
+				(void)WRW_Write(req->wrk, st->ptr + off, len);
+			}
+			off += len;
+			pos += len;
+		}
+		if (vg != NULL)
+			VGZ_WrwFlush(req, vg);
+		if (WRW_Flush(req->wrk))
+			return (-1);
+	}
+	return (bo->state == BOS_FAILED);
+}
+
 /*--------------------------------------------------------------------
  * Deliver an object.
  * Attempt optimizations like 304 and 206 here.
@@ -236,8 +328,14 @@ RES_WriteObj(struct req *req)
 {
 	char *r;
 	ssize_t low, high;
+	struct busyobj *bo;
+	struct vgz *vg;
+	int fail = 0;
+	uint64_t bodybytes;
 
 	CHECK_OBJ_NOTNULL(req, REQ_MAGIC);
+	bo = req->busyobj;
+	CHECK_OBJ_ORNULL(bo, BUSYOBJ_MAGIC);
 
 	/*
 	 * If nothing special planned, we can attempt Range support
@@ -247,7 +345,7 @@ RES_WriteObj(struct req *req)
 	if (
 	    req->wantbody &&
 	    (req->res_mode & RES_LEN) &&
-	    !(req->res_mode & (RES_ESI|RES_ESI_CHILD|RES_GUNZIP)) &&
+	    !(req->res_mode & (RES_ESI|RES_ESI_CHILD|RES_GUNZIP|RES_PLAIN)) &&
 	    cache_param->http_range_support &&
 	    req->obj->response == 200 &&
 	    http_GetHdr(req->http, H_Range, &r))
@@ -268,27 +366,57 @@ RES_WriteObj(struct req *req)
 	if (req->res_mode & RES_CHUNKED)
 		WRW_Chunked(req->wrk);
 
+	if (req->vesc != NULL)
+		ESI_CacheAdd(req);
+
+	bodybytes = req->acct_req.bodybytes;
 	if (!req->wantbody) {
 		/* This was a HEAD or conditional request */
+	} else if (bo != NULL) {
+		AZ(req->res_mode & (RES_ESI|RES_ESI_CHILD));
+		vg = NULL;
+		if (req->res_mode & RES_GUNZIP) {
+			vg = VGZ_NewUngzip(req->vsl, "U S -");
+			AZ(VGZ_WrwInit(vg));
+		}
+		fail = res_WriteStreamObj(req, bo, vg);
+		if (vg != NULL)
+			(void)VGZ_Destroy(&vg);
 	} else if (req->obj->len == 0) {
 		/* Nothing to do here */
 	} else if (req->res_mode & RES_ESI) {
 		ESI_Deliver(req);
+	} else if (req->res_mode & RES_PLAIN) {
+		res_WritePlainObj(req);
 	} else if (req->res_mode & RES_ESI_CHILD && req->gzip_resp) {
 		ESI_DeliverChild(req);
 	} else if (req->res_mode & RES_ESI_CHILD &&
 	    !req->gzip_resp && req->obj->gziped) {
-		res_WriteGunzipObj(req);
+		fail = res_WriteGunzipObj(req);
 	} else if (req->res_mode & RES_GUNZIP) {
-		res_WriteGunzipObj(req);
+		fail = res_WriteGunzipObj(req);
 	} else {
 		res_WriteDirObj(req, low, high);
 	}
 
+	/* Account body bytes by how they were encoded for the client */
+	bodybytes = req->acct_req.bodybytes - bodybytes;
+	if (!(req->res_mode & (RES_ESI|RES_ESI_CHILD))) {
+		if (req->res_mode & RES_PLAIN)
+			req->wrk->stats.s_body_plain += bodybytes;
+		else if (req->res_mode & RES_GUNZIP)
+			req->wrk->stats.s_body_gunzip += bodybytes;
+		else if (req->obj->gziped)
+			req->wrk->stats.s_body_gzip += bodybytes;
+	}
+
+	/* A truncated body must not look complete to the client */
 	if (req->res_mode & RES_CHUNKED &&
-	    !(req->res_mode & RES_ESI_CHILD))
+	    !(req->res_mode & RES_ESI_CHILD) && !fail)
 		WRW_EndChunk(req->wrk);
 
 	if (WRW_FlushRelease(req->wrk) && req->sp->fd >= 0)
 		SES_Close(req->sp, SC_REM_CLOSE);
+	else if (fail && req->sp->fd >= 0)
+		SES_Close(req->sp, SC_TX_ERROR);
 }
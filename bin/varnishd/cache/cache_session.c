@@ -43,6 +43,7 @@
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "cache.h"
 
@@ -102,6 +103,7 @@ ses_setup(struct sess *sp)
 	sp->sockaddr.ss_family = sp->mysockaddr.ss_family = PF_UNSPEC;
 	sp->t_open = NAN;
 	sp->t_idle = NAN;
+	sp->t_gap = NAN;
 }
 
 /*--------------------------------------------------------------------
@@ -234,6 +236,94 @@ SES_pool_accept_task(struct worker *wrk, void *arg)
 	ses_sess_pool_task(wrk, sp);
 }
 
+/*--------------------------------------------------------------------
+ * Background fetches get a session of their own, without a connection,
+ * so that they can outlive the session of the request which started
+ * them.  It inherits the client addresses for the benefit of VCL.
+ */
+
+struct req *
+SES_NewBgReq(struct worker *wrk, const struct sess *osp)
+{
+	struct sess *sp;
+	struct req *req;
+
+	CHECK_OBJ_NOTNULL(wrk, WORKER_MAGIC);
+	CHECK_OBJ_NOTNULL(osp, SESS_MAGIC);
+
+	sp = ses_new(osp->sesspool);
+	AN(sp);
+	sp->fd = -1;
+	sp->t_open = W_TIM_real(wrk);
+	sp->t_idle = sp->t_open;
+	sp->vxid = VXID_Get(&wrk->vxid_pool) | VSL_CLIENTMARKER;
+	sp->sockaddrlen = osp->sockaddrlen;
+	sp->mysockaddrlen = osp->mysockaddrlen;
+	memcpy(&sp->sockaddr, &osp->sockaddr, sizeof sp->sockaddr);
+	memcpy(&sp->mysockaddr, &osp->mysockaddr, sizeof sp->mysockaddr);
+	memcpy(sp->addr, osp->addr, sizeof sp->addr);
+	memcpy(sp->port, osp->port, sizeof sp->port);
+	VSL(SLT_SessOpen, sp->vxid, "%s %s bgfetch - - %.6f %d",
+	    sp->addr, sp->port, sp->t_open, sp->fd);
+
+	req = SES_GetReq(wrk, sp);
+	CHECK_OBJ_NOTNULL(req, REQ_MAGIC);
+	req->bgfetch = 1;
+	return (req);
+}
+
+static void
+ses_bg_pool_task(struct worker *wrk, void *arg)
+{
+	struct req *req;
+
+	CHECK_OBJ_NOTNULL(wrk, WORKER_MAGIC);
+	CAST_OBJ_NOTNULL(req, arg, REQ_MAGIC);
+	AN(req->bgfetch);
+
+	THR_SetRequest(req);
+	AZ(wrk->aws->r);
+	wrk->lastused = NAN;
+	assert(CNT_Request(wrk, req) == 1);
+	WS_Assert(wrk->aws);
+	AZ(wrk->wrw);
+	SES_DeleteBgReq(req);
+	THR_SetRequest(NULL);
+}
+
+int
+SES_ScheduleBgReq(struct req *req)
+{
+	struct sess *sp;
+	struct sesspool *pp;
+
+	CHECK_OBJ_NOTNULL(req, REQ_MAGIC);
+	sp = req->sp;
+	CHECK_OBJ_NOTNULL(sp, SESS_MAGIC);
+	pp = sp->sesspool;
+	CHECK_OBJ_NOTNULL(pp, SESSPOOL_MAGIC);
+	AN(pp->pool);
+
+	sp->task.func = ses_bg_pool_task;
+	sp->task.priv = req;
+	return (Pool_Task(pp->pool, &sp->task, POOL_NO_QUEUE));
+}
+
+void
+SES_DeleteBgReq(struct req *req)
+{
+	struct sess *sp;
+
+	CHECK_OBJ_NOTNULL(req, REQ_MAGIC);
+	AN(req->bgfetch);
+	sp = req->sp;
+	CHECK_OBJ_NOTNULL(sp, SESS_MAGIC);
+	if (req->vcl != NULL)
+		VCL_Rel(&req->vcl);
+	SES_ReleaseReq(req);
+	SES_Delete(sp, SC_NULL, NAN);
+}
+
 /*--------------------------------------------------------------------
  * Schedule a request back on a work-thread from its sessions pool
  *
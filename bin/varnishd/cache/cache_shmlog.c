@@ -29,8 +29,10 @@
 
 #include "config.h"
 
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include "cache.h"
 #include "common/heritage.h"
@@ -50,6 +52,19 @@ static uint32_t			*vsl_ptr;
 
 struct VSC_C_main       *VSC_C_main;
 
+#define VSC_MAXSHARD		64
+static struct VSC_C_main	*vsc_shard[VSC_MAXSHARD];
+static unsigned			vsc_nshard;
+#ifndef HAVE_SYNC_ADD
+static pthread_mutex_t		vsc_mtx;
+#endif
+
+static const char * const vsl_fmt[256] = {
+#  define SLTM(foo,fmt,sdesc,ldesc) [SLT_##foo] = fmt,
+#  include "tbl/vsl_tags.h"
+#  undef SLTM
+};
+
 /*--------------------------------------------------------------------
  * Check if the VSL_tag is masked by parameter bitmap
  */
@@ -109,24 +124,30 @@ vsl_wrap(void)
 
 /*--------------------------------------------------------------------
  * Reserve bytes for a record, wrap if necessary
+ *
+ * XXX: vsl_mtx is a contention point under heavy logging, see shm_cont.
+ * XXX: Reserving with an atomic add is not enough: readers stop at the
+ * XXX: ENDMARKER behind the last record, and a writer laying that down
+ * XXX: can overwrite the header of the record reserved after its own.
+ * XXX: The record header has no room for a generation to tell stale
+ * XXX: words from new ones, so this needs a layout change, either
+ * XXX: commit marks or one segment per pool which the readers merge.
  */
 
 static uint32_t *
 vsl_get(unsigned len, unsigned records, unsigned flushes)
 {
 	uint32_t *p;
+	struct VSC_C_main *vsc;
 
+	vsc = VSC_Shard();
 	if (pthread_mutex_trylock(&vsl_mtx)) {
 		AZ(pthread_mutex_lock(&vsl_mtx));
-		VSC_C_main->shm_cont++;
+		VSC_Add(&vsc->shm_cont, 1);
 	}
 	assert(vsl_ptr < vsl_end);
 	assert(((uintptr_t)vsl_ptr & 0x3) == 0);
 
-	VSC_C_main->shm_writes++;
-	VSC_C_main->shm_flushes += flushes;
-	VSC_C_main->shm_records += records;
-
 	/* Wrap if necessary */
 	if (VSL_END(vsl_ptr, len) >= vsl_end)
 		vsl_wrap();
@@ -140,6 +161,9 @@ vsl_get(unsigned len, unsigned records, unsigned flushes)
 	assert(((uintptr_t)vsl_ptr & 0x3) == 0);
 	AZ(pthread_mutex_unlock(&vsl_mtx));
 
+	VSC_Add(&vsc->shm_writes, 1);
+	VSC_Add(&vsc->shm_flushes, flushes);
+	VSC_Add(&vsc->shm_records, records);
 	return (p);
 }
 
@@ -312,6 +336,74 @@ VSLb(struct vsl_log *vsl, enum VSL_tag_e tag, const char *fmt, ...)
 		VSL_Flush(vsl, 0);
 }
 
+/*--------------------------------------------------------------------
+ * VSL-buffered-binary
+ *
+ * The arguments are laid down as the binary format of the tag says,
+ * readers render them to text if and when they need it.
+ */
+
+void
+VSLbb(struct vsl_log *vsl, enum VSL_tag_e tag, ...)
+{
+	const char *f;
+	char *p;
+	unsigned l;
+	uint64_t u;
+	double d;
+	va_list ap;
+
+	if (vsl_tag_is_masked(tag))
+		return;
+	f = vsl_fmt[tag];
+	AN(f);
+	AN(*f);
+
+	l = 0;
+	for (; *f != '\0'; f++) {
+		switch (*f) {
+		case 'j': l += sizeof u; break;
+		case 'T': l += sizeof d; break;
+		default: WRONG("Bad VSL binary format");
+		}
+	}
+
+	assert(vsl->wlp < vsl->wle);
+
+	/* Wrap if necessary */
+	if (VSL_END(vsl->wlp, l) >= vsl->wle)
+		VSL_Flush(vsl, 1);
+	assert(VSL_END(vsl->wlp, l) < vsl->wle);
+
+	p = VSL_DATA(vsl->wlp);
+	va_start(ap, tag);
+	for (f = vsl_fmt[tag]; *f != '\0'; f++) {
+		switch (*f) {
+		case 'j':
+			u = va_arg(ap, uint64_t);
+			memcpy(p, &u, sizeof u);
+			p += sizeof u;
+			break;
+		case 'T':
+			d = va_arg(ap, double);
+			memcpy(p, &d, sizeof d);
+			p += sizeof d;
+			break;
+		default:
+			WRONG("Bad VSL binary format");
+		}
+	}
+	va_end(ap);
+	(void)vsl_hdr(tag, vsl->wlp, l, vsl->wid);
+	vsl->wlp[0] |= VSL_BINMARKER;
+	vsl->wlp = VSL_END(vsl->wlp, l);
+	assert(vsl->wlp < vsl->wle);
+	vsl->wlr++;
+
+	if (DO_DEBUG(DBG_SYNCVSL))
+		VSL_Flush(vsl, 0);
+}
+
 /*--------------------------------------------------------------------
  * Setup a VSL buffer, allocate space if none provided.
  */
@@ -348,6 +440,80 @@ vsm_cleaner(void *priv)
 	NEEDLESS_RETURN(NULL);
 }
 
+/*--------------------------------------------------------------------
+ * Counters which are updated from all over the place go through
+ * VSC_ADD() into a per-CPU shard of VSC_C_main, readers add them up.
+ * A thread can be moved to another CPU between VSC_Shard() and the
+ * update, so the updates must still be atomic, but the cache line is
+ * nearly always local.
+ */
+
+unsigned
+VSC_NShard(void)
+{
+
+	AN(vsc_nshard);
+	return (vsc_nshard);
+}
+
+/* The shard for the CPU we run on, 0 ... VSC_NShard() - 1 */
+
+unsigned
+VSC_ShardNo(void)
+{
+#ifdef HAVE_SCHED_GETCPU
+	int i;
+
+	i = sched_getcpu();
+	if (i >= 0)
+		return ((unsigned)i % vsc_nshard);
+#endif
+	return (((uintptr_t)pthread_self() >> 10) % vsc_nshard);
+}
+
+struct VSC_C_main *
+VSC_Shard(void)
+{
+
+	return (vsc_shard[VSC_ShardNo()]);
+}
+
+#ifndef HAVE_SYNC_ADD
+void
+VSC_Add(uint64_t *p, uint64_t n)
+{
+
+	AZ(pthread_mutex_lock(&vsc_mtx));
+	*p += n;
+	AZ(pthread_mutex_unlock(&vsc_mtx));
+}
+#endif
+
+static void
+vsc_init(void)
+{
+	char buf[8];
+	long l;
+	unsigned u;
+
+#ifndef HAVE_SYNC_ADD
+	AZ(pthread_mutex_init(&vsc_mtx, NULL));
+#endif
+	l = sysconf(_SC_NPROCESSORS_CONF);
+	if (l < 1)
+		l = 1;
+	if (l > VSC_MAXSHARD)
+		l = VSC_MAXSHARD;
+	vsc_nshard = (unsigned)l;
+	for (u = 0; u < vsc_nshard; u++) {
+		bprintf(buf, "%u", u);
+		vsc_shard[u] = VSM_Alloc(sizeof *VSC_C_main,
+		    VSC_CLASS, VSC_TYPE_SHARD, buf);
+		AN(vsc_shard[u]);
+		memset(vsc_shard[u], 0, sizeof *VSC_C_main);
+	}
+}
+
 /*--------------------------------------------------------------------*/
 
 void
@@ -380,6 +546,7 @@ VSM_Init(void)
 	vsl_wrap();
 	// VSM_head->starttime = (intmax_t)VTIM_real();
 	memset(VSC_C_main, 0, sizeof *VSC_C_main);
+	vsc_init();
 	// VSM_head->child_pid = getpid();
 
 	AZ(pthread_create(&tp, NULL, vsm_cleaner, NULL));
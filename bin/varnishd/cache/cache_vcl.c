@@ -127,6 +127,19 @@ VCL_Rel(struct VCL_conf **vcc)
 	Lck_Unlock(&vcl_mtx);
 }
 
+/* Gain another reference on a VCL we already hold one on */
+
+void
+VCL_Ref(struct VCL_conf *vc)
+{
+
+	CHECK_OBJ_NOTNULL(vc, VCL_CONF_MAGIC);
+	Lck_Lock(&vcl_mtx);
+	assert(vc->busy > 0);
+	vc->busy++;
+	Lck_Unlock(&vcl_mtx);
+}
+
 /*--------------------------------------------------------------------*/
 
 static struct vcls *
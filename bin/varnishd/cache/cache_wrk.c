@@ -38,42 +38,26 @@
 
 #include "hash/hash_slinger.h"
 
-static struct lock		wstat_mtx;
-
-/*--------------------------------------------------------------------*/
+/*--------------------------------------------------------------------
+ * Add the workers private counters to the shard of the CPU we are on.
+ */
 
-static void
-wrk_sumstat(struct worker *w)
+void
+WRK_SumStat(struct worker *w)
 {
+	struct VSC_C_main *vsc;
 
-	Lck_AssertHeld(&wstat_mtx);
+	vsc = VSC_Shard();
 #define L0(n)
-#define L1(n) (VSC_C_main->n += w->stats.n)
+#define L1(n) \
+	do { if (w->stats.n) VSC_Add(&vsc->n, w->stats.n); } while (0)
 #define VSC_F(n, t, l, f, d, e) L##l(n);
 #include "tbl/vsc_f_main.h"
 #undef VSC_F
 #undef L0
 #undef L1
 	memset(&w->stats, 0, sizeof w->stats);
-}
-
-void
-WRK_SumStat(struct worker *w)
-{
-
-	Lck_Lock(&wstat_mtx);
-	wrk_sumstat(w);
-	Lck_Unlock(&wstat_mtx);
-}
-
-int
-WRK_TrySumStat(struct worker *w)
-{
-	if (Lck_Trylock(&wstat_mtx))
-		return (0);
-	wrk_sumstat(w);
-	Lck_Unlock(&wstat_mtx);
-	return (1);
+	HIST_Sum(w);
 }
 
 /*--------------------------------------------------------------------
@@ -160,9 +144,3 @@ WRK_thread(void *priv)
 
 	return (wrk_thread_real(priv, cache_param->workspace_thread));
 }
-
-void
-WRK_Init(void)
-{
-	Lck_New(&wstat_mtx, lck_wstat);
-}
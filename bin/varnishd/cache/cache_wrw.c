@@ -30,17 +30,28 @@
  * We try to use writev() if possible in order to minimize number of
  * syscalls made and packets sent.  It also just might allow the worker
  * thread to complete the request without holding stuff locked.
+ *
+ * Small writes (HTTP headers, ESI verbatim snippets, chunk framing) are
+ * copied into a staging buffer carved out of the thread workspace, and
+ * consecutive copies share a single io-vector, so that a response made
+ * of many tiny pieces does not run us out of io-vectors prematurely.
+ *
+ * When we are forced to flush because the io-vectors ran out, we know
+ * more data is coming, and tell the kernel so with MSG_MORE, so it can
+ * avoid sending a runt segment.
  */
 
 #include "config.h"
 
 #include <sys/types.h>
+#include <sys/socket.h>
 #include <sys/uio.h>
 
 #include <limits.h>
 #include <stdio.h>
 
 #include "cache.h"
+#include "vsb.h"
 #include "vtim.h"
 
 /*--------------------------------------------------------------------*/
@@ -56,10 +67,17 @@ struct wrw {
 	ssize_t			liov;
 	ssize_t			cliov;
 	unsigned		ciov;	/* Chunked header marker */
+	char			*buf;	/* Staging buffer for small writes */
+	unsigned		sbuf;
+	unsigned		lbuf;
 	double			t0;
 	struct vsl_log		*vsl;
+	struct dstat		*stats;
 };
 
+/* Writes this small or smaller are copied into the staging buffer */
+#define WRW_SMALL		256
+
 /*--------------------------------------------------------------------
  */
 
@@ -84,19 +102,25 @@ WRW_Reserve(struct worker *wrk, int *fd, struct vsl_log *vsl, double t0)
 	wrw->magic = WRW_MAGIC;
 	u = WS_Reserve(wrk->aws, 0);
 	u = PRNDDN(u);
-	u /= sizeof(struct iovec);
+	/* Half the space for io-vectors, the rest for the staging buffer */
+	u /= 2 * sizeof(struct iovec);
 	if (u > IOV_MAX)
 		u = IOV_MAX;
 	AN(u);
 	wrw->iov = (void*)PRNDUP(wrk->aws->f);
 	wrw->siov = u;
 	wrw->ciov = u;
+	wrw->buf = (void*)(wrw->iov + u);
+	assert(wrw->buf <= wrk->aws->r);
+	wrw->sbuf = pdiff(wrw->buf, wrk->aws->r);
+	wrw->lbuf = 0;
 	wrw->werr = 0;
 	wrw->liov = 0;
 	wrw->niov = 0;
 	wrw->wfd = fd;
 	wrw->t0 = t0;
 	wrw->vsl = vsl;
+	wrw->stats = &wrk->stats;
 	wrk->wrw = wrw;
 }
 
@@ -137,8 +161,59 @@ wrw_prune(struct wrw *wrw, ssize_t bytes)
 	assert(wrw->liov == 0);
 }
 
-unsigned
-WRW_Flush(const struct worker *wrk)
+/*--------------------------------------------------------------------
+ * Format the chunk header without going through printf(3), this is
+ * called for every flush of a chunked response.
+ */
+
+static unsigned
+wrw_chunkhead(char *p, size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+	char tmp[sizeof len * 2];
+	unsigned n, u;
+
+	n = 0;
+	do {
+		tmp[n++] = hex[len & 0xf];
+		len >>= 4;
+	} while (len > 0);
+	/* Same as the "00%zx\r\n" we used to bprintf() */
+	u = 0;
+	p[u++] = '0';
+	p[u++] = '0';
+	while (n > 0)
+		p[u++] = tmp[--n];
+	p[u++] = '\r';
+	p[u++] = '\n';
+	return (u);
+}
+
+static ssize_t
+wrw_writev(const struct wrw *wrw, int more)
+{
+#ifdef MSG_MORE
+	struct msghdr msg;
+	ssize_t i;
+
+	wrw->stats->wrw_writes++;
+	if (more) {
+		memset(&msg, 0, sizeof msg);
+		msg.msg_iov = wrw->iov;
+		msg.msg_iovlen = wrw->niov;
+		i = sendmsg(*wrw->wfd, &msg, MSG_MORE);
+		if (i >= 0 || errno != ENOTSOCK)
+			return (i);
+	}
+#else
+	wrw->stats->wrw_writes++;
+	(void)more;
+#endif
+	return (writev(*wrw->wfd, wrw->iov, wrw->niov));
+}
+
+static unsigned
+wrw_flush(const struct worker *wrk, int more)
 {
 	ssize_t i;
 	struct wrw *wrw;
@@ -156,8 +231,7 @@ WRW_Flush(const struct worker *wrk)
 	if (*wrw->wfd >= 0 && wrw->liov > 0 && wrw->werr == 0) {
 		if (wrw->ciov < wrw->siov && wrw->cliov > 0) {
 			/* Add chunk head & tail */
-			bprintf(cbuf, "00%zx\r\n", wrw->cliov);
-			i = strlen(cbuf);
+			i = wrw_chunkhead(cbuf, wrw->cliov);
 			wrw->iov[wrw->ciov].iov_base = cbuf;
 			wrw->iov[wrw->ciov].iov_len = i;
 			wrw->liov += i;
@@ -170,7 +244,7 @@ WRW_Flush(const struct worker *wrk)
 			wrw->iov[wrw->ciov].iov_len = 0;
 		}
 
-		i = writev(*wrw->wfd, wrw->iov, wrw->niov);
+		i = wrw_writev(wrw, more);
 		while (i != wrw->liov && i > 0) {
 			/* Remove sent data from start of I/O vector,
 			 * then retry; we hit a timeout, but some data
@@ -194,7 +268,7 @@ WRW_Flush(const struct worker *wrk)
 			    i, wrw->liov);
 
 			wrw_prune(wrw, i);
-			i = writev(*wrw->wfd, wrw->iov, wrw->niov);
+			i = wrw_writev(wrw, more);
 		}
 		if (i <= 0) {
 			wrw->werr++;
@@ -206,11 +280,19 @@ WRW_Flush(const struct worker *wrk)
 	wrw->liov = 0;
 	wrw->cliov = 0;
 	wrw->niov = 0;
+	wrw->lbuf = 0;
 	if (wrw->ciov < wrw->siov)
 		wrw->ciov = wrw->niov++;
 	return (wrw->werr);
 }
 
+unsigned
+WRW_Flush(const struct worker *wrk)
+{
+
+	return (wrw_flush(wrk, 0));
+}
+
 unsigned
 WRW_FlushRelease(struct worker *wrk)
 {
@@ -244,6 +326,7 @@ unsigned
 WRW_Write(const struct worker *wrk, const void *ptr, int len)
 {
 	struct wrw *wrw;
+	char *p;
 
 	CHECK_OBJ_NOTNULL(wrk, WORKER_MAGIC);
 	wrw = wrk->wrw;
@@ -253,8 +336,31 @@ WRW_Write(const struct worker *wrk, const void *ptr, int len)
 		return (0);
 	if (len == -1)
 		len = strlen(ptr);
+	if (wrk->wrw_copy != NULL && wrw->wfd == wrk->wrw_copy_fd)
+		(void)VSB_bcat(wrk->wrw_copy, ptr, len);
+	if (len <= WRW_SMALL && wrw->lbuf + len <= wrw->sbuf &&
+	    wrw->niov > 0 && wrw->niov - 1 != wrw->ciov &&
+	    (char*)wrw->iov[wrw->niov - 1].iov_base +
+	    wrw->iov[wrw->niov - 1].iov_len == wrw->buf + wrw->lbuf) {
+		/* Extend the previous staging io-vector */
+		memcpy(wrw->buf + wrw->lbuf, ptr, len);
+		wrw->lbuf += len;
+		wrw->iov[wrw->niov - 1].iov_len += len;
+		wrw->liov += len;
+		if (wrw->ciov < wrw->siov)
+			wrw->cliov += len;
+		wrw->stats->wrw_coalesced++;
+		return (len);
+	}
 	if (wrw->niov >= wrw->siov - (wrw->ciov < wrw->siov ? 1 : 0))
-		(void)WRW_Flush(wrk);
+		(void)wrw_flush(wrk, 1);
+	if (len <= WRW_SMALL && wrw->lbuf + len <= wrw->sbuf) {
+		p = wrw->buf + wrw->lbuf;
+		memcpy(p, ptr, len);
+		wrw->lbuf += len;
+		wrw->stats->wrw_coalesced++;
+		ptr = p;
+	}
 	wrw->iov[wrw->niov].iov_base = TRUST_ME(ptr);
 	wrw->iov[wrw->niov].iov_len = len;
 	wrw->liov += len;
@@ -281,7 +387,7 @@ WRW_Chunked(const struct worker *wrk)
 	 * a chunk tail, we might as well flush right away.
 	 */
 	if (wrw->niov + 3 >= wrw->siov)
-		(void)WRW_Flush(wrk);
+		(void)wrw_flush(wrk, 1);
 	wrw->ciov = wrw->niov++;
 	wrw->cliov = 0;
 	assert(wrw->ciov < wrw->siov);
@@ -305,7 +411,8 @@ WRW_EndChunk(const struct worker *wrk)
 	CHECK_OBJ_NOTNULL(wrw, WRW_MAGIC);
 
 	assert(wrw->ciov < wrw->siov);
-	(void)WRW_Flush(wrk);
+	/* The last-chunk marker follows right behind */
+	(void)wrw_flush(wrk, 1);
 	wrw->ciov = wrw->siov;
 	wrw->niov = 0;
 	wrw->cliov = 0;
@@ -138,12 +138,21 @@ struct params {
 	/* Maximum restarts allowed */
 	unsigned		max_restarts;
 
+	/* Run pipes on a dedicated thread */
+	unsigned		pipe_thread;
+
 	/* Maximum esi:include depth allowed */
 	unsigned		max_esi_depth;
 
 	/* ESI parser hints */
 	unsigned		esi_syntax;
 
+	/* Parallel esi:include fetches per ESI object */
+	unsigned		esi_prefetch;
+
+	/* Memory for assembled ESI bodies */
+	ssize_t			esi_cache;
+
 	/* Rush exponent */
 	unsigned		rush_exponent;
 
@@ -162,6 +171,13 @@ struct params {
 
 	/* Prefer IPv6 connections to backend*/
 	unsigned		prefer_ipv6;
+	double			connect_race_delay;
+
+	/* Idle backend connections */
+	double			backend_idle_timeout;
+	double			backend_max_age;
+	unsigned		backend_min_idle;
+	unsigned		backend_preconnect;
 
 	/* Acceptable clockskew with backends */
 	unsigned		clock_skew;
@@ -187,10 +203,16 @@ struct params {
 
 	unsigned		http_range_support;
 
+	unsigned		stream_followers;
+
+	unsigned		bgfetch;
+
 	unsigned		http_gzip_support;
 	unsigned		gzip_buffer;
 	unsigned		gzip_level;
 	unsigned		gzip_memlevel;
+	unsigned		gunzip_store;
+	ssize_t			gunzip_cache;
 
 	unsigned		obj_readonly;
 
@@ -452,7 +452,7 @@ hcb_lookup(struct worker *wrk, const void *digest, struct objhead **noh)
 		/* No luck, try with lock held, so we can modify tree */
 		CAST_OBJ_NOTNULL(y, wrk->nhashpriv, HCB_Y_MAGIC);
 		Lck_Lock(&hcb_mtx);
-		VSC_C_main->hcb_lock++;
+		VSC_ADD(hcb_lock, 1);
 		oh = hcb_insert(wrk, &hcb_root, digest, noh);
 		Lck_Unlock(&hcb_mtx);
 
@@ -464,7 +464,7 @@ hcb_lookup(struct worker *wrk, const void *digest, struct objhead **noh)
 		CHECK_OBJ_NOTNULL(oh, OBJHEAD_MAGIC);
 		if (noh != NULL && *noh == NULL) {
 			assert(oh->refcnt > 0);
-			VSC_C_main->hcb_insert++;
+			VSC_ADD(hcb_insert, 1);
 			return (oh);
 		}
 		/*
@@ -53,12 +53,16 @@ struct hash_slinger {
 
 /* cache_hash.c */
 void HSH_Cleanup(struct worker *w);
-struct objcore *HSH_Lookup(struct req *);
+struct objcore *HSH_Lookup(struct req *, struct objcore **bocp,
+    struct objcore **kocp);
 void HSH_Ref(struct objcore *o);
 void HSH_Drop(struct worker *, struct object **);
 void HSH_Init(const struct hash_slinger *slinger);
 void HSH_AddString(struct req *, const char *str);
 void HSH_Insert(struct worker *, const void *hash, struct objcore *);
+int HSH_Peek(struct worker *, const void *hash, double now);
+int HSH_Current(struct worker *, const void *hash, const struct objcore *,
+    unsigned xid, double now);
 void HSH_Purge(struct req *, struct objhead *, double ttl, double grace);
 void HSH_config(const char *h_arg);
 struct objcore *HSH_NewObjCore(struct worker *wrk);
@@ -96,7 +100,7 @@ struct objhead {
 };
 
 void HSH_Unbusy(struct dstat *, struct objcore *);
-void HSH_Complete(struct objcore *oc);
+void HSH_Complete(struct dstat *, struct objcore *oc);
 void HSH_DeleteObjHead(struct dstat *, struct objhead *oh);
 int HSH_Deref(struct dstat *, struct objcore *oc, struct object **o);
 #endif /* VARNISH_CACHE_CHILD */
@@ -97,7 +97,7 @@ mgt_DumpRstVsl(void)
 	    "\n.. The following is autogenerated output from "
 	    "varnishd -x dumprstvsl\n\n");
 
-#define SLTM(tag, sdesc, ldesc) mgt_sltm(#tag, sdesc, ldesc);
+#define SLTM(tag, fmt, sdesc, ldesc) mgt_sltm(#tag, sdesc, ldesc);
 #include "tbl/vsl_tags.h"
 #undef SLTM
 }
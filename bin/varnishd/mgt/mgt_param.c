@@ -706,7 +706,9 @@ static const struct parspec input_parspec[] = {
 		"One use is for the io-vectors for writing requests and"
 		" responses to sockets, having too little space will"
 		" result in more writev(2) system calls, having too much"
-		" just wastes the space.\n",
+		" just wastes the space.\n"
+		"Half of it is used as a staging buffer where small writes,"
+		" such as HTTP headers and ESI fragments, are coalesced.\n",
 		DELAYED_EFFECT,
 		"2048", "bytes" },
 	{ "http_req_hdr_len",
@@ -813,6 +815,14 @@ static const struct parspec input_parspec[] = {
 		"this many seconds, the session is closed.\n",
 		0,
 		"60", "seconds" },
+	{ "pipe_thread", tweak_bool, &mgt_param.pipe_thread, 0, 0,
+		"Hand piped connections to a single thread which moves the "
+		"bytes for all of them, rather than keeping a worker thread "
+		"busy for each until it closes.\n"
+		"Useful with many long lived pipes, such as websockets.  "
+		"The session is logged as closed when it is handed over.",
+		EXPERIMENTAL,
+		"off", "bool" },
 	{ "send_timeout", tweak_timeout, &mgt_param.send_timeout, 0, 0,
 		"Send timeout for client connections. "
 		"If the HTTP response hasn't been transmitted in this many\n"
@@ -884,7 +894,7 @@ static const struct parspec input_parspec[] = {
 		" this limit, the reponse code will be 201 instead of"
 		" 200 and the last line will indicate the truncation.",
 		0,
-		"48k", "bytes" },
+		"64k", "bytes" },
 	{ "cli_timeout", tweak_timeout, &mgt_param.cli_timeout, 0, 0,
 		"Timeout for the childs replies to CLI requests from "
 		"the mgt_param.",
@@ -933,6 +943,29 @@ static const struct parspec input_parspec[] = {
 		"Maximum depth of esi:include processing.\n",
 		0,
 		"5", "levels" },
+	{ "esi_prefetch",
+		tweak_uint, &mgt_param.esi_prefetch, 0, UINT_MAX,
+		"How many esi:include objects of an ESI object to start "
+		"fetching in parallel on other worker threads, when "
+		"delivery of the ESI object begins.\n"
+		"The included objects are still delivered in document "
+		"order, from the cache.  Zero disables prefetching.\n",
+		EXPERIMENTAL,
+		"0", "requests" },
+	{ "esi_cache", tweak_bytes, &mgt_param.esi_cache, 0, UINT_MAX,
+		"How much memory to use for keeping fully assembled ESI "
+		"bodies, so that later hits on the ESI object can be "
+		"delivered in one write, without processing the "
+		"esi:include elements.\n"
+		"An assembled body is only used while all the included "
+		"objects are the ones in the cache, not expired and no bans "
+		"have been added.  The included objects are not held, they "
+		"expire and get nuked as usual.\n"
+		"Only use this if vcl_recv{} and vcl_hash{} treat the "
+		"included objects the same for all clients.\n"
+		"Zero disables the ESI assembly cache.",
+		EXPERIMENTAL,
+		"0", "bytes" },
 	{ "connect_timeout", tweak_timeout_double,
 		&mgt_param.connect_timeout,0, UINT_MAX,
 		"Default connection timeout for backend connections. "
@@ -996,6 +1029,47 @@ static const struct parspec input_parspec[] = {
 		"have both IPv4 and IPv6 addresses.",
 		0,
 		"off", "bool" },
+	{ "connect_race_delay", tweak_timeout_double,
+		&mgt_param.connect_race_delay, 0, 10,
+		"When a backend has both IPv4 and IPv6 addresses, we "
+		"start connecting to the other address if the preferred "
+		"one has not answered within this time, and use whichever "
+		"connects first.\n"
+		"The total time spent is still limited by connect_timeout.",
+		EXPERIMENTAL,
+		"0.25", "s" },
+	{ "backend_idle_timeout", tweak_timeout_double,
+		&mgt_param.backend_idle_timeout, 0, UINT_MAX,
+		"Idle backend connections are closed after this many "
+		"seconds without being used.\n"
+		"Idle connections are checked in the background a few "
+		"times per second, so that connections closed by the "
+		"backend are discarded before a request tries to use "
+		"them.\n"
+		"Zero disables the timeout.",
+		0,
+		"60", "s" },
+	{ "backend_max_age", tweak_timeout_double,
+		&mgt_param.backend_max_age, 0, UINT_MAX,
+		"Backend connections older than this are closed instead "
+		"of being reused.\n"
+		"Zero disables the limit.",
+		0,
+		"0", "s" },
+	{ "backend_min_idle", tweak_uint,
+		&mgt_param.backend_min_idle, 0, UINT_MAX,
+		"Try to keep at least this many idle connections open "
+		"to each healthy backend in use by VCL, opening new "
+		"ones ahead of demand when needed.",
+		EXPERIMENTAL,
+		"0", "connections" },
+	{ "backend_preconnect", tweak_bool,
+		&mgt_param.backend_preconnect, 0, 0,
+		"When a request finds no idle connection to its backend "
+		"and has to open one, also open a spare one in the "
+		"background for the next request.",
+		EXPERIMENTAL,
+		"off", "bool" },
 	{ "session_max", tweak_uint,
 		&mgt_param.max_sess, 1000, UINT_MAX,
 		"Maximum number of sessions we will allocate from one pool "
@@ -1014,7 +1088,10 @@ static const struct parspec input_parspec[] = {
 		"completing.\n"
 		"Setting this too high results in worker threads not doing "
 		"anything for their keep, setting it too low just means that "
-		"more sessions take a detour around the waiter.",
+		"more sessions take a detour around the waiter.\n"
+		"This is the upper limit: the actual linger is adapted to "
+		"the clients observed gap between requests, and is zero "
+		"when the thread pool has no idle threads.",
 		EXPERIMENTAL,
 		"0.050", "seconds" },
 	{ "log_local_address", tweak_bool, &mgt_param.log_local_addr, 0, 0,
@@ -1055,6 +1132,23 @@ static const struct parspec input_parspec[] = {
 		"Enable support for HTTP Range headers.\n",
 		0,
 		"on", "bool" },
+	{ "stream_followers", tweak_bool, &mgt_param.stream_followers, 0, 0,
+		"Let requests which find an object still being fetched "
+		"stream it to their clients as the fetch progresses, "
+		"rather than waiting for the fetch to complete.\n"
+		"Objects being fetched with ESI processing, or with "
+		"streaming disabled in vcl_fetch{}, are never followed.",
+		EXPERIMENTAL,
+		"on", "bool" },
+	{ "bgfetch", tweak_bool, &mgt_param.bgfetch, 0, 0,
+		"Deliver an object in grace at once, and refresh it with "
+		"a fetch in the background, rather than making the request "
+		"wait for a new object.\n"
+		"The background fetch is conditional if the stale object "
+		"has an ETag or Last-Modified header, and a 304 response "
+		"refreshes it without transferring the body again.",
+		EXPERIMENTAL,
+		"off", "bool" },
 	{ "http_gzip_support", tweak_bool, &mgt_param.http_gzip_support, 0, 0,
 		"Enable gzip support. When enabled Varnish will compress "
 		"uncompressed objects before they are stored in the cache. "
@@ -1069,6 +1163,21 @@ static const struct parspec input_parspec[] = {
 		"Varnish reference.",
 		EXPERIMENTAL,
 		"on", "bool" },
+	{ "gunzip_store", tweak_bool, &mgt_param.gunzip_store, 0, 0,
+		"Also store a gunzip'ed copy of gzip'ed objects, and deliver "
+		"it to clients which do not support gzip, rather than "
+		"uncompressing the object on every delivery.\n"
+		"This costs a gunzip per fetch and the storage for the copy. "
+		"ESI objects and objects not in the cache are not copied.",
+		EXPERIMENTAL,
+		"off", "bool" },
+	{ "gunzip_cache", tweak_bytes, &mgt_param.gunzip_cache, 0, UINT_MAX,
+		"How much memory to use for keeping gunzip'ed bodies of "
+		"gzip'ed objects, for clients which do not support gzip.  "
+		"A body is kept when it is first gunzip'ed on delivery, and "
+		"freed with its object.  Zero disables the gunzip cache.",
+		EXPERIMENTAL,
+		"0", "bytes" },
 	{ "gzip_level", tweak_uint, &mgt_param.gzip_level, 0, 9,
 		"Gzip compression level: 0=debug, 1=fast, 9=best",
 		0,
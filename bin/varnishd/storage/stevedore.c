@@ -38,6 +38,7 @@
 
 #include "cache/cache.h"
 
+#include "hash/hash_slinger.h"
 #include "storage/storage.h"
 #include "vrt.h"
 #include "vrt_obj.h"
@@ -263,6 +264,7 @@ STV_MkObject(struct stevedore *stv, struct busyobj *bo, struct objcore **ocp,
 	o->http->magic = HTTP_MAGIC;
 	o->exp = bo->exp;
 	VTAILQ_INIT(&o->store);
+	VTAILQ_INIT(&o->gunzip_store);
 	bo->stats->n_object++;
 
 	o->objcore = *ocp;
@@ -382,6 +384,73 @@ STV_Freestore(struct object *o)
 		VTAILQ_REMOVE(&o->store, st, list);
 		STV_free(st);
 	}
+	o->gunzip_len = 0;
+	VTAILQ_FOREACH_SAFE(st, &o->gunzip_store, list, stn) {
+		CHECK_OBJ_NOTNULL(st, STORAGE_MAGIC);
+		VTAILQ_REMOVE(&o->gunzip_store, st, list);
+		STV_free(st);
+	}
+}
+
+/*--------------------------------------------------------------------
+ * Let an object use the body of another object, typically the one it
+ * revalidated.  The segments point into the other objects storage, and
+ * the objcore holds a reference on the objcore owning that storage,
+ * which HSH_Deref() drops after the segments are gone.
+ */
+
+static void
+stv_shared_free(struct storage *st)
+{
+
+	CHECK_OBJ_NOTNULL(st, STORAGE_MAGIC);
+	FREE_OBJ(st);
+}
+
+static struct stevedore stv_shared = {
+	.magic	=	STEVEDORE_MAGIC,
+	.name	=	"shared",
+	.free	=	stv_shared_free,
+};
+
+int
+STV_ShareBody(struct object *o, const struct object *src)
+{
+	struct objcore *oc;
+	struct storage *st, *sst;
+
+	CHECK_OBJ_NOTNULL(o, OBJECT_MAGIC);
+	CHECK_OBJ_NOTNULL(src, OBJECT_MAGIC);
+	CHECK_OBJ_NOTNULL(o->objcore, OBJCORE_MAGIC);
+	AZ(o->objcore->body_oc);
+	assert(VTAILQ_EMPTY(&o->store));
+
+	/* Persistent objects must own their storage */
+	if (o->objcore->methods != &default_oc_methods)
+		return (-1);
+	oc = src->objcore;
+	if (oc == NULL || oc->methods != &default_oc_methods ||
+	    oc->objhead == NULL)
+		return (-1);
+	/* Don't chain, reference whoever owns the storage */
+	if (oc->body_oc != NULL)
+		oc = oc->body_oc;
+	CHECK_OBJ_NOTNULL(oc, OBJCORE_MAGIC);
+
+	VTAILQ_FOREACH(sst, &src->store, list) {
+		CHECK_OBJ_NOTNULL(sst, STORAGE_MAGIC);
+		if (sst->len == 0)
+			continue;
+		ALLOC_OBJ(st, STORAGE_MAGIC);
+		XXXAN(st);
+		st->stevedore = &stv_shared;
+		st->ptr = sst->ptr;
+		st->len = st->space = sst->len;
+		VTAILQ_INSERT_TAIL(&o->store, st, list);
+	}
+	HSH_Ref(oc);
+	o->objcore->body_oc = oc;
+	return (0);
 }
 
 /*-------------------------------------------------------------------*/
@@ -459,6 +459,10 @@ smp_oc_getobj(struct dstat *ds, struct objcore *oc)
 		if (l != o->len)
 			bad |= 0x100;
 
+		/* Not worth validating, clients can gunzip on delivery */
+		VTAILQ_INIT(&o->gunzip_store);
+		o->gunzip_len = 0;
+
 		if(bad) {
 			EXP_Set_ttl(&o->exp, -1);
 			so->ttl = 0;
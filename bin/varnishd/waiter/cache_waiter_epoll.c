@@ -26,9 +26,16 @@
  * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
  * SUCH DAMAGE.
  *
- * XXX: We need to pass sessions back into the event engine when they are
- * reused.  Not sure what the most efficient way is for that.  For now
- * write the session pointer to a pipe which the event engine monitors.
+ * We run one epoll instance, each with its own thread, per thread pool
+ * and spread the sessions over them by file descriptor.
+ *
+ * Sessions are passed back to the waiter on a locked list, the waiter
+ * thread is only woken through an eventfd (or a pipe, where we have no
+ * eventfd) when that list goes from empty to non-empty.
+ *
+ * Idle sessions are kept on a timing wheel, hashed on the time they
+ * went idle.  Each tick we only look at the sessions which went idle
+ * timeout_idle seconds ago, rather than at all of them.
  */
 
 #include "config.h"
@@ -36,8 +43,12 @@
 #if defined(HAVE_EPOLL_CTL)
 
 #include <sys/epoll.h>
+#ifdef HAVE_EVENTFD
+#include <sys/eventfd.h>
+#endif
 
 #include <fcntl.h>
+#include <math.h>
 #include <stdlib.h>
 
 #include "cache/cache.h"
@@ -51,19 +62,53 @@
 
 #define NEEV	100
 
+/* Timing wheel: 1024 slots of 100 msec covers timeout_idle up to 102s */
+#define VWE_TICK	0.1
+#define VWE_NSLOT	1024
+
+VTAILQ_HEAD(sesshead, sess);
+
 struct vwe {
 	unsigned		magic;
 #define VWE_MAGIC		0x6bd73424
 
 	pthread_t		epoll_thread;
-	pthread_t		timer_thread;
 	int			epfd;
+	int			wakefd[2];
+
+	/* Sessions handed to us, protected by mtx */
+	struct lock		mtx;
+	struct sesshead		inq;
+	unsigned		ninq;
+	double			t_inq;	/* Sum of handoff timestamps */
 
-	VTAILQ_HEAD(,sess)	sesshead;
-	int			pipes[2];
-	int			timer_pipes[2];
+	/* Idle sessions, hashed on t_idle */
+	struct sesshead		wheel[VWE_NSLOT];
+	uint64_t		tick;	/* Last tick expired */
 };
 
+struct vwe_set {
+	unsigned		magic;
+#define VWE_SET_MAGIC		0x8f1f64a5
+	unsigned		nvwe;
+	struct vwe		**vwe;
+};
+
+static inline uint64_t
+vwe_tick(double t)
+{
+
+	return ((uint64_t)(t / VWE_TICK));
+}
+
+static inline struct sesshead *
+vwe_slot(struct vwe *vwe, const struct sess *sp)
+{
+
+	assert(!isnan(sp->t_idle));
+	return (&vwe->wheel[vwe_tick(sp->t_idle) % VWE_NSLOT]);
+}
+
 static void
 vwe_modadd(struct vwe *vwe, int fd, void *data, short arm)
 {
@@ -73,7 +118,7 @@ vwe_modadd(struct vwe *vwe, int fd, void *data, short arm)
 	 * XXX: will hang. See #644.
 	 */
 	assert(fd >= 0);
-	if (data == vwe->pipes || data == vwe->timer_pipes) {
+	if (data == vwe->wakefd) {
 		struct epoll_event ev = {
 		    EPOLLIN | EPOLLPRI , { data }
 		};
@@ -103,116 +148,142 @@ vwe_cond_modadd(struct vwe *vwe, int fd, void *data)
 	}
 }
 
+/*--------------------------------------------------------------------
+ * Pick up the sessions workers have handed to us.
+ */
+
+static void
+vwe_inq(struct vwe *vwe, double now)
+{
+	struct sesshead sh;
+	struct sess *sp;
+	unsigned n;
+	double t;
+	struct VSC_C_main *vsc;
+#ifdef HAVE_EVENTFD
+	uint64_t u;
+
+	(void)read(vwe->wakefd[0], &u, sizeof u);
+#else
+	char junk[64];
+
+	while (read(vwe->wakefd[0], junk, sizeof junk) > 0)
+		continue;
+#endif
+
+	VTAILQ_INIT(&sh);
+	Lck_Lock(&vwe->mtx);
+	VTAILQ_CONCAT(&sh, &vwe->inq, list);
+	n = vwe->ninq;
+	t = vwe->t_inq;
+	vwe->ninq = 0;
+	vwe->t_inq = 0;
+	Lck_Unlock(&vwe->mtx);
+
+	if (n > 0) {
+		vsc = VSC_Shard();
+		VSC_Add(&vsc->waiter_handoff, n);
+		VSC_Add(&vsc->waiter_handoff_usec,
+		    (uint64_t)(1e6 * (n * now - t)));
+	}
+
+	while (!VTAILQ_EMPTY(&sh)) {
+		sp = VTAILQ_FIRST(&sh);
+		VTAILQ_REMOVE(&sh, sp, list);
+		CHECK_OBJ_NOTNULL(sp, SESS_MAGIC);
+		assert(sp->fd >= 0);
+		VTAILQ_INSERT_TAIL(vwe_slot(vwe, sp), sp, list);
+		vwe_cond_modadd(vwe, sp->fd, sp);
+	}
+}
+
 static void
 vwe_eev(struct vwe *vwe, const struct epoll_event *ep, double now)
 {
-	struct sess *ss[NEEV], *sp;
-	int i, j;
+	struct sess *sp;
 
 	AN(ep->data.ptr);
-	if (ep->data.ptr == vwe->pipes) {
-		if (ep->events & EPOLLIN || ep->events & EPOLLPRI) {
-			j = 0;
-			i = read(vwe->pipes[0], ss, sizeof ss);
-			if (i == -1 && errno == EAGAIN)
-				return;
-			while (i >= sizeof ss[0]) {
-				CHECK_OBJ_NOTNULL(ss[j], SESS_MAGIC);
-				assert(ss[j]->fd >= 0);
-				VTAILQ_INSERT_TAIL(&vwe->sesshead, ss[j], list);
-				vwe_cond_modadd(vwe, ss[j]->fd, ss[j]);
-				j++;
-				i -= sizeof ss[0];
-			}
-			assert(i == 0);
-		}
+	if (ep->data.ptr == vwe->wakefd) {
+		if (ep->events & EPOLLIN || ep->events & EPOLLPRI)
+			vwe_inq(vwe, now);
 	} else {
 		CAST_OBJ_NOTNULL(sp, ep->data.ptr, SESS_MAGIC);
 		if (ep->events & EPOLLIN || ep->events & EPOLLPRI) {
-			VTAILQ_REMOVE(&vwe->sesshead, sp, list);
+			VTAILQ_REMOVE(vwe_slot(vwe, sp), sp, list);
 			SES_Handle(sp, now);
 		} else if (ep->events & EPOLLERR) {
-			VTAILQ_REMOVE(&vwe->sesshead, sp, list);
+			VTAILQ_REMOVE(vwe_slot(vwe, sp), sp, list);
 			SES_Delete(sp, SC_REM_CLOSE, now);
 		} else if (ep->events & EPOLLHUP) {
-			VTAILQ_REMOVE(&vwe->sesshead, sp, list);
+			VTAILQ_REMOVE(vwe_slot(vwe, sp), sp, list);
 			SES_Delete(sp, SC_REM_CLOSE, now);
 		} else if (ep->events & EPOLLRDHUP) {
-			VTAILQ_REMOVE(&vwe->sesshead, sp, list);
+			VTAILQ_REMOVE(vwe_slot(vwe, sp), sp, list);
 			SES_Delete(sp, SC_REM_CLOSE, now);
 		}
 	}
 }
 
-/*--------------------------------------------------------------------*/
+/*--------------------------------------------------------------------
+ * Expire the sessions in the slots which have gone past timeout_idle
+ * since we last looked.  A slot also holds sessions which went idle
+ * a multiple of VWE_NSLOT ticks later, those are left alone.
+ */
 
-static void *
-vwe_thread(void *priv)
+static void
+vwe_timeout(struct vwe *vwe, double now)
 {
-	struct epoll_event ev[NEEV], *ep;
-	struct sess *sp;
-	char junk;
-	double now, deadline;
-	int dotimer, i, n;
-	struct vwe *vwe;
-
-	CAST_OBJ_NOTNULL(vwe, priv, VWE_MAGIC);
-
-	THR_SetName("cache-epoll");
-
-	vwe->epfd = epoll_create(1);
-	assert(vwe->epfd >= 0);
-
-	vwe_modadd(vwe, vwe->pipes[0], vwe->pipes, EPOLL_CTL_ADD);
-	vwe_modadd(vwe, vwe->timer_pipes[0], vwe->timer_pipes, EPOLL_CTL_ADD);
-
-	while (1) {
-		dotimer = 0;
-		n = epoll_wait(vwe->epfd, ev, NEEV, -1);
-		now = VTIM_real();
-		for (ep = ev, i = 0; i < n; i++, ep++) {
-			if (ep->data.ptr == vwe->timer_pipes &&
-			    (ep->events == EPOLLIN || ep->events == EPOLLPRI))
-			{
-				assert(read(vwe->timer_pipes[0], &junk, 1));
-				dotimer = 1;
-			} else
-				vwe_eev(vwe, ep, now);
-		}
-		if (!dotimer)
-			continue;
-
-		/* check for timeouts */
-		deadline = now - cache_param->timeout_idle;
-		for (;;) {
-			sp = VTAILQ_FIRST(&vwe->sesshead);
-			if (sp == NULL)
-				break;
+	struct sesshead *sh;
+	struct sess *sp, *sp2;
+	double deadline;
+	uint64_t t, n;
+
+	deadline = now - cache_param->timeout_idle;
+	t = vwe_tick(deadline);
+	if (t < vwe->tick) {
+		/* timeout_idle was increased */
+		vwe->tick = t;
+		return;
+	}
+	if (t - vwe->tick > VWE_NSLOT)
+		vwe->tick = t - VWE_NSLOT;
+	for (n = vwe->tick; n <= t; n++) {
+		sh = &vwe->wheel[n % VWE_NSLOT];
+		VTAILQ_FOREACH_SAFE(sp, sh, list, sp2) {
 			if (sp->t_idle > deadline)
-				break;
-			VTAILQ_REMOVE(&vwe->sesshead, sp, list);
+				continue;
+			VTAILQ_REMOVE(sh, sp, list);
 			// XXX: not yet VTCP_linger(sp->fd, 0);
 			SES_Delete(sp, SC_RX_TIMEOUT, now);
 		}
 	}
-	return (NULL);
+	vwe->tick = t;
 }
 
 /*--------------------------------------------------------------------*/
 
 static void *
-vwe_timeout_idle_ticker(void *priv)
+vwe_thread(void *priv)
 {
-	char ticker = 'R';
+	struct epoll_event ev[NEEV], *ep;
+	double now, next;
+	int i, n;
 	struct vwe *vwe;
 
 	CAST_OBJ_NOTNULL(vwe, priv, VWE_MAGIC);
-	THR_SetName("cache-epoll-timeout_idle_ticker");
 
+	THR_SetName("cache-epoll");
+
+	next = VTIM_real() + VWE_TICK;
 	while (1) {
-		/* ticking */
-		assert(write(vwe->timer_pipes[1], &ticker, 1));
-		VTIM_sleep(100 * 1e-3);
+		n = epoll_wait(vwe->epfd, ev, NEEV, (int)(VWE_TICK * 1e3));
+		now = VTIM_real();
+		for (ep = ev, i = 0; i < n; i++, ep++)
+			vwe_eev(vwe, ep, now);
+		if (now < next)
+			continue;
+		vwe_timeout(vwe, now);
+		next = now + VWE_TICK;
 	}
 	return (NULL);
 }
@@ -220,44 +291,98 @@ vwe_timeout_idle_ticker(void *priv)
 /*--------------------------------------------------------------------*/
 
 static void
-vwe_pass(void *priv, const struct sess *sp)
+vwe_pass(void *priv, const struct sess *csp)
 {
+	struct vwe_set *vws;
 	struct vwe *vwe;
-
-	CAST_OBJ_NOTNULL(vwe, priv, VWE_MAGIC);
-	assert(sizeof sp == write(vwe->pipes[1], &sp, sizeof sp));
+	struct sess *sp;
+	unsigned wake;
+	double now;
+
+	CAST_OBJ_NOTNULL(vws, priv, VWE_SET_MAGIC);
+	CAST_OBJ_NOTNULL(sp, TRUST_ME(csp), SESS_MAGIC);
+	/* A session must always come back to the same epoll instance */
+	vwe = vws->vwe[sp->fd % vws->nvwe];
+	CHECK_OBJ_NOTNULL(vwe, VWE_MAGIC);
+
+	now = VTIM_real();
+	Lck_Lock(&vwe->mtx);
+	wake = VTAILQ_EMPTY(&vwe->inq);
+	VTAILQ_INSERT_TAIL(&vwe->inq, sp, list);
+	vwe->ninq++;
+	vwe->t_inq += now;
+	Lck_Unlock(&vwe->mtx);
+	if (wake) {
+#ifdef HAVE_EVENTFD
+		uint64_t u = 1;
+
+		assert(sizeof u == write(vwe->wakefd[1], &u, sizeof u));
+#else
+		char junk = 'W';
+
+		(void)write(vwe->wakefd[1], &junk, 1);
+#endif
+	}
 }
 
 /*--------------------------------------------------------------------*/
 
-static void *
-vwe_init(void)
+static struct vwe *
+vwe_new(void)
 {
-	int i;
 	struct vwe *vwe;
+	unsigned u;
+#ifndef HAVE_EVENTFD
+	int i;
+#endif
 
 	ALLOC_OBJ(vwe, VWE_MAGIC);
 	AN(vwe);
-	VTAILQ_INIT(&vwe->sesshead);
-	AZ(pipe(vwe->pipes));
-	AZ(pipe(vwe->timer_pipes));
-
-	i = fcntl(vwe->pipes[0], F_GETFL);
-	assert(i != -1);
-	i |= O_NONBLOCK;
-	i = fcntl(vwe->pipes[0], F_SETFL, i);
-	assert(i != -1);
-
-	i = fcntl(vwe->timer_pipes[0], F_GETFL);
-	assert(i != -1);
-	i |= O_NONBLOCK;
-	i = fcntl(vwe->timer_pipes[0], F_SETFL, i);
-	assert(i != -1);
-
-	AZ(pthread_create(&vwe->timer_thread,
-	    NULL, vwe_timeout_idle_ticker, vwe));
+	Lck_New(&vwe->mtx, lck_waiter);
+	VTAILQ_INIT(&vwe->inq);
+	for (u = 0; u < VWE_NSLOT; u++)
+		VTAILQ_INIT(&vwe->wheel[u]);
+	vwe->tick = vwe_tick(VTIM_real() - cache_param->timeout_idle);
+
+#ifdef HAVE_EVENTFD
+	vwe->wakefd[0] = eventfd(0, EFD_NONBLOCK);
+	assert(vwe->wakefd[0] >= 0);
+	vwe->wakefd[1] = vwe->wakefd[0];
+#else
+	AZ(pipe(vwe->wakefd));
+	for (u = 0; u < 2; u++) {
+		i = fcntl(vwe->wakefd[u], F_GETFL);
+		assert(i != -1);
+		i |= O_NONBLOCK;
+		i = fcntl(vwe->wakefd[u], F_SETFL, i);
+		assert(i != -1);
+	}
+#endif
+
+	vwe->epfd = epoll_create(1);
+	assert(vwe->epfd >= 0);
+	vwe_modadd(vwe, vwe->wakefd[0], vwe->wakefd, EPOLL_CTL_ADD);
+
 	AZ(pthread_create(&vwe->epoll_thread, NULL, vwe_thread, vwe));
-	return(vwe);
+	return (vwe);
+}
+
+static void *
+vwe_init(void)
+{
+	struct vwe_set *vws;
+	unsigned u;
+
+	ALLOC_OBJ(vws, VWE_SET_MAGIC);
+	AN(vws);
+	vws->nvwe = cache_param->wthread_pools;
+	if (vws->nvwe == 0)
+		vws->nvwe = 1;
+	vws->vwe = calloc(vws->nvwe, sizeof *vws->vwe);
+	AN(vws->vwe);
+	for (u = 0; u < vws->nvwe; u++)
+		vws->vwe[u] = vwe_new();
+	return (vws);
 }
 
 /*--------------------------------------------------------------------*/
@@ -46,6 +46,7 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "vapi/vsc.h"
 #include "vapi/vsl.h"
 #include "vapi/vsm.h"
 #include "vas.h"
@@ -53,6 +54,7 @@
 
 #define HIST_N 2000 /* how far back we remember */
 #define HIST_RES 100 /* bucket resolution */
+#define HIST_WIN 60 /* seconds of -H samples shown */
 
 static int hist_low;
 static int hist_high;
@@ -72,6 +74,7 @@ static uint64_t bitmap[FD_SETSIZE];
 static double  values[FD_SETSIZE];
 static char *format;
 static int match_tag;
+static const char *hist_name;
 
 static double log_ten;
 
@@ -265,6 +268,8 @@ accumulate_thread(void *arg)
 
 	for (;;) {
 		i = VSL_Dispatch(vd, h_hist, vd);
+		if (i == -3)
+			continue;	/* Overrun, nothing to show it on */
 		if (i < 0)
 			break;
 		if (i == 0)
@@ -273,13 +278,84 @@ accumulate_thread(void *arg)
 	return (arg);
 }
 
+/*--------------------------------------------------------------------
+ * Read one of the histograms varnishd keeps in shared memory, and show
+ * the samples added during the last HIST_WIN seconds.
+ */
+
+static unsigned
+vsc_bucket(unsigned u)
+{
+	uint64_t us;
+	int i;
+
+	if (u < 4)
+		us = u + 1;
+	else
+		us = (uint64_t)(u % 4 + 5) << (u / 4 - 1);
+	i = HIST_RES * (log(us * 1e-6) / log_ten);
+	if (i < hist_low * HIST_RES)
+		i = hist_low * HIST_RES;
+	if (i >= hist_high * HIST_RES)
+		i = hist_high * HIST_RES - 1;
+	return (i - hist_low * HIST_RES);
+}
+
+static void *
+vsc_thread(void *arg)
+{
+	struct VSM_data *vd = arg;
+	struct VSM_fantom vf;
+	static uint64_t snap[HIST_WIN][VSC_HIST_NBUCKET];
+	const volatile uint64_t *b;
+	uint64_t d;
+	unsigned u, n, w, o;
+
+	memset(&vf, 0, sizeof vf);
+	n = w = 0;
+	for (;; sleep(1)) {
+		if (VSM_StillValid(vd, &vf) != 1) {
+			n = w = 0;
+			if (!VSM_Get(vd, &vf, VSC_CLASS, VSC_TYPE_HIST,
+			    hist_name)) {
+				if (VSM_Abandoned(vd)) {
+					VSM_Close(vd);
+					while (VSM_Open(vd))
+						sleep(1);
+				}
+				continue;
+			}
+		}
+		b = (const volatile void *)((struct VSC_C_hist *)vf.b + 1);
+		for (u = 0; u < VSC_HIST_NBUCKET; u++)
+			snap[w][u] = b[u];
+		if (n < HIST_WIN)
+			n++;
+		o = (w + HIST_WIN + 1 - n) % HIST_WIN;
+
+		pthread_mutex_lock(&mtx);
+		memset(bucket_hit, 0, hist_buckets * sizeof *bucket_hit);
+		memset(bucket_miss, 0, hist_buckets * sizeof *bucket_miss);
+		nhist = 0;
+		for (u = 0; u < VSC_HIST_NBUCKET; u++) {
+			d = snap[w][u] - snap[o][u];
+			bucket_miss[vsc_bucket(u)] += d;
+			nhist += d;
+		}
+		pthread_mutex_unlock(&mtx);
+		w = (w + 1) % HIST_WIN;
+	}
+	return (arg);
+}
+
 static void
 do_curses(struct VSM_data *vd)
 {
 	pthread_t thr;
 	int ch;
 
-	if (pthread_create(&thr, NULL, accumulate_thread, vd) != 0) {
+	if (pthread_create(&thr, NULL,
+	    hist_name != NULL ? vsc_thread : accumulate_thread, vd) != 0) {
 		fprintf(stderr, "pthread_create(): %s\n", strerror(errno));
 		exit(1);
 	}
@@ -347,7 +423,7 @@ static void
 usage(void)
 {
 	fprintf(stderr, "usage: varnishhist "
-	    "%s [-p profile] [-f field_num] "
+	    "%s [-p profile] [-f field_num] [-H histogram] "
 	    "[-R max] [-r min] [-V] [-w delay]\n", VSL_USAGE);
 	exit(1);
 }
@@ -365,8 +441,22 @@ main(int argc, char **argv)
 
 	vd = VSM_New();
 
-	while ((o = getopt(argc, argv, VSL_ARGS "Vw:r:R:f:p:")) != -1) {
+	while ((o = getopt(argc, argv, VSL_ARGS "Vw:r:R:f:p:H:")) != -1) {
 		switch (o) {
+		case 'H':
+#define HIST(n, d) if (!strcmp(optarg, #n)) hist_name = #n;
+#include "tbl/histograms.h"
+#undef HIST
+			if (hist_name == NULL) {
+				fprintf(stderr, "No such histogram %s, use one of:",
+				    optarg);
+#define HIST(n, d) fprintf(stderr, " %s", #n);
+#include "tbl/histograms.h"
+#undef HIST
+				fprintf(stderr, "\n");
+				exit(1);
+			}
+			break;
 		case 'V':
 			VCS_Message("varnishhist");
 			exit(0);
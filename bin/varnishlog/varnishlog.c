@@ -194,6 +194,8 @@ do_order(struct VSM_data *vd)
 			clean_order(vd);
 			AZ(fflush(stdout));
 		}
+		else if (i == -3)
+			fprintf(stderr, "%s", VSM_Error(vd));
 		else if (i < 0)
 			break;
 	}
@@ -213,11 +215,13 @@ sighup(int sig)
 }
 
 static int
-open_log(const char *w_arg, int a_flag)
+open_log(const char *w_arg, int a_flag, int W_flag)
 {
 	int fd, flags;
 
-	flags = (a_flag ? O_APPEND : O_TRUNC) | O_WRONLY | O_CREAT;
+	/* Appending to an archive reads its header first */
+	flags = (a_flag ? O_APPEND : O_TRUNC) | O_CREAT;
+	flags |= (a_flag && W_flag) ? O_RDWR : O_WRONLY;
 #ifdef O_LARGEFILE
 	flags |= O_LARGEFILE;
 #endif
@@ -232,34 +236,88 @@ open_log(const char *w_arg, int a_flag)
 	return (fd);
 }
 
+static volatile sig_atomic_t stop;
+
 static void
-do_write(struct VSM_data *vd, const char *w_arg, int a_flag)
+sigterm(int sig)
+{
+
+	(void)sig;
+	stop = 1;
+}
+
+/*
+ * With -W the records are written as an indexed archive.  The block
+ * being filled is written out when the log has been idle for a second,
+ * and before we exit on SIGINT/SIGTERM.
+ */
+
+static void
+do_write(struct VSM_data *vd, const char *w_arg, int a_flag, int W_flag)
 {
 	int fd, i, l;
 	uint32_t *p;
+	struct VSL_archive *va = NULL;
 
-	fd = open_log(w_arg, a_flag);
+	fd = open_log(w_arg, a_flag, W_flag);
 	XXXAN(fd >= 0);
 	(void)signal(SIGHUP, sighup);
-	while (1) {
+	if (W_flag) {
+		va = VSL_ArchiveNew(fd);
+		if (va == NULL) {
+			perror(w_arg);
+			exit(1);
+		}
+		(void)signal(SIGINT, sigterm);
+		(void)signal(SIGTERM, sigterm);
+	}
+	while (!stop) {
 		i = VSL_NextSLT(vd, &p, NULL);
-		if (i < 0)
+		if (i == -3) {
+			fprintf(stderr, "%s", VSM_Error(vd));
+			i = 0;
+		} else if (i < 0)
 			break;
-		if (i > 0) {
+		if (i > 0 && va != NULL) {
+			i = VSL_ArchiveRecord(va, p);
+		} else if (i > 0) {
 			l = VSL_LEN(p);
 			i = write(fd, p, 8L + VSL_WORDS(l) * 4L);
-			if (i < 0) {
-				perror(w_arg);
-				exit(1);
-			}
+		} else if (va != NULL) {
+			i = VSL_ArchiveIdle(va);
+		}
+		if (i < 0) {
+			perror(w_arg);
+			exit(1);
 		}
 		if (reopen) {
+			if (va != NULL) {
+				if (VSL_ArchiveFlush(va)) {
+					perror(w_arg);
+					exit(1);
+				}
+				VSL_ArchiveDelete(va);
+			}
 			AZ(close(fd));
-			fd = open_log(w_arg, a_flag);
+			fd = open_log(w_arg, a_flag, W_flag);
 			XXXAN(fd >= 0);
+			if (va != NULL) {
+				va = VSL_ArchiveNew(fd);
+				if (va == NULL) {
+					perror(w_arg);
+					exit(1);
+				}
+			}
 			reopen = 0;
 		}
 	}
+	if (va != NULL) {
+		if (VSL_ArchiveFlush(va)) {
+			perror(w_arg);
+			exit(1);
+		}
+		VSL_ArchiveDelete(va);
+	}
 	exit(0);
 }
 
@@ -270,15 +328,16 @@ usage(void)
 {
 	fprintf(stderr, "usage: varnishlog "
 	    "%s [-aDV] [-o [tag regex]] [-n varnish_name]"
-	    " [-P file] [-w file]\n", VSL_USAGE);
+	    " [-P file] [-w file] [-W file]\n", VSL_USAGE);
 	exit(1);
 }
 
 int
 main(int argc, char * const *argv)
 {
-	int c;
+	int c, i;
 	int a_flag = 0, D_flag = 0, O_flag = 0, u_flag = 0, m_flag = 0;
+	int r_flag = 0, W_flag = 0;
 	const char *P_arg = NULL;
 	const char *w_arg = NULL;
 	struct vpf_fh *pfh = NULL;
@@ -286,7 +345,7 @@ main(int argc, char * const *argv)
 
 	vd = VSM_New();
 
-	while ((c = getopt(argc, argv, VSL_ARGS "aDP:uVw:oO")) != -1) {
+	while ((c = getopt(argc, argv, VSL_ARGS "aDP:uVw:W:oO")) != -1) {
 		switch (c) {
 		case 'a':
 			a_flag = 1;
@@ -319,6 +378,18 @@ main(int argc, char * const *argv)
 		case 'w':
 			w_arg = optarg;
 			break;
+		case 'W':
+			w_arg = optarg;
+			W_flag = 1;
+			break;
+		case 'q':
+		case 'r':
+			if (c == 'r')
+				r_flag = 1;
+			if (VSL_Arg(vd, c, optarg) > 0)
+				break;
+			fprintf(stderr, "%s\n", VSM_Error(vd));
+			exit(1);
 		case 'm':
 			m_flag = 1;
 			/* FALLTHROUGH */
@@ -335,7 +406,7 @@ main(int argc, char * const *argv)
 	if ((argc - optind) > 0)
 		usage();
 
-	if (VSM_Open(vd)) {
+	if (!r_flag && VSM_Open(vd)) {
 		fprintf(stderr, "%s\n", VSM_Error(vd));
 		exit(1);
 	}
@@ -356,7 +427,7 @@ main(int argc, char * const *argv)
 		VPF_Write(pfh);
 
 	if (w_arg != NULL)
-		do_write(vd, w_arg, a_flag);
+		do_write(vd, w_arg, a_flag, W_flag);
 
 	if (u_flag)
 		setbuf(stdout, NULL);
@@ -364,7 +435,9 @@ main(int argc, char * const *argv)
 	if (!O_flag)
 		do_order(vd);
 
-	while (VSL_Dispatch(vd, VSL_H_Print, stdout) >= 0) {
+	while ((i = VSL_Dispatch(vd, VSL_H_Print, stdout)) >= 0 || i == -3) {
+		if (i == -3)
+			fprintf(stderr, "%s", VSM_Error(vd));
 		if (fflush(stdout) != 0) {
 			perror("stdout");
 			break;
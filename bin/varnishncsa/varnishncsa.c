@@ -61,6 +61,7 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -84,41 +85,64 @@
 
 static volatile sig_atomic_t reopen;
 
-struct hdr {
-	char *key;
-	char *value;
-	VTAILQ_ENTRY(hdr) list;
+/*
+ * A field of a log line, pointing into the records of the transaction
+ * or into the logline itself, valid while the line is being written.
+ */
+struct fld {
+	const char		*b;
+	const char		*e;
 };
 
-static struct logline {
-	char *df_H;			/* %H, Protocol version */
-	char *df_U;			/* %U, URL path */
-	char *df_q;			/* %q, query string */
-	char *df_b;			/* %b, Bytes */
-	char *df_h;			/* %h (host name / IP adress)*/
-	char *df_m;			/* %m, Request method*/
-	char *df_s;			/* %s, Status */
+struct logline {
+	struct fld df_H;		/* %H, Protocol version */
+	struct fld df_U;		/* %U, URL path */
+	struct fld df_q;		/* %q, query string */
+	struct fld df_b;		/* %b, Bytes */
+	struct fld df_h;		/* %h (host name / IP adress)*/
+	struct fld df_m;		/* %m, Request method*/
+	struct fld df_s;		/* %s, Status */
 	struct tm df_t;			/* %t, Date and time */
-	char *df_u;			/* %u, Remote user */
-	char *df_ttfb;			/* Time to first byte */
+	struct fld df_u;		/* %u, Remote user */
+	struct fld df_ttfb;		/* Time to first byte */
 	const char *df_hitmiss;		/* Whether this is a hit or miss */
 	const char *df_handling;	/* How the request was handled
 					   (hit/miss/pass/pipe) */
-	int active;			/* Is log line in an active trans */
-	int complete;			/* Is log line complete */
-	uint64_t bitmap;		/* Bitmap for regex matches */
-	VTAILQ_HEAD(, hdr) req_headers; /* Request headers */
-	VTAILQ_HEAD(, hdr) resp_headers; /* Response headers */
-	VTAILQ_HEAD(, hdr) vcl_log;     /* VLC_Log entries */
-} **ll;
+	char b_buf[24];
+	char ttfb_buf[32];
+};
 
-struct VSM_data *vd;
+/*
+ * The -F format is compiled once, at startup, into a list of ops which
+ * each append one piece of the log line.
+ */
+enum fmt_e {
+	F_LIT,			/* literal text */
+	F_b, F_H, F_h, F_m, F_q, F_r, F_s, F_t, F_U, F_u,
+	F_strftime,		/* %{fmt}t */
+	F_reqhdr,		/* %{X}i */
+	F_resphdr,		/* %{X}o */
+	F_ttfb,			/* %{Varnish:time_firstbyte}x */
+	F_hitmiss,		/* %{Varnish:hitmiss}x */
+	F_handling,		/* %{Varnish:handling}x */
+	F_vcllog,		/* %{VCL_Log:key}x */
+};
 
-static size_t nll;
+struct fmt_op {
+	enum fmt_e		op;
+	const char		*s;
+	unsigned		l;
+};
+
+static struct fmt_op *prog;
+static unsigned nprog;
+
+struct VSM_data *vd;
 
 static int m_flag = 0;
 
-static const char *format;
+static FILE *of;
+static const char *w_arg;
 
 static int
 isprefix(const char *str, const char *prefix, const char *end,
@@ -139,688 +163,627 @@ isprefix(const char *str, const char *prefix, const char *end,
 }
 
 /*
- * Returns a copy of the first consecutive sequence of non-space
- * characters in the string in dst. dst will be free'd first if non-NULL.
+ * The first consecutive sequence of non-space characters.
  */
 static void
-trimfield(char **dst, const char *str, const char *end)
+trimfield(struct fld *f, const char *str, const char *end)
 {
-	size_t len;
-
-	/* free if already set */
-	if (*dst != NULL) {
-		free(*dst);
-		*dst = NULL;
-	}
 
-	/* skip leading space */
-	while (str < end && *str && *str == ' ')
+	while (str < end && *str == ' ')
 		++str;
-
-	/* seek to end of field */
-	for (len = 0; &str[len] < end && str[len]; ++len)
-		if (str[len] == ' ')
-			break;
-
-	/* copy and return */
-	*dst = malloc(len + 1);
-	assert(*dst != NULL);
-	memcpy(*dst, str, len);
-	(*dst)[len] = '\0';
+	f->b = str;
+	while (str < end && *str != ' ')
+		++str;
+	f->e = str;
 }
 
 /*
- * Returns a copy of the entire string with leading and trailing spaces
- * trimmed in dst. dst will be free'd first if non-NULL.
+ * The string with leading and trailing spaces trimmed.
  */
 static void
-trimline(char **dst, const char *str, const char *end)
+trimline(struct fld *f, const char *str, const char *end)
 {
-	size_t len;
-
-	/* free if already set */
-	if (*dst != NULL) {
-		free(*dst);
-		*dst = NULL;
-	}
 
-	/* skip leading space */
-	while (str < end && *str && *str == ' ')
+	while (str < end && *str == ' ')
 		++str;
+	while (end > str && end[-1] == ' ')
+		--end;
+	f->b = str;
+	f->e = end;
+}
 
-	/* seek to end of string */
-	for (len = 0; &str[len] < end && str[len]; ++len)
-		 /* nothing */ ;
-
-	/* trim trailing space */
-	while (len && str[len - 1] == ' ')
-		--len;
+static void
+fld_cat(struct vsb *os, const struct fld *f, const char *def)
+{
 
-	/* copy and return */
-	*dst = malloc(len + 1);
-	assert(*dst != NULL);
-	memcpy(*dst, str, len);
-	(*dst)[len] = '\0';
+	if (f->b == NULL)
+		VSB_cat(os, def);
+	else
+		VSB_bcat(os, f->b, f->e - f->b);
 }
 
-static char *
-req_header(struct logline *l, const char *name)
+static int
+isbasicauth(const char *ptr, const char *end, const char **next)
 {
-	struct hdr *h;
-	VTAILQ_FOREACH(h, &l->req_headers, list) {
-		if (strcasecmp(h->key, name) == 0) {
-			return (h->value);
-			break;
-		}
-	}
-	return (NULL);
+
+	return (isprefix(ptr, "authorization:", end, next) &&
+	    isprefix(*next, "basic", end, next));
 }
 
-static char *
-resp_header(struct logline *l, const char *name)
+/*
+ * Find the value of a "name: value" record, the last one logged wins.
+ */
+static void
+find_hdr(const struct VSL_transaction *t, enum VSL_tag_e tag,
+    const struct fmt_op *o, struct fld *f)
 {
-	struct hdr *h;
-	VTAILQ_FOREACH(h, &l->resp_headers, list) {
-		if (strcasecmp(h->key, name) == 0) {
-			return (h->value);
-			break;
-		}
+	const uint32_t *p;
+	const char *ptr, *end, *split, *next;
+	struct fld k;
+
+	f->b = NULL;
+	for (p = t->b; p < t->e; p = VSL_NEXT(p)) {
+		if (VSL_TAG(p) != tag)
+			continue;
+		ptr = VSL_CDATA(p);
+		end = ptr + VSL_LEN(p);
+		split = memchr(ptr, ':', end - ptr);
+		if (split == NULL)
+			continue;
+		if (tag == SLT_ReqHeader && isbasicauth(ptr, end, &next))
+			continue;
+		trimline(&k, ptr, split);
+		if (k.e - k.b != o->l || strncasecmp(k.b, o->s, o->l))
+			continue;
+		trimline(f, split + 1, end);
 	}
-	return (NULL);
 }
 
-static char *
-vcl_log(struct logline *l, const char *name)
+/*
+ * The numbers in ReqEnd and Length are binary, unless we read an old
+ * log file.
+ */
+static void
+collect_reqend(struct logline *lp, const uint32_t *p)
 {
-	struct hdr *h;
-	VTAILQ_FOREACH(h, &l->vcl_log, list) {
-		if (strcasecmp(h->key, name) == 0) {
-			return (h->value);
-			break;
-		}
+	double d[5];
+	time_t t;
+	char buf[128];
+	unsigned l;
+
+	if (VSL_BINARY(p) && VSL_LEN(p) == sizeof d) {
+		memcpy(d, VSL_CDATA(p), sizeof d);
+	} else {
+		l = VSL_BINARY(p) ? VSL_Render(p, buf, sizeof buf) :
+		    VSL_LEN(p) < sizeof buf ? VSL_LEN(p) : sizeof buf - 1;
+		if (!VSL_BINARY(p))
+			memcpy(buf, VSL_CDATA(p), l);
+		buf[l] = '\0';
+		if (sscanf(buf, "%lf %lf %lf %lf %lf",
+		    &d[0], &d[1], &d[2], &d[3], &d[4]) != 5)
+			return;
 	}
-	return (NULL);
+	/* Start of request, time to first byte */
+	t = (time_t)d[0];
+	localtime_r(&t, &lp->df_t);
+	l = snprintf(lp->ttfb_buf, sizeof lp->ttfb_buf, "%.9f", d[3]);
+	lp->df_ttfb.b = lp->ttfb_buf;
+	lp->df_ttfb.e = lp->ttfb_buf + l;
 }
 
 static void
-clean_logline(struct logline *lp)
+collect_length(struct logline *lp, const uint32_t *p)
 {
-	struct hdr *h, *h2;
-#define freez(x) do { if (x) free(x); x = NULL; } while (0);
-	freez(lp->df_H);
-	freez(lp->df_U);
-	freez(lp->df_q);
-	freez(lp->df_b);
-	freez(lp->df_h);
-	freez(lp->df_m);
-	freez(lp->df_s);
-	freez(lp->df_u);
-	freez(lp->df_ttfb);
-	VTAILQ_FOREACH_SAFE(h, &lp->req_headers, list, h2) {
-		VTAILQ_REMOVE(&lp->req_headers, h, list);
-		freez(h->key);
-		freez(h->value);
-		freez(h);
-	}
-	VTAILQ_FOREACH_SAFE(h, &lp->resp_headers, list, h2) {
-		VTAILQ_REMOVE(&lp->resp_headers, h, list);
-		freez(h->key);
-		freez(h->value);
-		freez(h);
-	}
-	VTAILQ_FOREACH_SAFE(h, &lp->vcl_log, list, h2) {
-		VTAILQ_REMOVE(&lp->vcl_log, h, list);
-		freez(h->key);
-		freez(h->value);
-		freez(h);
+	uint64_t u;
+	unsigned l;
+
+	if (VSL_BINARY(p) && VSL_LEN(p) == sizeof u) {
+		memcpy(&u, VSL_CDATA(p), sizeof u);
+		l = snprintf(lp->b_buf, sizeof lp->b_buf, "%ju",
+		    (uintmax_t)u);
+		lp->df_b.b = lp->b_buf;
+		lp->df_b.e = lp->b_buf + l;
+	} else if (!VSL_BINARY(p)) {
+		trimline(&lp->df_b, VSL_CDATA(p), VSL_CDATA(p) + VSL_LEN(p));
 	}
-#undef freez
-	memset(lp, 0, sizeof *lp);
 }
 
+/*
+ * Pick the fields out of a client request.  Returns non-zero if the
+ * request should not be logged.
+ */
 static int
-collect_backend(struct logline *lp, enum VSL_tag_e tag, unsigned spec,
-    const char *ptr, unsigned len)
+collect_client(struct logline *lp, const struct VSL_transaction *t)
 {
-	const char *end, *next, *split;
-
-	assert(spec & VSL_S_BACKEND);
-	end = ptr + len;
+	const uint32_t *p;
+	const char *ptr, *end, *next, *qs;
+	unsigned len;
+	int start = 0;
 
-	switch (tag) {
-	case SLT_BackendOpen:
-		if (lp->active || lp->df_h != NULL) {
-			/* New start for active line,
-			   clean it and start from scratch */
-			clean_logline(lp);
-		}
-		lp->active = 1;
-		if (isprefix(ptr, "default", end, &next))
-			trimfield(&lp->df_h, next, end);
-		else
+	memset(lp, 0, sizeof *lp);
+	for (p = t->b; p < t->e; p = VSL_NEXT(p)) {
+		ptr = VSL_CDATA(p);
+		len = VSL_LEN(p);
+		end = ptr + len;
+
+		switch (VSL_TAG(p)) {
+		case SLT_ReqStart:
+			start = 1;
 			trimfield(&lp->df_h, ptr, end);
-		break;
-
-	case SLT_BereqRequest:
-		if (!lp->active)
 			break;
-		if (lp->df_m != NULL) {
-			clean_logline(lp);
-			break;
-		}
-		trimline(&lp->df_m, ptr, end);
-		break;
 
-	case SLT_BereqURL: {
-		char *qs;
-
-		if (!lp->active)
-			break;
-		if (lp->df_U != NULL || lp->df_q != NULL) {
-			clean_logline(lp);
+		case SLT_ReqRequest:
+			if (lp->df_m.b == NULL)
+				trimline(&lp->df_m, ptr, end);
 			break;
-		}
-		qs = memchr(ptr, '?', len);
-		if (qs) {
-			trimline(&lp->df_U, ptr, qs);
-			trimline(&lp->df_q, qs, end);
-		} else {
-			trimline(&lp->df_U, ptr, end);
-		}
-		break;
-	}
 
-	case SLT_BereqProtocol:
-		if (!lp->active)
-			break;
-		if (lp->df_H != NULL) {
-			clean_logline(lp);
+		case SLT_ReqURL:
+			if (lp->df_U.b != NULL)
+				break;
+			qs = memchr(ptr, '?', len);
+			if (qs) {
+				trimline(&lp->df_U, ptr, qs);
+				trimline(&lp->df_q, qs, end);
+			} else {
+				trimline(&lp->df_U, ptr, end);
+			}
 			break;
-		}
-		trimline(&lp->df_H, ptr, end);
-		break;
 
-	case SLT_BerespStatus:
-		if (!lp->active)
-			break;
-		if (lp->df_s != NULL) {
-			clean_logline(lp);
+		case SLT_ReqProtocol:
+			if (lp->df_H.b == NULL)
+				trimline(&lp->df_H, ptr, end);
 			break;
-		}
-		trimline(&lp->df_s, ptr, end);
-		break;
 
-	case SLT_BerespHeader:
-		if (!lp->active)
+		case SLT_RespStatus:
+			trimline(&lp->df_s, ptr, end);
 			break;
-		if (isprefix(ptr, "content-length:", end, &next))
-			trimline(&lp->df_b, next, end);
-		else if (isprefix(ptr, "date:", end, &next) &&
-			 strptime(next, "%a, %d %b %Y %T", &lp->df_t) == NULL) {
-			clean_logline(lp);
-		}
-		break;
 
-	case SLT_BereqHeader:
-		if (!lp->active)
+		case SLT_ReqHeader:
+			if (isbasicauth(ptr, end, &next))
+				trimline(&lp->df_u, next, end);
+			break;
+
+		case SLT_VCL_call:
+			if (strncmp(ptr, "hit", len) == 0) {
+				lp->df_hitmiss = "hit";
+				lp->df_handling = "hit";
+			} else if (strncmp(ptr, "miss", len) == 0) {
+				lp->df_hitmiss = "miss";
+				lp->df_handling = "miss";
+			} else if (strncmp(ptr, "pass", len) == 0) {
+				lp->df_hitmiss = "miss";
+				lp->df_handling = "pass";
+			} else if (strncmp(ptr, "pipe", len) == 0) {
+				/* Just skip piped requests, since we can't
+				 * print their status code */
+				return (1);
+			}
 			break;
-		split = memchr(ptr, ':', len);
-		if (split == NULL)
+
+		case SLT_Length:
+			collect_length(lp, p);
 			break;
-		if (isprefix(ptr, "authorization:", end, &next) &&
-		    isprefix(next, "basic", end, &next)) {
-			trimline(&lp->df_u, next, end);
-		} else {
-			struct hdr *h;
-			size_t l;
-			h = calloc(1, sizeof(struct hdr));
-			AN(h);
-			AN(split);
-			l = strlen(split);
-			trimline(&h->key, ptr, split-1);
-			trimline(&h->value, split+1, split+l-1);
-			VTAILQ_INSERT_HEAD(&lp->req_headers, h, list);
-		}
-		break;
 
-	case SLT_BackendReuse:
-	case SLT_BackendClose:
-		if (!lp->active)
+		case SLT_ReqEnd:
+			collect_reqend(lp, p);
 			break;
-		/* got it all */
-		lp->complete = 1;
-		break;
 
-	default:
-		break;
+		default:
+			break;
+		}
 	}
-
-	return (1);
+	return (!start);
 }
 
-static int
-collect_client(struct logline *lp, enum VSL_tag_e tag, unsigned spec,
-    const char *ptr, unsigned len)
+/*--------------------------------------------------------------------*/
+
+static void
+fmt_compile(const char *p)
 {
-	const char *end, *next, *split;
-	long l;
-	time_t t;
+	struct fmt_op *o = NULL;
+	const char *tmp;
+	char *lit, *fname;
+	unsigned l;
 
-	assert(spec & VSL_S_CLIENT);
-	end = ptr + len;
+	l = strlen(p) + 1;
+	prog = calloc(l, sizeof *prog);
+	AN(prog);
+	lit = malloc(l);
+	AN(lit);
 
-	switch (tag) {
-	case SLT_ReqStart:
-		if (lp->active || lp->df_h != NULL) {
-			/* New start for active line,
-			   clean it and start from scratch */
-			clean_logline(lp);
-		}
-		lp->active = 1;
-		trimfield(&lp->df_h, ptr, end);
-		break;
+	for (; *p != '\0'; p++) {
 
-	case SLT_ReqRequest:
-		if (!lp->active)
-			break;
-		if (lp->df_m != NULL) {
-			clean_logline(lp);
+		if (*p != '%') {
+			if (o == NULL) {
+				o = &prog[nprog++];
+				o->op = F_LIT;
+				o->s = lit;
+			}
+			/* allow the most essential escape sequences in format. */
+			if (*p == '\\') {
+				if (p[1] == '\0')
+					break;
+				p++;
+				if (*p == 't') *lit++ = '\t', o->l++;
+				if (*p == 'n') *lit++ = '\n', o->l++;
+				continue;
+			}
+			*lit++ = *p;
+			o->l++;
+			continue;
+		}
+		o = &prog[nprog++];
+		p++;
+		switch (*p) {
+		case 'b': o->op = F_b; break;
+		case 'H': o->op = F_H; break;
+		case 'h': o->op = F_h; break;
+		case 'l': o->op = F_LIT; o->s = "-"; o->l = 1; break;
+		case 'm': o->op = F_m; break;
+		case 'q': o->op = F_q; break;
+		case 'r': o->op = F_r; break;
+		case 's': o->op = F_s; break;
+		case 't': o->op = F_t; break;
+		case 'U': o->op = F_U; break;
+		case 'u': o->op = F_u; VB64_init(); break;
+		case '{':
+			tmp = strchr(p, '}');
+			if (tmp == NULL)
+				goto unknown;
+			l = tmp - p - 1;
+			fname = malloc(l + 1);
+			AN(fname);
+			memcpy(fname, p + 1, l);
+			fname[l] = '\0';
+			o->s = fname;
+			o->l = l;
+			switch (tmp[1]) {
+			case 'i': o->op = F_reqhdr; break;
+			case 'o': o->op = F_resphdr; break;
+			case 't': o->op = F_strftime; break;
+			case 'x':
+				if (!strcmp(fname, "Varnish:time_firstbyte")) {
+					o->op = F_ttfb;
+					break;
+				} else if (!strcmp(fname, "Varnish:hitmiss")) {
+					o->op = F_hitmiss;
+					break;
+				} else if (!strcmp(fname, "Varnish:handling")) {
+					o->op = F_handling;
+					break;
+				} else if (!strncmp(fname, "VCL_Log:", 8)) {
+					// support pulling entries logged
+					// with std.log() into output.
+					// Format: %{VCL_Log:keyname}x
+					// Logging: std.log("keyname:value")
+					o->op = F_vcllog;
+					o->s += 8;
+					o->l -= 8;
+					break;
+				}
+				/* FALLTHROUGH */
+			default:
+				goto unknown;
+			}
+			p = tmp + 1;
 			break;
+		default:
+		unknown:
+			fprintf(stderr, "Unknown format starting at: %s\n", --p);
+			exit(1);
 		}
-		trimline(&lp->df_m, ptr, end);
-		break;
+		o = NULL;
+	}
+}
 
-	case SLT_ReqURL: {
-		char *qs;
+static void
+fmt_user(struct vsb *os, const struct fld *f)
+{
+	char ubuf[256], rubuf[256], *q;
+	unsigned l;
 
-		if (!lp->active)
-			break;
-		if (lp->df_U != NULL || lp->df_q != NULL) {
-			clean_logline(lp);
-			break;
-		}
-		qs = memchr(ptr, '?', len);
-		if (qs) {
-			trimline(&lp->df_U, ptr, qs);
-			trimline(&lp->df_q, qs, end);
-		} else {
-			trimline(&lp->df_U, ptr, end);
-		}
-		break;
+	/* %u: decode authorization string */
+	if (f->b == NULL) {
+		VSB_putc(os, '-');
+		return;
+	}
+	l = f->e - f->b;
+	if (l >= sizeof ubuf)
+		l = sizeof ubuf - 1;
+	memcpy(ubuf, f->b, l);
+	ubuf[l] = '\0';
+	if (VB64_decode(rubuf, sizeof rubuf, ubuf)) {
+		VSB_putc(os, '-');
+		return;
 	}
+	q = strchr(rubuf, ':');
+	if (q != NULL)
+		*q = '\0';
+	VSB_cat(os, rubuf);
+}
 
-	case SLT_ReqProtocol:
-		if (!lp->active)
+/*
+ * Run the format program over a transaction.  Returns non-zero if the
+ * request should not be logged.
+ */
+static int
+fmt_line(struct logline *lp, struct vsb *os, const struct VSL_transaction *t)
+{
+	const struct fmt_op *o;
+	char tbuf[64];
+	struct fld h;
+
+	VSB_clear(os);
+	if (collect_client(lp, t)) {
+		AZ(VSB_finish(os));
+		return (1);
+	}
+
+	for (o = prog; o < prog + nprog; o++) {
+		switch (o->op) {
+		case F_LIT:
+			VSB_bcat(os, o->s, o->l);
 			break;
-		if (lp->df_H != NULL) {
-			clean_logline(lp);
+		case F_b:
+			fld_cat(os, &lp->df_b, "-");
 			break;
-		}
-		trimline(&lp->df_H, ptr, end);
-		break;
-
-	case SLT_ObjStatus:
-		if (!lp->active)
+		case F_H:
+			fld_cat(os, &lp->df_H, "HTTP/1.0");
 			break;
-		if (lp->df_s != NULL)
-			clean_logline(lp);
-		else
-			trimline(&lp->df_s, ptr, end);
-		break;
-
-	case SLT_ObjHeader:
-	case SLT_ReqHeader:
-		if (!lp->active)
+		case F_h:
+			fld_cat(os, &lp->df_h, "-");
 			break;
-		split = memchr(ptr, ':', len);
-		if (split == NULL)
+		case F_m:
+			fld_cat(os, &lp->df_m, "-");
 			break;
-		if (tag == SLT_ReqHeader &&
-		    isprefix(ptr, "authorization:", end, &next) &&
-		    isprefix(next, "basic", end, &next)) {
-			trimline(&lp->df_u, next, end);
-		} else {
-			struct hdr *h;
-			h = calloc(1, sizeof(struct hdr));
-			AN(h);
-			AN(split);
-			trimline(&h->key, ptr, split);
-			trimline(&h->value, split+1, end);
-			if (tag == SLT_ReqHeader)
-				VTAILQ_INSERT_HEAD(&lp->req_headers, h, list);
-			else
-				VTAILQ_INSERT_HEAD(&lp->resp_headers, h, list);
-		}
-		break;
-
-	case SLT_VCL_Log:
-		if(!lp->active)
+		case F_q:
+			fld_cat(os, &lp->df_q, "");
 			break;
-
-		split = memchr(ptr, ':', len);
-		if (split == NULL)
+		case F_r:
+			/*
+			 * Fake "%r".  This would be a lot easier if Varnish
+			 * normalized the request URL.
+			 */
+			fld_cat(os, &lp->df_m, "-");
+			VSB_putc(os, ' ');
+			find_hdr(t, SLT_ReqHeader, &(struct fmt_op){
+			    F_reqhdr, "Host", 4 }, &h);
+			if (h.b != NULL) {
+				if (h.e - h.b < 7 || strncmp(h.b, "http://", 7))
+					VSB_cat(os, "http://");
+				fld_cat(os, &h, "");
+			} else {
+				VSB_cat(os, "http://localhost");
+			}
+			fld_cat(os, &lp->df_U, "-");
+			fld_cat(os, &lp->df_q, "");
+			VSB_putc(os, ' ');
+			fld_cat(os, &lp->df_H, "HTTP/1.0");
 			break;
-
-		struct hdr *h;
-		h = calloc(1, sizeof(struct hdr));
-		AN(h);
-		AN(split);
-
-		trimline(&h->key, ptr, split);
-		trimline(&h->value, split+1, end);
-
-		VTAILQ_INSERT_HEAD(&lp->vcl_log, h, list);
-		break;
-
-	case SLT_VCL_call:
-		if(!lp->active)
+		case F_s:
+			fld_cat(os, &lp->df_s, "");
 			break;
-		if (strncmp(ptr, "hit", len) == 0) {
-			lp->df_hitmiss = "hit";
-			lp->df_handling = "hit";
-		} else if (strncmp(ptr, "miss", len) == 0) {
-			lp->df_hitmiss = "miss";
-			lp->df_handling = "miss";
-		} else if (strncmp(ptr, "pass", len) == 0) {
-			lp->df_hitmiss = "miss";
-			lp->df_handling = "pass";
-		} else if (strncmp(ptr, "pipe", len) == 0) {
-			/* Just skip piped requests, since we can't
-			 * print their status code */
-			clean_logline(lp);
+		case F_t:
+			strftime(tbuf, sizeof tbuf,
+			    "[%d/%b/%Y:%T %z]", &lp->df_t);
+			VSB_cat(os, tbuf);
 			break;
-		}
-		break;
-
-	case SLT_Length:
-		if (!lp->active)
+		case F_U:
+			fld_cat(os, &lp->df_U, "-");
 			break;
-		if (lp->df_b != NULL) {
-			clean_logline(lp);
+		case F_u:
+			fmt_user(os, &lp->df_u);
 			break;
-		}
-		trimline(&lp->df_b, ptr, end);
-		break;
-
-	case SLT_SessClose:
-		if (!lp->active)
+		case F_strftime:
+			strftime(tbuf, sizeof tbuf, o->s, &lp->df_t);
+			VSB_cat(os, tbuf);
 			break;
-		if (strncmp(ptr, "TX_PIPE", len) == 0 ||
-		    strncmp(ptr, "TX_ERROR", len) == 0) {
-			clean_logline(lp);
+		case F_reqhdr:
+			find_hdr(t, SLT_ReqHeader, o, &h);
+			fld_cat(os, &h, "-");
 			break;
-		}
-		break;
-
-	case SLT_ReqEnd:
-	{
-		char ttfb[64];
-		if (!lp->active)
+		case F_resphdr:
+			find_hdr(t, SLT_RespHeader, o, &h);
+			fld_cat(os, &h, "-");
+			break;
+		case F_vcllog:
+			find_hdr(t, SLT_VCL_Log, o, &h);
+			fld_cat(os, &h, "-");
 			break;
-		if (lp->df_ttfb != NULL ||
-		    sscanf(ptr, "%*u %*u.%*u %ld.%*u %*u.%*u %s", &l, ttfb)
-		    != 2) {
-			clean_logline(lp);
+		case F_ttfb:
+			fld_cat(os, &lp->df_ttfb, "");
 			break;
+		case F_hitmiss:
+			VSB_cat(os, (lp->df_hitmiss ? lp->df_hitmiss : "-"));
+			break;
+		case F_handling:
+			VSB_cat(os, (lp->df_handling ? lp->df_handling : "-"));
+			break;
+		default:
+			WRONG("fmt_op");
 		}
-		if (lp->df_ttfb != NULL)
-			free(lp->df_ttfb);
-		lp->df_ttfb = strdup(ttfb);
-		t = l;
-		localtime_r(&t, &lp->df_t);
-		/* got it all */
-		lp->complete = 1;
-		break;
-	}
-
-	default:
-		break;
 	}
-
-	return (1);
+	VSB_putc(os, '\n');
+	AZ(VSB_finish(os));
+	return (0);
 }
 
-static int
-h_ncsa(void *priv, enum VSL_tag_e tag, unsigned fd,
-    unsigned len, unsigned spec, const char *ptr, uint64_t bitmap)
-{
-	struct logline *lp;
-	FILE *fo = priv;
-	char *q, tbuf[64];
-	const char *p;
-	struct vsb *os;
-
-	if (fd >= nll) {
-		struct logline **newll = ll;
-		size_t newnll = nll;
-
-		while (fd >= newnll)
-			newnll += newnll + 1;
-		newll = realloc(newll, newnll * sizeof *newll);
-		assert(newll != NULL);
-		memset(newll + nll, 0, (newnll - nll) * sizeof *newll);
-		ll = newll;
-		nll = newnll;
-	}
-	if (ll[fd] == NULL) {
-		ll[fd] = calloc(sizeof *ll[fd], 1);
-		assert(ll[fd] != NULL);
-	}
-	lp = ll[fd];
-
-	if (spec & VSL_S_BACKEND) {
-		collect_backend(lp, tag, spec, ptr, len);
-	} else if (spec & VSL_S_CLIENT) {
-		collect_client(lp, tag, spec, ptr, len);
-	} else {
-		/* huh? */
-		return (reopen);
-	}
+/*--------------------------------------------------------------------
+ * With -j, the lines are formatted by worker threads and written by a
+ * writer thread.  The reader keeps each transaction with VSL_TxKeep()
+ * and puts it in the next slot of a ring, the records are not copied.
+ * Slots are formatted in any order but written in ring order, so the
+ * lines come out in the order of the log.  The reader releases the
+ * transaction of a slot when it reuses it, because only the reader
+ * may call into libvarnishapi.
+ */
 
-	lp->bitmap |= bitmap;
+#define NSLOT		1024
+
+struct slot {
+	unsigned			state;
+#define SLOT_FREE			0
+#define SLOT_READY			1
+#define SLOT_BUSY			2
+#define SLOT_DONE			3
+	const struct VSL_transaction	*t;
+	struct logline			ll;
+	struct vsb			*vsb;
+};
 
-	if (!lp->complete)
-		return (reopen);
+static unsigned			j_arg;
+static struct slot		*slots;
+static unsigned			s_read, s_fmt, s_write;
+static pthread_mutex_t		mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t		c_free = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t		c_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t		c_done = PTHREAD_COND_INITIALIZER;
 
-	if (m_flag && !VSL_Matched(vd, lp->bitmap))
-		/* -o is in effect matching rule failed. Don't display */
-		return (reopen);
+static void
+ncsa_write(FILE *fo, struct vsb *os, int flush)
+{
 
-#if 0
-	/* non-optional fields */
-	if (!lp->df_m || !lp->df_U || !lp->df_H || !lp->df_s) {
-		clean_logline(lp);
-		return (reopen);
+	if (VSB_len(os) > 0)
+		(void)fwrite(VSB_data(os), VSB_len(os), 1, fo);
+	if (flush && fflush(fo) != 0) {
+		perror(w_arg);
+		exit(1);
 	}
-#endif
-
-	/* We have a complete data set - log a line */
-
-	fo = priv;
-	os = VSB_new_auto();
+}
 
-	for (p = format; *p != '\0'; p++) {
+static void *
+ncsa_worker(void *priv)
+{
+	struct slot *sl;
 
-		/* allow the most essential escape sequences in format. */
-		if (*p == '\\') {
-			p++;
-			if (*p == 't') VSB_putc(os, '\t');
-			if (*p == 'n') VSB_putc(os, '\n');
+	(void)priv;
+	AZ(pthread_mutex_lock(&mtx));
+	while (1) {
+		if (s_fmt == s_read) {
+			AZ(pthread_cond_wait(&c_ready, &mtx));
 			continue;
 		}
+		sl = &slots[s_fmt++ % NSLOT];
+		assert(sl->state == SLOT_READY);
+		sl->state = SLOT_BUSY;
+		AZ(pthread_mutex_unlock(&mtx));
+		(void)fmt_line(&sl->ll, sl->vsb, sl->t);
+		AZ(pthread_mutex_lock(&mtx));
+		sl->state = SLOT_DONE;
+		AZ(pthread_cond_signal(&c_done));
+	}
+	return (NULL);
+}
 
-		if (*p != '%') {
-			VSB_putc(os, *p);
+static void *
+ncsa_writer(void *priv)
+{
+	struct slot *sl;
+	FILE *fo;
+	int flush;
+
+	(void)priv;
+	AZ(pthread_mutex_lock(&mtx));
+	while (1) {
+		sl = &slots[s_write % NSLOT];
+		if (sl->state != SLOT_DONE) {
+			AZ(pthread_cond_wait(&c_done, &mtx));
 			continue;
 		}
-		p++;
-		switch (*p) {
-
-		case 'b':
-			/* %b */
-			VSB_cat(os, lp->df_b ? lp->df_b : "-");
-			break;
-
-		case 'H':
-			VSB_cat(os, lp->df_H ? lp->df_H : "HTTP/1.0");
-			break;
-
-		case 'h':
-			if (!lp->df_h && spec & VSL_S_BACKEND)
-				VSB_cat(os, "127.0.0.1");
-			else
-				VSB_cat(os, lp->df_h ? lp->df_h : "-");
-			break;
-		case 'l':
-			VSB_putc(os, '-');
-			break;
-
-		case 'm':
-			VSB_cat(os, lp->df_m ? lp->df_m : "-");
-			break;
+		fo = of;
+		flush = slots[(s_write + 1) % NSLOT].state != SLOT_DONE;
+		AZ(pthread_mutex_unlock(&mtx));
+		ncsa_write(fo, sl->vsb, flush);
+		AZ(pthread_mutex_lock(&mtx));
+		sl->state = SLOT_FREE;
+		s_write++;
+		AZ(pthread_cond_broadcast(&c_free));
+	}
+	return (NULL);
+}
 
-		case 'q':
-			VSB_cat(os, lp->df_q ? lp->df_q : "");
-			break;
+static void
+ncsa_start(void)
+{
+	pthread_t thr;
+	unsigned u;
+
+	slots = calloc(NSLOT, sizeof *slots);
+	AN(slots);
+	for (u = 0; u < NSLOT; u++) {
+		slots[u].vsb = VSB_new_auto();
+		AN(slots[u].vsb);
+	}
+	for (u = 0; u < j_arg; u++) {
+		AZ(pthread_create(&thr, NULL, ncsa_worker, NULL));
+		AZ(pthread_detach(thr));
+	}
+	AZ(pthread_create(&thr, NULL, ncsa_writer, NULL));
+	AZ(pthread_detach(thr));
+}
 
-		case 'r':
-			/*
-			 * Fake "%r".  This would be a lot easier if Varnish
-			 * normalized the request URL.
-			 */
-			VSB_cat(os, lp->df_m ? lp->df_m : "-");
-			VSB_putc(os, ' ');
-			if (req_header(lp, "Host")) {
-				if (strncmp(req_header(lp, "Host"),
-				    "http://", 7) != 0)
-					VSB_cat(os, "http://");
-				VSB_cat(os, req_header(lp, "Host"));
-			} else {
-				VSB_cat(os, "http://localhost");
-			}
-			VSB_cat(os, lp->df_U ? lp->df_U : "-");
-			VSB_cat(os, lp->df_q ? lp->df_q : "");
-			VSB_putc(os, ' ');
-			VSB_cat(os, lp->df_H ? lp->df_H : "HTTP/1.0");
-			break;
+/* Wait for all queued lines to be written */
 
-		case 's':
-			/* %s */
-			VSB_cat(os, lp->df_s ? lp->df_s : "");
-			break;
+static void
+ncsa_drain(void)
+{
 
-		case 't':
-			/* %t */
-			strftime(tbuf, sizeof tbuf,
-			    "[%d/%b/%Y:%T %z]", &lp->df_t);
-			VSB_cat(os, tbuf);
-			break;
+	if (j_arg == 0)
+		return;
+	AZ(pthread_mutex_lock(&mtx));
+	while (s_write != s_read)
+		AZ(pthread_cond_wait(&c_free, &mtx));
+	AZ(pthread_mutex_unlock(&mtx));
+}
 
-		case 'U':
-			VSB_cat(os, lp->df_U ? lp->df_U : "-");
-			break;
+static void
+ncsa_queue(const struct VSL_transaction *t)
+{
+	struct slot *sl;
+
+	AZ(pthread_mutex_lock(&mtx));
+	sl = &slots[s_read % NSLOT];
+	while (sl->state != SLOT_FREE)
+		AZ(pthread_cond_wait(&c_free, &mtx));
+	AZ(pthread_mutex_unlock(&mtx));
+
+	if (sl->t != NULL)
+		VSL_TxRelease(vd, sl->t);
+	VSL_TxKeep(vd, t);
+	sl->t = t;
+
+	AZ(pthread_mutex_lock(&mtx));
+	sl->state = SLOT_READY;
+	s_read++;
+	AZ(pthread_cond_signal(&c_ready));
+	AZ(pthread_mutex_unlock(&mtx));
+}
 
-		case 'u':
-			/* %u: decode authorization string */
-			if (lp->df_u != NULL) {
-				char *rubuf;
-				size_t rulen;
+static int
+h_ncsa(void *priv, const struct VSL_transaction *t)
+{
+	static struct logline ll;
+	static struct vsb *os;
 
-				VB64_init();
-				rulen = ((strlen(lp->df_u) + 3) * 4) / 3;
-				rubuf = malloc(rulen);
-				assert(rubuf != NULL);
-				VB64_decode(rubuf, rulen, lp->df_u);
-				q = strchr(rubuf, ':');
-				if (q != NULL)
-					*q = '\0';
-				VSB_cat(os, rubuf);
-				free(rubuf);
-			} else {
-				VSB_putc(os, '-');
-			}
-			break;
+	(void)priv;
+	if (!t->complete || t->type != VSL_t_req)
+		return (reopen);
 
-		case '{': {
-			const char *h, *tmp;
-			char fname[100], type;
-			tmp = p;
-			type = 0;
-			while (*tmp != '\0' && *tmp != '}')
-				tmp++;
-			if (*tmp == '}') {
-				tmp++;
-				type = *tmp;
-				memcpy(fname, p+1, tmp-p-2);
-				fname[tmp-p-2] = 0;
-			}
+	if (m_flag && !VSL_Matched(vd, t->bitmap))
+		/* -o is in effect matching rule failed. Don't display */
+		return (reopen);
 
-			switch (type) {
-			case 'i':
-				h = req_header(lp, fname);
-				VSB_cat(os, h ? h : "-");
-				p = tmp;
-				break;
-			case 'o':
-				h = resp_header(lp, fname);
-				VSB_cat(os, h ? h : "-");
-				p = tmp;
-				break;
-			case 't':
-				strftime(tbuf, sizeof tbuf, fname, &lp->df_t);
-				VSB_cat(os, tbuf);
-				p = tmp;
-				break;
-			case 'x':
-				if (!strcmp(fname, "Varnish:time_firstbyte")) {
-					VSB_cat(os, lp->df_ttfb);
-					p = tmp;
-					break;
-				} else if (!strcmp(fname, "Varnish:hitmiss")) {
-					VSB_cat(os, (lp->df_hitmiss ?
-					    lp->df_hitmiss : "-"));
-					p = tmp;
-					break;
-				} else if (!strcmp(fname, "Varnish:handling")) {
-					VSB_cat(os, (lp->df_handling ?
-					    lp->df_handling : "-"));
-					p = tmp;
-					break;
-				} else if (!strncmp(fname, "VCL_Log:", 8)) {
-					// support pulling entries logged
-					// with std.log() into output.
-					// Format: %{VCL_Log:keyname}x
-					// Logging: std.log("keyname:value")
-					h = vcl_log(lp, fname+8);
-					VSB_cat(os, h ? h : "-");
-					p = tmp;
-					break;
-				}
-			default:
-				fprintf(stderr,
-				    "Unknown format starting at: %s\n", --p);
-				exit(1);
-			}
-			break;
-		}
-			/* Fall through if we haven't handled something */
-			/* FALLTHROUGH*/
-		default:
-			fprintf(stderr,
-			    "Unknown format starting at: %s\n", --p);
-			exit(1);
-		}
+	if (j_arg > 0) {
+		ncsa_queue(t);
+		return (reopen);
 	}
-	VSB_putc(os, '\n');
-
-	/* flush the stream */
-	VSB_finish(os);
-	fprintf(fo, "%s", VSB_data(os));
-	fflush(fo);
 
-	/* clean up */
-	clean_logline(lp);
-	VSB_delete(os);
+	if (os == NULL) {
+		os = VSB_new_auto();
+		AN(os);
+	}
+	if (!fmt_line(&ll, os, t))
+		ncsa_write(of, os, 0);
 	return (reopen);
 }
 
@@ -837,13 +800,13 @@ sighup(int sig)
 static FILE *
 open_log(const char *ofn, int append)
 {
-	FILE *of;
+	FILE *fo;
 
-	if ((of = fopen(ofn, append ? "a" : "w")) == NULL) {
+	if ((fo = fopen(ofn, append ? "a" : "w")) == NULL) {
 		perror(ofn);
 		exit(1);
 	}
-	return (of);
+	return (fo);
 }
 
 /*--------------------------------------------------------------------*/
@@ -853,7 +816,7 @@ usage(void)
 {
 
 	fprintf(stderr,
-	    "usage: varnishncsa %s [-aDV] [-n varnish_name] "
+	    "usage: varnishncsa %s [-aDV] [-j threads] [-n varnish_name] "
 	    "[-P file] [-w file]\n", VSL_USAGE);
 	exit(1);
 }
@@ -861,17 +824,16 @@ usage(void)
 int
 main(int argc, char *argv[])
 {
-	int c;
-	int a_flag = 0, D_flag = 0, format_flag = 0;
+	int c, i;
+	int a_flag = 0, D_flag = 0, format_flag = 0, r_flag = 0;
 	const char *P_arg = NULL;
-	const char *w_arg = NULL;
+	const char *format;
 	struct vpf_fh *pfh = NULL;
-	FILE *of;
 	format = "%h %l %u %t \"%r\" %s %b \"%{Referer}i\" \"%{User-agent}i\"";
 
 	vd = VSM_New();
 
-	while ((c = getopt(argc, argv, VSL_ARGS "aDP:Vw:fF:")) != -1) {
+	while ((c = getopt(argc, argv, VSL_ARGS "aDj:P:Vw:fF:")) != -1) {
 		switch (c) {
 		case 'a':
 			a_flag = 1;
@@ -898,6 +860,9 @@ main(int argc, char *argv[])
 		case 'D':
 			D_flag = 1;
 			break;
+		case 'j':
+			j_arg = strtoul(optarg, NULL, 0);
+			break;
 		case 'P':
 			P_arg = optarg;
 			break;
@@ -922,6 +887,14 @@ main(int argc, char *argv[])
 		case 'c':
 			/* XXX: Silently ignored: it's required anyway */
 			break;
+		case 'q':
+		case 'r':
+			if (c == 'r')
+				r_flag = 1;
+			if (VSL_Arg(vd, c, optarg) > 0)
+				break;
+			fprintf(stderr, "%s\n", VSM_Error(vd));
+			exit(1);
 		case 'm':
 			m_flag = 1; /* Fall through */
 		default:
@@ -933,7 +906,9 @@ main(int argc, char *argv[])
 
 	VSL_Arg(vd, 'c', optarg);
 
-	if (VSM_Open(vd)) {
+	fmt_compile(format);
+
+	if (!r_flag && VSM_Open(vd)) {
 		fprintf(stderr, "%s\n", VSM_Error(vd));
 		return (-1);
 	}
@@ -961,17 +936,28 @@ main(int argc, char *argv[])
 		of = stdout;
 	}
 
-	while (VSL_Dispatch(vd, h_ncsa, of) >= 0) {
-		if (fflush(of) != 0) {
+	if (j_arg > 0)
+		ncsa_start();
+
+	while ((i = VSL_DispatchTx(vd, h_ncsa, NULL)) >= 0 || i == -3) {
+		if (i == -3)
+			fprintf(stderr, "%s", VSM_Error(vd));
+		if (j_arg == 0 && fflush(of) != 0) {
 			perror(w_arg);
 			exit(1);
 		}
 		if (reopen && of != stdout) {
+			ncsa_drain();
+			AZ(pthread_mutex_lock(&mtx));
 			fclose(of);
 			of = open_log(w_arg, a_flag);
+			AZ(pthread_mutex_unlock(&mtx));
 			reopen = 0;
 		}
+		if (i == 0)
+			(void)usleep(10000);
 	}
 
+	ncsa_drain();
 	exit(0);
 }
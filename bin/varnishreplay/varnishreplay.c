@@ -1,5 +1,5 @@
 /*-
- * Copyright (c) 2010 Varnish Software AS
+ * Copyright (c) 2010-2012 Varnish Software AS
  * All rights reserved.
  *
  * Author: Cecilie Fritzvold <cecilihf@linpro.no>
@@ -24,13 +24,25 @@
  * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
  * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
  * SUCH DAMAGE.
+ *
+ * Replay the client traffic of a log against a varnishd.
+ *
+ * The main thread reads the log a transaction at a time, and schedules
+ * each GET/HEAD request at its original offset from the first request,
+ * divided by the speed factor.  The requests of a client session are
+ * all handed to the same of a fixed number of replay threads, which
+ * run an event loop over their connections.  A request is written
+ * when it is due, also if the previous response on the connection has
+ * not arrived yet, so keep-alive sessions are pipelined.
+ *
+ * When the log ends, or on SIGINT, the achieved rate and the latency
+ * percentiles are reported on stdout.
  */
 
 #include "config.h"
 
 #include <sys/types.h>
 #include <sys/signal.h>
-#include <sys/uio.h>
 
 #include <ctype.h>
 #include <errno.h>
@@ -44,18 +56,27 @@
 #include <string.h>
 #include <unistd.h>
 
+#if defined(HAVE_EPOLL_CTL)
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+
 #include "vdef.h"
+#include "binary_heap.h"
 #include "vapi/vsl.h"
 #include "vapi/vsm.h"
 #include "vas.h"
 #include "vcs.h"
 #include "vqueue.h"
 #include "vss.h"
+#include "vtim.h"
 
 #define freez(x) do { if (x) free(x); x = NULL; } while (0);
 
 static struct vss_addr *addr_info;
 static int debug;
+static volatile sig_atomic_t stop;
 
 static int
 isprefix(const char *str, const char *prefix, const char **next)
@@ -64,6 +85,8 @@ isprefix(const char *str, const char *prefix, const char **next)
 	while (*str && *prefix &&
 	    tolower((int)*str) == tolower((int)*prefix))
 		++str, ++prefix;
+	if (*prefix)
+		return (0);
 	if (*str && *str != ' ')
 		return (0);
 	if (next) {
@@ -74,96 +97,6 @@ isprefix(const char *str, const char *prefix, const char **next)
 	return (1);
 }
 
-#if 0
-static int
-isequal(const char *str, const char *reference, const char *end)
-{
-
-	while (str < end && *str && *reference &&
-	    tolower((int)*str) == tolower((int)*reference))
-		++str, ++reference;
-	if (str != end || *reference)
-		return (0);
-	return (1);
-}
-#endif
-
-/*
- * mailbox toolkit
- */
-
-struct message {
-	enum VSL_tag_e tag;
-	size_t len;
-	char *ptr;
-	VSTAILQ_ENTRY(message) list;
-};
-
-#define MAX_MAILBOX_SIZE 30
-
-struct mailbox {
-	pthread_mutex_t lock;
-	pthread_cond_t has_mail;
-	int open;
-	VSTAILQ_HEAD(msgq_head, message) messages;
-};
-
-static void
-mailbox_create(struct mailbox *mbox)
-{
-
-	VSTAILQ_INIT(&mbox->messages);
-	pthread_mutex_init(&mbox->lock, NULL);
-	pthread_cond_init(&mbox->has_mail, NULL);
-	mbox->open = 1;
-}
-
-static void
-mailbox_destroy(struct mailbox *mbox)
-{
-	struct message *msg;
-
-	while ((msg = VSTAILQ_FIRST(&mbox->messages))) {
-		VSTAILQ_REMOVE_HEAD(&mbox->messages, list);
-		free(msg);
-	}
-	pthread_cond_destroy(&mbox->has_mail);
-	pthread_mutex_destroy(&mbox->lock);
-}
-
-static void
-mailbox_put(struct mailbox *mbox, struct message *msg)
-{
-
-	pthread_mutex_lock(&mbox->lock);
-	VSTAILQ_INSERT_TAIL(&mbox->messages, msg, list);
-	pthread_cond_signal(&mbox->has_mail);
-	pthread_mutex_unlock(&mbox->lock);
-}
-
-static struct message *
-mailbox_get(struct mailbox *mbox)
-{
-	struct message *msg;
-
-	pthread_mutex_lock(&mbox->lock);
-	while ((msg = VSTAILQ_FIRST(&mbox->messages)) == NULL && mbox->open)
-		pthread_cond_wait(&mbox->has_mail, &mbox->lock);
-	if (msg != NULL)
-		VSTAILQ_REMOVE_HEAD(&mbox->messages, list);
-	pthread_mutex_unlock(&mbox->lock);
-	return (msg);
-}
-
-static void
-mailbox_close(struct mailbox *mbox)
-{
-	pthread_mutex_lock(&mbox->lock);
-	mbox->open = 0;
-	pthread_cond_signal(&mbox->has_mail);
-	pthread_mutex_unlock(&mbox->lock);
-}
-
 /*
  * thread toolkit
  */
@@ -192,478 +125,929 @@ thread_log(int lvl, int errcode, const char *fmt, ...)
 	pthread_mutex_unlock(&log_mutex);
 }
 
-struct replay_thread {
-	pthread_t thread_id;
-	struct mailbox mbox;
+/*--------------------------------------------------------------------
+ * A request to replay, or the end of a session (buf == NULL)
+ */
 
-	int sock;
+struct rreq {
+	VTAILQ_ENTRY(rreq)	list;
+	unsigned		sess;
+	unsigned		idx;		/* In pending heap */
+	uint64_t		seq;
+	double			due;
+	double			t_sent;
+	char			*buf;
+	size_t			len;
+	unsigned		head:1;
+	unsigned		close:1;
+};
 
-	int fd;			/* original fd from logs */
+VTAILQ_HEAD(rreq_head, rreq);
 
-	char *method;		/* Request method*/
-	char *proto;		/* Protocol version */
-	char *url;		/* URL and query string */
-	const char *conn;	/* Connection info (keep-alive, close) */
-	char *hdr[64];		/* Headers */
-	int nhdr;		/* Number of headers */
-	int bogus;		/* bogus request */
+/*--------------------------------------------------------------------
+ * A connection replaying a client session
+ */
 
-	char arena[4096];
-	int top;
-	char line[2048];
-	char temp[2048];
+enum rstate {
+	R_HDR,		/* Reading response headers */
+	R_LEN,		/* Content-Length body */
+	R_CHUNK,	/* Chunk size line */
+	R_CHUNKDATA,	/* Chunk data and CRLF */
+	R_TRAILER,	/* Trailer after last chunk */
+	R_EOF,		/* Body until close */
 };
 
-static struct replay_thread **threads;
-static size_t nthreads;
+#define RC_HASH		1024
+#define RC_BUF		65536
+
+struct rconn {
+	VTAILQ_ENTRY(rconn)	list;
+	VTAILQ_ENTRY(rconn)	hlist;
+	unsigned		sess;
+	int			fd;
+	int			ev;
+	struct rreq_head	wait;		/* Due, not yet sent */
+	struct rreq_head	inflight;	/* Sent, awaiting response */
+	unsigned		closing:1;	/* No more on this fd */
+	unsigned		done:1;		/* Session has ended */
+	unsigned		connclose:1;	/* Response said close */
+
+	char			*obuf;
+	size_t			olen, ooff, ospace;
+
+	char			ibuf[RC_BUF];
+	size_t			ilen;
+	enum rstate		state;
+	uint64_t		remain;
+};
 
-/*
- * Clear thread state
+/*--------------------------------------------------------------------
+ * Replay threads
  */
-static void
-thread_clear(struct replay_thread *thr)
-{
-
-	thr->method = thr->proto = thr->url = NULL;
-	thr->conn = NULL;
-	memset(&thr->hdr, 0, sizeof thr->hdr);
-	thr->nhdr = 0;
-	thr->bogus = 0;
-	memset(&thr->arena, 0, sizeof thr->arena);
-	thr->top = 0;
-	memset(&thr->line, 0, sizeof thr->line);
-	memset(&thr->temp, 0, sizeof thr->temp);
-	if (thr->sock != -1)
-		close(thr->sock);
-	thr->sock = -1;
-}
 
-#define THREAD_FAIL ((struct replay_thread *)-1)
+struct rthread {
+	pthread_t		tid;
+	unsigned		idx;
+
+	/* Handed over from the main thread, under mtx */
+	pthread_mutex_t		mtx;
+	struct rreq_head	inbox;
+	int			eof;
+	int			pipe[2];
+
+	struct binheap		*pending;	/* By due time */
+	VTAILQ_HEAD(, rconn)	conns;
+	VTAILQ_HEAD(, rconn)	hash[RC_HASH];
+	unsigned		nconn;
+#if defined(HAVE_EPOLL_CTL)
+	int			epfd;
+#endif
 
-static pthread_attr_t thread_attr;
+	/* Statistics, summed when done */
+	uint64_t		sent;
+	uint64_t		completed;
+	uint64_t		failed;
+	uint64_t		status[6];
+	double			t_first;
+	double			t_last;
+	double			*lat;
+	size_t			nlat, llat;
+};
 
-static struct replay_thread *
-thread_get(int fd, void *(*thread_main)(void *))
-{
+static struct rthread	*rthreads;
+static unsigned		nrthreads = 1;
+static double		speed = 1.0;
 
-	assert(fd != 0);
-	if (fd >= nthreads) {
-		struct replay_thread **newthreads = threads;
-		size_t newnthreads = nthreads;
-
-		while (fd >= newnthreads)
-			newnthreads += newnthreads + 1;
-		newthreads = realloc(newthreads,
-		    newnthreads * sizeof *newthreads);
-		XXXAN(newthreads != NULL);
-		memset(newthreads + nthreads, 0,
-		    (newnthreads - nthreads) * sizeof *newthreads);
-		threads = newthreads;
-		nthreads = newnthreads;
-	}
-	if (threads[fd] == NULL) {
-		threads[fd] = malloc(sizeof *threads[fd]);
-		assert(threads[fd] != NULL);
-		threads[fd]->sock = -1;
-		thread_clear(threads[fd]);
-		mailbox_create(&threads[fd]->mbox);
-		if (pthread_create(&threads[fd]->thread_id, &thread_attr,
-		    thread_main, threads[fd]) != 0) {
-			thread_log(0, errno, "pthread_create()");
-			mailbox_destroy(&threads[fd]->mbox);
-			freez(threads[fd]);
-			threads[fd] = THREAD_FAIL;
-		} else {
-			threads[fd]->fd = fd;
-			thread_log(0, 0, "thread %p:%d started",
-			    (void *)threads[fd]->thread_id, fd);
-		}
-	}
-	if (threads[fd] == THREAD_FAIL)
-		return (NULL);
-	return (threads[fd]);
-}
+/*--------------------------------------------------------------------*/
 
 static void
-thread_close(int fd)
+ev_want(struct rthread *rt, struct rconn *rc)
 {
+	int ev;
+#if defined(HAVE_EPOLL_CTL)
+	struct epoll_event e;
+#endif
 
-	if (fd == -1) {
-		for (fd = 0; fd < nthreads; ++fd)
-			thread_close(fd);
+	if (rc->fd < 0)
 		return;
-	}
+	ev = 1;
+	if (rc->ooff < rc->olen)
+		ev |= 2;
+	if (ev == rc->ev)
+		return;
+#if defined(HAVE_EPOLL_CTL)
+	memset(&e, 0, sizeof e);
+	e.data.ptr = rc;
+	e.events = EPOLLIN | ((ev & 2) ? EPOLLOUT : 0);
+	AZ(epoll_ctl(rt->epfd, rc->ev ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+	    rc->fd, &e));
+#else
+	(void)rt;
+#endif
+	rc->ev = ev;
+}
 
-	assert(fd < nthreads);
+static void
+rc_close(struct rthread *rt, struct rconn *rc)
+{
 
-	if (threads[fd] == NULL)
+	if (rc->fd < 0)
 		return;
-	mailbox_close(&threads[fd]->mbox);
-	pthread_join(threads[fd]->thread_id, NULL);
-	thread_log(0, 0, "thread %p stopped",
-	    (void *)threads[fd]->thread_id);
-	thread_clear(threads[fd]);
-	mailbox_destroy(&threads[fd]->mbox);
-	freez(threads[fd]);
+	thread_log(1, 0, "sess %u close", rc->sess);
+#if defined(HAVE_EPOLL_CTL)
+	(void)epoll_ctl(rt->epfd, EPOLL_CTL_DEL, rc->fd, NULL);
+#else
+	(void)rt;
+#endif
+	AZ(close(rc->fd));
+	rc->fd = -1;
+	rc->ev = 0;
+	rc->olen = rc->ooff = 0;
+	rc->ilen = 0;
+	rc->state = R_HDR;
+	rc->closing = 0;
+	rc->connclose = 0;
 }
 
-/*
- * Allocate from thread arena
- */
-static void *
-thread_alloc(struct replay_thread *thr, size_t len)
+static struct rconn *
+rc_lookup(struct rthread *rt, unsigned sess, int create)
 {
-	void *ptr;
-
-	if (sizeof thr->arena - thr->top < len)
+	struct rconn *rc;
+	unsigned h;
+
+	h = sess % RC_HASH;
+	VTAILQ_FOREACH(rc, &rt->hash[h], hlist)
+		if (rc->sess == sess)
+			return (rc);
+	if (!create)
 		return (NULL);
-	ptr = thr->arena + thr->top;
-	thr->top += len;
-	return (ptr);
+	rc = calloc(sizeof *rc, 1);
+	AN(rc);
+	rc->sess = sess;
+	rc->fd = -1;
+	VTAILQ_INIT(&rc->wait);
+	VTAILQ_INIT(&rc->inflight);
+	VTAILQ_INSERT_TAIL(&rt->hash[h], rc, hlist);
+	VTAILQ_INSERT_TAIL(&rt->conns, rc, list);
+	rt->nconn++;
+	return (rc);
 }
 
-/*
- * Returns a copy of the entire string with leading and trailing spaces
- * trimmed.
- */
-static char *
-trimline(struct replay_thread *thr, const char *str)
+static void
+rc_free(struct rthread *rt, struct rconn *rc)
 {
-	size_t len;
-	char *p;
 
-	/* skip leading space */
-	while (*str && *str == ' ')
-		++str;
+	AN(VTAILQ_EMPTY(&rc->wait));
+	AN(VTAILQ_EMPTY(&rc->inflight));
+	rc_close(rt, rc);
+	VTAILQ_REMOVE(&rt->hash[rc->sess % RC_HASH], rc, hlist);
+	VTAILQ_REMOVE(&rt->conns, rc, list);
+	rt->nconn--;
+	free(rc->obuf);
+	free(rc);
+}
+
+/*--------------------------------------------------------------------*/
 
-	/* seek to end of string */
-	for (len = 0; str[len]; ++len)
-		 /* nothing */ ;
+static void
+rt_fail(struct rthread *rt, struct rconn *rc)
+{
+	struct rreq *rr;
 
-	/* trim trailing space */
-	while (len && str[len - 1] == ' ')
-		--len;
+	while ((rr = VTAILQ_FIRST(&rc->inflight)) != NULL) {
+		VTAILQ_REMOVE(&rc->inflight, rr, list);
+		rt->failed++;
+		free(rr->buf);
+		free(rr);
+	}
+	rc_close(rt, rc);
+}
 
-	/* copy and return */
-	if ((p = thread_alloc(thr, len + 1)) == NULL)
-		return (NULL);
-	memcpy(p, str, len);
-	p[len] = '\0';
-	return (p);
+static void
+rt_done(struct rthread *rt, struct rconn *rc, double now)
+{
+	struct rreq *rr;
+
+	rr = VTAILQ_FIRST(&rc->inflight);
+	AN(rr);
+	VTAILQ_REMOVE(&rc->inflight, rr, list);
+	rt->completed++;
+	rt->t_last = now;
+	if (rt->nlat == rt->llat) {
+		rt->llat = rt->llat ? rt->llat * 2 : 1024;
+		rt->lat = realloc(rt->lat, rt->llat * sizeof *rt->lat);
+		AN(rt->lat);
+	}
+	rt->lat[rt->nlat++] = now - rr->t_sent;
+	free(rr->buf);
+	free(rr);
+	rc->state = R_HDR;
+	if (rc->connclose)
+		rc->closing = 1;
 }
 
-/* Read a line from the socket and return the number of bytes read.
- * After returning, line will point to the read bytes in memory.
- * A line is terminated by \r\n
+/*
+ * Write out what is due on the connection, opening it if need be.
+ * Requests are sent back to back, until one which closes.
  */
-static int
-read_line(struct replay_thread *thr)
+static void
+rc_kick(struct rthread *rt, struct rconn *rc, double now)
 {
-	int i, len;
-
-	len = 0;
-	while (1) {
-		if (len + 2 > sizeof thr->line) {
-			thread_log(0, 0, "overflow");
-			return (-1);
+	struct rreq *rr;
+	ssize_t i;
+
+	if (rc->closing && VTAILQ_EMPTY(&rc->inflight))
+		rc_close(rt, rc);
+	if (rc->fd < 0 && !VTAILQ_EMPTY(&rc->wait)) {
+		rc->fd = VSS_connect(addr_info, 1);
+		if (rc->fd < 0) {
+			thread_log(0, errno, "connect failed");
+			while ((rr = VTAILQ_FIRST(&rc->wait)) != NULL) {
+				VTAILQ_REMOVE(&rc->wait, rr, list);
+				rt->failed++;
+				free(rr->buf);
+				free(rr);
+			}
+			return;
 		}
-		i = read(thr->sock, thr->line + len, 1);
-		if (i < 0) {
-			thread_log(0, errno, "read(%d, %p, %d)",
-			    thr->sock, thr->line + len, 1);
-			return (-1);
+		thread_log(1, 0, "sess %u connect", rc->sess);
+	}
+	while (!rc->closing && (rr = VTAILQ_FIRST(&rc->wait)) != NULL) {
+		VTAILQ_REMOVE(&rc->wait, rr, list);
+		if (rc->olen + rr->len > rc->ospace) {
+			if (rc->ooff > 0) {
+				memmove(rc->obuf, rc->obuf + rc->ooff,
+				    rc->olen - rc->ooff);
+				rc->olen -= rc->ooff;
+				rc->ooff = 0;
+			}
+			while (rc->olen + rr->len > rc->ospace)
+				rc->ospace = rc->ospace ? rc->ospace * 2 : 4096;
+			rc->obuf = realloc(rc->obuf, rc->ospace);
+			AN(rc->obuf);
 		}
-		if (i == 0)
-			break;
-		len += i;
-		if (len >= 2 && thr->line[len - 2] == '\r' &&
-		    thr->line[len - 1] == '\n') {
-			len -= 2;
-			break;
+		memcpy(rc->obuf + rc->olen, rr->buf, rr->len);
+		rc->olen += rr->len;
+		rr->t_sent = now;
+		if (rt->sent++ == 0)
+			rt->t_first = now;
+		if (rr->close)
+			rc->closing = 1;
+		VTAILQ_INSERT_TAIL(&rc->inflight, rr, list);
+	}
+	if (rc->fd >= 0 && rc->ooff < rc->olen) {
+		i = write(rc->fd, rc->obuf + rc->ooff, rc->olen - rc->ooff);
+		if (i < 0 && errno != EAGAIN && errno != EINTR &&
+		    errno != ENOTCONN) {
+			thread_log(0, errno, "write()");
+			rt_fail(rt, rc);
+			return;
 		}
+		if (i > 0)
+			rc->ooff += i;
+		if (rc->ooff == rc->olen)
+			rc->ooff = rc->olen = 0;
 	}
-	thr->line[len] = '\0';
-	return (len);
+	ev_want(rt, rc);
 }
 
-/* Read a block of data from the socket, and do nothing with it.
- * length says how many bytes to read, and the function returns
- * the number of bytes read.
+/*
+ * Parse as much of the buffered response data as we can
  */
-static int
-read_block(struct replay_thread *thr, int len)
+static void
+rc_parse(struct rthread *rt, struct rconn *rc, double now)
 {
-	int n, r, tot;
-
-	for (tot = 0; tot < len; tot += r) {
-		n = len - tot;
-		if (n > sizeof thr->temp)
-			n = sizeof thr->temp;
-		r = read(thr->sock, thr->temp, n);
-		if (r < 0) {
-			thread_log(0, errno, "read(%d, %p, %d)",
-			    thr->sock, thr->temp, n);
-			return (-1);
+	char *b, *e, *p, *q, *next;
+	const char *v;
+	struct rreq *rr;
+	int status, chunked, nobody;
+	uint64_t cl, n;
+
+	b = rc->ibuf;
+	e = rc->ibuf + rc->ilen;
+	while (b < e) {
+		rr = VTAILQ_FIRST(&rc->inflight);
+		if (rr == NULL) {
+			thread_log(0, 0, "sess %u unexpected data", rc->sess);
+			b = e;
+			break;
 		}
-		if (r == 0)
+		switch (rc->state) {
+		case R_HDR:
+			for (p = b; p + 3 < e; p++)
+				if (!memcmp(p, "\r\n\r\n", 4))
+					break;
+			if (p + 3 >= e)
+				goto out;
+			*p = '\0';
+			next = p + 4;
+			status = 0;
+			chunked = 0;
+			cl = 0;
+			nobody = rr->head;
+			rc->state = R_EOF;
+			for (p = b; p != NULL && *p != '\0'; p = q) {
+				q = strstr(p, "\r\n");
+				if (q != NULL) {
+					*q = '\0';
+					q += 2;
+				}
+				thread_log(2, 0, "< %s", p);
+				if (p == b) {
+					if (sscanf(p, "HTTP/%*u.%*u %d", &status)
+					    != 1)
+						status = 0;
+					if (!strncmp(p, "HTTP/1.0", 8))
+						rc->connclose = 1;
+				} else if (isprefix(p, "content-length:", &v)) {
+					cl = strtoull(v, NULL, 10);
+					rc->state = R_LEN;
+				} else if (isprefix(p, "transfer-encoding:",
+				    &v)) {
+					chunked = !strcasecmp(v, "chunked");
+				} else if (isprefix(p, "connection:", &v)) {
+					if (!strcasecmp(v, "close"))
+						rc->connclose = 1;
+					else if (!strcasecmp(v, "keep-alive"))
+						rc->connclose = 0;
+				}
+			}
+			rt->status[status >= 100 && status < 600 ?
+			    status / 100 : 0]++;
+			if (status < 200 || status == 204 || status == 304)
+				nobody = 1;
+			b = next;
+			if (nobody || (rc->state == R_LEN && cl == 0)) {
+				rt_done(rt, rc, now);
+			} else if (chunked) {
+				rc->state = R_CHUNK;
+			} else if (rc->state == R_LEN) {
+				rc->remain = cl;
+			} else {
+				rc->connclose = 1;
+			}
+			break;
+		case R_LEN:
+		case R_CHUNKDATA:
+			n = e - b;
+			if (n > rc->remain)
+				n = rc->remain;
+			b += n;
+			rc->remain -= n;
+			if (rc->remain > 0)
+				break;
+			if (rc->state == R_LEN)
+				rt_done(rt, rc, now);
+			else
+				rc->state = R_CHUNK;
+			break;
+		case R_CHUNK:
+			for (p = b; p + 1 < e; p++)
+				if (p[0] == '\r' && p[1] == '\n')
+					break;
+			if (p + 1 >= e)
+				goto out;
+			n = strtoull(b, NULL, 16);
+			b = p + 2;
+			if (n == 0) {
+				rc->state = R_TRAILER;
+			} else {
+				rc->state = R_CHUNKDATA;
+				rc->remain = n + 2;
+			}
+			break;
+		case R_TRAILER:
+			for (p = b; p + 1 < e; p++)
+				if (p[0] == '\r' && p[1] == '\n')
+					break;
+			if (p + 1 >= e)
+				goto out;
+			if (p == b)
+				rt_done(rt, rc, now);
+			b = p + 2;
 			break;
+		case R_EOF:
+			b = e;
+			break;
+		default:
+			WRONG("Wrong response state");
+		}
+	}
+out:
+	if (b > rc->ibuf) {
+		rc->ilen = e - b;
+		memmove(rc->ibuf, b, rc->ilen);
+	}
+	if (rc->ilen == sizeof rc->ibuf) {
+		thread_log(0, 0, "sess %u response header overflow", rc->sess);
+		rt_fail(rt, rc);
 	}
-	return (tot);
 }
 
-/* Receive the response after sending a request.
- */
-static int
-receive_response(struct replay_thread *thr)
+static void
+rc_read(struct rthread *rt, struct rconn *rc, double now)
 {
-	const char *next;
-	int line_len;
-	long chunk_length, content_length;
-	int chunked, connclose, failed;
-	int n, status;
-
-	content_length = 0;
-	chunked = connclose = failed = 0;
-
-	/* Read header */
-	for (;;) {
-		line_len = read_line(thr);
-		if (line_len < 0)
-			return (-1);
-		thread_log(2, 0, "< %.*s", line_len, thr->line);
-		if (line_len == 0)
-			break;
-		if (strncmp(thr->line, "HTTP", 4) == 0) {
-			sscanf(thr->line, "%*s %d %*s\r\n", &status);
-			failed = (status != 200);
-		} else if (isprefix(thr->line, "content-length:", &next)) {
-			content_length = strtol(next, NULL, 10);
-		} else if (isprefix(thr->line, "transfer-encoding:", &next)) {
-			chunked = (strcasecmp(next, "chunked") == 0);
-		} else if (isprefix(thr->line, "connection:", &next)) {
-			connclose = (strcasecmp(next, "close") == 0);
-		}
-	}
+	struct rreq *rr;
+	ssize_t i;
 
-	thread_log(1, 0, "status: %d", status);
-
-	/* Read body */
-	if (chunked) {
-		/* Chunked encoding, read size and bytes until no more */
-		thread_log(1, 0, "chunked encoding");
-		for (;;) {
-			line_len = read_line(thr);
-			if (line_len < 0)
-				return (-1);
-			/* read_line() guarantees null-termination */
-			chunk_length = strtol(thr->line, NULL, 16);
-			if (chunk_length == 0)
-				break;
-			if ((n = read_block(thr, chunk_length)) < 0)
-				return (-1);
-			if (n < chunk_length)
-				thread_log(0, 0, "short read: %d/%ld",
-				    n, chunk_length);
-			thread_log(1, 0, "chunk length: %ld", chunk_length);
-			thread_log(1, 0, "bytes read: %d", n);
-			/* trailing CR LF */
-			if ((n = read_line(thr)) < 0)
-				return (-1);
-		}
-		/* trailing CR LF */
-		n = read_line(thr);
-		if (n < 0)
-			return (-1);
-	} else if (content_length > 0) {
-		/* Fixed body size, read content_length bytes */
-		thread_log(1, 0, "fixed length");
-		thread_log(1, 0, "content length: %ld", content_length);
-		if ((n = read_block(thr, content_length)) < 0)
-			return (1);
-		if (n < content_length)
-			thread_log(0, 0, "short read: %d/%ld",
-			    n, content_length);
-		thread_log(1, 0, "bytes read: %d", n);
+	i = read(rc->fd, rc->ibuf + rc->ilen, sizeof rc->ibuf - rc->ilen);
+	if (i < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (i <= 0) {
+		if (rc->state == R_EOF && !VTAILQ_EMPTY(&rc->inflight))
+			rt_done(rt, rc, now);
+		if (i < 0)
+			thread_log(0, errno, "read()");
+		if (rc->connclose) {
+			/* As announced, resend the pipelined requests */
+			while ((rr = VTAILQ_LAST(&rc->inflight, rreq_head))) {
+				VTAILQ_REMOVE(&rc->inflight, rr, list);
+				VTAILQ_INSERT_HEAD(&rc->wait, rr, list);
+				rt->sent--;
+			}
+		} else if (!VTAILQ_EMPTY(&rc->inflight))
+			thread_log(0, 0, "sess %u closed early", rc->sess);
+		rt_fail(rt, rc);
 	} else {
-		/* No body --> stop reading. */
-		thread_log(1, 0, "no body");
-		return (-1);
+		rc->ilen += i;
+		rc_parse(rt, rc, now);
 	}
-
-	return (connclose);
+	rc_kick(rt, rc, now);
 }
 
-static void *
-replay_thread(void *arg)
+/*--------------------------------------------------------------------*/
+
+static void
+rc_reap(struct rthread *rt, struct rconn *rc)
 {
-	struct iovec iov[6];
-	char space[1] = " ", crlf[2] = "\r\n";
-	struct replay_thread *thr = arg;
-	struct message *msg;
-	enum VSL_tag_e tag;
-	char *ptr;
-	const char *next;
 
-	int i;
+	if (rc->done && VTAILQ_EMPTY(&rc->wait) &&
+	    VTAILQ_EMPTY(&rc->inflight))
+		rc_free(rt, rc);
+}
 
-	int reopen = 1;
+static void
+rt_due(struct rthread *rt, struct rreq *rr, double now)
+{
+	struct rconn *rc;
+
+	if (rr->buf == NULL) {
+		/* End of session */
+		rc = rc_lookup(rt, rr->sess, 0);
+		free(rr);
+		if (rc != NULL) {
+			rc->done = 1;
+			rc_reap(rt, rc);
+		}
+		return;
+	}
+	rc = rc_lookup(rt, rr->sess, 1);
+	VTAILQ_INSERT_TAIL(&rc->wait, rr, list);
+	rc_kick(rt, rc, now);
+}
 
-	while ((msg = mailbox_get(&thr->mbox)) != NULL) {
-		tag = msg->tag;
-		ptr = msg->ptr;
+static int
+rr_cmp(void *priv, void *a, void *b)
+{
+	const struct rreq *ra = a, *rb = b;
 
-		thread_log(2, 0, "%s(%s)", VSL_tags[tag], msg->ptr);
+	(void)priv;
+	if (ra->due != rb->due)
+		return (ra->due < rb->due);
+	return (ra->seq < rb->seq);
+}
 
-		switch (tag) {
-		case SLT_ReqRequest:
-			if (thr->method != NULL)
-				thr->bogus = 1;
-			else
-				thr->method = trimline(thr, ptr);
-			break;
+static void
+rr_update(void *priv, void *a, unsigned u)
+{
+	struct rreq *rr = a;
 
-		case SLT_ReqURL:
-			if (thr->url != NULL)
-				thr->bogus = 1;
-			else
-				thr->url = trimline(thr, ptr);
-			break;
+	(void)priv;
+	rr->idx = u;
+}
 
-		case SLT_ReqProtocol:
-			if (thr->proto != NULL)
-				thr->bogus = 1;
-			else
-				thr->proto = trimline(thr, ptr);
-			break;
+static int
+rt_busy(const struct rthread *rt)
+{
+	const struct rconn *rc;
 
-		case SLT_ReqHeader:
-			if (thr->nhdr >= sizeof thr->hdr / sizeof *thr->hdr) {
-				thr->bogus = 1;
-			} else {
-				thr->hdr[thr->nhdr++] = trimline(thr, ptr);
-				if (isprefix(ptr, "connection:", &next))
-					thr->conn = trimline(thr, next);
-			}
-			break;
+	VTAILQ_FOREACH(rc, &rt->conns, list)
+		if (!VTAILQ_EMPTY(&rc->wait) || !VTAILQ_EMPTY(&rc->inflight))
+			return (1);
+	return (0);
+}
 
-		default:
-			break;
-		}
+static void *
+replay_thread(void *arg)
+{
+	struct rthread *rt = arg;
+	struct rreq *rr, *rr2;
+	struct rconn *rc, *rc2;
+	struct rreq_head inbox;
+	double now, tmo;
+	int eof, i, n;
+	char c[64];
+#if defined(HAVE_EPOLL_CTL)
+	struct epoll_event ev[64];
+#else
+	struct pollfd *pfd = NULL;
+	struct rconn **prc = NULL;
+	unsigned lpfd = 0;
+#endif
 
-		freez(msg->ptr);
-		freez(msg);
-
-		if (tag != SLT_ReqEnd)
-			continue;
-
-		if (!thr->method || !thr->url || !thr->proto) {
-			thr->bogus = 1;
-		} else if (strcmp(thr->method, "GET") != 0 &&
-		    strcmp(thr->method, "HEAD") != 0) {
-			thr->bogus = 1;
-		} else if (strcmp(thr->proto, "HTTP/1.0") == 0) {
-			reopen = !(thr->conn &&
-			    strcasecmp(thr->conn, "keep-alive") == 0);
-		} else if (strcmp(thr->proto, "HTTP/1.1") == 0) {
-			reopen = (thr->conn &&
-			    strcasecmp(thr->conn, "close") == 0);
-		} else {
-			thr->bogus = 1;
+	eof = 0;
+	VTAILQ_INIT(&inbox);
+	while (!stop) {
+		AZ(pthread_mutex_lock(&rt->mtx));
+		VTAILQ_CONCAT(&inbox, &rt->inbox, list);
+		eof = rt->eof;
+		AZ(pthread_mutex_unlock(&rt->mtx));
+		VTAILQ_FOREACH_SAFE(rr, &inbox, list, rr2) {
+			VTAILQ_REMOVE(&inbox, rr, list);
+			binheap_insert(rt->pending, rr);
 		}
 
-		if (thr->bogus) {
-			thread_log(1, 0, "bogus");
-			goto clear;
+		now = VTIM_mono();
+		while ((rr = binheap_root(rt->pending)) != NULL &&
+		    rr->due <= now) {
+			binheap_delete(rt->pending, rr->idx);
+			rt_due(rt, rr, now);
 		}
+		if (eof && rr == NULL && !rt_busy(rt))
+			break;
 
-		if (thr->sock == -1) {
-			for (;;) {
-				thread_log(1, 0, "sleeping before connect...");
-				usleep(1000 * (thr->fd % 3001));
-				thr->sock = VSS_connect(addr_info, 0);
-				if (thr->sock >= 0)
-					break;
-				thread_log(0, errno, "connect failed");
+		tmo = 1.0;
+		if (rr != NULL && rr->due - now < tmo)
+			tmo = rr->due - now;
+#if defined(HAVE_EPOLL_CTL)
+		n = epoll_wait(rt->epfd, ev, 64, (int)(tmo * 1e3) + 1);
+		now = VTIM_mono();
+		for (i = 0; i < n; i++) {
+			rc = ev[i].data.ptr;
+			if (rc == NULL) {
+				(void)read(rt->pipe[0], c, sizeof c);
+				continue;
 			}
+			if (ev[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+				rc_read(rt, rc, now);
+			if (rc->fd >= 0 && (ev[i].events & EPOLLOUT))
+				rc_kick(rt, rc, now);
+			rc_reap(rt, rc);
 		}
-
-		thread_log(1, 0, "%s %s %s", thr->method, thr->url, thr->proto);
-
-		iov[0].iov_base = thr->method;
-		iov[0].iov_len = strlen(thr->method);
-		iov[2].iov_base = thr->url;
-		iov[2].iov_len = strlen(thr->url);
-		iov[4].iov_base = thr->proto;
-		iov[4].iov_len = strlen(thr->proto);
-		iov[1].iov_base = iov[3].iov_base = space;
-		iov[1].iov_len = iov[3].iov_len = 1;
-		iov[5].iov_base = crlf;
-		iov[5].iov_len = 2;
-		if (writev(thr->sock, iov, 6) == -1) {
-			thread_log(0, errno, "writev()");
-			goto close;
+#else
+		if (lpfd < rt->nconn + 1) {
+			lpfd = rt->nconn + 64;
+			pfd = realloc(pfd, lpfd * sizeof *pfd);
+			prc = realloc(prc, lpfd * sizeof *prc);
+			AN(pfd);
+			AN(prc);
 		}
-
-		for (i = 0; i < thr->nhdr; ++i) {
-			thread_log(2, 0, "%d %s", i, thr->hdr[i]);
-			iov[0].iov_base = thr->hdr[i];
-			iov[0].iov_len = strlen(thr->hdr[i]);
-			iov[1].iov_base = crlf;
-			iov[1].iov_len = 2;
-			if (writev(thr->sock, iov, 2) == -1) {
-				thread_log(0, errno, "writev()");
-				goto close;
-			}
+		pfd[0].fd = rt->pipe[0];
+		pfd[0].events = POLLIN;
+		n = 1;
+		VTAILQ_FOREACH(rc, &rt->conns, list) {
+			if (rc->fd < 0)
+				continue;
+			pfd[n].fd = rc->fd;
+			pfd[n].events = POLLIN |
+			    (rc->ooff < rc->olen ? POLLOUT : 0);
+			prc[n++] = rc;
 		}
-		if (write(thr->sock, crlf, 2) == -1) {
-			thread_log(0, errno, "writev()");
-			goto close;
+		i = poll(pfd, n, (int)(tmo * 1e3) + 1);
+		now = VTIM_mono();
+		if (i > 0 && pfd[0].revents)
+			(void)read(rt->pipe[0], c, sizeof c);
+		for (i = 1; i < n; i++) {
+			rc = prc[i];
+			if (pfd[i].revents & (POLLIN | POLLERR | POLLHUP))
+				rc_read(rt, rc, now);
+			if (rc->fd >= 0 && (pfd[i].revents & POLLOUT))
+				rc_kick(rt, rc, now);
+			rc_reap(rt, rc);
 		}
-		if (receive_response(thr) || reopen) {
-close:
-			thread_log(1, 0, "close");
-			assert(thr->sock != -1);
-			close(thr->sock);
-			thr->sock = -1;
+#endif
+	}
+
+	/* Whatever is left over was not replayed */
+	while ((rr = binheap_root(rt->pending)) != NULL) {
+		binheap_delete(rt->pending, rr->idx);
+		free(rr->buf);
+		free(rr);
+	}
+	VTAILQ_FOREACH_SAFE(rc, &rt->conns, list, rc2) {
+		rt_fail(rt, rc);
+		while ((rr = VTAILQ_FIRST(&rc->wait)) != NULL) {
+			VTAILQ_REMOVE(&rc->wait, rr, list);
+			free(rr->buf);
+			free(rr);
 		}
+		rc_free(rt, rc);
+	}
+	return (NULL);
+}
+
+static void
+rt_start(void)
+{
+	struct rthread *rt;
+	unsigned u, h;
+#if defined(HAVE_EPOLL_CTL)
+	struct epoll_event e;
+#endif
 
-		sleep(1);
-clear:
-		/* clean up */
-		thread_clear(thr);
+	rthreads = calloc(sizeof *rthreads, nrthreads);
+	AN(rthreads);
+	for (u = 0; u < nrthreads; u++) {
+		rt = &rthreads[u];
+		rt->idx = u;
+		AZ(pthread_mutex_init(&rt->mtx, NULL));
+		VTAILQ_INIT(&rt->inbox);
+		rt->pending = binheap_new(NULL, rr_cmp, rr_update);
+		AN(rt->pending);
+		VTAILQ_INIT(&rt->conns);
+		for (h = 0; h < RC_HASH; h++)
+			VTAILQ_INIT(&rt->hash[h]);
+		AZ(pipe(rt->pipe));
+		(void)fcntl(rt->pipe[0], F_SETFL, O_NONBLOCK);
+		(void)fcntl(rt->pipe[1], F_SETFL, O_NONBLOCK);
+#if defined(HAVE_EPOLL_CTL)
+		rt->epfd = epoll_create(1);
+		assert(rt->epfd >= 0);
+		memset(&e, 0, sizeof e);
+		e.events = EPOLLIN;
+		e.data.ptr = NULL;
+		AZ(epoll_ctl(rt->epfd, EPOLL_CTL_ADD, rt->pipe[0], &e));
+#endif
+		AZ(pthread_create(&rt->tid, NULL, replay_thread, rt));
 	}
+}
+
+static void
+rt_put(struct rreq *rr)
+{
+	struct rthread *rt;
+	int wake;
+
+	rt = &rthreads[rr->sess % nrthreads];
+	AZ(pthread_mutex_lock(&rt->mtx));
+	wake = VTAILQ_EMPTY(&rt->inbox);
+	VTAILQ_INSERT_TAIL(&rt->inbox, rr, list);
+	AZ(pthread_mutex_unlock(&rt->mtx));
+	if (wake)
+		(void)write(rt->pipe[1], "", 1);
+}
 
-	/* leftovers */
-	thread_clear(thr);
+/*--------------------------------------------------------------------*/
 
-	return (0);
+static int
+cmp_double(const void *a, const void *b)
+{
+	const double *da = a, *db = b;
+
+	return (*da < *db ? -1 : *da > *db);
+}
+
+static void
+rt_report(void)
+{
+	struct rthread *rt;
+	unsigned u;
+	uint64_t sent = 0, completed = 0, failed = 0, status[6];
+	double t_first = 0, t_last = 0, dt, *lat;
+	size_t nlat = 0, l;
+	static const double pct[] = { .5, .9, .99, .999 };
+
+	memset(status, 0, sizeof status);
+	for (u = 0; u < nrthreads; u++) {
+		rt = &rthreads[u];
+		AZ(pthread_join(rt->tid, NULL));
+		sent += rt->sent;
+		completed += rt->completed;
+		failed += rt->failed;
+		for (l = 0; l < 6; l++)
+			status[l] += rt->status[l];
+		if (rt->sent > 0 && (t_first == 0 || rt->t_first < t_first))
+			t_first = rt->t_first;
+		if (rt->t_last > t_last)
+			t_last = rt->t_last;
+		nlat += rt->nlat;
+	}
+	lat = malloc((nlat + 1) * sizeof *lat);
+	AN(lat);
+	nlat = 0;
+	for (u = 0; u < nrthreads; u++) {
+		rt = &rthreads[u];
+		memcpy(lat + nlat, rt->lat, rt->nlat * sizeof *lat);
+		nlat += rt->nlat;
+		free(rt->lat);
+	}
+	qsort(lat, nlat, sizeof *lat, cmp_double);
+
+	dt = t_last - t_first;
+	printf("Requests:   %ju sent, %ju completed, %ju failed\n",
+	    (uintmax_t)sent, (uintmax_t)completed, (uintmax_t)failed);
+	printf("Status:     %ju 1xx, %ju 2xx, %ju 3xx, %ju 4xx, %ju 5xx, "
+	    "%ju other\n", (uintmax_t)status[1], (uintmax_t)status[2],
+	    (uintmax_t)status[3], (uintmax_t)status[4],
+	    (uintmax_t)status[5], (uintmax_t)status[0]);
+	printf("Duration:   %.3f s, %.1f req/s\n", dt,
+	    dt > 0 ? completed / dt : 0.);
+	printf("Latency:   ");
+	for (l = 0; l < sizeof pct / sizeof *pct; l++)
+		printf(" p%g %.3f ms", pct[l] * 100,
+		    nlat ? lat[(size_t)(pct[l] * (nlat - 1))] * 1e3 : 0.);
+	printf(" max %.3f ms\n", nlat ? lat[nlat - 1] * 1e3 : 0.);
+	free(lat);
+}
+
+/*--------------------------------------------------------------------
+ * Turn a client request transaction into a request to replay
+ */
+
+static double t0_log, t0_replay, last_due;
+static uint64_t skipped, seq;
+
+static double
+reqend_start(const uint32_t *p)
+{
+	double d[5];
+	char buf[128];
+	unsigned l;
+
+	if (VSL_BINARY(p) && VSL_LEN(p) == sizeof d) {
+		memcpy(d, VSL_CDATA(p), sizeof d);
+		return (d[0]);
+	}
+	l = VSL_BINARY(p) ? VSL_Render(p, buf, sizeof buf) :
+	    VSL_LEN(p) < sizeof buf ? VSL_LEN(p) : sizeof buf - 1;
+	if (!VSL_BINARY(p))
+		memcpy(buf, VSL_CDATA(p), l);
+	buf[l] = '\0';
+	if (sscanf(buf, "%*u %lf", &d[0]) == 1 ||
+	    sscanf(buf, "%lf", &d[0]) == 1)
+		return (d[0]);
+	return (0.);
+}
+
+static void
+add_line(char **b, size_t *l, size_t *s, const char *p, size_t len)
+{
+
+	/* Trim like the old replay did */
+	while (len > 0 && *p == ' ')
+		p++, len--;
+	while (len > 0 && (p[len - 1] == ' ' || p[len - 1] == '\0'))
+		len--;
+	while (*l + len + 4 > *s) {
+		*s = *s ? *s * 2 : 1024;
+		*b = realloc(*b, *s);
+		AN(*b);
+	}
+	memcpy(*b + *l, p, len);
+	*l += len;
 }
 
 static int
-gen_traffic(void *priv, enum VSL_tag_e tag, unsigned fd,
-    unsigned len, unsigned spec, const char *ptr, uint64_t bitmap)
+h_replay(void *priv, const struct VSL_transaction *t)
 {
-	struct replay_thread *thr;
-	struct message *msg;
+	const uint32_t *p;
+	const char *method = NULL, *url = NULL, *proto = NULL, *ptr;
+	unsigned lmethod = 0, lurl = 0, lproto = 0, len, sess;
+	const uint32_t *hdr[64];
+	int nhdr = 0, bogus = 0, invcl = 0, conn_close = -1, i;
+	double t_req = 0., now;
+	struct rreq *rr;
+	char cbuf[32];
+	size_t s = 0;
 
 	(void)priv;
-	(void)bitmap;
+	if (stop)
+		return (1);
+	if (!t->complete)
+		return (0);
 
-	if (fd == 0 || !(spec & VSL_S_CLIENT))
+	if (t->type == VSL_t_sess) {
+		/* Close the connection after its last request */
+		rr = calloc(sizeof *rr, 1);
+		AN(rr);
+		rr->sess = t->vxid;
+		rr->seq = ++seq;
+		rr->due = last_due;
+		rt_put(rr);
 		return (0);
+	}
+	if (t->type != VSL_t_req || t->type_parent == VSL_t_req)
+		return (0);	/* ESI and other internal requests */
+
+	for (p = t->b; p < t->e; p = VSL_NEXT(p)) {
+		ptr = VSL_CDATA(p);
+		len = VSL_LEN(p);
+		switch (VSL_TAG(p)) {
+		case SLT_ReqRequest:
+			if (method != NULL)
+				bogus = 1;
+			method = ptr;
+			lmethod = len;
+			break;
+		case SLT_ReqURL:
+			if (url != NULL)
+				bogus = 1;
+			url = ptr;
+			lurl = len;
+			break;
+		case SLT_ReqProtocol:
+			if (proto != NULL)
+				bogus = 1;
+			proto = ptr;
+			lproto = len;
+			break;
+		case SLT_ReqHeader:
+			/* Only what the client sent, not what VCL did */
+			if (invcl)
+				break;
+			if (nhdr >= sizeof hdr / sizeof *hdr)
+				bogus = 1;
+			else
+				hdr[nhdr++] = p;
+			break;
+		case SLT_VCL_call:
+			invcl = 1;
+			break;
+		case SLT_ReqEnd:
+			t_req = reqend_start(p);
+			break;
+		default:
+			break;
+		}
+	}
 
-	thread_log(3, 0, "%d %s", fd, VSL_tags[tag]);
-	thr = thread_get(fd, replay_thread);
-	if (thr == NULL)
+	if (method == NULL || url == NULL || proto == NULL)
+		bogus = 1;
+	else if (strncmp(method, "GET", lmethod) &&
+	    strncmp(method, "HEAD", lmethod))
+		bogus = 1;
+	else if (strncmp(proto, "HTTP/1.0", lproto) &&
+	    strncmp(proto, "HTTP/1.1", lproto))
+		bogus = 1;
+	if (bogus) {
+		thread_log(1, 0, "%u bogus", t->vxid);
+		skipped++;
 		return (0);
-	msg = malloc(sizeof (struct message));
-	msg->tag = tag;
-	msg->len = len;
-	msg->ptr = malloc(len);
-	AN(msg->ptr);
-	memcpy(msg->ptr, ptr, len);
-	mailbox_put(&thr->mbox, msg);
+	}
 
+	sess = t->type_parent == VSL_t_sess ? t->vxid_parent : t->vxid;
+	rr = calloc(sizeof *rr, 1);
+	AN(rr);
+	rr->sess = sess;
+	rr->seq = ++seq;
+	rr->head = !strncmp(method, "HEAD", lmethod);
+	add_line(&rr->buf, &rr->len, &s, method, lmethod);
+	rr->buf[rr->len++] = ' ';
+	add_line(&rr->buf, &rr->len, &s, url, lurl);
+	rr->buf[rr->len++] = ' ';
+	add_line(&rr->buf, &rr->len, &s, proto, lproto);
+	rr->buf[rr->len++] = '\r';
+	rr->buf[rr->len++] = '\n';
+	for (i = 0; i < nhdr; i++) {
+		ptr = VSL_CDATA(hdr[i]);
+		len = VSL_LEN(hdr[i]);
+		if (len < sizeof cbuf) {
+			memcpy(cbuf, ptr, len);
+			cbuf[len] = '\0';
+			if (isprefix(cbuf, "connection:", &ptr))
+				conn_close = !strncasecmp(ptr, "close", 5);
+		} else if (!strncasecmp(ptr, "connection:", 11)) {
+			conn_close = 0;
+		}
+		add_line(&rr->buf, &rr->len, &s, VSL_CDATA(hdr[i]), len);
+		rr->buf[rr->len++] = '\r';
+		rr->buf[rr->len++] = '\n';
+	}
+	rr->buf[rr->len++] = '\r';
+	rr->buf[rr->len++] = '\n';
+	if (conn_close < 0)
+		conn_close = !strncmp(proto, "HTTP/1.0", lproto);
+	rr->close = conn_close;
+	thread_log(2, 0, "%u %.*s %.*s", sess, (int)lmethod, method,
+	    (int)lurl, url);
+
+	/* Schedule at the original offset, divided by the speed */
+	now = VTIM_mono();
+	if (t0_replay == 0.) {
+		t0_replay = now;
+		t0_log = t_req;
+	}
+	if (speed > 0. && t_req > 0.)
+		rr->due = t0_replay + (t_req - t0_log) / speed;
+	else
+		rr->due = now;
+	if (rr->due > last_due)
+		last_due = rr->due;
+	rt_put(rr);
+
+	/* Do not read too far ahead of the replay */
+	if (rr->due - now > 1.0 && !stop)
+		VTIM_sleep(rr->due - now - 1.0);
 	return (0);
 }
 
@@ -695,27 +1079,38 @@ init_connection(const char *address)
 
 /*--------------------------------------------------------------------*/
 
+static void
+sigstop(int sig)
+{
+
+	(void)sig;
+	stop = 1;
+}
+
 static void
 usage(void)
 {
 
 	fprintf(stderr,
-	    "usage: varnishreplay [-D] -a address:port -r logfile\n");
+	    "usage: varnishreplay [-D] -a address:port [-j threads] "
+	    "[-S speed] -r logfile\n");
 	exit(1);
 }
 
 int
 main(int argc, char *argv[])
 {
-	int c;
+	int c, i, r_flag = 0;
 	struct VSM_data *vd;
 	const char *address = NULL;
+	unsigned u;
+	char *p;
 
 	vd = VSM_New();
 	debug = 0;
 
 	VSL_Arg(vd, 'c', NULL);
-	while ((c = getopt(argc, argv, "a:Dr:n:")) != -1) {
+	while ((c = getopt(argc, argv, "a:Dj:r:n:S:")) != -1) {
 		switch (c) {
 		case 'a':
 			address = optarg;
@@ -723,6 +1118,19 @@ main(int argc, char *argv[])
 		case 'D':
 			++debug;
 			break;
+		case 'j':
+			nrthreads = strtoul(optarg, &p, 10);
+			if (*p != '\0' || nrthreads < 1 || nrthreads > 1024)
+				usage();
+			break;
+		case 'S':
+			speed = strtod(optarg, &p);
+			if (*p != '\0' || speed < 0.)
+				usage();
+			break;
+		case 'r':
+			r_flag = 1;
+			/* FALLTHROUGH */
 		default:
 			if (VSL_Arg(vd, c, optarg) > 0)
 				break;
@@ -734,7 +1142,7 @@ main(int argc, char *argv[])
 		usage();
 	}
 
-	if (VSM_Open(vd)) {
+	if (!r_flag && VSM_Open(vd)) {
 		fprintf(stderr, "%s\n", VSM_Error(vd));
 		exit(1);
 	}
@@ -742,17 +1150,28 @@ main(int argc, char *argv[])
 	addr_info = init_connection(address);
 
 	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, sigstop);
+	signal(SIGTERM, sigstop);
 
-	pthread_attr_init(&thread_attr);
+	rt_start();
 
-	/*
-	 * XXX: seting the stack size manually reduces the memory usage
-	 * XXX: (allowing more threads) and increases speed (?)
-	 */
-	pthread_attr_setstacksize(&thread_attr, 32768);
+	while (((i = VSL_DispatchTx(vd, h_replay, NULL)) >= 0 || i == -3) &&
+	    !stop) {
+		if (i == -3)
+			fprintf(stderr, "%s", VSM_Error(vd));
+		else if (i == 0)
+			(void)usleep(10000);
+	}
 
-	while (VSL_Dispatch(vd, gen_traffic, NULL) == 0)
-		/* nothing */ ;
-	thread_close(-1);
+	for (u = 0; u < nrthreads; u++) {
+		AZ(pthread_mutex_lock(&rthreads[u].mtx));
+		rthreads[u].eof = 1;
+		AZ(pthread_mutex_unlock(&rthreads[u].mtx));
+		(void)write(rthreads[u].pipe[1], "", 1);
+	}
+	rt_report();
+	if (skipped > 0)
+		printf("Skipped:    %ju requests, not GET or HEAD\n",
+		    (uintmax_t)skipped);
 	exit(0);
 }
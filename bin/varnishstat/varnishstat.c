@@ -229,7 +229,7 @@ usage(void)
 	fprintf(stderr, "usage: varnishstat "
 	    "[-1lV] [-f field_list] "
 	    VSC_n_USAGE " "
-	    "[-w delay]\n");
+	    "[-s line|bin] [-w delay]\n");
 	fprintf(stderr, FMT, "-1", "Print the statistics to stdout.");
 	fprintf(stderr, FMT, "-f field_list",
 	    "Comma separated list of fields to display. ");
@@ -239,6 +239,10 @@ usage(void)
 	    "Lists the available fields to use with the -f option");
 	fprintf(stderr, FMT, "-n varnish_name",
 	    "The varnishd instance to get logs from");
+	fprintf(stderr, FMT, "-s line|bin",
+	    "Stream the counters which changed every delay seconds,");
+	fprintf(stderr, FMT, "",
+	    "as line protocol or binary deltas.");
 	fprintf(stderr, FMT, "-V", "Display the version number and exit");
 	fprintf(stderr, FMT, "-w delay",
 	    "Wait delay seconds between updates."
@@ -259,10 +263,11 @@ main(int argc, char * const *argv)
 	struct VSM_data *vd;
 	const struct VSC_C_main *VSC_C_main;
 	int delay = 1, once = 0, xml = 0, json = 0, do_repeat = 0;
+	int stream = -1;
 
 	vd = VSM_New();
 
-	while ((c = getopt(argc, argv, VSC_ARGS "1f:lVw:xjt:")) != -1) {
+	while ((c = getopt(argc, argv, VSC_ARGS "1f:lVs:w:xjt:")) != -1) {
 		switch (c) {
 		case '1':
 			once = 1;
@@ -270,6 +275,14 @@ main(int argc, char * const *argv)
 		case 'l':
 			list_fields(vd);
 			exit(0);
+		case 's':
+			if (!strcmp(optarg, "line"))
+				stream = 0;
+			else if (!strcmp(optarg, "bin"))
+				stream = 1;
+			else
+				usage();
+			break;
 		case 'V':
 			VCS_Message("varnishstat");
 			exit(0);
@@ -293,6 +306,13 @@ main(int argc, char * const *argv)
 	VSC_C_main = VSC_Main(vd);
 	AN(VSC_C_main);
 
+	if (stream >= 0) {
+		if (delay < 1)
+			delay = 1;
+		do_stream(vd, delay, stream);
+		exit(0);
+	}
+
 	if (!(xml || json || once)) {
 		do_curses(vd, VSC_C_main, delay);
 		exit(0);
@@ -38,3 +38,4 @@
 
 void do_curses(struct VSM_data *vd, const struct VSC_C_main *VSC_C_main,
     int delay);
+void do_stream(struct VSM_data *vd, int delay, int binary);
@@ -176,6 +176,9 @@ do_curses(struct VSM_data *vd, const struct VSC_C_main *VSC_C_main,
 			tt = tv.tv_usec * 1e-6 + tv.tv_sec;
 			lt = tt - lt;
 
+			/* Refresh the summed copy of the main counters */
+			(void)VSC_Main(vd);
+
 			rt = VSC_C_main->uptime;
 			up = rt;
 
@@ -0,0 +1,319 @@
+/*-
+ * Copyright (c) 2012 Varnish Software AS
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Streaming export of changed counters.
+ *
+ * The counters are collected with VSC_Iter() into a flat index once,
+ * and only collected again when the VSM allocations change.  Each
+ * sample is then a linear scan over the index, emitting the counters
+ * which changed since the previous sample.
+ *
+ * Line format (-s line), one line per sample, influxdb style:
+ *
+ *	varnishstat,instance=NAME field=VALUEi[,field=VALUEi...] NSEC
+ *
+ * Binary format (-s bin), a stream of records:
+ *
+ *	'D' n { len name[len] flag } * n
+ *		Dictionary, sent whenever the index is (re)built.
+ *		All previous values are reset to zero.
+ *	'S' time n { gap delta } * n
+ *		Sample.  time is seconds since the epoch, gap is the
+ *		index distance from the previous changed counter (the
+ *		first from -1), delta is the change in value, zigzag
+ *		encoded so that decreasing gauges stay small.
+ *
+ * All numbers in the binary format are unsigned LEB128 varints, the
+ * count in 'S' records is always padded to five bytes.
+ */
+
+#include "config.h"
+
+#include <sys/time.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "varnishstat.h"
+
+struct spt {
+	const volatile uint64_t	*ptr;
+	uint64_t		last;
+	char			*name;
+	int			flag;
+};
+
+static struct spt	*spts;
+static unsigned		nspt, lspt;
+static int		fresh;
+
+static uint8_t		*obuf;
+static size_t		lobuf, nobuf;
+
+/*--------------------------------------------------------------------*/
+
+static void
+stream_clear(void)
+{
+	unsigned u;
+
+	for (u = 0; u < nspt; u++)
+		free(spts[u].name);
+	nspt = 0;
+}
+
+static int
+stream_cb(void *priv, const struct VSC_point * const pt)
+{
+	struct spt *sp;
+	char buf[256], ebuf[512], *p, *q;
+	int binary;
+
+	binary = *(int *)priv;
+	if (pt == NULL) {
+		stream_clear();
+		return (0);
+	}
+	assert(!strcmp(pt->desc->fmt, "uint64_t"));
+	if (nspt == lspt) {
+		lspt = lspt ? lspt * 2 : 256;
+		spts = realloc(spts, lspt * sizeof *spts);
+		AN(spts);
+	}
+	sp = &spts[nspt++];
+	memset(sp, 0, sizeof *sp);
+	sp->ptr = pt->ptr;
+	sp->flag = pt->desc->flag;
+	(void)snprintf(buf, sizeof buf, "%s%s%s%s%s",
+	    pt->class, pt->class[0] ? "." : "",
+	    pt->ident, pt->ident[0] ? "." : "", pt->desc->name);
+	if (!binary) {
+		/* Escape as a line protocol key */
+		for (p = buf, q = ebuf; *p != '\0'; p++) {
+			if (*p == ',' || *p == '=' || *p == ' ')
+				*q++ = '\\';
+			*q++ = *p;
+		}
+		*q = '\0';
+		sp->name = strdup(ebuf);
+	} else
+		sp->name = strdup(buf);
+	AN(sp->name);
+	return (0);
+}
+
+/*--------------------------------------------------------------------*/
+
+static void
+ob_need(size_t n)
+{
+
+	if (nobuf + n <= lobuf)
+		return;
+	while (nobuf + n > lobuf)
+		lobuf = lobuf ? lobuf * 2 : 4096;
+	obuf = realloc(obuf, lobuf);
+	AN(obuf);
+}
+
+static void
+ob_varint(uint64_t u)
+{
+
+	ob_need(10);
+	while (u >= 0x80) {
+		obuf[nobuf++] = (uint8_t)(u | 0x80);
+		u >>= 7;
+	}
+	obuf[nobuf++] = (uint8_t)u;
+}
+
+static void
+ob_bytes(const void *p, size_t l)
+{
+
+	ob_need(l);
+	memcpy(obuf + nobuf, p, l);
+	nobuf += l;
+}
+
+static void
+ob_flush(void)
+{
+
+	if (nobuf > 0 && fwrite(obuf, 1, nobuf, stdout) != nobuf)
+		exit(1);
+	nobuf = 0;
+	if (fflush(stdout))
+		exit(1);
+}
+
+/*--------------------------------------------------------------------*/
+
+static void
+stream_dict(void)
+{
+	unsigned u;
+	size_t l;
+	char c;
+
+	ob_bytes("D", 1);
+	ob_varint(nspt);
+	for (u = 0; u < nspt; u++) {
+		l = strlen(spts[u].name);
+		ob_varint(l);
+		ob_bytes(spts[u].name, l);
+		c = (char)spts[u].flag;
+		ob_bytes(&c, 1);
+	}
+}
+
+static void
+stream_sample_bin(double now)
+{
+	unsigned u, n, prev;
+	uint64_t v, d;
+	size_t hdr;
+
+	/* Reserve the worst case header, fill it in when we know n */
+	ob_bytes("S", 1);
+	ob_varint((uint64_t)now);
+	hdr = nobuf;
+	ob_need(5);
+	nobuf += 5;
+	n = 0;
+	prev = 0;
+	for (u = 0; u < nspt; u++) {
+		v = *spts[u].ptr;
+		if (v == spts[u].last)
+			continue;
+		d = v - spts[u].last;
+		spts[u].last = v;
+		ob_varint(u + 1 - prev);
+		prev = u + 1;
+		/* zigzag: 0, -1, 1, -2 ... -> 0, 1, 2, 3 ... */
+		ob_varint((d << 1) ^ (uint64_t)((int64_t)d >> 63));
+		n++;
+	}
+	for (u = 0; u < 5; u++) {
+		obuf[hdr + u] = (uint8_t)((n & 0x7f) | (u < 4 ? 0x80 : 0));
+		n >>= 7;
+	}
+}
+
+static void
+stream_sample_line(double now, const char *name)
+{
+	unsigned u;
+	uint64_t v;
+	int first;
+
+	first = 1;
+	for (u = 0; u < nspt; u++) {
+		v = *spts[u].ptr;
+		if (v == spts[u].last && !fresh)
+			continue;
+		spts[u].last = v;
+		if (first)
+			printf("varnishstat,instance=%s ", name);
+		printf("%s%s=%jui", first ? "" : ",", spts[u].name,
+		    (uintmax_t)v);
+		first = 0;
+	}
+	if (!first)
+		printf(" %.0f000000\n", now * 1e3);
+}
+
+/*--------------------------------------------------------------------*/
+
+void
+do_stream(struct VSM_data *vd, int delay, int binary)
+{
+	struct VSM_fantom vf;
+	struct timeval tv;
+	struct timespec ts;
+	double now, next;
+	char name[256], *q;
+	const char *n;
+
+	memset(&vf, 0, sizeof vf);
+
+	/* The instance name is a line protocol tag value */
+	for (n = VSM_Name(vd), q = name; *n != '\0' &&
+	    q < name + sizeof name - 2; n++) {
+		if (*n == ',' || *n == '=' || *n == ' ')
+			*q++ = '\\';
+		*q++ = *n;
+	}
+	*q = '\0';
+
+	AZ(gettimeofday(&tv, NULL));
+	next = tv.tv_sec + 1e-6 * tv.tv_usec;
+	while (1) {
+		if (VSM_StillValid(vd, &vf) != 1) {
+			/*
+			 * VSC_Main() reopens the VSM if needed, the fantom
+			 * is taken before collecting so that a change while
+			 * we do that causes another round.
+			 */
+			stream_clear();
+			if (VSC_Main(vd) == NULL ||
+			    !VSM_Get(vd, &vf, VSC_CLASS, NULL, NULL) ||
+			    VSC_Iter(vd, stream_cb, &binary)) {
+				VSM_Close(vd);
+				memset(&vf, 0, sizeof vf);
+				stream_clear();
+			} else if (binary) {
+				stream_dict();
+			}
+			fresh = 1;
+		} else
+			(void)VSC_Main(vd);
+
+		AZ(gettimeofday(&tv, NULL));
+		now = tv.tv_sec + 1e-6 * tv.tv_usec;
+		if (binary) {
+			if (nspt > 0)
+				stream_sample_bin(now);
+			ob_flush();
+		} else {
+			stream_sample_line(now, name);
+			if (fflush(stdout))
+				exit(1);
+		}
+		fresh = 0;
+
+		/* Keep a fixed cadence, regardless of how long we took */
+		next += delay;
+		if (next < now)
+			next = now;
+		ts.tv_sec = (time_t)(next - now);
+		ts.tv_nsec = (long)((next - now - ts.tv_sec) * 1e9);
+		(void)nanosleep(&ts, NULL);
+	}
+}
@@ -527,6 +527,7 @@ cmd_feature(CMD_ARGS)
 static const struct cmds cmds[] = {
 	{ "server",	cmd_server },
 	{ "client",	cmd_client },
+	{ "bench",	cmd_bench },
 	{ "varnish",	cmd_varnish },
 	{ "delay",	cmd_delay },
 	{ "varnishtest",cmd_varnishtest },
@@ -61,6 +61,7 @@ void parse_string(char *buf, const struct cmds *cmd, void *priv,
 cmd_f cmd_delay;
 cmd_f cmd_server;
 cmd_f cmd_client;
+cmd_f cmd_bench;
 cmd_f cmd_varnish;
 cmd_f cmd_sema;
 
@@ -77,6 +78,7 @@ void cmd_server_genvcl(struct vsb *vsb);
 void vtc_loginit(char *buf, unsigned buflen);
 struct vtclog *vtc_logopen(const char *id);
 void vtc_logclose(struct vtclog *vl);
+void vtc_logbench(int on);
 void vtc_log(struct vtclog *vl, int lvl, const char *fmt, ...)
     __printflike(3, 4);
 void vtc_dump(struct vtclog *vl, int lvl, const char *pfx,
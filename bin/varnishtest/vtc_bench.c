@@ -0,0 +1,655 @@
+/*-
+ * Copyright (c) 2012 Varnish Software AS
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Sustained load:
+ *
+ *	bench b1 -connect ${v1_sock} -concurrency 4 -duration 2 \
+ *	    -url /foo -url /bar -hdr "Foo: bar" -run
+ *	bench b1 -expect rate > 1000
+ *	bench b1 -expect p99 < 0.01
+ *
+ * Each of -concurrency threads sends keep-alive requests for the -url's
+ * in turn, one at a time, until -duration seconds have passed or a
+ * total of -requests have been sent.  Responses which are incomplete,
+ * or do not have a 2xx status, count as failed.
+ *
+ * -expect knows: requests, failed, rate (req/s), and the latency
+ * percentiles p50, p90, p99, p999 and max, all in seconds.
+ */
+
+#include "config.h"
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vtc.h"
+
+#include "vss.h"
+#include "vtcp.h"
+#include "vtim.h"
+
+struct bench_thr {
+	unsigned		magic;
+#define BENCH_THR_MAGIC		0x3c0b5f8e
+	struct bench		*b;
+	pthread_t		tp;
+	unsigned		idx;
+
+	int			fd;
+	char			buf[8192];
+	unsigned		bb, be;
+
+	unsigned		requests;
+	unsigned		failed;
+	double			*lat;
+	unsigned		nlat, llat;
+};
+
+struct bench {
+	unsigned		magic;
+#define BENCH_MAGIC		0x11a2ef2d
+	char			*name;
+	struct vtclog		*vl;
+	VTAILQ_ENTRY(bench)	list;
+
+	char			connect[256];
+	char			*addr;
+	unsigned		concurrency;
+	double			duration;
+	unsigned		max_requests;
+
+	char			*req;
+	struct vsb		*hdrs;
+	char			**url;
+	unsigned		nurl;
+	struct vsb		**reqs;
+
+	pthread_t		tp;
+	unsigned		running;
+	pthread_mutex_t		mtx;
+	unsigned		sent;
+	double			t_end;
+
+	/* Results */
+	unsigned		requests;
+	unsigned		failed;
+	double			rate;
+	double			p50, p90, p99, p999, max;
+};
+
+static VTAILQ_HEAD(, bench)	benches =
+    VTAILQ_HEAD_INITIALIZER(benches);
+
+/**********************************************************************
+ * Minimal HTTP/1.1 response reader, we do not want to measure the
+ * logging and the checks of vtc_http.c.
+ */
+
+static int
+bt_fill(struct bench_thr *bt)
+{
+	ssize_t i;
+
+	if (bt->bb > 0) {
+		memmove(bt->buf, bt->buf + bt->bb, bt->be - bt->bb);
+		bt->be -= bt->bb;
+		bt->bb = 0;
+	}
+	if (bt->be == sizeof bt->buf)
+		return (-1);
+	i = read(bt->fd, bt->buf + bt->be, sizeof bt->buf - bt->be);
+	if (i <= 0)
+		return (-1);
+	bt->be += i;
+	return (0);
+}
+
+static char *
+bt_line(struct bench_thr *bt)
+{
+	char *p, *q;
+
+	while (1) {
+		p = bt->buf + bt->bb;
+		q = memchr(p, '\n', bt->be - bt->bb);
+		if (q != NULL) {
+			bt->bb = (q + 1) - bt->buf;
+			if (q > p && q[-1] == '\r')
+				q--;
+			*q = '\0';
+			return (p);
+		}
+		if (bt_fill(bt))
+			return (NULL);
+	}
+}
+
+static int
+bt_skip(struct bench_thr *bt, uintmax_t n)
+{
+	unsigned l;
+
+	while (n > 0) {
+		if (bt->bb == bt->be && bt_fill(bt))
+			return (-1);
+		l = bt->be - bt->bb;
+		if (l > n)
+			l = n;
+		bt->bb += l;
+		n -= l;
+	}
+	return (0);
+}
+
+/*
+ * Returns the status, -1 on error.  *do_close is set if the connection
+ * can not be reused.
+ */
+static int
+bt_response(struct bench_thr *bt, int head, int *do_close)
+{
+	char *p;
+	int status, chunked = 0;
+	uintmax_t cl = 0, n;
+
+	*do_close = 1;
+	p = bt_line(bt);
+	if (p == NULL || sscanf(p, "HTTP/%*u.%*u %d", &status) != 1)
+		return (-1);
+	*do_close = !strncmp(p, "HTTP/1.0", 8);
+	cl = UINTMAX_MAX;
+	while ((p = bt_line(bt)) != NULL && *p != '\0') {
+		if (!strncasecmp(p, "Content-Length:", 15))
+			cl = strtoumax(p + 15, NULL, 10);
+		else if (!strncasecmp(p, "Transfer-Encoding:", 18))
+			chunked = strstr(p + 18, "chunked") != NULL;
+		else if (!strncasecmp(p, "Connection:", 11))
+			*do_close = strstr(p + 11, "close") != NULL;
+	}
+	if (p == NULL)
+		return (-1);
+	if (head || status < 200 || status == 204 || status == 304)
+		return (status);
+	if (chunked) {
+		do {
+			p = bt_line(bt);
+			if (p == NULL)
+				return (-1);
+			n = strtoumax(p, NULL, 16);
+			if (bt_skip(bt, n))
+				return (-1);
+			if ((p = bt_line(bt)) == NULL)
+				return (-1);
+		} while (n > 0);
+		return (status);
+	}
+	if (cl != UINTMAX_MAX)
+		return (bt_skip(bt, cl) ? -1 : status);
+	/* Body until close */
+	while (!bt_fill(bt))
+		bt->bb = bt->be;
+	*do_close = 1;
+	return (status);
+}
+
+/**********************************************************************
+ * Load thread
+ */
+
+static void
+bt_close(struct bench_thr *bt)
+{
+
+	if (bt->fd >= 0)
+		AZ(close(bt->fd));
+	bt->fd = -1;
+	bt->bb = bt->be = 0;
+}
+
+static void *
+bench_thread(void *priv)
+{
+	struct bench_thr *bt;
+	struct bench *b;
+	struct vsb *req;
+	unsigned u;
+	int status, do_close;
+	double t0, t1;
+
+	CAST_OBJ_NOTNULL(bt, priv, BENCH_THR_MAGIC);
+	b = bt->b;
+	bt->fd = -1;
+	for (u = bt->idx; !vtc_error; u++) {
+		AZ(pthread_mutex_lock(&b->mtx));
+		if (b->max_requests > 0 && b->sent >= b->max_requests) {
+			AZ(pthread_mutex_unlock(&b->mtx));
+			break;
+		}
+		b->sent++;
+		AZ(pthread_mutex_unlock(&b->mtx));
+
+		t0 = VTIM_mono();
+		if (b->duration > 0 && t0 >= b->t_end)
+			break;
+		if (bt->fd < 0) {
+			bt->fd = VSS_open(b->addr, 10.);
+			if (bt->fd < 0) {
+				vtc_log(b->vl, 0, "Failed to open %s", b->addr);
+				break;
+			}
+			VTCP_blocking(bt->fd);
+		}
+		req = b->reqs[u % b->nurl];
+		bt->requests++;
+		if (write(bt->fd, VSB_data(req), VSB_len(req)) !=
+		    VSB_len(req)) {
+			bt->failed++;
+			bt_close(bt);
+			continue;
+		}
+		status = bt_response(bt, !strcmp(b->req, "HEAD"), &do_close);
+		t1 = VTIM_mono();
+		if (status < 200 || status > 299)
+			bt->failed++;
+		if (status >= 0) {
+			if (bt->nlat == bt->llat) {
+				bt->llat = bt->llat ? bt->llat * 2 : 1024;
+				bt->lat = realloc(bt->lat,
+				    bt->llat * sizeof *bt->lat);
+				AN(bt->lat);
+			}
+			bt->lat[bt->nlat++] = t1 - t0;
+		}
+		if (status < 0 || do_close)
+			bt_close(bt);
+	}
+	bt_close(bt);
+	return (NULL);
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	const double *da = a, *db = b;
+
+	return (*da < *db ? -1 : *da > *db);
+}
+
+static double
+pct(const double *lat, unsigned n, double p)
+{
+
+	if (n == 0)
+		return (0.);
+	return (lat[(unsigned)floor(p * (n - 1))]);
+}
+
+static void *
+bench_main(void *priv)
+{
+	struct bench *b;
+	struct bench_thr *bt;
+	struct vsb *vsb;
+	unsigned u, n;
+	double t0, t1, *lat;
+
+	CAST_OBJ_NOTNULL(b, priv, BENCH_MAGIC);
+	vsb = macro_expand(b->vl, b->connect);
+	AN(vsb);
+	REPLACE(b->addr, VSB_data(vsb));
+	VSB_delete(vsb);
+
+	bt = calloc(sizeof *bt, b->concurrency);
+	AN(bt);
+	b->sent = 0;
+	vtc_logbench(1);
+	t0 = VTIM_mono();
+	b->t_end = t0 + b->duration;
+	vtc_log(b->vl, 2, "Load %s with %u connections", b->addr,
+	    b->concurrency);
+	for (u = 0; u < b->concurrency; u++) {
+		bt[u].magic = BENCH_THR_MAGIC;
+		bt[u].b = b;
+		bt[u].idx = u;
+		AZ(pthread_create(&bt[u].tp, NULL, bench_thread, &bt[u]));
+	}
+	b->requests = b->failed = 0;
+	n = 0;
+	for (u = 0; u < b->concurrency; u++) {
+		AZ(pthread_join(bt[u].tp, NULL));
+		b->requests += bt[u].requests;
+		b->failed += bt[u].failed;
+		n += bt[u].nlat;
+	}
+	t1 = VTIM_mono();
+	vtc_logbench(0);
+
+	lat = malloc((n + 1) * sizeof *lat);
+	AN(lat);
+	n = 0;
+	for (u = 0; u < b->concurrency; u++) {
+		memcpy(lat + n, bt[u].lat, bt[u].nlat * sizeof *lat);
+		n += bt[u].nlat;
+		free(bt[u].lat);
+	}
+	free(bt);
+	qsort(lat, n, sizeof *lat, cmp_double);
+
+	b->rate = t1 > t0 ? (b->requests - b->failed) / (t1 - t0) : 0.;
+	b->p50 = pct(lat, n, .5);
+	b->p90 = pct(lat, n, .9);
+	b->p99 = pct(lat, n, .99);
+	b->p999 = pct(lat, n, .999);
+	b->max = n > 0 ? lat[n - 1] : 0.;
+	free(lat);
+
+	vtc_log(b->vl, 2, "%u requests, %u failed, %.3f s, %.1f req/s",
+	    b->requests, b->failed, t1 - t0, b->rate);
+	vtc_log(b->vl, 2,
+	    "latency p50 %.6f p90 %.6f p99 %.6f p999 %.6f max %.6f",
+	    b->p50, b->p90, b->p99, b->p999, b->max);
+	return (NULL);
+}
+
+/**********************************************************************
+ * Allocate and initialize a bench
+ */
+
+static struct bench *
+bench_new(const char *name)
+{
+	struct bench *b;
+
+	AN(name);
+	ALLOC_OBJ(b, BENCH_MAGIC);
+	AN(b);
+	REPLACE(b->name, name);
+	b->vl = vtc_logopen(name);
+	AN(b->vl);
+	if (*b->name != 'b')
+		vtc_log(b->vl, 0, "Bench name must start with 'b'");
+
+	bprintf(b->connect, "%s", "${v1_sock}");
+	b->concurrency = 1;
+	b->duration = 1.;
+	REPLACE(b->req, "GET");
+	b->hdrs = VSB_new_auto();
+	AN(b->hdrs);
+	AZ(pthread_mutex_init(&b->mtx, NULL));
+	VTAILQ_INSERT_TAIL(&benches, b, list);
+	return (b);
+}
+
+static void
+bench_clear_reqs(struct bench *b)
+{
+	unsigned u;
+
+	if (b->reqs == NULL)
+		return;
+	for (u = 0; u < b->nurl; u++)
+		VSB_delete(b->reqs[u]);
+	free(b->reqs);
+	b->reqs = NULL;
+}
+
+/**********************************************************************
+ * Clean up bench
+ */
+
+static void
+bench_delete(struct bench *b)
+{
+	unsigned u;
+
+	CHECK_OBJ_NOTNULL(b, BENCH_MAGIC);
+	bench_clear_reqs(b);
+	for (u = 0; u < b->nurl; u++)
+		free(b->url[u]);
+	free(b->url);
+	VSB_delete(b->hdrs);
+	AZ(pthread_mutex_destroy(&b->mtx));
+	vtc_logclose(b->vl);
+	free(b->req);
+	free(b->addr);
+	free(b->name);
+	FREE_OBJ(b);
+}
+
+/**********************************************************************
+ * Start the bench, wait for it to finish
+ */
+
+static void
+bench_start(struct bench *b)
+{
+	struct vsb *vsb;
+	unsigned u;
+	char *hdr;
+
+	CHECK_OBJ_NOTNULL(b, BENCH_MAGIC);
+	if (b->nurl == 0) {
+		b->url = malloc(sizeof *b->url);
+		AN(b->url);
+		b->url[0] = NULL;
+		REPLACE(b->url[0], "/");
+		b->nurl = 1;
+	}
+	AZ(VSB_finish(b->hdrs));
+	hdr = strdup(VSB_data(b->hdrs));
+	AN(hdr);
+	bench_clear_reqs(b);
+	b->reqs = calloc(sizeof *b->reqs, b->nurl);
+	AN(b->reqs);
+	for (u = 0; u < b->nurl; u++) {
+		vsb = VSB_new_auto();
+		AN(vsb);
+		VSB_printf(vsb, "%s %s HTTP/1.1\r\n%s\r\n",
+		    b->req, b->url[u], hdr);
+		AZ(VSB_finish(vsb));
+		b->reqs[u] = vsb;
+	}
+	/* Keep the headers for another run */
+	VSB_clear(b->hdrs);
+	VSB_cat(b->hdrs, hdr);
+	free(hdr);
+
+	vtc_log(b->vl, 2, "Starting bench");
+	AZ(pthread_create(&b->tp, NULL, bench_main, b));
+	b->running = 1;
+}
+
+static void
+bench_wait(struct bench *b)
+{
+	void *res;
+
+	CHECK_OBJ_NOTNULL(b, BENCH_MAGIC);
+	vtc_log(b->vl, 2, "Waiting for bench");
+	AZ(pthread_join(b->tp, &res));
+	if (res != NULL)
+		vtc_log(b->vl, 0, "Bench returned \"%s\"", (char *)res);
+	b->tp = 0;
+	b->running = 0;
+}
+
+/**********************************************************************
+ * Check a result
+ */
+
+static void
+bench_expect(const struct bench *b, char * const *av)
+{
+	double val, ref;
+	char *p;
+	int good;
+
+	if (av[0] == NULL || av[1] == NULL || av[2] == NULL) {
+		vtc_log(b->vl, 0, "Missing arguments to -expect");
+		return;
+	}
+	if (!strcmp(av[0], "requests"))		val = b->requests;
+	else if (!strcmp(av[0], "failed"))	val = b->failed;
+	else if (!strcmp(av[0], "rate"))	val = b->rate;
+	else if (!strcmp(av[0], "p50"))		val = b->p50;
+	else if (!strcmp(av[0], "p90"))		val = b->p90;
+	else if (!strcmp(av[0], "p99"))		val = b->p99;
+	else if (!strcmp(av[0], "p999"))	val = b->p999;
+	else if (!strcmp(av[0], "max"))		val = b->max;
+	else {
+		vtc_log(b->vl, 0, "bench field %s unknown", av[0]);
+		return;
+	}
+	ref = strtod(av[2], &p);
+	if (*p != '\0')
+		vtc_log(b->vl, 0, "Syntax error in number (%s)", av[2]);
+	good = 0;
+	if      (!strcmp(av[1], "==")) { if (val == ref) good = 1; }
+	else if (!strcmp(av[1], "!=")) { if (val != ref) good = 1; }
+	else if (!strcmp(av[1], ">"))  { if (val > ref)  good = 1; }
+	else if (!strcmp(av[1], "<"))  { if (val < ref)  good = 1; }
+	else if (!strcmp(av[1], ">=")) { if (val >= ref) good = 1; }
+	else if (!strcmp(av[1], "<=")) { if (val <= ref) good = 1; }
+	else {
+		vtc_log(b->vl, 0, "comparison %s unknown", av[1]);
+	}
+	if (good)
+		vtc_log(b->vl, 2, "as expected: %s (%g) %s %s",
+		    av[0], val, av[1], av[2]);
+	else
+		vtc_log(b->vl, 0, "Not true: %s (%g) %s %s",
+		    av[0], val, av[1], av[2]);
+}
+
+/**********************************************************************
+ * Bench command dispatch
+ */
+
+void
+cmd_bench(CMD_ARGS)
+{
+	struct bench *b, *b2;
+
+	(void)priv;
+	(void)cmd;
+	(void)vl;
+
+	if (av == NULL) {
+		/* Reset and free */
+		VTAILQ_FOREACH_SAFE(b, &benches, list, b2) {
+			VTAILQ_REMOVE(&benches, b, list);
+			if (b->tp != 0)
+				bench_wait(b);
+			bench_delete(b);
+		}
+		return;
+	}
+
+	assert(!strcmp(av[0], "bench"));
+	av++;
+
+	VTAILQ_FOREACH(b, &benches, list)
+		if (!strcmp(b->name, av[0]))
+			break;
+	if (b == NULL)
+		b = bench_new(av[0]);
+	av++;
+
+	for (; *av != NULL; av++) {
+		if (vtc_error)
+			break;
+
+		if (!strcmp(*av, "-wait")) {
+			bench_wait(b);
+			continue;
+		}
+
+		/* Don't muck about with a running bench */
+		if (b->running)
+			bench_wait(b);
+
+		if (!strcmp(*av, "-connect")) {
+			bprintf(b->connect, "%s", av[1]);
+			av++;
+			continue;
+		}
+		if (!strcmp(*av, "-concurrency")) {
+			b->concurrency = strtoul(av[1], NULL, 0);
+			if (b->concurrency < 1)
+				vtc_log(b->vl, 0, "-concurrency must be > 0");
+			av++;
+			continue;
+		}
+		if (!strcmp(*av, "-duration")) {
+			b->duration = strtod(av[1], NULL);
+			av++;
+			continue;
+		}
+		if (!strcmp(*av, "-requests")) {
+			b->max_requests = strtoul(av[1], NULL, 0);
+			av++;
+			continue;
+		}
+		if (!strcmp(*av, "-req")) {
+			REPLACE(b->req, av[1]);
+			av++;
+			continue;
+		}
+		if (!strcmp(*av, "-url")) {
+			b->url = realloc(b->url,
+			    (b->nurl + 1) * sizeof *b->url);
+			AN(b->url);
+			b->url[b->nurl] = NULL;
+			REPLACE(b->url[b->nurl], av[1]);
+			b->nurl++;
+			av++;
+			continue;
+		}
+		if (!strcmp(*av, "-hdr")) {
+			VSB_printf(b->hdrs, "%s\r\n", av[1]);
+			av++;
+			continue;
+		}
+		if (!strcmp(*av, "-expect")) {
+			bench_expect(b, av + 1);
+			av += 3;
+			continue;
+		}
+		if (!strcmp(*av, "-start")) {
+			bench_start(b);
+			continue;
+		}
+		if (!strcmp(*av, "-run")) {
+			bench_start(b);
+			bench_wait(b);
+			continue;
+		}
+		vtc_log(b->vl, 0, "Unknown bench argument: %s", *av);
+	}
+}
@@ -40,6 +40,16 @@
 static pthread_mutex_t	vtclog_mtx;
 static char		*vtclog_buf;
 static unsigned		vtclog_left;
+static int		vtclog_full;
+static unsigned		vtclog_bench;
+
+/*
+ * Room kept for the important (level 0-2) messages.  While a bench is
+ * running, varnishd produces more VSL than the buffer holds, so once we
+ * get this close to the end of it, the chatty levels are dropped, for
+ * the rest of the test.
+ */
+#define VTCLOG_RESERVE		(32 * 1024)
 
 struct vtclog {
 	unsigned	magic;
@@ -62,12 +72,30 @@ vtc_loginit(char *buf, unsigned buflen)
 	t0 = VTIM_mono();
 	vtclog_buf = buf;
 	vtclog_left = buflen;
+	vtclog_full = 0;
+	vtclog_bench = 0;
 	AZ(pthread_mutex_init(&vtclog_mtx, NULL));
 	AZ(pthread_key_create(&log_key, NULL));
 }
 
 /**********************************************************************/
 
+void
+vtc_logbench(int on)
+{
+
+	AZ(pthread_mutex_lock(&vtclog_mtx));
+	if (on)
+		vtclog_bench++;
+	else {
+		assert(vtclog_bench > 0);
+		vtclog_bench--;
+	}
+	AZ(pthread_mutex_unlock(&vtclog_mtx));
+}
+
+/**********************************************************************/
+
 
 struct vtclog *
 vtc_logopen(const char *id)
@@ -114,6 +142,19 @@ vtc_log_emit(const struct vtclog *vl, int lvl)
 		return;
 	l = VSB_len(vl->vsb);
 	AZ(pthread_mutex_lock(&vtclog_mtx));
+	if (lvl > 2 && (vtclog_bench > 0 || vtclog_full) &&
+	    vtclog_left < l + VTCLOG_RESERVE) {
+		if (!vtclog_full) {
+			l = snprintf(vtclog_buf, vtclog_left,
+			    "%s %-4s Log full, dropping levels > 2\n",
+			    lead[2], vl->id);
+			vtclog_buf += l;
+			vtclog_left -= l;
+			vtclog_full = 1;
+		}
+		AZ(pthread_mutex_unlock(&vtclog_mtx));
+		return;
+	}
 	assert(vtclog_left > l);
 	memcpy(vtclog_buf,VSB_data(vl->vsb), l);
 	vtclog_buf += l;
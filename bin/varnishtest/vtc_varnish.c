@@ -201,12 +201,16 @@ varnishlog_thread(void *priv)
 {
 	struct varnish *v;
 	struct VSM_data	*vsl;
+	int i;
 
 	CAST_OBJ_NOTNULL(v, priv, VARNISH_MAGIC);
 	vsl = VSM_New();
 	(void)VSL_Arg(vsl, 'n', v->workdir);
 	while (v->pid) {
-		if (VSL_Dispatch(vsl, h_addlog, v) <= 0)
+		i = VSL_Dispatch(vsl, h_addlog, v);
+		if (i == -3)
+			vtc_log(v->vl, 3, "vsl| overrun, records were lost");
+		else if (i <= 0)
 			usleep(100000);
 	}
 	VSM_Delete(vsl);
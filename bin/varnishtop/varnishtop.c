@@ -217,6 +217,8 @@ accumulate_thread(void *arg)
 	for (;;) {
 
 		i = VSL_Dispatch(vd, accumulate, NULL);
+		if (i == -3)
+			continue;	/* Overrun, nothing to show it on */
 		if (i < 0)
 			break;
 		if (i == 0)
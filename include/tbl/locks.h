@@ -37,7 +37,6 @@ LOCK(hcb)
 LOCK(hcl)
 LOCK(vcl)
 LOCK(sessmem)
-LOCK(wstat)
 LOCK(herder)
 LOCK(wq)
 LOCK(objhdr)
@@ -52,4 +51,9 @@ LOCK(nbusyobj)
 LOCK(busyobj)
 LOCK(mempool)
 LOCK(vxid)
+LOCK(waiter)
+LOCK(vbe)
+LOCK(vgzc)
+LOCK(vesc)
+LOCK(pipe)
 /*lint -restore */
@@ -62,3 +62,9 @@ VSC_DO(MEMPOOL, mempool, VSC_TYPE_MEMPOOL)
 #include "tbl/vsc_fields.h"
 #undef VSC_DO_MEMPOOL
 VSC_DONE(MEMPOOL, mempool, VSC_TYPE_MEMPOOL)
+
+VSC_DO(HIST, hist, VSC_TYPE_HIST)
+#define VSC_DO_HIST
+#include "tbl/vsc_fields.h"
+#undef VSC_DO_HIST
+VSC_DONE(HIST, hist, VSC_TYPE_HIST)
@@ -125,6 +125,11 @@ VSC_F(backend_fail,		uint64_t, 0, 'a',
     "Backend conn. failures",
 	""
 )
+VSC_F(backend_race,		uint64_t, 0, 'a',
+    "Backend conn. not to first address",
+	"Count of backend connections where the preferred address"
+	" failed, or was beaten by the other one, see connect_race_delay."
+)
 VSC_F(backend_reuse,		uint64_t, 0, 'a',
     "Backend conn. reuses",
 	"Count of backend connection reuses"
@@ -199,6 +204,30 @@ VSC_F(fetch_failed,		uint64_t, 1, 'c',
     "Fetch body failed",
 	"beresp body fetch failed."
 )
+VSC_F(fetch_gunzip_store,	uint64_t, 1, 'c',
+    "Fetch stored gunzip'ed copy",
+	"Gzip'ed objects also stored uncompressed.  See param gunzip_store."
+)
+VSC_F(fetch_bgfetch,		uint64_t, 1, 'c',
+    "Fetch in background",
+	"Fetches started in the background to refresh an object in grace,"
+	" while the stale object was delivered.  See also param bgfetch."
+)
+VSC_F(fetch_conditional,	uint64_t, 1, 'c',
+    "Fetch conditional",
+	"Fetches with If-None-Match or If-Modified-Since taken from an"
+	" expired object we still have."
+)
+VSC_F(fetch_refresh,		uint64_t, 1, 'c',
+    "Fetch body from stored object (304)",
+	"beresp 304 to a conditional fetch, the body was copied from"
+	" the stored object."
+)
+VSC_F(fetch_refresh_bytes,	uint64_t, 1, 'c',
+    "Fetch body bytes not transferred (304)",
+	"Body bytes copied from stored objects rather than fetched"
+	" from the backend again."
+)
 
 /*---------------------------------------------------------------------
  * Pools, threads, and sessions
@@ -261,6 +290,12 @@ VSC_F(busy_wakeup,		uint64_t, 1, 'c',
 	" and rescheduled."
 )
 
+VSC_F(busy_follow,		uint64_t, 1, 'c',
+    "Number of requests following a busy object",
+	"Number of requests which found an object still being fetched"
+	" and streamed it to the client as the fetch progressed."
+)
+
 VSC_F(sess_queued,		uint64_t, 0, 'c',
     "Sessions queued for thread",
 	"Number of times session was queued waiting for a thread."
@@ -274,6 +309,20 @@ VSC_F(sess_dropped,		uint64_t, 0, 'c',
 	"  See also param queue_max."
 )
 
+VSC_F(waiter_handoff,		uint64_t, 0, 'c',
+    "Sessions handed to waiter",
+	"Count of idle sessions passed from worker threads to the waiter."
+	"  NB: Only maintained by the epoll waiter."
+)
+
+VSC_F(waiter_handoff_usec,	uint64_t, 0, 'c',
+    "Waiter handoff time (usec)",
+	"Total time, in microseconds, sessions spent between being passed"
+	" to the waiter and the waiter starting to watch them."
+	"  Divide by waiter_handoff for the average handoff latency."
+	"  NB: Only maintained by the epoll waiter."
+)
+
 /*---------------------------------------------------------------------*/
 
 VSC_F(n_object,			uint64_t, 1, 'i',
@@ -332,6 +381,19 @@ VSC_F(s_pipe,			uint64_t, 1, 'a',
     "Total pipe",
 	""
 )
+VSC_F(s_pipe_in,		uint64_t, 0, 'c',
+    "Total piped bytes from client",
+	"Bytes moved from clients to backends by pipes which have ended."
+)
+VSC_F(s_pipe_out,		uint64_t, 0, 'c',
+    "Total piped bytes to client",
+	"Bytes moved from backends to clients by pipes which have ended."
+)
+VSC_F(n_pipe,			uint64_t, 0, 'g',
+    "Open pipes",
+	"Number of piped connections currently open."
+	"  See also param pipe_thread."
+)
 VSC_F(s_pass,			uint64_t, 1, 'a',
     "Total pass",
 	""
@@ -348,6 +410,34 @@ VSC_F(s_bodybytes,		uint64_t, 1, 'a',
     "Total body bytes",
 	""
 )
+VSC_F(s_body_gzip,		uint64_t, 1, 'c',
+    "Body bytes delivered gzip'ed",
+	"Body bytes of gzip'ed objects delivered as they are stored."
+	"  ESI deliveries are only counted in s_bodybytes."
+)
+VSC_F(s_body_gunzip,		uint64_t, 1, 'c',
+    "Body bytes gunzip'ed on delivery",
+	"Body bytes delivered to clients which do not accept gzip,"
+	" uncompressed on the fly."
+)
+VSC_F(s_body_plain,		uint64_t, 1, 'c',
+    "Body bytes delivered from gunzip'ed copies",
+	"Body bytes delivered to clients which do not accept gzip,"
+	" from a gunzip'ed copy stored with the object."
+	"  See also param gunzip_store."
+)
+VSC_F(wrw_writes,		uint64_t, 1, 'c',
+    "Write syscalls",
+	"Count of writev(2) and sendmsg(2) calls made to send requests"
+	" and responses.  Compare with client_req and backend_req"
+	" to get the number of syscalls per transaction."
+	"  See also param workspace_thread."
+)
+VSC_F(wrw_coalesced,		uint64_t, 1, 'c',
+    "Coalesced small writes",
+	"Count of small writes copied into the staging buffer"
+	" instead of using an io-vector of their own."
+)
 
 VSC_F(sess_closed,		uint64_t, 1, 'a',
     "Session Closed",
@@ -365,6 +455,25 @@ VSC_F(sess_herd,		uint64_t, 1, 'a',
     "Session herd",
 	""
 )
+VSC_F(sess_linger_win,		uint64_t, 1, 'c',
+    "Session linger wins",
+	"Count of keep-alive requests which arrived while the worker"
+	" thread lingered on the session, saving a trip through the waiter."
+	"  See also param timeout_linger."
+)
+VSC_F(sess_linger_loss,		uint64_t, 1, 'c',
+    "Session linger losses",
+	"Count of times a worker thread lingered on a keep-alive session"
+	" in vain, and handed it to the waiter anyway."
+	"  See also param timeout_linger."
+)
+VSC_F(sess_linger_skip,		uint64_t, 1, 'c',
+    "Session linger skipped",
+	"Count of keep-alive sessions handed straight to the waiter,"
+	" because the thread pool had no idle threads or because the"
+	" client usually takes longer than timeout_linger to send its"
+	" next request."
+)
 
 VSC_F(shm_records,		uint64_t, 0, 'a',
     "SHM records",
@@ -491,6 +600,29 @@ VSC_F(esi_warnings,		uint64_t, 0, 'a',
     "ESI parse warnings (unlock)",
 	""
 )
+VSC_F(esi_cache_hit,		uint64_t, 1, 'c',
+    "ESI assembly cache hits",
+	"Count of ESI objects delivered in one piece from the ESI"
+	" assembly cache.  See param esi_cache."
+)
+VSC_F(esi_cache_miss,		uint64_t, 1, 'c',
+    "ESI assembly cache misses",
+	"Count of ESI objects which had to be assembled from their"
+	" included objects."
+)
+VSC_F(n_esi_cache,		uint64_t, 0, 'g',
+    "ESI assembly cache bodies",
+	"Number of assembled ESI bodies held in the ESI assembly cache."
+)
+VSC_F(esi_cache_bytes,		uint64_t, 0, 'g',
+    "ESI assembly cache bytes",
+	"Number of bytes held in the ESI assembly cache."
+)
+VSC_F(esi_prefetch,		uint64_t, 1, 'c',
+    "ESI include prefetches",
+	"Included objects which were fetched in parallel ahead of"
+	" delivery.  See param esi_prefetch."
+)
 VSC_F(client_drop_late,		uint64_t, 0, 'a',
     "Connection dropped late",
 	""
@@ -530,6 +662,24 @@ VSC_F(n_gunzip,			uint64_t, 0, 'a',
     "Gunzip operations",
 	""
 )
+VSC_F(gunzip_cache_hit,		uint64_t, 1, 'c',
+    "Gunzip cache hits",
+	"Count of deliveries to clients which do not accept gzip, served"
+	" from a cached gunzip'ed body.  See param gunzip_cache."
+)
+VSC_F(gunzip_cache_miss,	uint64_t, 1, 'c',
+    "Gunzip cache misses",
+	"Count of deliveries to clients which do not accept gzip, which"
+	" had to gunzip the object."
+)
+VSC_F(n_gunzip_cache,		uint64_t, 0, 'g',
+    "Gunzip cache bodies",
+	"Number of gunzip'ed bodies held in the gunzip cache."
+)
+VSC_F(gunzip_cache_bytes,	uint64_t, 0, 'g',
+    "Gunzip cache bytes",
+	"Number of bytes held in the gunzip cache."
+)
 
 /**********************************************************************/
 
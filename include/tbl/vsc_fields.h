@@ -147,6 +147,80 @@ VSC_F(happy,			uint64_t, 0, 'b',
     "Happy health probes",
 	""
 )
+VSC_F(idle,			uint64_t, 0, 'g',
+    "Idle connections",
+	""
+)
+VSC_F(reuse,			uint64_t, 0, 'a',
+    "Connections reused",
+	""
+)
+VSC_F(recycle,			uint64_t, 0, 'a',
+    "Connections recycled",
+	""
+)
+VSC_F(toolate,			uint64_t, 0, 'a',
+    "Idle connections failing validation",
+	"Idle connections found closed or readable by the background"
+	" check, and discarded."
+)
+VSC_F(retire,			uint64_t, 0, 'a',
+    "Idle connections retired",
+	"Idle connections closed because of backend_idle_timeout or"
+	" backend_max_age."
+)
+VSC_F(prewarm,			uint64_t, 0, 'a',
+    "Connections opened ahead of demand",
+	"Connections opened to keep backend_min_idle idle connections,"
+	" or because backend_preconnect is set."
+)
+VSC_F(ttfb_p50,			uint64_t, 0, 'g',
+    "Time to first byte, median (us)",
+	"Upper bound of the histogram bucket holding the median time"
+	" from sending the request to the first byte of the response."
+)
+VSC_F(ttfb_p90,			uint64_t, 0, 'g',
+    "Time to first byte, 90th percentile (us)",
+	""
+)
+VSC_F(ttfb_p99,			uint64_t, 0, 'g',
+    "Time to first byte, 99th percentile (us)",
+	""
+)
+
+#endif
+
+/**********************************************************************/
+#ifdef VSC_DO_HIST
+
+VSC_F(count,			uint64_t, 0, 'c',
+    "Samples",
+	"Count of samples.  The histogram buckets follow these counters"
+	" in shared memory, see vapi/vsc_int.h.  They are updated once a"
+	" second."
+)
+VSC_F(sum,			uint64_t, 0, 'c',
+    "Sum of samples (us)",
+	""
+)
+VSC_F(p50,			uint64_t, 0, 'g',
+    "Median (us)",
+	"Upper bound of the histogram bucket holding the median of the"
+	" recent samples.  The counts behind the percentiles are halved"
+	" every ten seconds."
+)
+VSC_F(p90,			uint64_t, 0, 'g',
+    "90th percentile (us)",
+	""
+)
+VSC_F(p99,			uint64_t, 0, 'g',
+    "99th percentile (us)",
+	""
+)
+VSC_F(p999,			uint64_t, 0, 'g',
+    "99.9th percentile (us)",
+	""
+)
 
 #endif
 
@@ -37,25 +37,32 @@
  *
  * Arguments:
  *	Tag-Name
+ *	Binary layout, "" for text records (see below)
  *	Short Description (1 line, max ? chars)
  *	Long Description (in RST "definition list" format)
+ *
+ * Records with a binary layout are written with VSLbb(), and their
+ * payload is the fields back to back in host byte order, one per
+ * letter:
+ *	j	uint64_t, rendered "%ju"
+ *	T	double, rendered "%.9f"
+ * Readers render them to text, with the fields separated by a space.
  */
 
-SLTM(Debug, "Debug messages",
+SLTM(Debug, "", "Debug messages",
 	"Debug messages can normally be ignored, but are sometimes\n"
 	"helpful during trouble-shooting.  Most debug messages must\n"
 	"be explicitly enabled with parameters."
 )
-SLTM(Error, "Error messages",
+SLTM(Error, "", "Error messages",
 	"Error messages are stuff you probably want to know."
 )
-SLTM(CLI, "CLI communication",
+SLTM(CLI, "", "CLI communication",
 	"CLI communication between master and child process."
 )
 
-SLTM(ReqEnd, "Client request end",
+SLTM(ReqEnd, "TTTTT", "Client request end",
 	"Marks the end of client request.\n\n"
-	"xid\n    Transaction id.\n\n"
 	"Trxd\n     Timestamp when the request started.\n\n"
 	"Tidle\n    Timestamp when the request ended.\n\n"
 	"dTrx\n    Time to receive request\n\n"
@@ -65,7 +72,7 @@ SLTM(ReqEnd, "Client request end",
 
 /*---------------------------------------------------------------------*/
 
-SLTM(SessOpen, "Client connection opened",
+SLTM(SessOpen, "", "Client connection opened",
 	"The first record for a client connection, with the\n"
 	"socket-endpoints of the connection.\n\n"
 	"caddr\n    Client IPv4/6 address\n\n"
@@ -86,7 +93,7 @@ SLTM(SessOpen, "Client connection opened",
 #undef SESS_CLOSE
 */
 
-SLTM(SessClose, "Client connection closed",
+SLTM(SessClose, "", "Client connection closed",
 	"SessionClose is the last record for any client connection.\n\n"
 	"reason\n    Why the connection closed.\n\n"
 	"duration\n    How long the session were open.\n\n"
@@ -100,64 +107,64 @@ SLTM(SessClose, "Client connection closed",
 
 /*---------------------------------------------------------------------*/
 
-SLTM(BackendOpen, "Backend connection opened", "")
-SLTM(BackendXID, "The unique ID of the backend transaction", "")
-SLTM(BackendReuse, "Backend connection reused", "")
-SLTM(BackendClose, "Backend connection closed", "")
-SLTM(HttpGarbage, "", "")
-SLTM(Backend, "Backend selected", "")
-SLTM(Length, "Size of object body", "")
+SLTM(BackendOpen, "", "Backend connection opened", "")
+SLTM(BackendXID, "", "The unique ID of the backend transaction", "")
+SLTM(BackendReuse, "", "Backend connection reused", "")
+SLTM(BackendClose, "", "Backend connection closed", "")
+SLTM(HttpGarbage, "", "", "")
+SLTM(Backend, "", "Backend selected", "")
+SLTM(Length, "j", "Size of object body", "")
 
-SLTM(FetchError, "Error while fetching object", "")
+SLTM(FetchError, "", "Error while fetching object", "")
 
-#define SLTH(aa, bb)	SLTM(Req##aa, "", "")
+#define SLTH(aa, bb)	SLTM(Req##aa, "", "", "")
 #include "tbl/vsl_tags_http.h"
 #undef SLTH
 
-#define SLTH(aa, bb)	SLTM(Resp##aa, "", "")
+#define SLTH(aa, bb)	SLTM(Resp##aa, "", "", "")
 #include "tbl/vsl_tags_http.h"
 #undef SLTH
 
-#define SLTH(aa, bb)	SLTM(Bereq##aa, "", "")
+#define SLTH(aa, bb)	SLTM(Bereq##aa, "", "", "")
 #include "tbl/vsl_tags_http.h"
 #undef SLTH
 
-#define SLTH(aa, bb)	SLTM(Beresp##aa, "", "")
+#define SLTH(aa, bb)	SLTM(Beresp##aa, "", "", "")
 #include "tbl/vsl_tags_http.h"
 #undef SLTH
 
-#define SLTH(aa, bb)	SLTM(Obj##aa, "", "")
+#define SLTH(aa, bb)	SLTM(Obj##aa, "", "", "")
 #include "tbl/vsl_tags_http.h"
 #undef SLTH
 
-SLTM(LostHeader, "", "")
+SLTM(LostHeader, "", "", "")
 
-SLTM(TTL, "TTL set on object", "")
-SLTM(Fetch_Body, "Body fetched from backend", "")
-SLTM(VCL_acl, "", "")
-SLTM(VCL_call, "VCL method called", "")
-SLTM(VCL_trace, "VCL trace data", "")
-SLTM(VCL_return, "VCL method return value", "")
-SLTM(ReqStart, "Client request start", "")
-SLTM(Hit, "Hit object in cache", "")
-SLTM(HitPass, "Hit for pass object in cache", "")
-SLTM(ExpBan, "Object evicted due to ban", "")
-SLTM(ExpKill, "Object expired", "")
-SLTM(WorkThread, "", "")
+SLTM(TTL, "", "TTL set on object", "")
+SLTM(Fetch_Body, "", "Body fetched from backend", "")
+SLTM(VCL_acl, "", "", "")
+SLTM(VCL_call, "", "VCL method called", "")
+SLTM(VCL_trace, "", "VCL trace data", "")
+SLTM(VCL_return, "", "VCL method return value", "")
+SLTM(ReqStart, "", "Client request start", "")
+SLTM(Hit, "", "Hit object in cache", "")
+SLTM(HitPass, "", "Hit for pass object in cache", "")
+SLTM(ExpBan, "", "Object evicted due to ban", "")
+SLTM(ExpKill, "", "Object expired", "")
+SLTM(WorkThread, "", "", "")
 
-SLTM(ESI_xmlerror, "Error while parsing ESI tags", "")
+SLTM(ESI_xmlerror, "", "Error while parsing ESI tags", "")
 
-SLTM(Hash, "Value added to hash", "")
+SLTM(Hash, "", "Value added to hash", "")
 
-SLTM(Backend_health, "Backend health check", "")
+SLTM(Backend_health, "", "Backend health check", "")
 
-SLTM(VCL_Debug, "Unused", "")
-SLTM(VCL_Log, "Log statement from VCL", "")
-SLTM(VCL_Error, "", "")
+SLTM(VCL_Debug, "", "Unused", "")
+SLTM(VCL_Log, "", "Log statement from VCL", "")
+SLTM(VCL_Error, "", "", "")
 
-SLTM(Gzip, "G(un)zip performed on object", "")
+SLTM(Gzip, "", "G(un)zip performed on object", "")
 
-SLTM(Link, "Linkage between different VXIDs",
+SLTM(Link, "", "Linkage between different VXIDs",
 	"Links this records VXID to its parent VXID\n"
 	"The first field gives the type of the parent:\n"
 	"    req     Request\n"
@@ -166,3 +173,8 @@ SLTM(Link, "Linkage between different VXIDs",
 	"    esireq  ESI subrequest\n"
 	"The second field gives the VXID if the parent.\n"
 )
+
+SLTM(BereqEnd, "", "Backend request end",
+	"Marks the end of a backend request, it is the last record\n"
+	"with the VXID of the backend request."
+)
@@ -63,6 +63,10 @@ struct VSC_C_main *VSC_Main(struct VSM_data *vd);
 	/*
 	 * return Main stats structure
 	 * returns NULL until child has been started.
+	 *
+	 * The structure is a private copy, summed up from the shared
+	 * memory shards.  Every call to VSC_Main() or VSC_Iter()
+	 * refreshes it.
 	 */
 
 struct VSC_desc {
@@ -91,6 +95,9 @@ int VSC_Iter(struct VSM_data *vd, VSC_iter_f *func, void *priv);
 	 * Func is called with pt == NULL, whenever VSM allocations
 	 * change (child restart, allocations/deallocations)
 	 *
+	 * The main counters point into the copy VSC_Main() returns,
+	 * and are refreshed by each call.
+	 *
 	 * Returns:
 	 *	!=0:	func returned non-zero
 	 *	-1:	No VSC's available
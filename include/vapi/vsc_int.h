@@ -36,6 +36,25 @@
 #define VSC_TYPE_VBE		"VBE"
 #define VSC_TYPE_LCK		"LCK"
 #define VSC_TYPE_MEMPOOL	"MEMPOOL"
+#define VSC_TYPE_HIST		"HIST"
+#define VSC_TYPE_SHARD		"SHARD"
+
+/*
+ * Busy counters of the MAIN segment are updated in per-CPU SHARD
+ * segments instead, to keep the CPUs from fighting over cache lines.
+ * Each SHARD is a struct VSC_C_main, and the value of a counter is
+ * the sum, modulo 2^64, of the MAIN and all the SHARD copies of it.
+ * VSC_Main() and VSC_Iter() do this summing.
+ */
+
+/*
+ * A HIST segment is a struct VSC_C_hist followed by VSC_HIST_NBUCKET
+ * uint64_t bucket counters.  Bucket 0-3 count samples of 0-3
+ * microseconds, above that there are four buckets per power of two,
+ * bucket u > 3 holding samples below (u % 4 + 5) << (u / 4 - 1)
+ * microseconds.  The last bucket also holds everything longer.
+ */
+#define VSC_HIST_NBUCKET	128
 
 #define VSC_F(n, t, l, f, e, d)	t n;
 
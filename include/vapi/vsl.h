@@ -37,6 +37,14 @@
  * and once VSL_Dispatch()/VSL_NextSLT() will indicate EOF by returning -2.
  * Another file can then be opened with VSL_Arg() and processed.
  *
+ * The file can be a plain dump of records (varnishlog -w) or an indexed
+ * archive (varnishlog -W).  An archive can be queried with one or more
+ * -q arguments, before or after the -r:
+ *	vxid=N		Records of transaction N
+ *	url=URL		Transactions with this ReqURL or BereqURL
+ *	from=T, to=T	Requests with ReqEnd in this time window (time_t)
+ * Only the blocks of the archive which may match are read.
+ *
  */
 
 #ifndef VAPI_VSL_H_INCLUDED
@@ -50,7 +58,7 @@ struct VSM_data;
  * VSL level access functions
  */
 
-#define VSL_ARGS	"bCcdI:i:k:n:r:s:X:x:m:"
+#define VSL_ARGS	"bCcdI:i:k:n:q:r:s:X:x:m:"
 #define VSL_b_USAGE	"[-b]"
 #define VSL_c_USAGE	"[-c]"
 #define VSL_C_USAGE	"[-C]"
@@ -60,6 +68,7 @@ struct VSM_data;
 #define VSL_k_USAGE	"[-k keep]"
 #define VSL_m_USAGE	"[-m tag:regex]"
 #define VSL_n_USAGE	VSM_n_USAGE
+#define VSL_q_USAGE	"[-q query]"
 #define VSL_r_USAGE	"[-r file]"
 #define VSL_s_USAGE	"[-s skip]"
 #define VSL_x_USAGE	"[-x tag]"
@@ -71,6 +80,7 @@ struct VSM_data;
 			VSL_k_USAGE " "		\
 			VSL_m_USAGE " "		\
 			VSL_n_USAGE " "		\
+			VSL_q_USAGE " "		\
 			VSL_r_USAGE " "		\
 			VSL_s_USAGE " "		\
 			VSL_X_USAGE " "		\
@@ -123,17 +133,147 @@ int VSL_Dispatch(struct VSM_data *vd, VSL_handler_f *func, void *priv);
 	 *	0:	no VSL records.
 	 *	-1:	VSL chunk was abandoned.
 	 *	-2:	End of file (-r) / -k arg exhausted / "done"
+	 *	-3:	Overrun, varnishd lapped us and records were lost,
+	 *		VSM_Error() says so.  Reading resumes at the front
+	 *		of the log on the next call.
+	 */
+
+/*---------------------------------------------------------------------
+ * Indexed archives
+ */
+
+struct VSL_archive;
+
+struct VSL_archive *VSL_ArchiveNew(int fd);
+	/*
+	 * Write an archive to fd.  If fd is a non-empty file, it must be
+	 * an archive opened for reading and writing, and the new records
+	 * are appended to it.
+	 * Returns NULL on error, with errno EINVAL if fd is not an archive.
+	 */
+
+int VSL_ArchiveRecord(struct VSL_archive *va, const uint32_t *p);
+	/*
+	 * Add a record, as returned by VSL_NextSLT().  Records are written
+	 * out a block at a time.
+	 * Returns -1 on write error.
+	 */
+
+int VSL_ArchiveIdle(struct VSL_archive *va);
+	/*
+	 * Call when there are no records to write.  Writes out the
+	 * current block if it was started more than a second ago.
+	 * Returns -1 on write error.
+	 */
+
+int VSL_ArchiveFlush(struct VSL_archive *va);
+	/*
+	 * Write out the current block.
+	 * Returns -1 on write error.
+	 */
+
+void VSL_ArchiveDelete(struct VSL_archive *va);
+	/*
+	 * Free the archive writer, without flushing.  The fd is left open.
+	 */
+
+/*---------------------------------------------------------------------
+ * Transactions
+ *
+ * The records of a transaction all carry its VXID, and the transaction
+ * is done at the record which ends it: ReqEnd for a request, SessClose
+ * for a session and BereqEnd for a backend request.  Link records tie
+ * requests to their session and backend requests to their request.
+ */
+
+enum VSL_tx_type_e {
+	VSL_t_unknown,
+	VSL_t_sess,
+	VSL_t_req,
+	VSL_t_bereq,
+};
+
+struct VSL_transaction {
+	unsigned		vxid;
+	enum VSL_tx_type_e	type;
+	unsigned		vxid_parent;	/* 0 if none */
+	enum VSL_tx_type_e	type_parent;
+	int			complete;	/* End record seen */
+	uint64_t		bitmap;		/* -m matches */
+	const uint32_t		*b;		/* First record */
+	const uint32_t		*e;		/* End of records */
+};
+	/*
+	 * Walk the records with:
+	 *	for (p = t->b; p < t->e; p = VSL_NEXT(p))
+	 * Binary records are as VSL_NextSLT() returns them.
+	 */
+
+typedef int VSL_tx_handler_f(void *priv, const struct VSL_transaction *t);
+	/*
+	 * The transaction and its records are only valid during the call,
+	 * unless the handler calls VSL_TxKeep().
+	 */
+
+int VSL_DispatchTx(struct VSM_data *vd, VSL_tx_handler_f *func, void *priv);
+	/*
+	 * Call func(priv, ...) for all transactions of the filtered VSL
+	 * records, as their end record arrives.  Transactions which are
+	 * still open at end of file, or pushed out by the limit, are
+	 * passed with complete == 0.  Records with VXID zero are not
+	 * part of any transaction and are skipped.  Binary records are
+	 * passed on as they are, see VSL_Render().  On an overrun the
+	 * open transactions are dropped, they have lost records.
+	 *
+	 * Return values as for VSL_Dispatch().
+	 */
+
+void VSL_TxLimit(struct VSM_data *vd, unsigned limit);
+	/*
+	 * Limit the number of open transactions VSL_DispatchTx() will
+	 * keep, and thus its memory use.  Default 10000.
+	 */
+
+void VSL_TxKeep(struct VSM_data *vd, const struct VSL_transaction *t);
+	/*
+	 * Called from the VSL_DispatchTx() handler, keep t and its
+	 * records valid after the handler returns, until VSL_TxRelease().
+	 * This lets the records be handed to another thread without
+	 * copying them.  Kept transactions do not count towards the
+	 * VSL_TxLimit().
+	 */
+
+void VSL_TxRelease(struct VSM_data *vd, const struct VSL_transaction *t);
+	/*
+	 * Give a transaction kept with VSL_TxKeep() back for reuse.  Like
+	 * VSL_TxKeep(), this must be called from the thread which calls
+	 * VSL_DispatchTx().
 	 */
 
 int VSL_NextSLT(struct VSM_data *lh, uint32_t **pp, uint64_t *bitmap);
 	/*
 	 * Return raw pointer to next filtered VSL record.
 	 *
+	 * Binary records are returned rendered as the text records
+	 * they replace, so VSL_BINARY() is never true for them.
+	 *
 	 * Return values:
 	 *	1:	Valid VSL record at *pp
 	 *	0:	no VSL records
 	 *	-1:	VSL chunk was abandoned
 	 *	-2:	End of file (-r) / -k arg exhausted / "done"
+	 *	-3:	Overrun, see VSL_Dispatch()
+	 */
+
+unsigned VSL_Render(const uint32_t *p, char *buf, unsigned len);
+	/*
+	 * Render the content of a binary record (VSL_BINARY(p)) as text
+	 * into buf.  Only the records in the transactions passed on by
+	 * VSL_DispatchTx() are left binary, VSL_Dispatch() and
+	 * VSL_NextSLT() do this for you.
+	 *
+	 * Return value:
+	 *	Length of the text, excluding the terminating NUL.
 	 */
 
 int VSL_Matched(struct VSM_data *vd, uint64_t bitmap);
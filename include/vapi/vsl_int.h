@@ -45,10 +45,14 @@
  * whenever writing the log starts from the front.
  *
  * Each logrecord consist of:
- *	[n]		= ((type & 0xff) << 24) | (length & 0xffff)
+ *	[n]		= ((type & 0xff) << 24) | (binary << 16) |
+ *			  (length & 0xffff)
  *	[n + 1]		= ((marker & 0x03) << 30) | (identifier & 0x3fffffff)
  *	[n + 2] ... [m]	= content
  *
+ * If the binary bit is set, the content is laid out as described by
+ * the format of the tag in tbl/vsl_tags.h, rather than text.
+ *
  * Notice that the constants in these macros cannot be changed without
  * changing corresponding magic numbers in varnishd/cache/cache_shmlog.c
  */
@@ -58,6 +62,7 @@
 #define VSL_IDENTMASK		(~(3U<<30))
 
 #define VSL_LENMASK		0xffff
+#define VSL_BINMARKER		(1U<<16)
 #define VSL_WORDS(len)		(((len) + 3) / 4)
 #define VSL_END(ptr, len)	((ptr) + 2 + VSL_WORDS(len))
 #define VSL_NEXT(ptr)		VSL_END(ptr, VSL_LEN(ptr))
@@ -66,7 +71,9 @@
 #define VSL_ID(ptr)		(((ptr)[1]) & VSL_IDENTMASK)
 #define VSL_CLIENT(ptr)		(((ptr)[1]) & VSL_CLIENTMARKER)
 #define VSL_BACKEND(ptr)	(((ptr)[1]) & VSL_BACKENDMARKER)
+#define VSL_BINARY(ptr)		(((ptr)[0]) & VSL_BINMARKER)
 #define VSL_DATA(ptr)		((char*)((ptr)+2))
+#define VSL_CDATA(ptr)		((const char*)((ptr)+2))
 
 #define VSL_ENDMARKER	(((uint32_t)SLT__Reserved << 24) | 0x454545) /* "EEE" */
 #define VSL_WRAPMARKER	(((uint32_t)SLT__Reserved << 24) | 0x575757) /* "WWW" */
@@ -77,7 +84,7 @@
  */
 enum VSL_tag_e {
 	SLT__Bogus = 0,
-#define SLTM(foo,sdesc,ldesc)	SLT_##foo,
+#define SLTM(foo,fmt,sdesc,ldesc)	SLT_##foo,
 #include "tbl/vsl_tags.h"
 #undef SLTM
 	SLT__Reserved = 254,
@@ -78,6 +78,7 @@ struct vsc {
 	VTAILQ_HEAD(, vsc_sf)	sf_list;
 	struct VSM_fantom	main_fantom;
 	struct VSM_fantom	iter_fantom;
+	struct VSC_C_main	main_sum;	/* MAIN plus SHARDs */
 };
 
 
@@ -226,6 +227,33 @@ VSC_Arg(struct VSM_data *vd, int arg, const char *opt)
 	}
 }
 
+/*--------------------------------------------------------------------
+ * Add up the MAIN segment and its per-CPU shards, see vapi/vsc_int.h
+ */
+
+static void
+vsc_sum(struct VSM_data *vd, struct vsc *vsc)
+{
+	struct VSM_fantom vf;
+	const volatile uint64_t *s;
+	uint64_t *d;
+	unsigned u, n;
+
+	d = (void*)&vsc->main_sum;
+	n = sizeof vsc->main_sum / sizeof *d;
+	s = vsc->main_fantom.b;
+	for (u = 0; u < n; u++)
+		d[u] = s[u];
+	VSM_FOREACH_SAFE(&vf, vd) {
+		if (strcmp(vf.chunk->class, VSC_CLASS) ||
+		    strcmp(vf.chunk->type, VSC_TYPE_SHARD))
+			continue;
+		s = vf.b;
+		for (u = 0; u < n; u++)
+			d[u] += s[u];
+	}
+}
+
 /*--------------------------------------------------------------------*/
 
 struct VSC_C_main *
@@ -237,7 +265,8 @@ VSC_Main(struct VSM_data *vd)
 		return (NULL);
 	if (!VSM_Get(vd, &vsc->main_fantom, VSC_CLASS, "", ""))
 		return (NULL);
-	return ((void*)vsc->main_fantom.b);
+	vsc_sum(vd, vsc);
+	return (&vsc->main_sum);
 }
 
 /*--------------------------------------------------------------------
@@ -264,13 +293,13 @@ vsc_add_pt(struct vsc *vsc, const char *class, const char *ident,
 #define VSC_DO(U,l,t)							\
 	static void							\
 	iter_##l(struct vsc *vsc, struct VSM_fantom *vf,		\
-	    const struct VSC_desc *descs)				\
+	    const struct VSC_desc *descs, void *b)			\
 	{								\
 		struct VSC_C_##l *st;					\
 		const char *class = t;					\
 									\
 		CHECK_OBJ_NOTNULL(vsc, VSC_MAGIC);			\
-		st = vf->b;						\
+		st = b;							\
 
 #define VSC_F(nn,tt,ll,ff,dd,ee)					\
 		vsc_add_pt(vsc, class, vf->chunk->ident, descs++,	\
@@ -300,12 +329,18 @@ vsc_build_pt_list(struct VSM_data *vd)
 	VSM_FOREACH_SAFE(&vf, vd) {
 		if (strcmp(vf.chunk->class, VSC_CLASS))
 			continue;
+		if (!strcmp(vf.chunk->type, VSC_TYPE_MAIN)) {
+			/* Point at the sum, not the shared memory */
+			vsc->main_fantom = vf;
+			iter_main(vsc, &vf, VSC_desc_main, &vsc->main_sum);
+			continue;
+		}
 		/*lint -save -e525 -e539 */
 #define VSC_F(n,t,l,f,d,e)
 #define VSC_DONE(a,b,c)
 #define VSC_DO(U,l,t)						\
 		if (!strcmp(vf.chunk->type, t))			\
-			iter_##l(vsc, &vf, VSC_desc_##l);
+			iter_##l(vsc, &vf, VSC_desc_##l, vf.b);
 #include "tbl/vsc_all.h"
 #undef VSC_F
 #undef VSC_DO
@@ -390,6 +425,8 @@ VSC_Iter(struct VSM_data *vd, VSC_iter_f *func, void *priv)
 		vsc_filter_pt_list(vd);
 	}
 	AN(vd->head);
+	if (VSM_StillValid(vd, &vsc->main_fantom) == 1)
+		vsc_sum(vd, vsc);
 	VTAILQ_FOREACH(pt, &vsc->pt_list, list) {
 		i = func(priv, &pt->point);
 		if (i)
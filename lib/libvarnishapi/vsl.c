@@ -55,13 +55,93 @@
 /*--------------------------------------------------------------------*/
 
 const char *VSL_tags[256] = {
-#  define SLTM(foo,sdesc,ldesc)       [SLT_##foo] = #foo,
+#  define SLTM(foo,fmt,sdesc,ldesc)   [SLT_##foo] = #foo,
+#  include "tbl/vsl_tags.h"
+#  undef SLTM
+};
+
+static const char *vsl_fmts[256] = {
+#  define SLTM(foo,fmt,sdesc,ldesc)   [SLT_##foo] = fmt,
 #  include "tbl/vsl_tags.h"
 #  undef SLTM
 };
 
 /*--------------------------------------------------------------------*/
 
+unsigned
+VSL_Render(const uint32_t *p, char *buf, unsigned len)
+{
+	const char *f, *d;
+	unsigned l, n;
+	uint64_t u;
+	double t;
+	int i;
+
+	AN(VSL_BINARY(p));
+	AN(buf);
+	assert(len > 0);
+	*buf = '\0';
+	f = vsl_fmts[VSL_TAG(p)];
+	if (f == NULL)
+		return (0);
+	d = VSL_CDATA(p);
+	l = VSL_LEN(p);
+	for (n = 0; *f != '\0'; f++) {
+		switch (*f) {
+		case 'j':
+			if (l < sizeof u)
+				return (n);
+			memcpy(&u, d, sizeof u);
+			d += sizeof u;
+			l -= sizeof u;
+			i = snprintf(buf + n, len - n, "%s%ju",
+			    n > 0 ? " " : "", (uintmax_t)u);
+			break;
+		case 'T':
+			if (l < sizeof t)
+				return (n);
+			memcpy(&t, d, sizeof t);
+			d += sizeof t;
+			l -= sizeof t;
+			i = snprintf(buf + n, len - n, "%s%.9f",
+			    n > 0 ? " " : "", t);
+			break;
+		default:
+			return (n);
+		}
+		if (i < 0 || (unsigned)i >= len - n)
+			return (len - 1);	/* Truncated */
+		n += i;
+	}
+	return (n);
+}
+
+/*--------------------------------------------------------------------
+ * The text of a record, binary records are rendered on first use.
+ */
+
+static const char *
+vsl_text(struct vsl *vsl, const uint32_t *p, unsigned *lp)
+{
+	unsigned l;
+
+	if (!VSL_BINARY(p)) {
+		*lp = VSL_LEN(p);
+		return (VSL_CDATA(p));
+	}
+	if (vsl->tptr != p) {
+		l = VSL_Render(p, VSL_DATA(vsl->trec),
+		    sizeof vsl->trec - 2 * sizeof *vsl->trec);
+		vsl->trec[0] = (p[0] & ~(VSL_BINMARKER | VSL_LENMASK)) | l;
+		vsl->trec[1] = p[1];
+		vsl->tptr = p;
+	}
+	*lp = VSL_LEN(vsl->trec);
+	return (VSL_CDATA(vsl->trec));
+}
+
+/*--------------------------------------------------------------------*/
+
 struct vsl *
 vsl_Setup(struct VSM_data *vd)
 {
@@ -99,6 +179,8 @@ VSL_Delete(struct VSM_data *vd)
 
 	if (vsl->r_fd > STDIN_FILENO)
 		(void)close(vsl->r_fd);
+	vsl_tx_delete(vsl);
+	vsla_delete(vsl);
 	vbit_destroy(vsl->vbm_supress);
 	vbit_destroy(vsl->vbm_select);
 	free(vsl->rbuf);
@@ -165,6 +247,49 @@ vsl_close(struct VSM_data *vd)
 	vsl->log_ptr = NULL;
 }
 
+/*--------------------------------------------------------------------
+ * Read the -r file in large chunks and hand out the records directly
+ * from the buffer.  A record is valid until the next call.
+ */
+
+static int
+vsl_readfile(struct vsl *vsl, uint32_t **pp)
+{
+	uint32_t *p;
+	unsigned l;
+	ssize_t i;
+
+	while (1) {
+		l = 8;
+		if (vsl->rlen - vsl->roff >= l) {
+			p = vsl->rbuf + vsl->roff / 4;
+			l = (2 + VSL_WORDS(VSL_LEN(p))) * 4;
+			if (vsl->rlen - vsl->roff >= l) {
+				vsl->roff += l;
+				*pp = p;
+				return (1);
+			}
+		}
+		/* Move the partial record to the front and read more */
+		memmove(vsl->rbuf, (char *)vsl->rbuf + vsl->roff,
+		    vsl->rlen - vsl->roff);
+		vsl->rlen -= vsl->roff;
+		vsl->roff = 0;
+		if (vsl->rbuflen * 4L < l) {
+			vsl->rbuflen = l / 4;
+			vsl->rbuf = realloc(vsl->rbuf, vsl->rbuflen * 4L);
+			AN(vsl->rbuf);
+		}
+		i = read(vsl->r_fd, (char *)vsl->rbuf + vsl->rlen,
+		    vsl->rbuflen * 4L - vsl->rlen);
+		if (i == 0 && vsl->rlen == 0)
+			return (-2);
+		if (i <= 0)
+			return (-1);
+		vsl->rlen += i;
+	}
+}
+
 /*--------------------------------------------------------------------
  * Return the next log record, if there is one
  *
@@ -178,31 +303,13 @@ static int
 vsl_nextslt(struct VSM_data *vd, uint32_t **pp)
 {
 	struct vsl *vsl = vsl_Setup(vd);
-	unsigned l;
 	uint32_t t;
-	int i;
 
 	*pp = NULL;
-	if (vsl->r_fd != -1) {
-		assert(vsl->rbuflen >= 8);
-		i = read(vsl->r_fd, vsl->rbuf, 8);
-		if (i == 0)
-			return (-2);
-		if (i != 8)
-			return (-1);
-		l = 2 + VSL_WORDS(VSL_LEN(vsl->rbuf));
-		if (vsl->rbuflen < l) {
-			l += 256;
-			vsl->rbuf = realloc(vsl->rbuf, l * 4L);
-			assert(vsl->rbuf != NULL);
-			vsl->rbuflen = l;
-		}
-		i = read(vsl->r_fd, vsl->rbuf + 2, l * 4L - 8L);
-		if (i != (l * 4L - 8L))
-			return (-1);
-		*pp = vsl->rbuf;
-		return (1);
-	}
+	if (vsl->r_fd != -1 && vsl->ra != NULL)
+		return (vsla_next(vsl, pp));
+	if (vsl->r_fd != -1)
+		return (vsl_readfile(vsl, pp));
 
 	if (vsl->log_ptr == NULL && vsl_open(vd))
 		return (0);
@@ -238,20 +345,38 @@ vsl_nextslt(struct VSM_data *vd, uint32_t **pp)
 		if (vsl->log_ptr == vsl->log_start + 1)
 			vsl->last_seq = vsl->log_start[0];
 
+		if (vsl->log_start[0] - vsl->last_seq > 1 ||
+		    VSL_NEXT(vsl->log_ptr) >= vsl->log_end) {
+			/*
+			 * The writer wrapped twice since we were at the
+			 * front, or we read a garbage length: it lapped us
+			 * and the records in between are lost.
+			 */
+			vsl->log_ptr = vsl->log_start + 1;
+			(void)vsm_diag(vd, "VSL overrun, records were lost\n");
+			return (-3);
+		}
+
 		*pp = (void*)(uintptr_t)vsl->log_ptr; /* Loose volatile */
 		vsl->log_ptr = VSL_NEXT(vsl->log_ptr);
 		return (1);
 	}
 }
 
+/*--------------------------------------------------------------------
+ * The next filtered record, binary records are returned as they are.
+ */
+
 int
-VSL_NextSLT(struct VSM_data *vd, uint32_t **pp, uint64_t *bits)
+vsl_next(struct VSM_data *vd, uint32_t **pp, uint64_t *bits)
 {
 	struct vsl *vsl = vsl_Setup(vd);
 	uint32_t *p;
 	unsigned char t;
 	int i;
 	struct vsl_re_match *vrm;
+	const char *txt;
+	unsigned l;
 	int j;
 
 	if (bits != NULL)
@@ -259,6 +384,7 @@ VSL_NextSLT(struct VSM_data *vd, uint32_t **pp, uint64_t *bits)
 
 	while (1) {
 		i = vsl_nextslt(vd, &p);
+		vsl->tptr = NULL;
 		if (i < 0)
 			return (i);
 		if (i == 0) {
@@ -281,12 +407,14 @@ VSL_NextSLT(struct VSM_data *vd, uint32_t **pp, uint64_t *bits)
 		} else if (vsl->c_opt && !VSL_CLIENT(p)) {
 			continue;
 		} else if (vsl->regincl != NULL) {
-			i = VRE_exec(vsl->regincl, VSL_DATA(p), VSL_LEN(p),
+			txt = vsl_text(vsl, p, &l);
+			i = VRE_exec(vsl->regincl, txt, l,
 			    0, 0, NULL, 0, NULL);
 			if (i == VRE_ERROR_NOMATCH)
 				continue;
 		} else if (vsl->regexcl != NULL) {
-			i = VRE_exec(vsl->regexcl, VSL_DATA(p), VSL_LEN(p),
+			txt = vsl_text(vsl, p, &l);
+			i = VRE_exec(vsl->regexcl, txt, l,
 			    0, 0, NULL, 0, NULL);
 			if (i != VRE_ERROR_NOMATCH)
 				continue;
@@ -304,8 +432,9 @@ VSL_NextSLT(struct VSM_data *vd, uint32_t **pp, uint64_t *bits)
 			j = 0;
 			VTAILQ_FOREACH(vrm, &vsl->matchers, next) {
 				if (vrm->tag == t) {
-					i = VRE_exec(vrm->re, VSL_DATA(p),
-					    VSL_LEN(p), 0, 0, NULL, 0, NULL);
+					txt = vsl_text(vsl, p, &l);
+					i = VRE_exec(vrm->re, txt, l,
+					    0, 0, NULL, 0, NULL);
 					if (i >= 0)	/* XXX ?? */
 						*bits |= (uintmax_t)1 << j;
 				}
@@ -317,29 +446,46 @@ VSL_NextSLT(struct VSM_data *vd, uint32_t **pp, uint64_t *bits)
 	}
 }
 
+int
+VSL_NextSLT(struct VSM_data *vd, uint32_t **pp, uint64_t *bits)
+{
+	struct vsl *vsl = vsl_Setup(vd);
+	unsigned l;
+	int i;
+
+	i = vsl_next(vd, pp, bits);
+	if (i > 0 && VSL_BINARY(*pp)) {
+		(void)vsl_text(vsl, *pp, &l);
+		*pp = vsl->trec;
+	}
+	return (i);
+}
+
 /*--------------------------------------------------------------------*/
 
 int
 VSL_Dispatch(struct VSM_data *vd, VSL_handler_f *func, void *priv)
 {
+	struct vsl *vsl = vsl_Setup(vd);
 	int i;
 	unsigned u, l, s;
 	uint32_t *p;
 	uint64_t bitmap;
+	const char *txt;
 
 	while (1) {
-		i = VSL_NextSLT(vd, &p, &bitmap);
+		i = vsl_next(vd, &p, &bitmap);
 		if (i <= 0)
 			return (i);
 		u = VSL_ID(p);
-		l = VSL_LEN(p);
+		txt = vsl_text(vsl, p, &l);
 		s = 0;
 		if (VSL_CLIENT(p))
 			s |= VSL_S_CLIENT;
 		if (VSL_BACKEND(p))
 			s |= VSL_S_BACKEND;
 		i = func(priv, (enum VSL_tag_e)VSL_TAG(p),
-		    u, l, s, VSL_DATA(p), bitmap);
+		    u, l, s, txt, bitmap);
 		if (i)
 			return (i);
 	}
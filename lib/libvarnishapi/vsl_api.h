@@ -58,8 +58,12 @@ struct vsl {
 
 	/* for -r option */
 	int			r_fd;
-	unsigned		rbuflen;
+	unsigned		rbuflen;	/* words */
 	uint32_t		*rbuf;
+	unsigned		rlen;		/* bytes read into rbuf */
+	unsigned		roff;		/* bytes handed out */
+	struct vsla		*ra;		/* -r file is an archive */
+	struct vsla_query	*rq;		/* -q */
 
 	int			b_opt;
 	int			c_opt;
@@ -86,6 +90,23 @@ struct vsl {
 
 	unsigned long		skip;
 	unsigned long		keep;
+
+	/* Transactions for VSL_DispatchTx() */
+	struct vsl_txs		*txs;
+
+	/* The current binary record, rendered as a text record */
+	const uint32_t		*tptr;
+	uint32_t		trec[2 + VSL_WORDS(1024)];
 };
 
 struct vsl *vsl_Setup(struct VSM_data *vd);
+int vsl_next(struct VSM_data *vd, uint32_t **pp, uint64_t *bits);
+
+/* vsl_tx.c */
+void vsl_tx_delete(struct vsl *vsl);
+
+/* vsl_archive.c */
+int vsla_open(struct VSM_data *vd);
+void vsla_delete(struct vsl *vsl);
+int vsla_query(struct VSM_data *vd, const char *opt);
+int vsla_next(struct vsl *vsl, uint32_t **pp);
@@ -0,0 +1,782 @@
+/*-
+ * Copyright (c) 2012 Varnish Software AS
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Indexed log archives.
+ *
+ * An archive is a file header followed by blocks.  Each block holds up
+ * to VSLA_BLOCK bytes of records, in the same layout as a plain -w file,
+ * compressed on their own so a block can be read without the ones
+ * before it.  In front of the compressed data is a header which indexes
+ * the block: the VXID range, the time range of the requests which ended
+ * in it, the tags present and a bloom filter of the URLs.
+ *
+ * A reader with a query (-q) looks at the block headers only, and skips
+ * over the blocks which cannot contain anything it wants without
+ * reading or decompressing them.  For url= and from=/to= the blocks
+ * whose index matches are first scanned for the VXIDs of the matching
+ * transactions, so their records are found in all the blocks.
+ *
+ * If the writer dies, at most the block it was filling is lost; the
+ * blocks already written are complete.
+ */
+
+#include "config.h"
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "miniobj.h"
+#include "vas.h"
+#include "vdef.h"
+#include "vgz.h"
+
+#include "vapi/vsl.h"
+#include "vapi/vsm.h"
+#include "vapi/vsm_int.h"
+#include "vbm.h"
+#include "vqueue.h"
+#include "vre.h"
+#include "vsl_api.h"
+#include "vsm_api.h"
+
+#define VSLA_BLOCK		(1024 * 1024)
+#define VSLA_NBLOOM		512			/* Bits */
+
+static const char vsla_magic[8] = "VSLArch1";
+
+struct vsla_hdr {
+	uint32_t		magic;
+#define VSLA_HDR_MAGIC		0x7a4c3e05
+	uint32_t		clen;		/* Compressed bytes following */
+	uint32_t		ulen;		/* Bytes of records */
+	uint32_t		nrec;
+	uint32_t		vxid_lo;
+	uint32_t		vxid_hi;
+	double			t_lo;		/* t_req of ReqEnd records */
+	double			t_hi;
+	uint64_t		tags[256 / 64];
+	uint64_t		urls[VSLA_NBLOOM / 64];
+};
+
+/*--------------------------------------------------------------------*/
+
+static void
+vsla_bloom_add(uint64_t *bloom, uint32_t h)
+{
+	unsigned u;
+
+	for (u = 0; u < 3; u++, h >>= 9)
+		bloom[(h % VSLA_NBLOOM) / 64] |=
+		    (uint64_t)1 << ((h % VSLA_NBLOOM) % 64);
+}
+
+static int
+vsla_bloom_test(const uint64_t *bloom, uint32_t h)
+{
+	unsigned u;
+
+	for (u = 0; u < 3; u++, h >>= 9)
+		if (!(bloom[(h % VSLA_NBLOOM) / 64] &
+		    ((uint64_t)1 << ((h % VSLA_NBLOOM) % 64))))
+			return (0);
+	return (1);
+}
+
+static uint32_t
+vsla_hash(const void *p, unsigned l)
+{
+
+	return (crc32(0L, p, l));
+}
+
+#define TAG_SET(h, t)	((h)->tags[(t) / 64] |= (uint64_t)1 << ((t) % 64))
+#define TAG_TEST(h, t)	((h)->tags[(t) / 64] & ((uint64_t)1 << ((t) % 64)))
+
+/* The t_req field of a ReqEnd record */
+
+static int
+vsla_reqend(const uint32_t *p, double *t)
+{
+	char buf[32];
+	unsigned l;
+
+	if (VSL_BINARY(p)) {
+		if (VSL_LEN(p) < sizeof *t)
+			return (0);
+		memcpy(t, VSL_CDATA(p), sizeof *t);
+		return (1);
+	}
+	l = VSL_LEN(p);
+	if (l >= sizeof buf)
+		l = sizeof buf - 1;
+	memcpy(buf, VSL_CDATA(p), l);
+	buf[l] = '\0';
+	return (sscanf(buf, "%lf", t) == 1);
+}
+
+static int
+vsla_isurl(const uint32_t *p)
+{
+
+	return (VSL_TAG(p) == SLT_ReqURL || VSL_TAG(p) == SLT_BereqURL);
+}
+
+/*--------------------------------------------------------------------
+ * Writing
+ */
+
+struct VSL_archive {
+	unsigned		magic;
+#define VSL_ARCHIVE_MAGIC	0x2d1b8e4a
+	int			fd;
+	struct vsla_hdr		hdr;
+	uint32_t		*buf;
+	unsigned		len;		/* Bytes */
+	unsigned char		*cbuf;
+	unsigned long		cspace;
+	time_t			t_flush;
+};
+
+static int
+vsla_write(int fd, const void *p, size_t l)
+{
+	const char *b = p;
+	ssize_t i;
+
+	while (l > 0) {
+		i = write(fd, b, l);
+		if (i < 0 && errno == EINTR)
+			continue;
+		if (i <= 0)
+			return (-1);
+		b += i;
+		l -= i;
+	}
+	return (0);
+}
+
+static void
+vsla_reset(struct VSL_archive *va)
+{
+
+	memset(&va->hdr, 0, sizeof va->hdr);
+	va->hdr.magic = VSLA_HDR_MAGIC;
+	va->len = 0;
+	va->t_flush = time(NULL);
+}
+
+struct VSL_archive *
+VSL_ArchiveNew(int fd)
+{
+	struct VSL_archive *va;
+	struct stat st;
+	char m[sizeof vsla_magic];
+
+	ALLOC_OBJ(va, VSL_ARCHIVE_MAGIC);
+	AN(va);
+	va->fd = fd;
+	va->buf = malloc(VSLA_BLOCK);
+	AN(va->buf);
+	va->cspace = compressBound(VSLA_BLOCK);
+	va->cbuf = malloc(va->cspace);
+	AN(va->cbuf);
+	vsla_reset(va);
+	if (fstat(fd, &st) || st.st_size == 0) {
+		if (vsla_write(fd, vsla_magic, sizeof vsla_magic)) {
+			VSL_ArchiveDelete(va);
+			return (NULL);
+		}
+		return (va);
+	}
+	/* Only append to something which is an archive */
+	errno = 0;
+	if (pread(fd, m, sizeof m, 0) != sizeof m ||
+	    memcmp(m, vsla_magic, sizeof m) ||
+	    lseek(fd, 0, SEEK_END) < 0) {
+		if (errno == 0)
+			errno = EINVAL;
+		VSL_ArchiveDelete(va);
+		return (NULL);
+	}
+	return (va);
+}
+
+int
+VSL_ArchiveFlush(struct VSL_archive *va)
+{
+	uLongf l;
+
+	CHECK_OBJ_NOTNULL(va, VSL_ARCHIVE_MAGIC);
+	if (va->len == 0) {
+		va->t_flush = time(NULL);
+		return (0);
+	}
+	l = va->cspace;
+	AZ(compress2(va->cbuf, &l, (void *)va->buf, va->len, Z_BEST_SPEED));
+	va->hdr.ulen = va->len;
+	va->hdr.clen = l;
+	if (vsla_write(va->fd, &va->hdr, sizeof va->hdr) ||
+	    vsla_write(va->fd, va->cbuf, l))
+		return (-1);
+	vsla_reset(va);
+	return (0);
+}
+
+int
+VSL_ArchiveRecord(struct VSL_archive *va, const uint32_t *p)
+{
+	struct vsla_hdr *h;
+	unsigned l, vxid;
+	double t;
+
+	CHECK_OBJ_NOTNULL(va, VSL_ARCHIVE_MAGIC);
+	l = (VSL_NEXT(p) - p) * 4;
+	if (va->len + l > VSLA_BLOCK && VSL_ArchiveFlush(va))
+		return (-1);
+	assert(va->len + l <= VSLA_BLOCK);
+	memcpy((char *)va->buf + va->len, p, l);
+	va->len += l;
+
+	h = &va->hdr;
+	h->nrec++;
+	TAG_SET(h, VSL_TAG(p));
+	vxid = VSL_ID(p);
+	if (vxid != 0) {
+		if (h->vxid_lo == 0 || vxid < h->vxid_lo)
+			h->vxid_lo = vxid;
+		if (vxid > h->vxid_hi)
+			h->vxid_hi = vxid;
+	}
+	if (VSL_TAG(p) == SLT_ReqEnd && vsla_reqend(p, &t)) {
+		if (h->t_lo == 0 || t < h->t_lo)
+			h->t_lo = t;
+		if (t > h->t_hi)
+			h->t_hi = t;
+	}
+	if (vsla_isurl(p))
+		vsla_bloom_add(h->urls, vsla_hash(VSL_CDATA(p), VSL_LEN(p)));
+	return (0);
+}
+
+int
+VSL_ArchiveIdle(struct VSL_archive *va)
+{
+
+	CHECK_OBJ_NOTNULL(va, VSL_ARCHIVE_MAGIC);
+	if (time(NULL) - va->t_flush < 1)
+		return (0);
+	return (VSL_ArchiveFlush(va));
+}
+
+void
+VSL_ArchiveDelete(struct VSL_archive *va)
+{
+
+	CHECK_OBJ_NOTNULL(va, VSL_ARCHIVE_MAGIC);
+	free(va->buf);
+	free(va->cbuf);
+	FREE_OBJ(va);
+}
+
+/*--------------------------------------------------------------------
+ * Reading
+ */
+
+/* A sorted list of VXIDs */
+
+struct vsla_list {
+	uint32_t		*v;
+	unsigned		n;
+	unsigned		space;
+};
+
+/* The -q arguments, which can be given before or after the -r */
+
+struct vsla_query {
+	unsigned		magic;
+#define VSLA_QUERY_MAGIC	0x0e6c41d3
+	unsigned		vxid;
+	char			*url;
+	unsigned		urllen;
+	uint32_t		urlhash;
+	int			time;
+	double			from;
+	double			to;
+};
+
+struct vsla {
+	unsigned		magic;
+#define VSLA_MAGIC		0x5b1d07e9
+
+	struct vsla_hdr		hdr;
+	unsigned char		*cbuf;
+	unsigned		cspace;
+	uint32_t		*buf;
+	unsigned		space;		/* Bytes */
+	uint32_t		*ptr;
+	uint32_t		*end;
+
+	/* VXIDs of the transactions matching url= and from=/to= */
+	int			collected;
+	struct vsla_list	match;
+};
+
+static void
+vsla_close(struct vsl *vsl)
+{
+	struct vsla *ra;
+
+	ra = vsl->ra;
+	if (ra == NULL)
+		return;
+	CHECK_OBJ_NOTNULL(ra, VSLA_MAGIC);
+	vsl->ra = NULL;
+	free(ra->cbuf);
+	free(ra->buf);
+	free(ra->match.v);
+	FREE_OBJ(ra);
+}
+
+/*
+ * url= and from=/to= are decided by one record of a transaction, but
+ * its other records can be in other blocks.  So we first go through
+ * the archive to find the matching VXIDs, and then read it again.
+ * That needs a file we can seek in.
+ */
+
+static int
+vsla_seekable(struct VSM_data *vd)
+{
+	struct vsl *vsl = vsl_Setup(vd);
+	const struct vsla_query *q = vsl->rq;
+
+	if (q == NULL || (q->url == NULL && !q->time) || vsl->r_fd < 0 ||
+	    lseek(vsl->r_fd, 0, SEEK_CUR) >= 0)
+		return (1);
+	return (vsm_diag(vd, "-q url=, from= and to= need a seekable file\n"));
+}
+
+/*
+ * Called with the first bytes of a -r file in vsl->rbuf.  If it is an
+ * archive, the reader is set up and the magic dropped.
+ */
+
+int
+vsla_open(struct VSM_data *vd)
+{
+	struct vsl *vsl = vsl_Setup(vd);
+	struct vsla *ra;
+
+	vsla_close(vsl);
+	if (vsl->rlen < sizeof vsla_magic ||
+	    memcmp(vsl->rbuf, vsla_magic, sizeof vsla_magic)) {
+		if (vsl->rq != NULL)
+			return (vsm_diag(vd, "-q needs an archive (-W)\n"));
+		return (1);
+	}
+	ALLOC_OBJ(ra, VSLA_MAGIC);
+	AN(ra);
+	vsl->ra = ra;
+	vsl->roff = vsl->rlen = 0;
+	return (vsla_seekable(vd));
+}
+
+void
+vsla_delete(struct vsl *vsl)
+{
+	struct vsla_query *q;
+
+	CHECK_OBJ_NOTNULL(vsl, VSL_MAGIC);
+	vsla_close(vsl);
+	q = vsl->rq;
+	if (q == NULL)
+		return;
+	CHECK_OBJ_NOTNULL(q, VSLA_QUERY_MAGIC);
+	vsl->rq = NULL;
+	free(q->url);
+	FREE_OBJ(q);
+}
+
+int
+vsla_query(struct VSM_data *vd, const char *opt)
+{
+	struct vsl *vsl = vsl_Setup(vd);
+	struct vsla_query *q;
+	char *e;
+
+	if (vsl->r_fd >= 0 && vsl->ra == NULL)
+		return (vsm_diag(vd, "-q needs an archive (-W)\n"));
+	q = vsl->rq;
+	if (q == NULL) {
+		ALLOC_OBJ(q, VSLA_QUERY_MAGIC);
+		AN(q);
+		vsl->rq = q;
+	}
+	CHECK_OBJ_NOTNULL(q, VSLA_QUERY_MAGIC);
+	if (!strncmp(opt, "vxid=", 5)) {
+		q->vxid = strtoul(opt + 5, &e, 0);
+		if (*e != '\0' || q->vxid == 0)
+			return (vsm_diag(vd, "Bad -q vxid: \"%s\"\n", opt));
+	} else if (!strncmp(opt, "url=", 4)) {
+		REPLACE(q->url, opt + 4);
+		q->urllen = strlen(q->url);
+		q->urlhash = vsla_hash(q->url, q->urllen);
+	} else if (!strncmp(opt, "from=", 5) || !strncmp(opt, "to=", 3)) {
+		if (!q->time) {
+			q->from = 0;
+			q->to = 1e99;
+			q->time = 1;
+		}
+		if (*opt == 'f')
+			q->from = strtod(opt + 5, &e);
+		else
+			q->to = strtod(opt + 3, &e);
+		if (*e != '\0')
+			return (vsm_diag(vd, "Bad -q time: \"%s\"\n", opt));
+	} else {
+		return (vsm_diag(vd,
+		    "Unknown -q \"%s\" (vxid=, url=, from=, to=)\n", opt));
+	}
+	return (vsla_seekable(vd));
+}
+
+/*--------------------------------------------------------------------*/
+
+static void
+vsla_list_add(struct vsla_list *vl, uint32_t vxid)
+{
+
+	if (vl->n == vl->space) {
+		vl->space = vl->space ? vl->space * 2 : 1024;
+		vl->v = realloc(vl->v, vl->space * sizeof *vl->v);
+		AN(vl->v);
+	}
+	vl->v[vl->n++] = vxid;
+}
+
+static int
+vsla_cmp(const void *a, const void *b)
+{
+	const uint32_t *x = a, *y = b;
+
+	return (*x < *y ? -1 : *x > *y);
+}
+
+/* Sort, and drop the duplicates */
+
+static void
+vsla_list_sort(struct vsla_list *vl)
+{
+	unsigned u, n;
+
+	if (vl->n == 0)
+		return;
+	qsort(vl->v, vl->n, sizeof *vl->v, vsla_cmp);
+	for (u = n = 1; u < vl->n; u++)
+		if (vl->v[u] != vl->v[n - 1])
+			vl->v[n++] = vl->v[u];
+	vl->n = n;
+}
+
+/* Is there a VXID from lo to hi in the list ? */
+
+static int
+vsla_list_range(const struct vsla_list *vl, uint32_t lo, uint32_t hi)
+{
+	unsigned l, h, m;
+
+	l = 0;
+	h = vl->n;
+	while (l < h) {
+		m = l + (h - l) / 2;
+		if (vl->v[m] < lo)
+			l = m + 1;
+		else
+			h = m;
+	}
+	return (l < vl->n && vl->v[l] <= hi);
+}
+
+/* Keep only the VXIDs which are in both lists */
+
+static void
+vsla_list_and(struct vsla_list *vl, const struct vsla_list *vl2)
+{
+	unsigned u, n;
+
+	for (u = n = 0; u < vl->n; u++)
+		if (vsla_list_range(vl2, vl->v[u], vl->v[u]))
+			vl->v[n++] = vl->v[u];
+	vl->n = n;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Skip over a block we do not want, seeking if we can */
+
+static int
+vsla_skip(struct vsl *vsl, struct vsla *ra, unsigned l)
+{
+	ssize_t i;
+
+	if (lseek(vsl->r_fd, l, SEEK_CUR) >= 0)
+		return (0);
+	while (l > 0) {
+		i = read(vsl->r_fd, ra->cbuf, l < ra->cspace ? l : ra->cspace);
+		if (i <= 0)
+			return (-1);
+		l -= i;
+	}
+	return (0);
+}
+
+static int
+vsla_read(int fd, void *p, unsigned l)
+{
+	char *b = p;
+	ssize_t i;
+
+	while (l > 0) {
+		i = read(fd, b, l);
+		if (i < 0 && errno == EINTR)
+			continue;
+		if (i <= 0)
+			return (b == p && i == 0 ? -2 : -1);
+		b += i;
+		l -= i;
+	}
+	return (0);
+}
+
+/* Read the header of the next block, -2 at the end of the archive */
+
+static int
+vsla_header(struct vsl *vsl, struct vsla *ra)
+{
+	struct vsla_hdr *h = &ra->hdr;
+	int i;
+
+	i = vsla_read(vsl->r_fd, h, sizeof *h);
+	if (i)
+		return (i);
+	if (h->magic != VSLA_HDR_MAGIC || h->ulen > VSLA_BLOCK ||
+	    h->clen > compressBound(VSLA_BLOCK))
+		return (-1);
+	if (ra->cspace < h->clen || ra->cbuf == NULL) {
+		free(ra->cbuf);
+		ra->cspace = h->clen > 65536 ? h->clen : 65536;
+		ra->cbuf = malloc(ra->cspace);
+		AN(ra->cbuf);
+	}
+	return (0);
+}
+
+/* Read and uncompress the records of the block */
+
+static int
+vsla_load(struct vsl *vsl, struct vsla *ra)
+{
+	struct vsla_hdr *h = &ra->hdr;
+	uLongf l;
+
+	if (vsla_read(vsl->r_fd, ra->cbuf, h->clen))
+		return (-1);
+	if (ra->space < h->ulen) {
+		free(ra->buf);
+		ra->space = VSLA_BLOCK;
+		ra->buf = malloc(ra->space);
+		AN(ra->buf);
+	}
+	l = h->ulen;
+	if (uncompress((void *)ra->buf, &l, ra->cbuf, h->clen) != Z_OK ||
+	    l != h->ulen)
+		return (-1);
+	ra->ptr = ra->buf;
+	ra->end = ra->buf + l / 4;
+	return (0);
+}
+
+/* The first pass for url= and from=/to=, see vsla_seekable() */
+
+static int
+vsla_collect(struct vsl *vsl, struct vsla *ra, const struct vsla_query *q)
+{
+	struct vsla_hdr *h = &ra->hdr;
+	struct vsla_list l_url, l_time;
+	const uint32_t *p;
+	off_t o;
+	double t;
+	int i, u, tm;
+
+	memset(&l_url, 0, sizeof l_url);
+	memset(&l_time, 0, sizeof l_time);
+	o = lseek(vsl->r_fd, 0, SEEK_CUR);
+	if (o < 0)
+		return (-1);
+	while (1) {
+		i = vsla_header(vsl, ra);
+		if (i == -2)
+			break;
+		if (i)
+			goto fail;
+		u = q->url != NULL && vsla_bloom_test(h->urls, q->urlhash);
+		tm = q->time && TAG_TEST(h, SLT_ReqEnd) &&
+		    h->t_hi >= q->from && h->t_lo <= q->to;
+		if (q->vxid && (q->vxid < h->vxid_lo || q->vxid > h->vxid_hi))
+			u = tm = 0;
+		if (!u && !tm) {
+			if (vsla_skip(vsl, ra, h->clen))
+				goto fail;
+			continue;
+		}
+		if (vsla_load(vsl, ra))
+			goto fail;
+		for (p = ra->ptr; p < ra->end; p = VSL_NEXT(p)) {
+			if (VSL_ID(p) == 0 || (q->vxid && VSL_ID(p) != q->vxid))
+				continue;
+			if (u && vsla_isurl(p) && VSL_LEN(p) == q->urllen &&
+			    !memcmp(VSL_CDATA(p), q->url, q->urllen))
+				vsla_list_add(&l_url, VSL_ID(p));
+			if (tm && VSL_TAG(p) == SLT_ReqEnd &&
+			    vsla_reqend(p, &t) && t >= q->from && t <= q->to)
+				vsla_list_add(&l_time, VSL_ID(p));
+		}
+	}
+	vsla_list_sort(&l_url);
+	vsla_list_sort(&l_time);
+	if (q->url != NULL && q->time)
+		vsla_list_and(&l_url, &l_time);
+	if (q->url != NULL) {
+		ra->match = l_url;
+		free(l_time.v);
+	} else {
+		ra->match = l_time;
+		free(l_url.v);
+	}
+	ra->ptr = ra->end = NULL;
+	if (lseek(vsl->r_fd, o, SEEK_SET) < 0)
+		return (-1);
+	return (0);
+
+    fail:
+	free(l_url.v);
+	free(l_time.v);
+	return (-1);
+}
+
+/* Can the block have anything for us, going by its header only? */
+
+static int
+vsla_want(const struct vsl *vsl, const struct vsla *ra)
+{
+	const struct vsla_query *q = vsl->rq;
+	const struct vsla_hdr *h = &ra->hdr;
+	unsigned u;
+
+	if (q != NULL && q->vxid &&
+	    (q->vxid < h->vxid_lo || q->vxid > h->vxid_hi))
+		return (0);
+	if (q != NULL && (q->url != NULL || q->time) &&
+	    !vsla_list_range(&ra->match, h->vxid_lo, h->vxid_hi))
+		return (0);
+	/* Are all the tags in the block filtered away by -i/-x ? */
+	for (u = 0; u < 256; u++)
+		if (TAG_TEST(h, u) && (vbit_test(vsl->vbm_select, u) ||
+		    !vbit_test(vsl->vbm_supress, u)))
+			return (1);
+	return (0);
+}
+
+static int
+vsla_match(const struct vsla *ra, const struct vsla_query *q,
+    const uint32_t *p)
+{
+
+	if (q == NULL)
+		return (1);
+	if (q->vxid && VSL_ID(p) != q->vxid)
+		return (0);
+	if ((q->url != NULL || q->time) &&
+	    !vsla_list_range(&ra->match, VSL_ID(p), VSL_ID(p)))
+		return (0);
+	return (1);
+}
+
+static int
+vsla_block(struct vsl *vsl, struct vsla *ra)
+{
+	int i;
+
+	while (1) {
+		i = vsla_header(vsl, ra);
+		if (i)
+			return (i);
+		if (vsla_want(vsl, ra))
+			return (vsla_load(vsl, ra));
+		if (vsla_skip(vsl, ra, ra->hdr.clen))
+			return (-1);
+	}
+}
+
+int
+vsla_next(struct vsl *vsl, uint32_t **pp)
+{
+	const struct vsla_query *q = vsl->rq;
+	struct vsla *ra;
+	uint32_t *p;
+	int i;
+
+	ra = vsl->ra;
+	CHECK_OBJ_NOTNULL(ra, VSLA_MAGIC);
+	if (!ra->collected && q != NULL && (q->url != NULL || q->time)) {
+		ra->collected = 1;
+		if (vsla_collect(vsl, ra, q))
+			return (-1);
+	}
+	while (1) {
+		if (ra->ptr >= ra->end) {
+			i = vsla_block(vsl, ra);
+			if (i)
+				return (i);
+			continue;
+		}
+		p = ra->ptr;
+		ra->ptr = VSL_NEXT(p);
+		if (ra->ptr > ra->end)
+			return (-1);
+		if (!vsla_match(ra, q, p))
+			continue;
+		*pp = p;
+		return (1);
+	}
+}
@@ -86,6 +86,7 @@ static int
 vsl_r_arg(struct VSM_data *vd, const char *opt)
 {
 	struct vsl *vsl = vsl_Setup(vd);
+	ssize_t i;
 
 	if (vsl->r_fd > STDIN_FILENO)
 		(void)close(vsl->r_fd);
@@ -97,11 +98,21 @@ vsl_r_arg(struct VSM_data *vd, const char *opt)
 		return (vsm_diag(vd,
 		    "Could not open %s: %s", opt, strerror(errno)));
 	if (vsl->rbuflen == 0) {
-		vsl->rbuflen = BUFSIZ;
-		vsl->rbuf = malloc(vsl->rbuflen);
+		vsl->rbuflen = 65536;
+		vsl->rbuf = malloc(vsl->rbuflen * 4L);
 		AN(vsl->rbuf);
 	}
-	return (1);
+	vsl->rlen = vsl->roff = 0;
+
+	/* Look at the start of the file to see if it is an archive */
+	while (vsl->rlen < 8) {
+		i = read(vsl->r_fd, (char *)vsl->rbuf + vsl->rlen,
+		    8 - vsl->rlen);
+		if (i <= 0)
+			break;
+		vsl->rlen += i;
+	}
+	return (vsla_open(vd));
 }
 
 /*--------------------------------------------------------------------*/
@@ -272,6 +283,7 @@ VSL_Arg(struct VSM_data *vd, int arg, const char *opt)
 	case 's': return (vsl_s_arg(vd, opt));
 	case 'I': case 'X': return (vsl_IX_arg(vd, opt, arg));
 	case 'm': return (vsl_m_arg(vd, opt));
+	case 'q': return (vsla_query(vd, opt));
 	case 'C': vsl->regflags = VRE_CASELESS; return (1);
 	default:
 		return (0);
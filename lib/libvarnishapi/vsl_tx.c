@@ -0,0 +1,399 @@
+/*-
+ * Copyright (c) 2012 Varnish Software AS
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Group log records into transactions.
+ *
+ * Records are collected per VXID until the record which ends the
+ * transaction (ReqEnd, SessClose, BereqEnd) arrives, and the whole
+ * transaction is then handed to the caller in one go.
+ *
+ * The records are copied into a buffer per transaction.  Finished
+ * transactions go on a free list with their buffer, so once the number
+ * of open transactions has settled, no memory is allocated.  The number
+ * of open transactions is limited, when the limit is hit the oldest is
+ * handed to the caller unfinished to make room.
+ *
+ * The caller can keep a transaction past its handler with VSL_TxKeep(),
+ * to pass it on to another thread without copying the records.  It is
+ * parked on the kept list until VSL_TxRelease() frees it.
+ */
+
+#include "config.h"
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "miniobj.h"
+#include "vas.h"
+#include "vdef.h"
+
+#include "vapi/vsl.h"
+#include "vapi/vsm.h"
+#include "vapi/vsm_int.h"
+#include "vqueue.h"
+#include "vre.h"
+#include "vsl_api.h"
+#include "vsm_api.h"
+
+#define VTX_NHASH		4096	/* Power of two */
+#define VTX_MINSPACE		256	/* Words */
+#define VTX_LIMIT		10000
+
+struct vtx {
+	unsigned		magic;
+#define VTX_MAGIC		0x1c7a53e5
+	struct VSL_transaction	t;
+	uint32_t		*buf;
+	unsigned		len;		/* Words used */
+	unsigned		space;		/* Words allocated */
+	int			kept;
+	VTAILQ_ENTRY(vtx)	hash;
+	VTAILQ_ENTRY(vtx)	list;
+};
+
+VTAILQ_HEAD(vtxhead, vtx);
+
+struct vsl_txs {
+	unsigned		magic;
+#define VSL_TXS_MAGIC		0x6f02b3a4
+	unsigned		nopen;
+	unsigned		limit;
+	struct vtxhead		open;		/* Oldest first */
+	struct vtxhead		free;
+	struct vtxhead		kept;
+	struct vtx		*cur;		/* In the handler */
+	struct vtxhead		hash[VTX_NHASH];
+};
+
+/*--------------------------------------------------------------------*/
+
+static struct vsl_txs *
+vtx_setup(struct vsl *vsl)
+{
+	struct vsl_txs *txs;
+	unsigned u;
+
+	if (vsl->txs == NULL) {
+		ALLOC_OBJ(txs, VSL_TXS_MAGIC);
+		AN(txs);
+		txs->limit = VTX_LIMIT;
+		VTAILQ_INIT(&txs->open);
+		VTAILQ_INIT(&txs->free);
+		VTAILQ_INIT(&txs->kept);
+		for (u = 0; u < VTX_NHASH; u++)
+			VTAILQ_INIT(&txs->hash[u]);
+		vsl->txs = txs;
+	}
+	CHECK_OBJ_NOTNULL(vsl->txs, VSL_TXS_MAGIC);
+	return (vsl->txs);
+}
+
+static void
+vtx_free(struct vsl_txs *txs, struct vtx *vtx)
+{
+
+	memset(&vtx->t, 0, sizeof vtx->t);
+	vtx->len = 0;
+	VTAILQ_INSERT_HEAD(&txs->free, vtx, list);
+}
+
+static void
+vtx_retire(struct vsl_txs *txs, struct vtx *vtx)
+{
+
+	CHECK_OBJ_NOTNULL(vtx, VTX_MAGIC);
+	VTAILQ_REMOVE(&txs->hash[vtx->t.vxid & (VTX_NHASH - 1)], vtx, hash);
+	VTAILQ_REMOVE(&txs->open, vtx, list);
+	assert(txs->nopen > 0);
+	txs->nopen--;
+	if (vtx->kept)
+		VTAILQ_INSERT_TAIL(&txs->kept, vtx, list);
+	else
+		vtx_free(txs, vtx);
+}
+
+static int
+vtx_dispatch(struct vsl_txs *txs, struct vtx *vtx, VSL_tx_handler_f *func,
+    void *priv)
+{
+	int i;
+
+	vtx->t.b = vtx->buf;
+	vtx->t.e = vtx->buf + vtx->len;
+	AZ(txs->cur);
+	txs->cur = vtx;
+	i = func(priv, &vtx->t);
+	txs->cur = NULL;
+	vtx_retire(txs, vtx);
+	return (i);
+}
+
+static struct vtx *
+vtx_lookup(struct vsl_txs *txs, unsigned vxid)
+{
+	struct vtx *vtx;
+
+	VTAILQ_FOREACH(vtx, &txs->hash[vxid & (VTX_NHASH - 1)], hash)
+		if (vtx->t.vxid == vxid)
+			return (vtx);
+	return (NULL);
+}
+
+static struct vtx *
+vtx_new(struct vsl_txs *txs, unsigned vxid)
+{
+	struct vtx *vtx;
+
+	vtx = VTAILQ_FIRST(&txs->free);
+	if (vtx != NULL) {
+		VTAILQ_REMOVE(&txs->free, vtx, list);
+	} else {
+		ALLOC_OBJ(vtx, VTX_MAGIC);
+		AN(vtx);
+	}
+	vtx->t.vxid = vxid;
+	VTAILQ_INSERT_HEAD(&txs->hash[vxid & (VTX_NHASH - 1)], vtx, hash);
+	VTAILQ_INSERT_TAIL(&txs->open, vtx, list);
+	txs->nopen++;
+	return (vtx);
+}
+
+static void
+vtx_append(struct vtx *vtx, const uint32_t *p)
+{
+	unsigned l;
+
+	l = VSL_NEXT(p) - p;
+	if (vtx->len + l > vtx->space) {
+		if (vtx->space == 0)
+			vtx->space = VTX_MINSPACE;
+		while (vtx->len + l > vtx->space)
+			vtx->space *= 2;
+		vtx->buf = realloc(vtx->buf, vtx->space * sizeof *vtx->buf);
+		AN(vtx->buf);
+	}
+	memcpy(vtx->buf + vtx->len, p, l * sizeof *p);
+	vtx->len += l;
+}
+
+/*--------------------------------------------------------------------
+ * Link records are "<type> <vxid>", naming the parent ("sess", "req")
+ * or a child ("bereq", "esireq", "bgreq") of this transaction.
+ */
+
+static void
+vtx_link(struct vtx *vtx, const uint32_t *p)
+{
+	char buf[32];
+	unsigned l, vxid;
+	enum VSL_tx_type_e type;
+
+	l = VSL_LEN(p);
+	if (l >= sizeof buf)
+		return;
+	memcpy(buf, VSL_CDATA(p), l);
+	buf[l] = '\0';
+	if (sscanf(buf, "sess %u", &vxid) == 1)
+		type = VSL_t_sess;
+	else if (sscanf(buf, "req %u", &vxid) == 1)
+		type = VSL_t_req;
+	else
+		return;
+	/* A request below another request is below the session too */
+	if (vtx->t.type_parent == VSL_t_req)
+		return;
+	vtx->t.vxid_parent = vxid;
+	vtx->t.type_parent = type;
+}
+
+/*--------------------------------------------------------------------*/
+
+void
+VSL_TxLimit(struct VSM_data *vd, unsigned limit)
+{
+	struct vsl_txs *txs = vtx_setup(vsl_Setup(vd));
+
+	assert(limit > 0);
+	txs->limit = limit;
+}
+
+void
+VSL_TxKeep(struct VSM_data *vd, const struct VSL_transaction *t)
+{
+	struct vsl_txs *txs = vtx_setup(vsl_Setup(vd));
+
+	CHECK_OBJ_NOTNULL(txs->cur, VTX_MAGIC);
+	assert(t == &txs->cur->t);
+	txs->cur->kept = 1;
+}
+
+void
+VSL_TxRelease(struct VSM_data *vd, const struct VSL_transaction *t)
+{
+	struct vsl_txs *txs = vtx_setup(vsl_Setup(vd));
+	struct vtx *vtx;
+
+	AN(t);
+	vtx = (void*)((uintptr_t)t - offsetof(struct vtx, t));
+	CHECK_OBJ_NOTNULL(vtx, VTX_MAGIC);
+	assert(vtx->kept);
+	assert(vtx != txs->cur);
+	vtx->kept = 0;
+	VTAILQ_REMOVE(&txs->kept, vtx, list);
+	vtx_free(txs, vtx);
+}
+
+int
+VSL_DispatchTx(struct VSM_data *vd, VSL_tx_handler_f *func, void *priv)
+{
+	struct vsl_txs *txs = vtx_setup(vsl_Setup(vd));
+	struct vtx *vtx;
+	uint32_t *p;
+	uint64_t bitmap;
+	unsigned vxid;
+	int i, end;
+
+	while (1) {
+		i = vsl_next(vd, &p, &bitmap);
+		if (i == -1 || i == -3) {
+			/*
+			 * The log was abandoned, or we were lapped and lost
+			 * records: these will not finish.
+			 */
+			while (!VTAILQ_EMPTY(&txs->open))
+				vtx_retire(txs, VTAILQ_FIRST(&txs->open));
+			return (i);
+		}
+		if (i == -2) {
+			/* End of input, hand over what we have */
+			while (!VTAILQ_EMPTY(&txs->open)) {
+				vtx = VTAILQ_FIRST(&txs->open);
+				i = vtx_dispatch(txs, vtx, func, priv);
+				if (i)
+					return (i);
+			}
+			return (-2);
+		}
+		if (i == 0)
+			return (i);
+
+		vxid = VSL_ID(p);
+		if (vxid == 0)
+			continue;	/* Not part of a transaction */
+
+		vtx = vtx_lookup(txs, vxid);
+		if (vtx == NULL) {
+			if (txs->nopen >= txs->limit) {
+				i = vtx_dispatch(txs,
+				    VTAILQ_FIRST(&txs->open), func, priv);
+				if (i)
+					return (i);
+			}
+			vtx = vtx_new(txs, vxid);
+		}
+		vtx_append(vtx, p);
+		vtx->t.bitmap |= bitmap;
+
+		end = 0;
+		switch (VSL_TAG(p)) {
+		case SLT_SessOpen:
+			vtx->t.type = VSL_t_sess;
+			break;
+		case SLT_SessClose:
+			vtx->t.type = VSL_t_sess;
+			end = 1;
+			break;
+		case SLT_ReqStart:
+			vtx->t.type = VSL_t_req;
+			break;
+		case SLT_ReqEnd:
+			vtx->t.type = VSL_t_req;
+			end = 1;
+			break;
+		case SLT_BereqEnd:
+			end = 1;
+			break;
+		case SLT_Link:
+			vtx_link(vtx, p);
+			break;
+		default:
+			break;
+		}
+		if (VSL_BACKEND(p))
+			vtx->t.type = VSL_t_bereq;
+		else if (vtx->t.type == VSL_t_unknown &&
+		    vtx->t.type_parent != VSL_t_unknown)
+			vtx->t.type = VSL_t_req;
+
+		if (end) {
+			vtx->t.complete = 1;
+			i = vtx_dispatch(txs, vtx, func, priv);
+			if (i)
+				return (i);
+		}
+	}
+}
+
+/*--------------------------------------------------------------------
+ * Called from VSL_Delete()
+ */
+
+void
+vsl_tx_delete(struct vsl *vsl)
+{
+	struct vsl_txs *txs;
+	struct vtx *vtx;
+	unsigned u;
+
+	txs = vsl->txs;
+	if (txs == NULL)
+		return;
+	vsl->txs = NULL;
+	CHECK_OBJ_NOTNULL(txs, VSL_TXS_MAGIC);
+	for (u = 0; u < VTX_NHASH; u++) {
+		while (!VTAILQ_EMPTY(&txs->hash[u]))
+			vtx_retire(txs, VTAILQ_FIRST(&txs->hash[u]));
+	}
+	while (!VTAILQ_EMPTY(&txs->kept)) {
+		vtx = VTAILQ_FIRST(&txs->kept);
+		VTAILQ_REMOVE(&txs->kept, vtx, list);
+		vtx->kept = 0;
+		vtx_free(txs, vtx);
+	}
+	while (!VTAILQ_EMPTY(&txs->free)) {
+		vtx = VTAILQ_FIRST(&txs->free);
+		VTAILQ_REMOVE(&txs->free, vtx, list);
+		free(vtx->buf);
+		FREE_OBJ(vtx);
+	}
+	FREE_OBJ(txs);
+}
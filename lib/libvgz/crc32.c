@@ -65,11 +65,34 @@
 #endif /* BYFOUR */
 
 /* Local functions for crc concatenation */
-local unsigned long gf2_matrix_times OF((unsigned long *mat,
-                                         unsigned long vec));
-local void gf2_matrix_square OF((unsigned long *square, unsigned long *mat));
+local unsigned long multmodp OF((unsigned long a, unsigned long b));
+local unsigned long x2nmodp OF((z_off64_t n, unsigned k));
 local uLong crc32_combine_(uLong crc1, uLong crc2, z_off64_t len2);
 
+/*
+ * Hardware assisted crc: carry-less multiplication folding (Intel,
+ * "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ
+ * Instruction") where the CPU has it, or the ARMv8 CRC32 instructions
+ * if we are compiled for them.
+ */
+#if defined(__GNUC__) && defined(__x86_64__) && !defined(NO_CRC32_SIMD)
+#  define CRC32_PCLMUL
+#  include <stdint.h>
+#  include <cpuid.h>
+#  include <immintrin.h>
+   local int crc32_have_pclmul OF((void));
+   local unsigned long crc32_pclmul OF((unsigned long,
+                        const unsigned char FAR *, unsigned));
+#endif
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32) && \
+    !defined(NO_CRC32_SIMD)
+#  define CRC32_ARMV8
+#  include <stdint.h>
+#  include <arm_acle.h>
+   local unsigned long crc32_armv8 OF((unsigned long,
+                        const unsigned char FAR *, unsigned));
+#endif
+
 
 #ifdef DYNAMIC_CRC_TABLE
 
@@ -230,6 +253,22 @@ unsigned long ZEXPORT crc32(crc, buf, len)
         make_crc_table();
 #endif /* DYNAMIC_CRC_TABLE */
 
+#ifdef CRC32_ARMV8
+    return crc32_armv8(crc, buf, len);
+#endif /* CRC32_ARMV8 */
+
+#ifdef CRC32_PCLMUL
+    if (len >= 64 && crc32_have_pclmul()) {
+        unsigned n = len & ~15U;
+
+        crc = crc32_pclmul(crc, buf, n);
+        buf += n;
+        len -= n;
+        if (len == 0)
+            return crc;
+    }
+#endif /* CRC32_PCLMUL */
+
 #ifdef BYFOUR
     if (sizeof(void *) == sizeof(ptrdiff_t)) {
         u4 endian;
@@ -338,9 +377,269 @@ local unsigned long crc32_big(crc, buf, len)
 
 #endif /* BYFOUR */
 
-#define GF2_DIM 32      /* dimension of GF(2) vectors (length of CRC) */
+#ifdef CRC32_PCLMUL
 
 /* ========================================================================= */
+local int crc32_have_pclmul()
+{
+    static volatile int have = -1;
+    unsigned eax, ebx, ecx, edx;
+
+    if (have < 0)
+        have = __get_cpuid(1, &eax, &ebx, &ecx, &edx) &&
+            (ecx & bit_PCLMUL) && (ecx & bit_SSE4_1);
+    return have;
+}
+
+/* ========================================================================= */
+/*
+ * Fold four 128 bit lanes in parallel across the buffer, then fold them
+ * into one, and Barrett reduce that to the 32 bit crc.  len must be a
+ * multiple of 16, and at least 64.  The constants are x^(k*32) mod P(x)
+ * for the bit-reflected crc-32 polynomial, from the paper above.
+ */
+__attribute__((target("sse4.1,pclmul")))
+local unsigned long crc32_pclmul(crc, buf, len)
+    unsigned long crc;
+    const unsigned char FAR *buf;
+    unsigned len;
+{
+    static const uint64_t k1k2[2] __attribute__((aligned(16))) =
+        { 0x0154442bd4ULL, 0x01c6e41596ULL };
+    static const uint64_t k3k4[2] __attribute__((aligned(16))) =
+        { 0x01751997d0ULL, 0x00ccaa009eULL };
+    static const uint64_t k5k0[2] __attribute__((aligned(16))) =
+        { 0x0163cd6124ULL, 0x0000000000ULL };
+    static const uint64_t poly[2] __attribute__((aligned(16))) =
+        { 0x01db710641ULL, 0x01f7011641ULL };
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)~(uint32_t)crc));
+    x0 = _mm_load_si128((const __m128i *)k1k2);
+    buf += 64;
+    len -= 64;
+
+    while (len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        y5 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+        y6 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+        y7 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+        y8 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+        buf += 64;
+        len -= 64;
+    }
+
+    /* Fold the four lanes into one */
+    x0 = _mm_load_si128((const __m128i *)k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    while (len >= 16) {
+        x2 = _mm_loadu_si128((const __m128i *)buf);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        buf += 16;
+        len -= 16;
+    }
+
+    /* 128 bits to 64 */
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    /* Barrett reduction to 32 bits */
+    x0 = _mm_load_si128((const __m128i *)poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return (unsigned long)(~(uint32_t)_mm_extract_epi32(x1, 1));
+}
+
+#endif /* CRC32_PCLMUL */
+
+#ifdef CRC32_ARMV8
+
+/* ========================================================================= */
+local unsigned long crc32_armv8(crc, buf, len)
+    unsigned long crc;
+    const unsigned char FAR *buf;
+    unsigned len;
+{
+    uint32_t c;
+
+    c = ~(uint32_t)crc;
+    while (len && ((ptrdiff_t)buf & 7)) {
+        c = __crc32b(c, *buf++);
+        len--;
+    }
+    while (len >= 32) {
+        c = __crc32d(c, *(const uint64_t *)(const void *)(buf + 0));
+        c = __crc32d(c, *(const uint64_t *)(const void *)(buf + 8));
+        c = __crc32d(c, *(const uint64_t *)(const void *)(buf + 16));
+        c = __crc32d(c, *(const uint64_t *)(const void *)(buf + 24));
+        buf += 32;
+        len -= 32;
+    }
+    while (len >= 8) {
+        c = __crc32d(c, *(const uint64_t *)(const void *)buf);
+        buf += 8;
+        len -= 8;
+    }
+    while (len--)
+        c = __crc32b(c, *buf++);
+    return (unsigned long)~c;
+}
+
+#endif /* CRC32_ARMV8 */
+
+/* ========================================================================= */
+/*
+ * Multiply a and b mod p(x), both representing polynomials with the
+ * lowest powers in the highest bits, as the crc itself does.
+ */
+local unsigned long multmodp(a, b)
+    unsigned long a;
+    unsigned long b;
+{
+    unsigned long m, p;
+
+    m = 1UL << 31;
+    p = 0;
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0)
+                break;
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ 0xedb88320UL : b >> 1;
+    }
+    return p;
+}
+
+/* x^(2^n) mod p(x), for n = 0..31 */
+local const unsigned long x2n_table[32] = {
+    0x40000000UL, 0x20000000UL, 0x08000000UL, 0x00800000UL,
+    0x00008000UL, 0xedb88320UL, 0xb1e6b092UL, 0xa06a2517UL,
+    0xed627daeUL, 0x88d14467UL, 0xd7bbfe6aUL, 0xec447f11UL,
+    0x8e7ea170UL, 0x6427800eUL, 0x4d47bae0UL, 0x09fe548fUL,
+    0x83852d0fUL, 0x30362f1aUL, 0x7b5a9cc3UL, 0x31fec169UL,
+    0x9fec022aUL, 0x6c8dedc4UL, 0x15d6874dUL, 0x5fde7a4eUL,
+    0xbad90e37UL, 0x2e4e5eefUL, 0x4eaba214UL, 0xa8a472c0UL,
+    0x429a969eUL, 0x148d302aUL, 0xc40ba6d0UL, 0xc4e22c3cUL
+};
+
+/* x^(n * 2^k) mod p(x) */
+local unsigned long x2nmodp(n, k)
+    z_off64_t n;
+    unsigned k;
+{
+    unsigned long p;
+
+    p = 1UL << 31;
+    while (n) {
+        if (n & 1)
+            p = multmodp(x2n_table[k & 31], p);
+        n >>= 1;
+        k++;
+    }
+    return p;
+}
+
+/* ========================================================================= */
+/*
+ * Appending len2 zero bytes to the first stream multiplies its crc by
+ * x^(8*len2) mod p(x), which we get from the table in at most 64 steps,
+ * rather than by squaring 32x32 bit matrices for every bit of len2.
+ */
+local uLong crc32_combine_(crc1, crc2, len2)
+    uLong crc1;
+    uLong crc2;
+    z_off64_t len2;
+{
+
+    /* degenerate case (also disallow negative lengths) */
+    if (len2 <= 0)
+        return crc1;
+
+    return multmodp(x2nmodp(len2, 3), crc1 & 0xffffffffUL) ^
+        (crc2 & 0xffffffffUL);
+}
+
+/* ========================================================================= */
+uLong ZEXPORT crc32_combine(crc1, crc2, len2)
+    uLong crc1;
+    uLong crc2;
+    z_off_t len2;
+{
+    return crc32_combine_(crc1, crc2, len2);
+}
+
+uLong ZEXPORT crc32_combine64(crc1, crc2, len2)
+    uLong crc1;
+    uLong crc2;
+    z_off64_t len2;
+{
+    return crc32_combine_(crc1, crc2, len2);
+}
+
+#ifdef CRC32_C_TEST
+/*
+ * Check the fast paths against the tables and the old matrix based
+ * crc32_combine(), and report how much faster they are.
+ * Compile with: "cc -o foo -DCRC32_C_TEST -I. crc32.c"
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+local uLong crc32_table OF((uLong, const unsigned char *, unsigned));
+local uLong crc32_combine_gf2 OF((uLong, uLong, z_off64_t));
+
+local uLong crc32_table(crc, buf, len)
+    uLong crc;
+    const unsigned char *buf;
+    unsigned len;
+{
+    crc = crc ^ 0xffffffffUL;
+    while (len--)
+        crc = crc_table[0][((int)crc ^ (*buf++)) & 0xff] ^ (crc >> 8);
+    return crc ^ 0xffffffffUL;
+}
+
 local unsigned long gf2_matrix_times(mat, vec)
     unsigned long *mat;
     unsigned long vec;
@@ -357,86 +656,138 @@ local unsigned long gf2_matrix_times(mat, vec)
     return sum;
 }
 
-/* ========================================================================= */
 local void gf2_matrix_square(square, mat)
     unsigned long *square;
     unsigned long *mat;
 {
     int n;
 
-    for (n = 0; n < GF2_DIM; n++)
+    for (n = 0; n < 32; n++)
         square[n] = gf2_matrix_times(mat, mat[n]);
 }
 
-/* ========================================================================= */
-local uLong crc32_combine_(crc1, crc2, len2)
+/* The crc32_combine() we had before */
+local uLong crc32_combine_gf2(crc1, crc2, len2)
     uLong crc1;
     uLong crc2;
     z_off64_t len2;
 {
     int n;
-    unsigned long row;
-    unsigned long even[GF2_DIM];    /* even-power-of-two zeros operator */
-    unsigned long odd[GF2_DIM];     /* odd-power-of-two zeros operator */
+    unsigned long row, even[32], odd[32];
 
-    /* degenerate case (also disallow negative lengths) */
     if (len2 <= 0)
         return crc1;
-
-    /* put operator for one zero bit in odd */
-    odd[0] = 0xedb88320UL;          /* CRC-32 polynomial */
+    odd[0] = 0xedb88320UL;
     row = 1;
-    for (n = 1; n < GF2_DIM; n++) {
+    for (n = 1; n < 32; n++) {
         odd[n] = row;
         row <<= 1;
     }
-
-    /* put operator for two zero bits in even */
     gf2_matrix_square(even, odd);
-
-    /* put operator for four zero bits in odd */
     gf2_matrix_square(odd, even);
-
-    /* apply len2 zeros to crc1 (first square will put the operator for one
-       zero byte, eight zero bits, in even) */
     do {
-        /* apply zeros operator for this bit of len2 */
         gf2_matrix_square(even, odd);
         if (len2 & 1)
             crc1 = gf2_matrix_times(even, crc1);
         len2 >>= 1;
-
-        /* if no more bits set, then done */
         if (len2 == 0)
             break;
-
-        /* another iteration of the loop with odd and even swapped */
         gf2_matrix_square(odd, even);
         if (len2 & 1)
             crc1 = gf2_matrix_times(odd, crc1);
         len2 >>= 1;
-
-        /* if no more bits set, then done */
     } while (len2 != 0);
-
-    /* return combined crc */
-    crc1 ^= crc2;
-    return crc1;
+    return crc1 ^ crc2;
 }
 
-/* ========================================================================= */
-uLong ZEXPORT crc32_combine(crc1, crc2, len2)
-    uLong crc1;
-    uLong crc2;
-    z_off_t len2;
+local double now(void)
 {
-    return crc32_combine_(crc1, crc2, len2);
+    struct timespec ts;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
 }
 
-uLong ZEXPORT crc32_combine64(crc1, crc2, len2)
-    uLong crc1;
-    uLong crc2;
-    z_off64_t len2;
+#define BUFSZ   (4 * 1024 * 1024)
+#define REPS    16
+#define NCOMB   100000
+
+int
+main(void)
 {
-    return crc32_combine_(crc1, crc2, len2);
+    unsigned char *buf;
+    unsigned u, l, o;
+    uLong a, b, c, sum;
+    double t0, t1, t2;
+    int err = 0;
+
+    buf = malloc(BUFSZ + 16);
+    if (buf == NULL)
+        return (1);
+    srandom(42);
+    for (u = 0; u < BUFSZ + 16; u++)
+        buf[u] = random();
+#ifdef DYNAMIC_CRC_TABLE
+    (void)get_crc_table();
+#endif
+
+    for (o = 0; o < 16; o++) {
+        for (l = 0; l < 1100; l += (l < 200 ? 1 : 37)) {
+            a = crc32(0x1234, buf + o, l);
+            b = crc32_table(0x1234, buf + o, l);
+            if (a != b) {
+                printf("crc32 mismatch off %u len %u\n", o, l);
+                err = 1;
+            }
+        }
+    }
+    if (crc32(0, buf, BUFSZ) != crc32_table(0, buf, BUFSZ)) {
+        printf("crc32 mismatch len %u\n", BUFSZ);
+        err = 1;
+    }
+
+    for (u = 0; u < 1000; u++) {
+        l = random() % 70000;
+        o = random() % 70000;
+        a = crc32(0, buf, l);
+        b = crc32(0, buf + l, o);
+        c = crc32(0, buf, l + o);
+        if (crc32_combine(a, b, o) != c ||
+            crc32_combine_gf2(a, b, o) != c) {
+            printf("crc32_combine mismatch len %u + %u\n", l, o);
+            err = 1;
+        }
+    }
+
+    /* What crc32() did before, four bytes at a time from the tables */
+    sum = 0;
+    t0 = now();
+    for (u = 0; u < REPS; u++)
+#ifdef BYFOUR
+        sum = crc32_little(sum, buf, BUFSZ);
+#else
+        sum = crc32_table(sum, buf, BUFSZ);
+#endif
+    t1 = now();
+    for (u = 0; u < REPS; u++)
+        sum = crc32(sum, buf, BUFSZ);
+    t2 = now();
+    printf("crc32 before %8.1f MB/s\n", REPS * (BUFSZ / 1e6) / (t1 - t0));
+    printf("crc32 after  %8.1f MB/s\n", REPS * (BUFSZ / 1e6) / (t2 - t1));
+
+    t0 = now();
+    for (u = 0; u < NCOMB; u++)
+        sum += crc32_combine_gf2(sum, u, u * 997);
+    t1 = now();
+    for (u = 0; u < NCOMB; u++)
+        sum += crc32_combine(sum, u, u * 997);
+    t2 = now();
+    printf("crc32_combine before %8.3f us/op\n", 1e6 * (t1 - t0) / NCOMB);
+    printf("crc32_combine after  %8.3f us/op\n", 1e6 * (t2 - t1) / NCOMB);
+
+    free(buf);
+    /* Print sum, so the compiler cannot skip the loops */
+    printf("%s %lx\n", err ? "FAIL" : "OK", sum);
+    return (err);
 }
+#endif /* CRC32_C_TEST */
@@ -62,6 +62,14 @@ int main(int argc, char **argv)
 #include "tbl/vsc_fields.h"
 #undef VSC_DO_VBE
 
+	P("");
+	P("PER HISTOGRAM COUNTERS");
+	P("======================");
+	P("");
+#define VSC_DO_HIST
+#include "tbl/vsc_fields.h"
+#undef VSC_DO_HIST
+
 	return (0);
 }
 